@@ -372,6 +372,19 @@ g_daemon_file_resolve_relative_path (GFile *file,
   return child;
 }
 
+static void
+invalidate_info_cache (GFile *file)
+{
+  GDaemonFile *daemon_file;
+
+  if (!G_IS_DAEMON_FILE (file))
+    return;
+
+  daemon_file = G_DAEMON_FILE (file);
+  _g_daemon_vfs_info_cache_invalidate (daemon_file->mount_spec,
+                                       daemon_file->path);
+}
+
 static GVfsDBusMount *
 create_proxy_for_file2 (GFile *file1,
                         GFile *file2,
@@ -422,19 +435,16 @@ create_proxy_for_file2 (GFile *file1,
   if (connection == NULL)
     goto out;
 
-  proxy = gvfs_dbus_mount_proxy_new_sync (connection,
-                                          G_DBUS_PROXY_FLAGS_DO_NOT_LOAD_PROPERTIES | G_DBUS_PROXY_FLAGS_DO_NOT_CONNECT_SIGNALS,
-                                          mount_info1->dbus_id,
-                                          mount_info1->object_path,
-                                          cancellable,
-                                          error);
+  /* Cached per thread, only the first call on a mount creates it */
+  proxy = _g_dbus_mount_proxy_get_sync (connection,
+                                        mount_info1->dbus_id,
+                                        mount_info1->object_path,
+                                        cancellable,
+                                        error);
   
   if (proxy == NULL)
     goto out;
   
-  /* Set infinite timeout, see bug 687534 */
-  g_dbus_proxy_set_default_timeout (G_DBUS_PROXY (proxy), G_MAXINT);
-  
   _g_dbus_connect_vfs_filters (connection);
 
   if (mount_info1_out)
@@ -674,6 +684,93 @@ create_proxy_for_file_async (GFile *file,
                                       data);
 }
 
+typedef struct {
+  GFile *file;
+  GSimpleAsyncResult *result;
+  char *dbus_id;
+  GFileMonitor *monitor;
+} InfoCacheMonitorData;
+
+static void
+info_cache_monitor_data_free (InfoCacheMonitorData *data)
+{
+  GDaemonFile *daemon_file = G_DAEMON_FILE (data->file);
+
+  /* Without a monitor, e.g. if the backend doesn't support it, the
+   * directory's children are only cached for the short TTL */
+  _g_daemon_vfs_info_cache_set_monitor (daemon_file->mount_spec,
+                                        daemon_file->path,
+                                        data->monitor);
+  g_object_unref (data->file);
+  g_free (data->dbus_id);
+  g_free (data);
+}
+
+static void
+info_cache_monitor_cb (GVfsDBusMount *proxy,
+                       GAsyncResult *res,
+                       gpointer user_data)
+{
+  InfoCacheMonitorData *data = user_data;
+  GSimpleAsyncResult *result;
+  char *obj_path;
+
+  if (gvfs_dbus_mount_call_create_directory_monitor_finish (proxy, &obj_path, res, NULL))
+    {
+      data->monitor = g_daemon_file_monitor_new (data->dbus_id, obj_path);
+      g_free (obj_path);
+    }
+
+  result = data->result;
+  data->result = NULL;
+  g_object_unref (result);   /* trigger async_proxy_create_free() */
+}
+
+static void
+info_cache_monitor_get_proxy_cb (GVfsDBusMount *proxy,
+                                 GDBusConnection *connection,
+                                 GMountInfo *mount_info,
+                                 const gchar *path,
+                                 GSimpleAsyncResult *result,
+                                 GError *error,
+                                 GCancellable *cancellable,
+                                 gpointer callback_data)
+{
+  InfoCacheMonitorData *data = callback_data;
+
+  data->result = g_object_ref (result);
+  data->dbus_id = g_strdup (mount_info->dbus_id);
+
+  gvfs_dbus_mount_call_create_directory_monitor (proxy,
+                                                 path,
+                                                 G_FILE_MONITOR_NONE,
+                                                 NULL,
+                                                 (GAsyncReadyCallback) info_cache_monitor_cb,
+                                                 data);
+}
+
+/* Lets the info cache keep what it learns about the children of
+ * @file until the backend reports them changed */
+static void
+info_cache_monitor_directory (GFile *file)
+{
+  GDaemonFile *daemon_file = G_DAEMON_FILE (file);
+  InfoCacheMonitorData *data;
+
+  if (!_g_daemon_vfs_info_cache_want_monitor (daemon_file->mount_spec,
+                                              daemon_file->path))
+    return;
+
+  data = g_new0 (InfoCacheMonitorData, 1);
+  data->file = g_object_ref (file);
+
+  create_proxy_for_file_async (file,
+                               NULL,
+                               NULL, NULL,
+                               info_cache_monitor_get_proxy_cb,
+                               data, (GDestroyNotify) info_cache_monitor_data_free);
+}
+
 static GFileEnumerator *
 g_daemon_file_enumerate_children (GFile      *file,
 				  const char *attributes,
@@ -690,7 +787,9 @@ g_daemon_file_enumerate_children (GFile      *file,
   gboolean res;
   GError *local_error = NULL;
   
-  enumerator = g_daemon_file_enumerator_new (file, attributes, TRUE);
+  info_cache_monitor_directory (file);
+
+  enumerator = g_daemon_file_enumerator_new (file, attributes, flags, TRUE);
 
   proxy = create_proxy_for_file (file, NULL, &path, &connection, cancellable, error);
   if (proxy == NULL)
@@ -810,6 +909,17 @@ g_daemon_file_query_info (GFile                *file,
   GVariant *iter_info;
   gboolean res;
   GError *local_error = NULL;
+  GDaemonFile *daemon_file = G_DAEMON_FILE (file);
+
+  info = _g_daemon_vfs_info_cache_lookup (daemon_file->mount_spec,
+                                          daemon_file->path,
+                                          attributes,
+                                          flags);
+  if (info)
+    {
+      add_metadata (file, attributes, info);
+      return info;
+    }
 
   proxy = create_proxy_for_file (file, NULL, &path, NULL, cancellable, error);
   if (proxy == NULL)
@@ -845,7 +955,14 @@ g_daemon_file_query_info (GFile                *file,
   g_variant_unref (iter_info);
 
   if (info)
-    add_metadata (file, attributes, info);
+    {
+      _g_daemon_vfs_info_cache_insert (daemon_file->mount_spec,
+                                       daemon_file->path,
+                                       attributes,
+                                       flags,
+                                       info);
+      add_metadata (file, attributes, info);
+    }
   
   return info;
 }
@@ -901,6 +1018,11 @@ query_info_async_cb (GVfsDBusMount *proxy,
     }
 
   file = G_FILE (g_async_result_get_source_object (G_ASYNC_RESULT (orig_result)));
+  _g_daemon_vfs_info_cache_insert (G_DAEMON_FILE (file)->mount_spec,
+                                   G_DAEMON_FILE (file)->path,
+                                   data->attributes,
+                                   data->flags,
+                                   info);
   add_metadata (file, data->attributes, info);
   g_object_unref (file);
 
@@ -953,6 +1075,25 @@ g_daemon_file_query_info_async (GFile                      *file,
 				gpointer                    user_data)
 {
   AsyncCallQueryInfo *data;
+  GDaemonFile *daemon_file = G_DAEMON_FILE (file);
+  GSimpleAsyncResult *result;
+  GFileInfo *info;
+
+  info = _g_daemon_vfs_info_cache_lookup (daemon_file->mount_spec,
+                                          daemon_file->path,
+                                          attributes,
+                                          flags);
+  if (info)
+    {
+      add_metadata (file, attributes, info);
+      result = g_simple_async_result_new (G_OBJECT (file),
+                                          callback, user_data,
+                                          NULL);
+      g_simple_async_result_set_op_res_gpointer (result, info, g_object_unref);
+      g_simple_async_result_complete_in_idle (result);
+      g_object_unref (result);
+      return;
+    }
 
   data = g_new0 (AsyncCallQueryInfo, 1);
   data->file = g_object_ref (file);
@@ -1231,6 +1372,9 @@ file_open_write (GFile *file,
   g_free (path);
   g_object_unref (proxy);
 
+  /* Opening may have created or truncated it */
+  invalidate_info_cache (file);
+
   if (! res)
     return NULL;
   
@@ -1246,7 +1390,9 @@ file_open_write (GFile *file,
   g_variant_unref (fd_id_val);
   g_object_unref (fd_list);
   
-  return g_daemon_file_output_stream_new (fd, can_seek, initial_offset);
+  return g_daemon_file_output_stream_new (fd, can_seek, initial_offset,
+                                          G_DAEMON_FILE (file)->mount_spec,
+                                          G_DAEMON_FILE (file)->path);
 }
 
 static GFileOutputStream *
@@ -1946,6 +2092,8 @@ mount_reply (GVfsDBusMountTracker *proxy,
     }
   else
     {
+      /* Don't let a lookup made just before this report it unmounted */
+      _g_daemon_vfs_clear_negative_mount_cache ();
       ares = g_simple_async_result_new (G_OBJECT (data->file),
 				       data->callback,
 				       data->user_data,
@@ -2321,6 +2469,7 @@ g_daemon_file_set_display_name (GFile *file,
                                                     &new_path,
                                                     cancellable,
                                                     &local_error);
+  invalidate_info_cache (file);
 
   if (! res)
     {
@@ -2362,6 +2511,7 @@ g_daemon_file_delete (GFile *file,
                                           path,
                                           cancellable,
                                           &local_error);
+  invalidate_info_cache (file);
 
   if (! res)
     {
@@ -2394,6 +2544,7 @@ g_daemon_file_trash (GFile *file,
                                          path,
                                          cancellable,
                                          &local_error);
+  invalidate_info_cache (file);
 
   if (! res)
     {
@@ -2426,6 +2577,7 @@ g_daemon_file_make_directory (GFile *file,
                                                   path,
                                                   cancellable,
                                                   &local_error);
+  invalidate_info_cache (file);
 
   if (! res)
     {
@@ -2460,6 +2612,7 @@ g_daemon_file_make_symbolic_link (GFile *file,
                                                       symlink_value ? symlink_value : "",
                                                       cancellable,
                                                       &local_error);
+  invalidate_info_cache (file);
 
   if (! res)
     {
@@ -2665,6 +2818,7 @@ g_daemon_file_set_attribute (GFile *file,
                                                  cancellable,
                                                  &my_error);
   g_free (path);
+  invalidate_info_cache (file);
 
   if (! res)
     {
@@ -2948,6 +3102,7 @@ g_daemon_file_copy (GFile                  *source,
                           progress_callback,
                           progress_callback_data,
                           error);
+  invalidate_info_cache (destination);
 
   return result;
 }
@@ -2971,6 +3126,8 @@ g_daemon_file_move (GFile                  *source,
                           progress_callback,
                           progress_callback_data,
                           error);
+  invalidate_info_cache (source);
+  invalidate_info_cache (destination);
 
   return result;
 }
@@ -3118,12 +3275,15 @@ file_open_write_async_cb (GVfsDBusMount *proxy,
     }
   else
     {
-      output_stream = g_daemon_file_output_stream_new (fd, can_seek, initial_offset);
+      output_stream = g_daemon_file_output_stream_new (fd, can_seek, initial_offset,
+                                                       G_DAEMON_FILE (data->file)->mount_spec,
+                                                       G_DAEMON_FILE (data->file)->path);
       g_simple_async_result_set_op_res_gpointer (orig_result, output_stream, g_object_unref);
       g_object_unref (fd_list);
     }
 
 out:
+  invalidate_info_cache (data->file);
   _g_simple_async_result_complete_with_cancellable (orig_result, data->cancellable);
   _g_dbus_async_unsubscribe_cancellable (data->cancellable, data->cancelled_tag);
   data->result = NULL;
@@ -3351,7 +3511,9 @@ g_daemon_file_enumerate_children_async (GFile                      *file,
   data->io_priority = io_priority;
   if (cancellable)
     data->cancellable = g_object_ref (cancellable);
-  data->enumerator = g_daemon_file_enumerator_new (data->file, data->attributes, FALSE);
+  data->enumerator = g_daemon_file_enumerator_new (data->file, data->attributes, data->flags, FALSE);
+
+  info_cache_monitor_directory (file);
 
   create_proxy_for_file_async (file,
                                cancellable,
@@ -3559,6 +3721,7 @@ set_display_name_async_cb (GVfsDBusMount *proxy,
   g_simple_async_result_set_op_res_gpointer (orig_result, file, g_object_unref);
 
   out:
+    invalidate_info_cache (data->file);
     _g_simple_async_result_complete_with_cancellable (orig_result, data->cancellable);
     _g_dbus_async_unsubscribe_cancellable (data->cancellable, data->cancelled_tag);
     data->result = NULL;
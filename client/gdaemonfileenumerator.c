@@ -36,6 +36,10 @@
 
 #define OBJ_PATH_PREFIX "/org/gtk/vfs/client/enumerator/"
 
+/* Once this many infos are buffered the reply to GotInfo is held back,
+ * which makes the daemon pause the backend until we are below half */
+#define MAX_BUFFERED_INFOS 1000
+
 /* atomic */
 static volatile gint path_counter = 1;
 
@@ -49,8 +53,13 @@ struct _GDaemonFileEnumerator
   GDBusConnection *sync_connection; /* NULL if async, i.e. we're listening on main dbus connection */
 
   /* protected by infos lock */
-  GList *infos;
+  GFileInfo **infos; /* ring buffer */
+  guint infos_size;
+  guint infos_head;
+  guint n_infos;
+  GQueue held_got_info; /* GDBusMethodInvocation */
   gboolean done;
+  gboolean closed;
 
   /* For async ops, also protected by infos lock */
   int async_requested_files;
@@ -62,8 +71,14 @@ struct _GDaemonFileEnumerator
   guint next_files_sync_timeout_tag;
   GMutex next_files_mutex;
 
+  /* For filling the info cache */
+  char *attributes;
+  GFileQueryInfoFlags flags;
+
   GFileAttributeMatcher *matcher;
   MetaTree *metadata_tree;
+  /* name -> GFileInfo with the metadata of each child, read on first use */
+  GHashTable *metadata_children;
 };
 
 G_DEFINE_TYPE (GDaemonFileEnumerator, g_daemon_file_enumerator, G_TYPE_FILE_ENUMERATOR)
@@ -100,6 +115,59 @@ free_info_list (GList *infos)
   g_list_free_full (infos, g_object_unref);
 }
 
+/* Called with infos lock held */
+static void
+push_info (GDaemonFileEnumerator *daemon,
+           GFileInfo *info)
+{
+  GFileInfo **infos;
+  guint i;
+
+  if (daemon->n_infos == daemon->infos_size)
+    {
+      infos = g_new (GFileInfo *, MAX (16, daemon->infos_size * 2));
+      for (i = 0; i < daemon->n_infos; i++)
+        infos[i] = daemon->infos[(daemon->infos_head + i) % daemon->infos_size];
+      g_free (daemon->infos);
+      daemon->infos = infos;
+      daemon->infos_size = MAX (16, daemon->infos_size * 2);
+      daemon->infos_head = 0;
+    }
+
+  daemon->infos[(daemon->infos_head + daemon->n_infos) % daemon->infos_size] = info;
+  daemon->n_infos++;
+}
+
+/* Called with infos lock held */
+static GFileInfo *
+pop_info (GDaemonFileEnumerator *daemon)
+{
+  GFileInfo *info;
+
+  if (daemon->n_infos == 0)
+    return NULL;
+
+  info = daemon->infos[daemon->infos_head];
+  daemon->infos_head = (daemon->infos_head + 1) % daemon->infos_size;
+  daemon->n_infos--;
+
+  return info;
+}
+
+/* Called with infos lock held */
+static void
+release_got_info (GDaemonFileEnumerator *daemon,
+                  gboolean all)
+{
+  GDBusMethodInvocation *invocation;
+
+  if (!all && daemon->n_infos >= MAX_BUFFERED_INFOS / 2)
+    return;
+
+  while ((invocation = g_queue_pop_head (&daemon->held_got_info)) != NULL)
+    g_dbus_method_invocation_return_value (invocation, g_variant_new ("()"));
+}
+
 static void
 g_daemon_file_enumerator_finalize (GObject *object)
 {
@@ -112,11 +180,17 @@ g_daemon_file_enumerator_finalize (GObject *object)
   _g_dbus_unregister_vfs_filter (path);
   g_free (path);
 
-  free_info_list (daemon->infos);
+  release_got_info (daemon, TRUE);
+  while (daemon->n_infos > 0)
+    g_object_unref (pop_info (daemon));
+  g_free (daemon->infos);
 
+  g_free (daemon->attributes);
   g_file_attribute_matcher_unref (daemon->matcher);
   if (daemon->metadata_tree)
     meta_tree_unref (daemon->metadata_tree);
+  if (daemon->metadata_children)
+    g_hash_table_destroy (daemon->metadata_children);
 
   g_clear_object (&daemon->sync_connection);
 
@@ -150,7 +224,7 @@ static void
 next_files_sync_check (GDaemonFileEnumerator *enumerator)
 {
   g_mutex_lock (&enumerator->next_files_mutex);
-  if ((enumerator->infos || enumerator->done) && 
+  if ((enumerator->n_infos > 0 || enumerator->done) && 
       enumerator->next_files_mainloop != NULL)
     {
       g_main_loop_quit (enumerator->next_files_mainloop);
@@ -177,6 +251,33 @@ handle_done (GVfsDBusEnumerator *object,
   return TRUE;
 }
 
+static void
+cache_infos (GDaemonFileEnumerator *enumerator,
+             GList *infos)
+{
+  GDaemonFile *container;
+  const char *name;
+  char *path;
+  GList *l;
+
+  container = G_DAEMON_FILE (g_file_enumerator_get_container (G_FILE_ENUMERATOR (enumerator)));
+
+  for (l = infos; l != NULL; l = l->next)
+    {
+      name = g_file_info_get_name (l->data);
+      if (name == NULL)
+        continue;
+
+      path = g_build_path ("/", container->path, name, NULL);
+      _g_daemon_vfs_info_cache_insert (container->mount_spec,
+                                       path,
+                                       enumerator->attributes,
+                                       enumerator->flags,
+                                       l->data);
+      g_free (path);
+    }
+}
+
 static gboolean
 handle_got_info (GVfsDBusEnumerator *object,
                  GDBusMethodInvocation *invocation,
@@ -184,10 +285,11 @@ handle_got_info (GVfsDBusEnumerator *object,
                  gpointer user_data)
 {
   GDaemonFileEnumerator *enumerator = G_DAEMON_FILE_ENUMERATOR (user_data);
-  GList *infos;
+  GList *infos, *l;
   GFileInfo *info;
   GVariantIter iter;
   GVariant *child;
+  gboolean hold;
 
   infos = NULL;
     
@@ -205,16 +307,32 @@ handle_got_info (GVfsDBusEnumerator *object,
     }
   
   infos = g_list_reverse (infos);
+
+  if (_g_daemon_vfs_info_cache_enabled ())
+    cache_infos (enumerator, infos);
   
   G_LOCK (infos);
-  enumerator->infos = g_list_concat (enumerator->infos, infos);
+  if (enumerator->closed)
+    free_info_list (infos);
+  else
+    {
+      for (l = infos; l != NULL; l = l->next)
+        push_info (enumerator, l->data);
+      g_list_free (infos);
+    }
   if (enumerator->async_requested_files > 0 &&
-      g_list_length (enumerator->infos) >= enumerator->async_requested_files)
+      enumerator->n_infos >= enumerator->async_requested_files)
     trigger_async_done (enumerator, TRUE);
   next_files_sync_check (enumerator);
+
+  /* Don't ask for more until the application catches up */
+  hold = enumerator->n_infos >= MAX (MAX_BUFFERED_INFOS, enumerator->async_requested_files);
+  if (hold)
+    g_queue_push_tail (&enumerator->held_got_info, invocation);
   G_UNLOCK (infos);
 
-  gvfs_dbus_enumerator_complete_got_info (object, invocation);
+  if (!hold)
+    gvfs_dbus_enumerator_complete_got_info (object, invocation);
   
   return TRUE;
 }
@@ -258,11 +376,13 @@ g_daemon_file_enumerator_init (GDaemonFileEnumerator *daemon)
   daemon->id = g_atomic_int_add (&path_counter, 1);
 
   g_mutex_init (&daemon->next_files_mutex);
+  g_queue_init (&daemon->held_got_info);
 }
 
 GDaemonFileEnumerator *
 g_daemon_file_enumerator_new (GFile *file,
 			      const char *attributes,
+			      GFileQueryInfoFlags flags,
 			      gboolean sync)
 {
   GDaemonFileEnumerator *daemon;
@@ -283,6 +403,8 @@ g_daemon_file_enumerator_new (GFile *file,
                                G_OBJECT (daemon));
   g_free (path);
 
+  daemon->attributes = g_strdup (attributes);
+  daemon->flags = flags;
   daemon->matcher = g_file_attribute_matcher_new (attributes);
   if (g_file_attribute_matcher_enumerate_namespace (daemon->matcher, "metadata") ||
       g_file_attribute_matcher_enumerate_next (daemon->matcher) != NULL)
@@ -316,27 +438,69 @@ enumerate_keys_callback (const char *key,
   return TRUE;
 }
 
+static gboolean
+enumerate_dir_keys_callback (const char *child,
+			     const char *key,
+			     MetaKeyType type,
+			     gpointer value,
+			     gpointer user_data)
+{
+  GHashTable *children = user_data;
+  GFileInfo *info;
+
+  info = g_hash_table_lookup (children, child);
+  if (info == NULL)
+    {
+      info = g_file_info_new ();
+      g_hash_table_insert (children, g_strdup (child), info);
+    }
+
+  return enumerate_keys_callback (key, type, value, info);
+}
+
 static void
 add_metadata (GFileInfo *info,
 	      GDaemonFileEnumerator *daemon)
 {
   GFile *container;
-  const char *name;
-  char *path;
+  GFileInfo *child_info;
+  GFileAttributeType type;
+  gpointer value;
+  char **attrs;
+  int i;
 
   if (!daemon->metadata_tree)
     return;
 
-  name = g_file_info_get_name (info);
-  container = g_file_enumerator_get_container (G_FILE_ENUMERATOR (daemon));
-  path = g_build_filename (G_DAEMON_FILE (container)->path, name, NULL);
+  /* Read the metadata of all children in one go rather than
+     looking up every file separately */
+  if (daemon->metadata_children == NULL)
+    {
+      container = g_file_enumerator_get_container (G_FILE_ENUMERATOR (daemon));
+      daemon->metadata_children =
+	g_hash_table_new_full (g_str_hash, g_str_equal,
+			       g_free, g_object_unref);
+      meta_tree_enumerate_dir_with_keys (daemon->metadata_tree,
+					 G_DAEMON_FILE (container)->path,
+					 enumerate_dir_keys_callback,
+					 daemon->metadata_children);
+    }
+
+  child_info = g_hash_table_lookup (daemon->metadata_children,
+				    g_file_info_get_name (info));
+  if (child_info == NULL)
+    return;
 
   g_file_info_set_attribute_mask (info, daemon->matcher);
-  meta_tree_enumerate_keys (daemon->metadata_tree, path,
-			    enumerate_keys_callback, info);
+  attrs = g_file_info_list_attributes (child_info, "metadata");
+  for (i = 0; attrs[i] != NULL; i++)
+    {
+      if (g_file_info_get_attribute_data (child_info, attrs[i],
+					  &type, &value, NULL))
+	g_file_info_set_attribute (info, attrs[i], type, value);
+    }
+  g_strfreev (attrs);
   g_file_info_unset_attribute_mask (info);
-
-  g_free (path);
 }
 
 static GCancellable *
@@ -362,7 +526,8 @@ simple_async_result_set_cancellable (GSimpleAsyncResult *res,
 static void
 trigger_async_done (GDaemonFileEnumerator *daemon, gboolean ok)
 {
-  GList *rest, *l;
+  GList *l;
+  int i;
   
   if (daemon->cancelled_tag != 0)
     {
@@ -398,15 +563,11 @@ trigger_async_done (GDaemonFileEnumerator *daemon, gboolean ok)
 
   if (ok)
     {
-      l = daemon->infos;
-      rest = g_list_nth (l, daemon->async_requested_files);
-      if (rest)
-	{
-	  /* Split list */
-	  rest->prev->next = NULL;
-	  rest->prev = NULL;
-	}
-      daemon->infos = rest;
+      l = NULL;
+      for (i = 0; i < daemon->async_requested_files && daemon->n_infos > 0; i++)
+	l = g_list_prepend (l, pop_info (daemon));
+      l = g_list_reverse (l);
+      release_got_info (daemon, FALSE);
 
       g_list_foreach (l, (GFunc)add_metadata, daemon);
 
@@ -475,7 +636,7 @@ g_daemon_file_enumerator_next_file (GFileEnumerator *enumerator,
       return NULL;
     }
 
-  if (! daemon->infos && ! daemon->done)
+  if (daemon->n_infos == 0 && ! daemon->done)
     {
       /* Wait for incoming data */
       g_mutex_lock (&daemon->next_files_mutex);
@@ -500,16 +661,13 @@ g_daemon_file_enumerator_next_file (GFileEnumerator *enumerator,
   info = NULL;
 
   G_LOCK (infos);
-  if (daemon->infos)
+  info = pop_info (daemon);
+  if (info)
     {
-      info = daemon->infos->data;
-      if (info)
-        {
-          g_assert (G_IS_FILE_INFO (info));
-          add_metadata (G_FILE_INFO (info), daemon);
-        }
-      daemon->infos = g_list_delete_link (daemon->infos, daemon->infos);
+      g_assert (G_IS_FILE_INFO (info));
+      add_metadata (G_FILE_INFO (info), daemon);
     }
+  release_got_info (daemon, FALSE);
   G_UNLOCK (infos);
 
   if (info)
@@ -578,7 +736,7 @@ g_daemon_file_enumerator_next_files_async (GFileEnumerator     *enumerator,
 
   /* Maybe we already have enough info to fulfill the requeust already */
   if (daemon->done ||
-      g_list_length (daemon->infos) >= daemon->async_requested_files)
+      daemon->n_infos >= daemon->async_requested_files)
     trigger_async_done (daemon, TRUE);
   else
     {
@@ -617,12 +775,26 @@ g_daemon_file_enumerator_next_files_finish (GFileEnumerator  *enumerator,
   return g_list_copy (l);
 }
 
+/* Lets the daemon finish an enumeration nobody is reading any more */
+static void
+release_all_infos (GDaemonFileEnumerator *daemon)
+{
+  G_LOCK (infos);
+  daemon->closed = TRUE;
+  while (daemon->n_infos > 0)
+    g_object_unref (pop_info (daemon));
+  release_got_info (daemon, TRUE);
+  G_UNLOCK (infos);
+}
+
 static gboolean
 g_daemon_file_enumerator_close (GFileEnumerator *enumerator,
 				GCancellable     *cancellable,
 				GError          **error)
 {
-  /*GDaemonFileEnumerator *daemon = G_DAEMON_FILE_ENUMERATOR (enumerator); */
+  GDaemonFileEnumerator *daemon = G_DAEMON_FILE_ENUMERATOR (enumerator);
+
+  release_all_infos (daemon);
 
   return TRUE;
 }
@@ -639,6 +811,8 @@ g_daemon_file_enumerator_close_async (GFileEnumerator      *enumerator,
 {
   GSimpleAsyncResult *res;
 
+  release_all_infos (G_DAEMON_FILE_ENUMERATOR (enumerator));
+
   res = g_simple_async_result_new (G_OBJECT (enumerator), callback, user_data,
 				   g_daemon_file_enumerator_close_async);
   simple_async_result_set_cancellable (res, cancellable);
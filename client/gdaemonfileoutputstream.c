@@ -38,6 +38,7 @@
 #include <gio/gunixinputstream.h>
 #include <gio/gunixoutputstream.h>
 #include "gdaemonfileoutputstream.h"
+#include "gdaemonvfs.h"
 #include "gvfsdaemondbus.h"
 #include <gvfsdaemonprotocol.h>
 #include <gvfsfileinfo.h>
@@ -168,7 +169,10 @@ struct _GDaemonFileOutputStream {
   GString *output_buffer;
 
   char *etag;
-  
+
+  /* The file being written, its cached info is dropped on close */
+  GMountSpec *mount_spec;
+  char *path;
 };
 
 static gssize     g_daemon_file_output_stream_write             (GOutputStream        *stream,
@@ -251,6 +255,8 @@ g_daemon_file_output_stream_finalize (GObject *object)
   g_string_free (file->output_buffer, TRUE);
 
   g_free (file->etag);
+  g_mount_spec_unref (file->mount_spec);
+  g_free (file->path);
   
   if (G_OBJECT_CLASS (g_daemon_file_output_stream_parent_class)->finalize)
     (*G_OBJECT_CLASS (g_daemon_file_output_stream_parent_class)->finalize) (object);
@@ -293,7 +299,9 @@ g_daemon_file_output_stream_init (GDaemonFileOutputStream *info)
 GFileOutputStream *
 g_daemon_file_output_stream_new (int fd,
 				 gboolean can_seek,
-				 goffset initial_offset)
+				 goffset initial_offset,
+				 GMountSpec *mount_spec,
+				 const char *path)
 {
   GDaemonFileOutputStream *stream;
 
@@ -303,6 +311,8 @@ g_daemon_file_output_stream_new (int fd,
   stream->data_stream = g_unix_input_stream_new (fd, TRUE);
   stream->can_seek = can_seek;
   stream->current_offset = initial_offset;
+  stream->mount_spec = g_mount_spec_ref (mount_spec);
+  stream->path = g_strdup (path);
   
   return G_FILE_OUTPUT_STREAM (stream);
 }
@@ -810,6 +820,9 @@ g_daemon_file_output_stream_close (GOutputStream *stream,
     res = g_input_stream_close (file->data_stream, cancellable, error);
   else
     g_input_stream_close (file->data_stream, cancellable, NULL);
+
+  /* Size and times changed, also if closing failed half way */
+  _g_daemon_vfs_info_cache_invalidate (file->mount_spec, file->path);
   
   return res;
 }
@@ -1507,6 +1520,8 @@ async_close_done (GOutputStream *stream,
     result = g_input_stream_close (file->data_stream, cancellable, &error);
   else
     g_input_stream_close (file->data_stream, cancellable, NULL);
+
+  _g_daemon_vfs_info_cache_invalidate (file->mount_spec, file->path);
   
   simple = g_simple_async_result_new (G_OBJECT (stream),
 				      callback, user_data,
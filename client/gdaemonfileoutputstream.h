@@ -24,6 +24,7 @@
 #define __G_DAEMON_FILE_OUTPUT_STREAM_H__
 
 #include <gio/gio.h>
+#include <gmountspec.h>
 
 G_BEGIN_DECLS
 
@@ -46,7 +47,9 @@ GType g_daemon_file_output_stream_get_type (void) G_GNUC_CONST;
 
 GFileOutputStream *g_daemon_file_output_stream_new (int fd,
 						    gboolean can_seek,
-						    goffset initial_offset);
+						    goffset initial_offset,
+						    GMountSpec *mount_spec,
+						    const char *path);
 
 G_END_DECLS
 
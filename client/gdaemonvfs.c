@@ -55,7 +55,12 @@ struct _GDaemonVfs
   GDBusConnection *async_bus;
   
   GVfs *wrapped_vfs;
-  GList *mount_cache;
+
+  /* Protected by mount_cache lock */
+  GHashTable *mount_cache; /* GMountSpec, items only -> GList of GMountInfo */
+  GHashTable *mount_cache_by_fuse; /* fuse mountpoint -> GMountInfo */
+  GHashTable *mount_cache_negative; /* spec and path -> expiry time */
+  guint mount_tracker_signal_id;
 
   GFile *fuse_root;
   
@@ -80,8 +85,65 @@ static GVfsMetadata *metadata_proxy = NULL;
 
 G_LOCK_DEFINE_STATIC(mount_cache);
 
+/* Lookups of locations that are not mounted are remembered for a while,
+   or until the mount tracker says something got mounted */
+#define MOUNT_CACHE_NEGATIVE_TTL (5 * G_USEC_PER_SEC)
+#define MOUNT_CACHE_MAX_NEGATIVE 256
+
+/* Client side GFileInfo cache, off unless GVFS_INFO_CACHE_TTL is set to
+   the number of seconds query results may be reused for. Entries of
+   directories with a working monitor are kept longer, and dropped when
+   the backend reports a change. */
+#define INFO_CACHE_MAX_PATHS 4096
+#define INFO_CACHE_MAX_MONITORS 64
+#define INFO_CACHE_MONITORED_TTL (60 * G_USEC_PER_SEC)
+
+typedef struct {
+  char *attributes;
+  GFileQueryInfoFlags flags;
+  GFileInfo *info;
+  gint64 expires;
+} InfoCacheEntry;
+
+/* Used as both key and value */
+typedef struct {
+  GMountSpec *spec;
+  char *path;
+  GList *entries;
+} InfoCachePath;
+
+typedef struct {
+  GMountSpec *spec;
+  char *path;
+  GFileMonitor *monitor; /* NULL if pending or not supported */
+} InfoCacheMonitor;
+
+G_LOCK_DEFINE_STATIC(info_cache);
+static gint64 info_cache_ttl = 0;
+static GHashTable *info_cache = NULL;
+static GHashTable *info_cache_monitors = NULL;
+/* InfoCacheMonitors, oldest first */
+static GQueue info_cache_monitor_queue = G_QUEUE_INIT;
+
+/* Recently parsed uris, applications tend to convert the same ones
+   over and over (recent files, bookmarks, search results) */
+#define URI_CACHE_SIZE 512
+
+typedef struct {
+  char *uri;
+  GMountSpec *spec; /* unique */
+  char *path;
+  GList link;
+} UriCacheEntry;
+
+G_LOCK_DEFINE_STATIC(uri_cache);
+static GHashTable *uri_cache = NULL;
+/* UriCacheEntries, most recently used first */
+static GQueue uri_cache_lru = G_QUEUE_INIT;
+
 
 static void fill_mountable_info (GDaemonVfs *vfs);
+static void mount_cache_init (GDaemonVfs *vfs);
 
 static void
 g_daemon_vfs_finalize (GObject *object)
@@ -98,6 +160,15 @@ g_daemon_vfs_finalize (GObject *object)
 
   g_strfreev (vfs->supported_uri_schemes);
 
+  if (vfs->mount_tracker_signal_id != 0)
+    g_dbus_connection_signal_unsubscribe (vfs->async_bus, vfs->mount_tracker_signal_id);
+  if (vfs->mount_cache)
+    g_hash_table_destroy (vfs->mount_cache);
+  if (vfs->mount_cache_by_fuse)
+    g_hash_table_destroy (vfs->mount_cache_by_fuse);
+  if (vfs->mount_cache_negative)
+    g_hash_table_destroy (vfs->mount_cache_negative);
+
   g_clear_object (&vfs->async_bus);
   g_clear_object (&vfs->wrapped_vfs);
   
@@ -171,10 +242,10 @@ str_tolower_inplace (char *str)
 }
 
 static gboolean
-get_mountspec_from_uri (GDaemonVfs *vfs,
-			const char *uri,
-			GMountSpec **spec_out,
-			char **path_out)
+parse_mountspec_from_uri (GDaemonVfs *vfs,
+			  const char *uri,
+			  GMountSpec **spec_out,
+			  char **path_out)
 {
   GMountSpec *spec;
   char *path;
@@ -280,6 +351,74 @@ get_mountspec_from_uri (GDaemonVfs *vfs,
   return TRUE;
 }
 
+static void
+uri_cache_entry_free (UriCacheEntry *entry)
+{
+  g_free (entry->uri);
+  g_mount_spec_unref (entry->spec);
+  g_free (entry->path);
+  g_free (entry);
+}
+
+static gboolean
+get_mountspec_from_uri (GDaemonVfs *vfs,
+			const char *uri,
+			GMountSpec **spec_out,
+			char **path_out)
+{
+  UriCacheEntry *entry;
+  GMountSpec *spec;
+  char *path;
+
+  G_LOCK (uri_cache);
+  if (uri_cache != NULL &&
+      (entry = g_hash_table_lookup (uri_cache, uri)) != NULL)
+    {
+      g_queue_unlink (&uri_cache_lru, &entry->link);
+      g_queue_push_head_link (&uri_cache_lru, &entry->link);
+
+      *spec_out = g_mount_spec_ref (entry->spec);
+      *path_out = g_strdup (entry->path);
+      G_UNLOCK (uri_cache);
+      return TRUE;
+    }
+  G_UNLOCK (uri_cache);
+
+  if (!parse_mountspec_from_uri (vfs, uri, &spec, &path))
+    return FALSE;
+
+  /* Interned so that all files on the same location share the spec */
+  *spec_out = g_mount_spec_get_unique_for (spec);
+  *path_out = path;
+  g_mount_spec_unref (spec);
+
+  G_LOCK (uri_cache);
+  if (uri_cache == NULL)
+    uri_cache = g_hash_table_new_full (g_str_hash, g_str_equal,
+				       NULL, (GDestroyNotify)uri_cache_entry_free);
+
+  if (!g_hash_table_contains (uri_cache, uri))
+    {
+      entry = g_new0 (UriCacheEntry, 1);
+      entry->uri = g_strdup (uri);
+      entry->spec = g_mount_spec_ref (*spec_out);
+      entry->path = g_strdup (path);
+      entry->link.data = entry;
+      g_queue_push_head_link (&uri_cache_lru, &entry->link);
+      g_hash_table_insert (uri_cache, entry->uri, entry);
+
+      if (g_queue_get_length (&uri_cache_lru) > URI_CACHE_SIZE)
+	{
+	  entry = g_queue_peek_tail (&uri_cache_lru);
+	  g_queue_unlink (&uri_cache_lru, &entry->link);
+	  g_hash_table_remove (uri_cache, entry->uri);
+	}
+    }
+  G_UNLOCK (uri_cache);
+
+  return TRUE;
+}
+
 static void
 g_daemon_vfs_init (GDaemonVfs *vfs)
 {
@@ -288,6 +427,7 @@ g_daemon_vfs_init (GDaemonVfs *vfs)
   const char * const *schemes, * const *mount_types;
   GVfsUriMapper *mapper;
   GList *modules;
+  const char *ttl;
   char *file;
   int i;
 
@@ -314,7 +454,12 @@ g_daemon_vfs_init (GDaemonVfs *vfs)
   */
   signal (SIGPIPE, SIG_IGN);
 
+  ttl = g_getenv ("GVFS_INFO_CACHE_TTL");
+  if (ttl != NULL)
+    info_cache_ttl = MAX (0, atoi (ttl)) * G_USEC_PER_SEC;
+
   fill_mountable_info (vfs);
+  mount_cache_init (vfs);
   
   vfs->wrapped_vfs = g_vfs_get_local ();
 
@@ -705,6 +850,184 @@ g_daemon_vfs_get_supported_uri_schemes (GVfs *vfs)
   return (const gchar * const *) G_DAEMON_VFS (vfs)->supported_uri_schemes;
 }
 
+/* Mounts only match specs with the same items, so the cache is bucketed
+   by those and the mount prefixes are only compared within a bucket */
+static guint
+mount_spec_items_hash (gconstpointer key)
+{
+  const GMountSpec *spec = key;
+  guint hash;
+  int i;
+
+  hash = 0;
+  for (i = 0; i < spec->items->len; i++)
+    {
+      GMountSpecItem *item = &g_array_index (spec->items, GMountSpecItem, i);
+      hash = hash * 31 + g_str_hash (item->key);
+      hash = hash * 31 + g_str_hash (item->value);
+    }
+
+  return hash;
+}
+
+static gboolean
+mount_spec_items_equal (gconstpointer a,
+			gconstpointer b)
+{
+  const GMountSpec *spec_a = a, *spec_b = b;
+  int i;
+
+  if (spec_a->items->len != spec_b->items->len)
+    return FALSE;
+
+  for (i = 0; i < spec_a->items->len; i++)
+    {
+      GMountSpecItem *item_a = &g_array_index (spec_a->items, GMountSpecItem, i);
+      GMountSpecItem *item_b = &g_array_index (spec_b->items, GMountSpecItem, i);
+
+      if (strcmp (item_a->key, item_b->key) != 0 ||
+	  strcmp (item_a->value, item_b->value) != 0)
+	return FALSE;
+    }
+
+  return TRUE;
+}
+
+static char *
+mount_cache_negative_key (GMountSpec *spec,
+			  const char *path)
+{
+  char *spec_str, *key;
+
+  spec_str = g_mount_spec_to_string (spec);
+  key = g_strconcat (spec_str, "\n", path, NULL);
+  g_free (spec_str);
+
+  return key;
+}
+
+static void
+mount_cache_add_locked (GMountInfo *info)
+{
+  GList *mounts;
+  GMountSpec *key;
+
+  if (g_hash_table_lookup_extended (the_vfs->mount_cache, info->mount_spec,
+				    (gpointer *)&key, (gpointer *)&mounts))
+    g_hash_table_steal (the_vfs->mount_cache, key);
+  else
+    {
+      key = g_mount_spec_ref (info->mount_spec);
+      mounts = NULL;
+    }
+
+  mounts = g_list_prepend (mounts, g_mount_info_ref (info));
+  g_hash_table_insert (the_vfs->mount_cache, key, mounts);
+
+  if (info->fuse_mountpoint != NULL)
+    g_hash_table_insert (the_vfs->mount_cache_by_fuse, info->fuse_mountpoint, info);
+}
+
+/* Returns whether anything was removed */
+static gboolean
+mount_cache_remove_matching_locked (GMountInfo *match,
+				    const char *dbus_id)
+{
+  GHashTableIter iter;
+  GList *mounts, *l, *next;
+  GMountInfo *mount_info;
+  gboolean removed;
+
+  removed = FALSE;
+  g_hash_table_iter_init (&iter, the_vfs->mount_cache);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&mounts))
+    {
+      for (l = mounts; l != NULL; l = next)
+	{
+	  mount_info = l->data;
+	  next = l->next;
+
+	  if ((match != NULL && g_mount_info_equal (mount_info, match)) ||
+	      (dbus_id != NULL && strcmp (mount_info->dbus_id, dbus_id) == 0))
+	    {
+	      if (mount_info->fuse_mountpoint != NULL &&
+		  g_hash_table_lookup (the_vfs->mount_cache_by_fuse,
+				       mount_info->fuse_mountpoint) == mount_info)
+		g_hash_table_remove (the_vfs->mount_cache_by_fuse,
+				     mount_info->fuse_mountpoint);
+
+	      mounts = g_list_delete_link (mounts, l);
+	      g_mount_info_unref (mount_info);
+	      removed = TRUE;
+	    }
+	}
+
+      if (mounts == NULL)
+	g_hash_table_iter_remove (&iter);
+      else
+	g_hash_table_iter_replace (&iter, mounts);
+    }
+
+  return removed;
+}
+
+static void
+mount_tracker_signal_cb (GDBusConnection *connection,
+			 const gchar *sender_name,
+			 const gchar *object_path,
+			 const gchar *interface_name,
+			 const gchar *signal_name,
+			 GVariant *parameters,
+			 gpointer user_data)
+{
+  GMountInfo *info;
+  GVariant *mount;
+
+  if (!g_variant_is_of_type (parameters, G_VARIANT_TYPE ("((sossssssbay(aya{sv})ay))")))
+    return;
+
+  mount = g_variant_get_child_value (parameters, 0);
+  info = g_mount_info_from_dbus (mount);
+  g_variant_unref (mount);
+  if (info == NULL)
+    return;
+
+  G_LOCK (mount_cache);
+  if (strcmp (signal_name, "Mounted") == 0)
+    g_hash_table_remove_all (the_vfs->mount_cache_negative);
+  else if (strcmp (signal_name, "Unmounted") == 0)
+    mount_cache_remove_matching_locked (info, NULL);
+  G_UNLOCK (mount_cache);
+
+  g_mount_info_unref (info);
+}
+
+static void
+mount_cache_init (GDaemonVfs *vfs)
+{
+  vfs->mount_cache = g_hash_table_new_full (mount_spec_items_hash,
+					    mount_spec_items_equal,
+					    (GDestroyNotify)g_mount_spec_unref,
+					    NULL);
+  vfs->mount_cache_by_fuse = g_hash_table_new (g_str_hash, g_str_equal);
+  vfs->mount_cache_negative = g_hash_table_new_full (g_str_hash, g_str_equal,
+						     g_free, g_free);
+
+  /* Signals arrive on the context that is thread-default here. If that
+     one never runs, mounts made by this process still clear the
+     negative cache themselves, see mount_reply() in gdaemonfile.c */
+  vfs->mount_tracker_signal_id =
+    g_dbus_connection_signal_subscribe (vfs->async_bus,
+					G_VFS_DBUS_DAEMON_NAME,
+					"org.gtk.vfs.MountTracker",
+					NULL,
+					G_VFS_DBUS_MOUNTTRACKER_PATH,
+					NULL,
+					G_DBUS_SIGNAL_FLAGS_NONE,
+					mount_tracker_signal_cb,
+					NULL, NULL);
+}
+
 static GMountInfo *
 lookup_mount_info_in_cache_locked (GMountSpec *spec,
 				   const char *path)
@@ -713,7 +1036,7 @@ lookup_mount_info_in_cache_locked (GMountSpec *spec,
   GList *l;
 
   info = NULL;
-  for (l = the_vfs->mount_cache; l != NULL; l = l->next)
+  for (l = g_hash_table_lookup (the_vfs->mount_cache, spec); l != NULL; l = l->next)
     {
       GMountInfo *mount_info = l->data;
 
@@ -727,50 +1050,117 @@ lookup_mount_info_in_cache_locked (GMountSpec *spec,
   return info;
 }
 
-static GMountInfo *
+/* Returns TRUE and sets error if the location is known not to be mounted */
+static gboolean
 lookup_mount_info_in_cache (GMountSpec *spec,
-			   const char *path)
+			    const char *path,
+			    GMountInfo **info,
+			    GError **error)
 {
-  GMountInfo *info;
+  gint64 *expires;
+  char *key;
 
   G_LOCK (mount_cache);
-  info = lookup_mount_info_in_cache_locked (spec, path);
+  *info = lookup_mount_info_in_cache_locked (spec, path);
+
+  expires = NULL;
+  key = NULL;
+  if (*info == NULL && g_hash_table_size (the_vfs->mount_cache_negative) > 0)
+    {
+      key = mount_cache_negative_key (spec, path);
+      expires = g_hash_table_lookup (the_vfs->mount_cache_negative, key);
+      if (expires != NULL && *expires < g_get_monotonic_time ())
+	{
+	  g_hash_table_remove (the_vfs->mount_cache_negative, key);
+	  expires = NULL;
+	}
+    }
   G_UNLOCK (mount_cache);
 
-  return info;
+  g_free (key);
+
+  if (expires != NULL)
+    {
+      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_NOT_MOUNTED,
+			   _("The specified location is not mounted"));
+      return TRUE;
+    }
+
+  return *info != NULL;
+}
+
+static void
+mount_cache_add_negative (GMountSpec *spec,
+			  const char *path,
+			  const GError *error)
+{
+  gint64 *expires;
+
+  if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_NOT_MOUNTED))
+    return;
+
+  expires = g_new (gint64, 1);
+  *expires = g_get_monotonic_time () + MOUNT_CACHE_NEGATIVE_TTL;
+
+  G_LOCK (mount_cache);
+  if (g_hash_table_size (the_vfs->mount_cache_negative) >= MOUNT_CACHE_MAX_NEGATIVE)
+    g_hash_table_remove_all (the_vfs->mount_cache_negative);
+  g_hash_table_replace (the_vfs->mount_cache_negative,
+			mount_cache_negative_key (spec, path),
+			expires);
+  G_UNLOCK (mount_cache);
+}
+
+/* Called after mounting a location, which may have been cached as not
+   mounted a moment ago */
+void
+_g_daemon_vfs_clear_negative_mount_cache (void)
+{
+  G_LOCK (mount_cache);
+  g_hash_table_remove_all (the_vfs->mount_cache_negative);
+  G_UNLOCK (mount_cache);
 }
 
+/* Mountpoints are looked up by each leading run of path components,
+   longest first, so this costs a hash lookup per component */
 static GMountInfo *
 lookup_mount_info_by_fuse_path_in_cache (const char *fuse_path,
 					 char **mount_path)
 {
   GMountInfo *info;
-  GList *l;
+  char *prefix;
+  int len;
+
+  prefix = g_strdup (fuse_path);
+  len = strlen (prefix);
 
   G_LOCK (mount_cache);
   info = NULL;
-  for (l = the_vfs->mount_cache; l != NULL; l = l->next)
+  while (len > 0)
     {
-      GMountInfo *mount_info = l->data;
+      prefix[len] = 0;
+      info = g_hash_table_lookup (the_vfs->mount_cache_by_fuse, prefix);
+      if (info != NULL)
+	break;
 
-      if (mount_info->fuse_mountpoint != NULL &&
-	  g_str_has_prefix (fuse_path, mount_info->fuse_mountpoint))
-	{
-	  int len = strlen (mount_info->fuse_mountpoint);
-	  if (fuse_path[len] == 0 ||
-	      fuse_path[len] == '/')
-	    {
-	      if (fuse_path[len] == 0)
-		*mount_path = g_strdup ("/");
-	      else
-		*mount_path = g_strdup (fuse_path + len);
-	      info = g_mount_info_ref (mount_info);
-	      break;
-	    }
-	}
+      while (len > 0 && prefix[len - 1] != '/')
+	len--;
+      while (len > 0 && prefix[len - 1] == '/')
+	len--;
+    }
+
+  if (info != NULL)
+    {
+      if (fuse_path[len] == 0)
+	*mount_path = g_strdup ("/");
+      else
+	*mount_path = g_strdup (fuse_path + len);
+      g_mount_info_ref (info);
     }
   G_UNLOCK (mount_cache);
 
+  g_free (prefix);
+
   return info;
 }
 
@@ -778,22 +1168,12 @@ lookup_mount_info_by_fuse_path_in_cache (const char *fuse_path,
 void
 _g_daemon_vfs_invalidate_dbus_id (const char *dbus_id)
 {
-  GList *l, *next;
-
   G_LOCK (mount_cache);
-  for (l = the_vfs->mount_cache; l != NULL; l = next)
-    {
-      GMountInfo *mount_info = l->data;
-      next = l->next;
-
-      if (strcmp (mount_info->dbus_id, dbus_id) == 0)
-	{
-	  the_vfs->mount_cache = g_list_delete_link (the_vfs->mount_cache, l);
-	  g_mount_info_unref (mount_info);
-	}
-    }
-  
+  mount_cache_remove_matching_locked (NULL, dbus_id);
   G_UNLOCK (mount_cache);
+
+  /* The monitors went away with the connection */
+  _g_daemon_vfs_info_cache_clear ();
 }
 
 
@@ -818,7 +1198,7 @@ handler_lookup_mount_reply (GVariant *iter,
 
   in_cache = FALSE;
   /* Already in cache from other thread? */
-  for (l = the_vfs->mount_cache; l != NULL; l = l->next)
+  for (l = g_hash_table_lookup (the_vfs->mount_cache, info->mount_spec); l != NULL; l = l->next)
     {
       GMountInfo *cached_info = l->data;
       
@@ -833,7 +1213,7 @@ handler_lookup_mount_reply (GVariant *iter,
 
   /* No, lets add it to the cache */
   if (!in_cache)
-    the_vfs->mount_cache = g_list_prepend (the_vfs->mount_cache, g_mount_info_ref (info));
+    mount_cache_add_locked (info);
 
   G_UNLOCK (mount_cache);
   
@@ -844,6 +1224,7 @@ typedef struct {
   GMountInfoLookupCallback callback;
   gpointer user_data;
   GMountInfo *info;
+  GError *error;
   GMountSpec *spec;
   char *path;
 } GetMountInfoData;
@@ -853,6 +1234,7 @@ free_get_mount_info_data (GetMountInfoData *data)
 {
   if (data->info)
     g_mount_info_unref (data->info);
+  g_clear_error (&data->error);
   if (data->spec)
     g_mount_spec_unref (data->spec);
   g_free (data->path);
@@ -876,6 +1258,7 @@ async_get_mount_info_response (GVfsDBusMountTracker *proxy,
                                                           &error))
     {
       /* g_warning ("Error from org.gtk.vfs.MountTracker.lookupMount(): %s", error->message); */
+      mount_cache_add_negative (data->spec, data->path, error);
       data->callback (NULL, data->user_data, error);
       g_error_free (error);
     }
@@ -899,7 +1282,7 @@ static gboolean
 async_get_mount_info_cache_hit (gpointer _data)
 {
   GetMountInfoData *data = _data;
-  data->callback (data->info, data->user_data, NULL);
+  data->callback (data->info, data->user_data, data->error);
   free_get_mount_info_data (data);
   return FALSE;
 }
@@ -946,9 +1329,7 @@ _g_daemon_vfs_get_mount_info_async (GMountSpec *spec,
   data->spec = g_mount_spec_ref (spec);
   data->path = g_strdup (path);
 
-  info = lookup_mount_info_in_cache (spec, path);
-
-  if (info != NULL)
+  if (lookup_mount_info_in_cache (spec, path, &info, &data->error))
     {
       data->info = info;
       g_idle_add (async_get_mount_info_cache_hit, data);
@@ -973,23 +1354,29 @@ _g_daemon_vfs_get_mount_info_sync (GMountSpec *spec,
   GMountInfo *info;
   GVfsDBusMountTracker *proxy;
   GVariant *iter_mount;
+  GError *local_error;
   
-  info = lookup_mount_info_in_cache (spec, path);
-  if (info != NULL)
+  if (lookup_mount_info_in_cache (spec, path, &info, error))
     return info;
   
   proxy = create_mount_tracker_proxy ();
   g_return_val_if_fail (proxy != NULL, NULL);
   
+  local_error = NULL;
   if (gvfs_dbus_mount_tracker_call_lookup_mount_sync (proxy,
                                                       g_mount_spec_to_dbus_with_path (spec, path),
                                                       &iter_mount,
                                                       cancellable,
-                                                      error))
+                                                      &local_error))
     {
       info = handler_lookup_mount_reply (iter_mount, error);
       g_variant_unref (iter_mount);
     }
+  else
+    {
+      mount_cache_add_negative (spec, path, local_error);
+      g_propagate_error (error, local_error);
+    }
   
   g_object_unref (proxy);
 
@@ -1051,6 +1438,408 @@ _g_daemon_vfs_get_mount_info_by_fuse_sync (const char *fuse_path,
   return info;
 }
 
+static guint
+info_cache_path_hash (gconstpointer key)
+{
+  const InfoCachePath *path = key;
+
+  return g_mount_spec_hash (path->spec) ^ g_str_hash (path->path);
+}
+
+static gboolean
+info_cache_path_equal (gconstpointer a,
+		       gconstpointer b)
+{
+  const InfoCachePath *path_a = a;
+  const InfoCachePath *path_b = b;
+
+  return strcmp (path_a->path, path_b->path) == 0 &&
+    g_mount_spec_equal (path_a->spec, path_b->spec);
+}
+
+static void
+info_cache_entry_free (InfoCacheEntry *entry)
+{
+  g_free (entry->attributes);
+  g_object_unref (entry->info);
+  g_free (entry);
+}
+
+static void
+info_cache_path_free (InfoCachePath *path)
+{
+  g_list_free_full (path->entries, (GDestroyNotify)info_cache_entry_free);
+  g_mount_spec_unref (path->spec);
+  g_free (path->path);
+  g_free (path);
+}
+
+static void
+info_cache_monitor_changed (GFileMonitor *monitor,
+			    GFile *file,
+			    GFile *other_file,
+			    GFileMonitorEvent event_type,
+			    gpointer user_data)
+{
+  if (G_IS_DAEMON_FILE (file))
+    _g_daemon_vfs_info_cache_invalidate (G_DAEMON_FILE (file)->mount_spec,
+					 G_DAEMON_FILE (file)->path);
+  if (other_file && G_IS_DAEMON_FILE (other_file))
+    _g_daemon_vfs_info_cache_invalidate (G_DAEMON_FILE (other_file)->mount_spec,
+					 G_DAEMON_FILE (other_file)->path);
+}
+
+static void
+info_cache_monitor_free (InfoCacheMonitor *monitor)
+{
+  if (monitor->monitor)
+    {
+      g_signal_handlers_disconnect_by_func (monitor->monitor,
+					    info_cache_monitor_changed,
+					    NULL);
+      g_file_monitor_cancel (monitor->monitor);
+      g_object_unref (monitor->monitor);
+    }
+  g_mount_spec_unref (monitor->spec);
+  g_free (monitor->path);
+  g_free (monitor);
+}
+
+static void
+info_cache_ensure_locked (void)
+{
+  if (info_cache != NULL)
+    return;
+
+  info_cache = g_hash_table_new_full (info_cache_path_hash,
+				      info_cache_path_equal,
+				      (GDestroyNotify)info_cache_path_free,
+				      NULL);
+  info_cache_monitors = g_hash_table_new_full (info_cache_path_hash,
+					       info_cache_path_equal,
+					       (GDestroyNotify)info_cache_monitor_free,
+					       NULL);
+}
+
+static gboolean
+info_cache_path_expired (gpointer key,
+			 gpointer value,
+			 gpointer user_data)
+{
+  InfoCachePath *path = key;
+  gint64 now = *(gint64 *)user_data;
+  GList *l;
+
+  for (l = path->entries; l != NULL; l = l->next)
+    {
+      InfoCacheEntry *entry = l->data;
+
+      if (entry->expires > now)
+	return FALSE;
+    }
+
+  return TRUE;
+}
+
+static gboolean
+info_cache_path_in_dir (gpointer key,
+			gpointer value,
+			gpointer user_data)
+{
+  InfoCachePath *path = key;
+  InfoCacheMonitor *dir = user_data;
+  char *parent;
+  gboolean res;
+
+  if (!g_mount_spec_equal (path->spec, dir->spec))
+    return FALSE;
+
+  parent = g_path_get_dirname (path->path);
+  res = strcmp (parent, dir->path) == 0;
+  g_free (parent);
+
+  return res;
+}
+
+gboolean
+_g_daemon_vfs_info_cache_enabled (void)
+{
+  return info_cache_ttl > 0;
+}
+
+/* Returns a copy of the cached info, or NULL */
+GFileInfo *
+_g_daemon_vfs_info_cache_lookup (GMountSpec *spec,
+				 const char *path,
+				 const char *attributes,
+				 GFileQueryInfoFlags flags)
+{
+  InfoCachePath key, *cache_path;
+  GFileInfo *info;
+  GList *l;
+
+  if (info_cache_ttl == 0)
+    return NULL;
+
+  if (attributes == NULL)
+    attributes = "";
+
+  key.spec = spec;
+  key.path = (char *)path;
+
+  info = NULL;
+
+  G_LOCK (info_cache);
+
+  cache_path = info_cache ? g_hash_table_lookup (info_cache, &key) : NULL;
+  if (cache_path)
+    {
+      for (l = cache_path->entries; l != NULL; l = l->next)
+	{
+	  InfoCacheEntry *entry = l->data;
+
+	  if (entry->flags == flags &&
+	      strcmp (entry->attributes, attributes) == 0)
+	    {
+	      if (entry->expires > g_get_monotonic_time ())
+		info = g_file_info_dup (entry->info);
+	      break;
+	    }
+	}
+    }
+
+  G_UNLOCK (info_cache);
+
+  return info;
+}
+
+void
+_g_daemon_vfs_info_cache_insert (GMountSpec *spec,
+				 const char *path,
+				 const char *attributes,
+				 GFileQueryInfoFlags flags,
+				 GFileInfo *info)
+{
+  InfoCachePath key, *cache_path;
+  InfoCacheMonitor *monitor;
+  InfoCacheEntry *entry;
+  gint64 now;
+  GList *l;
+
+  if (info_cache_ttl == 0)
+    return;
+
+  if (attributes == NULL)
+    attributes = "";
+
+  now = g_get_monotonic_time ();
+
+  G_LOCK (info_cache);
+
+  info_cache_ensure_locked ();
+
+  if (g_hash_table_size (info_cache) >= INFO_CACHE_MAX_PATHS)
+    {
+      g_hash_table_foreach_remove (info_cache, info_cache_path_expired, &now);
+      if (g_hash_table_size (info_cache) >= INFO_CACHE_MAX_PATHS)
+	g_hash_table_remove_all (info_cache);
+    }
+
+  key.spec = spec;
+  key.path = g_path_get_dirname (path);
+  monitor = g_hash_table_lookup (info_cache_monitors, &key);
+  g_free (key.path);
+
+  key.path = (char *)path;
+  cache_path = g_hash_table_lookup (info_cache, &key);
+  if (cache_path == NULL)
+    {
+      cache_path = g_new0 (InfoCachePath, 1);
+      cache_path->spec = g_mount_spec_ref (spec);
+      cache_path->path = g_strdup (path);
+      g_hash_table_add (info_cache, cache_path);
+    }
+
+  entry = NULL;
+  for (l = cache_path->entries; l != NULL; l = l->next)
+    {
+      InfoCacheEntry *e = l->data;
+
+      if (e->flags == flags && strcmp (e->attributes, attributes) == 0)
+	{
+	  entry = e;
+	  g_object_unref (entry->info);
+	  break;
+	}
+    }
+
+  if (entry == NULL)
+    {
+      entry = g_new0 (InfoCacheEntry, 1);
+      entry->attributes = g_strdup (attributes);
+      entry->flags = flags;
+      cache_path->entries = g_list_prepend (cache_path->entries, entry);
+    }
+
+  entry->info = g_file_info_dup (info);
+  if (monitor != NULL && monitor->monitor != NULL)
+    entry->expires = now + INFO_CACHE_MONITORED_TTL;
+  else
+    entry->expires = now + info_cache_ttl;
+
+  G_UNLOCK (info_cache);
+}
+
+typedef struct {
+  GMountSpec *spec;
+  const char *path;
+  gsize len;
+} InfoCachePrefix;
+
+static gboolean
+info_cache_path_under (gpointer key,
+		       gpointer value,
+		       gpointer user_data)
+{
+  InfoCachePath *path = key;
+  InfoCachePrefix *prefix = user_data;
+
+  if (!g_mount_spec_equal (path->spec, prefix->spec))
+    return FALSE;
+
+  if (strncmp (path->path, prefix->path, prefix->len) != 0)
+    return FALSE;
+
+  return path->path[prefix->len] == 0 ||
+    path->path[prefix->len] == '/' ||
+    (prefix->len > 0 && prefix->path[prefix->len - 1] == '/');
+}
+
+/* Drops @path and everything below it, which is gone too if it was a
+   directory that got moved or deleted, and its parent whose contents
+   changed */
+void
+_g_daemon_vfs_info_cache_invalidate (GMountSpec *spec,
+				     const char *path)
+{
+  InfoCachePath key;
+  InfoCachePrefix prefix;
+
+  if (info_cache_ttl == 0)
+    return;
+
+  key.spec = spec;
+
+  G_LOCK (info_cache);
+
+  if (info_cache)
+    {
+      prefix.spec = spec;
+      prefix.path = path;
+      prefix.len = strlen (path);
+      g_hash_table_foreach_remove (info_cache, info_cache_path_under, &prefix);
+
+      key.path = g_path_get_dirname (path);
+      g_hash_table_remove (info_cache, &key);
+      g_free (key.path);
+    }
+
+  G_UNLOCK (info_cache);
+}
+
+void
+_g_daemon_vfs_info_cache_clear (void)
+{
+  G_LOCK (info_cache);
+
+  if (info_cache)
+    {
+      g_queue_clear (&info_cache_monitor_queue);
+      g_hash_table_remove_all (info_cache_monitors);
+      g_hash_table_remove_all (info_cache);
+    }
+
+  G_UNLOCK (info_cache);
+}
+
+/* Returns TRUE if the caller should set up a monitor for the directory
+   and pass it to _g_daemon_vfs_info_cache_set_monitor() */
+gboolean
+_g_daemon_vfs_info_cache_want_monitor (GMountSpec *spec,
+				       const char *path)
+{
+  InfoCacheMonitor *monitor, *oldest;
+  InfoCachePath key;
+
+  if (info_cache_ttl == 0)
+    return FALSE;
+
+  key.spec = spec;
+  key.path = (char *)path;
+
+  G_LOCK (info_cache);
+
+  info_cache_ensure_locked ();
+
+  if (g_hash_table_contains (info_cache_monitors, &key))
+    {
+      G_UNLOCK (info_cache);
+      return FALSE;
+    }
+
+  if (g_hash_table_size (info_cache_monitors) >= INFO_CACHE_MAX_MONITORS)
+    {
+      /* Without the monitor the long lived entries may go stale */
+      oldest = g_queue_pop_head (&info_cache_monitor_queue);
+      g_hash_table_foreach_remove (info_cache, info_cache_path_in_dir, oldest);
+      g_hash_table_remove (info_cache_monitors, oldest);
+    }
+
+  monitor = g_new0 (InfoCacheMonitor, 1);
+  monitor->spec = g_mount_spec_ref (spec);
+  monitor->path = g_strdup (path);
+  g_hash_table_add (info_cache_monitors, monitor);
+  g_queue_push_tail (&info_cache_monitor_queue, monitor);
+
+  G_UNLOCK (info_cache);
+
+  return TRUE;
+}
+
+/* Takes ownership of @file_monitor, which is NULL if the directory
+   can't be monitored */
+void
+_g_daemon_vfs_info_cache_set_monitor (GMountSpec *spec,
+				      const char *path,
+				      GFileMonitor *file_monitor)
+{
+  InfoCacheMonitor *monitor;
+  InfoCachePath key;
+
+  key.spec = spec;
+  key.path = (char *)path;
+
+  G_LOCK (info_cache);
+
+  monitor = info_cache ? g_hash_table_lookup (info_cache_monitors, &key) : NULL;
+  if (monitor != NULL && monitor->monitor == NULL && file_monitor != NULL)
+    {
+      monitor->monitor = file_monitor;
+      g_signal_connect (file_monitor, "changed",
+			G_CALLBACK (info_cache_monitor_changed), NULL);
+      file_monitor = NULL;
+    }
+
+  G_UNLOCK (info_cache);
+
+  /* Evicted or cleared while it was being set up */
+  if (file_monitor != NULL)
+    {
+      g_file_monitor_cancel (file_monitor);
+      g_object_unref (file_monitor);
+    }
+}
+
 static GFile *
 g_daemon_vfs_parse_name (GVfs       *vfs,
 			 const char *parse_name)
@@ -1092,6 +1881,80 @@ enumerate_keys_callback (const char *key,
   return TRUE;
 }
 
+typedef struct {
+  MetaLookupCache *cache;
+
+  /* The directory of the last file looked up, and where it maps to */
+  char *dirname;
+  guint64 device;
+  MetaTree *tree;
+  char *tree_dirname;
+  /* name -> GFileInfo with the metadata of every child of tree_dirname,
+     only filled in once a second file in the same directory is seen */
+  GHashTable *children;
+} LocalMetadata;
+
+static void
+local_metadata_clear_dir (LocalMetadata *local)
+{
+  g_free (local->dirname);
+  local->dirname = NULL;
+  g_free (local->tree_dirname);
+  local->tree_dirname = NULL;
+  if (local->tree)
+    meta_tree_unref (local->tree);
+  local->tree = NULL;
+  if (local->children)
+    g_hash_table_destroy (local->children);
+  local->children = NULL;
+}
+
+static void
+local_metadata_free (LocalMetadata *local)
+{
+  local_metadata_clear_dir (local);
+  meta_lookup_cache_free (local->cache);
+  g_free (local);
+}
+
+static gboolean
+enumerate_dir_keys_callback (const char *child,
+			     const char *key,
+			     MetaKeyType type,
+			     gpointer value,
+			     gpointer user_data)
+{
+  GHashTable *children = user_data;
+  GFileInfo *info;
+
+  info = g_hash_table_lookup (children, child);
+  if (info == NULL)
+    {
+      info = g_file_info_new ();
+      g_hash_table_insert (children, g_strdup (child), info);
+    }
+
+  return enumerate_keys_callback (key, type, value, info);
+}
+
+static void
+copy_metadata_attributes (GFileInfo *from,
+			  GFileInfo *to)
+{
+  GFileAttributeType type;
+  gpointer value;
+  char **attrs;
+  int i;
+
+  attrs = g_file_info_list_attributes (from, "metadata");
+  for (i = 0; attrs[i] != NULL; i++)
+    {
+      if (g_file_info_get_attribute_data (from, attrs[i], &type, &value, NULL))
+	g_file_info_set_attribute (to, attrs[i], type, value);
+    }
+  g_strfreev (attrs);
+}
+
 static void
 g_daemon_vfs_local_file_add_info (GVfs       *vfs,
 				  const char *filename,
@@ -1102,9 +1965,10 @@ g_daemon_vfs_local_file_add_info (GVfs       *vfs,
 				  gpointer    *extra_data,
 				  GDestroyNotify *extra_data_free)
 {
-  MetaLookupCache *cache;
+  LocalMetadata *local;
+  GFileInfo *child_info;
   const char *first;
-  char *tree_path;
+  char *tree_path, *dirname, *basename;
   gboolean all;
   MetaTree *tree;
 
@@ -1124,12 +1988,43 @@ g_daemon_vfs_local_file_add_info (GVfs       *vfs,
 
   if (*extra_data == NULL)
     {
-      *extra_data = meta_lookup_cache_new ();
-      *extra_data_free = (GDestroyNotify)meta_lookup_cache_free;
+      local = g_new0 (LocalMetadata, 1);
+      local->cache = meta_lookup_cache_new ();
+      *extra_data = local;
+      *extra_data_free = (GDestroyNotify)local_metadata_free;
     }
-  cache = (MetaLookupCache *)*extra_data;
+  local = (LocalMetadata *)*extra_data;
 
-  tree = meta_lookup_cache_lookup_path (cache,
+  dirname = g_path_get_dirname (filename);
+
+  /* When enumerating a directory we get called for each child, so
+     fetch the metadata for all of them at once instead of walking
+     the tree and journal for each file */
+  if (local->tree != NULL &&
+      local->device == device &&
+      strcmp (local->dirname, dirname) == 0)
+    {
+      if (local->children == NULL)
+	{
+	  local->children = g_hash_table_new_full (g_str_hash, g_str_equal,
+						   g_free, g_object_unref);
+	  meta_tree_enumerate_dir_with_keys (local->tree, local->tree_dirname,
+					     enumerate_dir_keys_callback,
+					     local->children);
+	}
+
+      basename = g_path_get_basename (filename);
+      child_info = g_hash_table_lookup (local->children, basename);
+      if (child_info)
+	copy_metadata_attributes (child_info, info);
+      g_free (basename);
+      g_free (dirname);
+      return;
+    }
+
+  local_metadata_clear_dir (local);
+
+  tree = meta_lookup_cache_lookup_path (local->cache,
 					filename,
 					device,
 					FALSE,
@@ -1139,9 +2034,16 @@ g_daemon_vfs_local_file_add_info (GVfs       *vfs,
     {
       meta_tree_enumerate_keys (tree, tree_path,
 				enumerate_keys_callback, info);
-      meta_tree_unref (tree);
+
+      local->dirname = dirname;
+      dirname = NULL;
+      local->device = device;
+      local->tree = tree;
+      local->tree_dirname = g_path_get_dirname (tree_path);
       g_free (tree_path);
     }
+
+  g_free (dirname);
 }
 
 static void
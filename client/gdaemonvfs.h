@@ -68,6 +68,7 @@ GMountSpec *    _g_daemon_vfs_get_mount_spec_for_path  (GMountSpec
 						        const char               *path,
 						        const char               *new_path);
 void            _g_daemon_vfs_invalidate_dbus_id       (const char               *dbus_id);
+void            _g_daemon_vfs_clear_negative_mount_cache (void);
 GDBusConnection *_g_daemon_vfs_get_async_bus           (void);
 int             _g_daemon_vfs_append_metadata_for_set  (GVariantBuilder *builder,
 							MetaTree *tree,
@@ -79,6 +80,25 @@ int             _g_daemon_vfs_append_metadata_for_set  (GVariantBuilder *builder
 GVfsMetadata *  _g_daemon_vfs_get_metadata_proxy       (GCancellable             *cancellable,
                                                         GError                  **error);
 
+gboolean        _g_daemon_vfs_info_cache_enabled       (void);
+GFileInfo *     _g_daemon_vfs_info_cache_lookup        (GMountSpec               *spec,
+							const char               *path,
+							const char               *attributes,
+							GFileQueryInfoFlags       flags);
+void            _g_daemon_vfs_info_cache_insert        (GMountSpec               *spec,
+							const char               *path,
+							const char               *attributes,
+							GFileQueryInfoFlags       flags,
+							GFileInfo                *info);
+void            _g_daemon_vfs_info_cache_invalidate    (GMountSpec               *spec,
+							const char               *path);
+void            _g_daemon_vfs_info_cache_clear         (void);
+gboolean        _g_daemon_vfs_info_cache_want_monitor  (GMountSpec               *spec,
+							const char               *path);
+void            _g_daemon_vfs_info_cache_set_monitor   (GMountSpec               *spec,
+							const char               *path,
+							GFileMonitor             *file_monitor);
+
 
 
 G_END_DECLS
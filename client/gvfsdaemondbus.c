@@ -29,6 +29,7 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <errno.h>
+#include <string.h>
 
 #include <glib/gi18n-lib.h>
 
@@ -564,16 +565,31 @@ void
 struct _ThreadLocalConnections {
   GHashTable *connections;
   GDBusConnection *session_bus;
+  /* "dbus id\nobject path" -> GVfsDBusMount */
+  GHashTable *mount_proxies;
 };
 
 static void
 free_local_connections (ThreadLocalConnections *local)
 {
   g_hash_table_destroy (local->connections);
+  g_hash_table_destroy (local->mount_proxies);
   g_clear_object (&local->session_bus);
   g_free (local);
 }
 
+static gboolean
+mount_proxy_has_dbus_id (gpointer key,
+			 gpointer value,
+			 gpointer user_data)
+{
+  const char *id = key;
+  const char *dbus_id = user_data;
+  gsize len = strlen (dbus_id);
+
+  return strncmp (id, dbus_id, len) == 0 && id[len] == '\n';
+}
+
 static void
 invalidate_local_connection (const char *dbus_id,
 			     GError **error)
@@ -584,7 +600,11 @@ invalidate_local_connection (const char *dbus_id,
 
   local = g_private_get (&local_connections);
   if (local)
-    g_hash_table_remove (local->connections, dbus_id);
+    {
+      g_hash_table_remove (local->connections, dbus_id);
+      g_hash_table_foreach_remove (local->mount_proxies,
+				   mount_proxy_has_dbus_id, (gpointer) dbus_id);
+    }
   
   g_set_error_literal (error,
 		       G_VFS_ERROR,
@@ -614,6 +634,8 @@ _g_dbus_connection_get_sync (const char *dbus_id,
       local = g_new0 (ThreadLocalConnections, 1);
       local->connections = g_hash_table_new_full (g_str_hash, g_str_equal,
 						  g_free, (GDestroyNotify)g_object_unref);
+      local->mount_proxies = g_hash_table_new_full (g_str_hash, g_str_equal,
+						    g_free, (GDestroyNotify)g_object_unref);
       g_private_set (&local_connections, local);
     }
 
@@ -712,6 +734,65 @@ _g_dbus_connection_get_sync (const char *dbus_id,
   return connection;
 }
 
+/**
+ * _g_dbus_mount_proxy_get_sync:
+ * @connection: the connection returned by _g_dbus_connection_get_sync()
+ * @dbus_id: the dbus id of the mount
+ * @object_path: the object path of the mount
+ * @cancellable: a #GCancellable
+ * @error: a #GError
+ *
+ * Returns a proxy for the mount, like gvfs_dbus_mount_proxy_new_sync()
+ * but reused for all sync operations on the mount from the calling
+ * thread, as long as its connection stays the same. The proxy has an
+ * infinite default timeout, see bug 687534.
+ *
+ * Returns: (transfer full): the proxy, or %NULL on error
+ **/
+GVfsDBusMount *
+_g_dbus_mount_proxy_get_sync (GDBusConnection *connection,
+			      const char *dbus_id,
+			      const char *object_path,
+			      GCancellable *cancellable,
+			      GError **error)
+{
+  ThreadLocalConnections *local;
+  GVfsDBusMount *proxy;
+  char *id;
+
+  /* Set up by _g_dbus_connection_get_sync() */
+  local = g_private_get (&local_connections);
+  g_assert (local != NULL);
+
+  id = g_strconcat (dbus_id, "\n", object_path, NULL);
+
+  proxy = g_hash_table_lookup (local->mount_proxies, id);
+  if (proxy != NULL &&
+      g_dbus_proxy_get_connection (G_DBUS_PROXY (proxy)) == connection)
+    {
+      g_free (id);
+      return g_object_ref (proxy);
+    }
+
+  proxy = gvfs_dbus_mount_proxy_new_sync (connection,
+                                          G_DBUS_PROXY_FLAGS_DO_NOT_LOAD_PROPERTIES | G_DBUS_PROXY_FLAGS_DO_NOT_CONNECT_SIGNALS,
+                                          dbus_id,
+                                          object_path,
+                                          cancellable,
+                                          error);
+  if (proxy == NULL)
+    {
+      g_free (id);
+      return NULL;
+    }
+
+  g_dbus_proxy_set_default_timeout (G_DBUS_PROXY (proxy), G_MAXINT);
+
+  g_hash_table_replace (local->mount_proxies, id, g_object_ref (proxy));
+
+  return proxy;
+}
+
 /**
  * _g_simple_async_result_complete_with_cancellable:
  * @result: the result
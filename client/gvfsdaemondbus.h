@@ -25,6 +25,7 @@
 
 #include <glib.h>
 #include <gio/gio.h>
+#include <gvfsdbus.h>
 
 G_BEGIN_DECLS
 
@@ -56,6 +57,11 @@ void            _g_dbus_connect_vfs_filters             (GDBusConnection
 GDBusConnection *_g_dbus_connection_get_sync            (const char                     *dbus_id,
                                                          GCancellable                   *cancellable,
 							 GError                        **error);
+GVfsDBusMount  *_g_dbus_mount_proxy_get_sync            (GDBusConnection                *connection,
+                                                         const char                     *dbus_id,
+                                                         const char                     *object_path,
+                                                         GCancellable                   *cancellable,
+                                                         GError                        **error);
 void            _g_dbus_connection_get_for_async        (const char                     *dbus_id,
                                                          GVfsAsyncDBusCallback           callback,
                                                          gpointer                        callback_data,
@@ -50,6 +50,42 @@
 #define GET_FILE_HANDLE(fi)     ((gpointer) (fi)->fh)
 #define SET_FILE_HANDLE(fi, fh) ((fi)->fh = (guint64) (fh))
 
+/* Everything getattr needs to fill in a struct stat */
+#define STAT_ATTRIBUTES                         \
+  G_FILE_ATTRIBUTE_STANDARD_TYPE ","            \
+  G_FILE_ATTRIBUTE_STANDARD_NAME ","            \
+  G_FILE_ATTRIBUTE_STANDARD_IS_SYMLINK ","      \
+  G_FILE_ATTRIBUTE_STANDARD_SIZE ","            \
+  G_FILE_ATTRIBUTE_UNIX_MODE ","                \
+  G_FILE_ATTRIBUTE_TIME_CHANGED ","             \
+  G_FILE_ATTRIBUTE_TIME_MODIFIED ","            \
+  G_FILE_ATTRIBUTE_TIME_ACCESS ","              \
+  G_FILE_ATTRIBUTE_UNIX_BLOCK_SIZE ","          \
+  G_FILE_ATTRIBUTE_UNIX_BLOCKS ","              \
+  "access::*"
+
+/* How long attributes from readdir and getattr are trusted, in usecs */
+#define ATTR_CACHE_TTL (2 * G_USEC_PER_SEC)
+
+/* Defaults for fuse, options given on the command line override them.
+ * With auto_cache, the page cache of a file is kept across opens as long
+ * as its size and modification time are unchanged. big_writes lets the
+ * kernel send writes bigger than a page. */
+#define DEFAULT_OPTIONS "-oentry_timeout=5,attr_timeout=5,auto_cache,big_writes"
+
+/* Sequential writes are collected up to this size before they're passed
+ * on to the output stream */
+#define WRITE_BUFFER_SIZE (1024 * 1024)
+
+/* Input streams kept per file handle, so that concurrent and interleaved
+ * reads each get a stream that is already at the right offset */
+#define MAX_READ_STREAMS 4
+
+/* The maps of file handles and the attribute cache are split into shards
+ * with their own locks, so that operations on different files don't
+ * contend for one lock */
+#define N_SHARDS 16
+
 typedef struct {
   time_t creation_time;
   char *name;
@@ -62,16 +98,55 @@ typedef enum {
   FILE_OP_WRITE
 } FileOp;
 
+typedef struct {
+  GFileInfo *info;
+  gint64     expires;
+} AttrCacheEntry;
+
+typedef struct {
+  GInputStream *stream;
+  goffset       pos;
+} ReadStream;
+
 typedef struct {
   gint      refcount;
 
   GMutex    mutex;
   gchar    *path;
+  gint      path_shard;
   FileOp    op;
   gpointer  stream;
   goffset   pos;
+
+  /* Data to be written at pos, not passed to the stream yet */
+  GByteArray *write_buffer;
+
+  /* Idle streams for vfs_read(), which reads without holding the mutex.
+   * Streams in use are dropped when they come back if read_generation
+   * changed meanwhile. */
+  GList    *read_streams;
+  guint     n_read_streams;
+  guint     read_generation;
+  GCond     read_cond;
 } FileHandle;
 
+typedef struct {
+  GMutex      mutex;
+  GHashTable *path_to_fh;
+} PathShard;
+
+typedef struct {
+  GMutex      mutex;
+  GHashTable *active_fh;
+} ActiveShard;
+
+typedef struct {
+  GMutex      mutex;
+  /* Maps paths to AttrCacheEntry */
+  GHashTable *entries;
+  gint64      next_expire;
+} AttrCacheShard;
+
 static GThread        *subthread             = NULL;
 static GMainLoop      *subthread_main_loop   = NULL;
 static GVfs           *gvfs                  = NULL;
@@ -80,15 +155,18 @@ static GVolumeMonitor *volume_monitor        = NULL;
 
 /* Contains pointers to MountRecord */
 static GList          *mount_list            = NULL;
-static GMutex          mount_list_mutex      = {NULL};
+static GRWLock         mount_list_rwlock     = {NULL};
 
 static time_t          daemon_creation_time;
 static uid_t           daemon_uid;
 static gid_t           daemon_gid;
 
-static GMutex          global_mutex          = {NULL};
-static GHashTable     *global_path_to_fh_map = NULL;
-static GHashTable     *global_active_fh_map  = NULL;
+/* FileHandles by path, and the valid ones by address. When both are
+ * needed, the path shard is locked first. */
+static PathShard       path_shards [N_SHARDS];
+static ActiveShard     active_shards [N_SHARDS];
+
+static AttrCacheShard  attr_cache_shards [N_SHARDS];
 
 static GDBusConnection *dbus_conn            = NULL;
 static guint            daemon_name_watcher;
@@ -204,18 +282,57 @@ set_pid_for_file (GFile *file)
   ;
 }
 
+static guint
+path_shard_index (const gchar *path)
+{
+  return g_str_hash (path) % N_SHARDS;
+}
+
+static ActiveShard *
+active_shard_for_file_handle (gconstpointer file_handle)
+{
+  /* The low bits are the same for all allocations */
+  return &active_shards [(GPOINTER_TO_SIZE (file_handle) >> 4) % N_SHARDS];
+}
+
+/* Locks the path shard the file handle is in, it moves when renamed */
+static PathShard *
+lock_path_shard_for_file_handle (FileHandle *file_handle)
+{
+  PathShard *shard;
+  gint       index;
+
+  while (TRUE)
+    {
+      index = g_atomic_int_get (&file_handle->path_shard);
+      shard = &path_shards [index];
+
+      g_mutex_lock (&shard->mutex);
+      if (g_atomic_int_get (&file_handle->path_shard) == index)
+        return shard;
+      g_mutex_unlock (&shard->mutex);
+    }
+}
+
+/* Called with the path's shard locked */
 static FileHandle *
 file_handle_new (const gchar *path)
 {
-  FileHandle *file_handle;
+  FileHandle  *file_handle;
+  ActiveShard *active_shard;
 
   file_handle = g_new0 (FileHandle, 1);
   file_handle->refcount = 1;
   g_mutex_init (&file_handle->mutex);
+  g_cond_init (&file_handle->read_cond);
   file_handle->op = FILE_OP_NONE;
   file_handle->path = g_strdup (path);
+  file_handle->path_shard = path_shard_index (path);
 
-  g_hash_table_insert (global_active_fh_map, file_handle, file_handle);
+  active_shard = active_shard_for_file_handle (file_handle);
+  g_mutex_lock (&active_shard->mutex);
+  g_hash_table_insert (active_shard->active_fh, file_handle, file_handle);
+  g_mutex_unlock (&active_shard->mutex);
 
   return file_handle;
 }
@@ -232,27 +349,100 @@ file_handle_unref (FileHandle *file_handle)
 {
   if (g_atomic_int_dec_and_test (&file_handle->refcount))
     {
-      gint refs;
+      PathShard   *shard;
+      ActiveShard *active_shard;
+      gint         refs;
 
-      g_mutex_lock (&global_mutex);
+      shard = lock_path_shard_for_file_handle (file_handle);
+      active_shard = active_shard_for_file_handle (file_handle);
+      g_mutex_lock (&active_shard->mutex);
 
       /* Test again, since e.g. get_file_handle_for_path() might have
-       * snatched the global mutex and revived the file handle between
-       * g_atomic_int_dec_and_test() and us obtaining the global lock. */
+       * snatched the locks and revived the file handle between
+       * g_atomic_int_dec_and_test() and us obtaining them. */
 
       refs = g_atomic_int_get (&file_handle->refcount);
 
       if (refs == 0)
-        g_hash_table_remove (global_path_to_fh_map, file_handle->path);
+        g_hash_table_remove (active_shard->active_fh, file_handle);
+
+      g_mutex_unlock (&active_shard->mutex);
+
+      if (refs == 0)
+        g_hash_table_remove (shard->path_to_fh, file_handle->path);
 
-      g_mutex_unlock (&global_mutex);
+      g_mutex_unlock (&shard->mutex);
     }
 }
 
 static void
+read_stream_free (ReadStream *rstream)
+{
+  g_input_stream_close (rstream->stream, NULL, NULL);
+  g_object_unref (rstream->stream);
+  g_slice_free (ReadStream, rstream);
+}
+
+static void
+file_handle_close_read_streams (FileHandle *file_handle)
+{
+  GList *l;
+
+  for (l = file_handle->read_streams; l; l = l->next)
+    {
+      read_stream_free (l->data);
+      file_handle->n_read_streams--;
+    }
+
+  g_list_free (file_handle->read_streams);
+  file_handle->read_streams = NULL;
+  file_handle->read_generation++;
+}
+
+/* Writes out what write_stream() buffered, errors from earlier writes
+ * show up here */
+static gint
+file_handle_flush_write_buffer (FileHandle *file_handle)
+{
+  GByteArray *write_buffer = file_handle->write_buffer;
+  gsize       bytes_written = 0;
+  GError     *error = NULL;
+  gint        result = 0;
+
+  if (write_buffer == NULL || write_buffer->len == 0)
+    return 0;
+
+  g_output_stream_write_all (file_handle->stream, write_buffer->data, write_buffer->len,
+                             &bytes_written, NULL, &error);
+  file_handle->pos += bytes_written;
+
+  /* Don't try to write the rest again */
+  g_byte_array_set_size (write_buffer, 0);
+
+  if (error)
+    {
+      result = -errno_from_error (error);
+      g_error_free (error);
+    }
+  else if (!g_output_stream_flush (file_handle->stream, NULL, &error))
+    {
+      result = -errno_from_error (error);
+      g_error_free (error);
+    }
+
+  return result;
+}
+
+/* Returns the first error from writing out buffered data or closing a
+ * write stream, backends may only report failures on close */
+static gint
 file_handle_close_stream (FileHandle *file_handle)
 {
+  GError *error = NULL;
+  gint    result = 0;
+
   debug_print ("file_handle_close_stream\n");
+  file_handle_close_read_streams (file_handle);
   if (file_handle->stream)
     {
       switch (file_handle->op)
@@ -262,7 +452,13 @@ file_handle_close_stream (FileHandle *file_handle)
           break;
           
         case FILE_OP_WRITE:
-          g_output_stream_close (file_handle->stream, NULL, NULL);
+          result = file_handle_flush_write_buffer (file_handle);
+          if (!g_output_stream_close (file_handle->stream, NULL, &error))
+            {
+              if (result == 0)
+                result = -errno_from_error (error);
+              g_error_free (error);
+            }
           break;
           
         default:
@@ -273,16 +469,19 @@ file_handle_close_stream (FileHandle *file_handle)
       file_handle->stream = NULL;
       file_handle->op = FILE_OP_NONE;
     }
+
+  return result;
 }
 
 /* Called on hash table removal */
 static void
 file_handle_free (FileHandle *file_handle)
 {
-  g_hash_table_remove (global_active_fh_map, file_handle);
-
   file_handle_close_stream (file_handle);
+  if (file_handle->write_buffer)
+    g_byte_array_free (file_handle->write_buffer, TRUE);
   g_mutex_clear (&file_handle->mutex);
+  g_cond_clear (&file_handle->read_cond);
   g_free (file_handle->path);
   g_free (file_handle);
 }
@@ -290,27 +489,31 @@ file_handle_free (FileHandle *file_handle)
 static FileHandle *
 get_file_handle_for_path (const gchar *path)
 {
+  PathShard  *shard;
   FileHandle *fh;
 
-  g_mutex_lock (&global_mutex);
+  shard = &path_shards [path_shard_index (path)];
+  g_mutex_lock (&shard->mutex);
 
-  fh = g_hash_table_lookup (global_path_to_fh_map, path);
+  fh = g_hash_table_lookup (shard->path_to_fh, path);
 
   if (fh)
     file_handle_ref (fh);
 
-  g_mutex_unlock (&global_mutex);
+  g_mutex_unlock (&shard->mutex);
   return fh;
 }
 
 static FileHandle *
 get_or_create_file_handle_for_path (const gchar *path)
 {
+  PathShard  *shard;
   FileHandle *fh;
 
-  g_mutex_lock (&global_mutex);
+  shard = &path_shards [path_shard_index (path)];
+  g_mutex_lock (&shard->mutex);
 
-  fh = g_hash_table_lookup (global_path_to_fh_map, path);
+  fh = g_hash_table_lookup (shard->path_to_fh, path);
 
   if (fh)
     {
@@ -319,30 +522,32 @@ get_or_create_file_handle_for_path (const gchar *path)
   else
     {
       fh = file_handle_new (path);
-      g_hash_table_insert (global_path_to_fh_map, fh->path, fh);
+      g_hash_table_insert (shard->path_to_fh, fh->path, fh);
     }
 
-  g_mutex_unlock (&global_mutex);
+  g_mutex_unlock (&shard->mutex);
   return fh;
 }
 
 static FileHandle *
 get_file_handle_from_info (struct fuse_file_info *fi)
 {
-  FileHandle *fh;
-
-  g_mutex_lock (&global_mutex);
+  ActiveShard *active_shard;
+  FileHandle  *fh;
 
   fh = GET_FILE_HANDLE (fi);
 
+  active_shard = active_shard_for_file_handle (fh);
+  g_mutex_lock (&active_shard->mutex);
+
   /* If the file handle is still valid, its value won't change. If
    * invalid, it's set to NULL. */
-  fh = g_hash_table_lookup (global_active_fh_map, fh);
+  fh = g_hash_table_lookup (active_shard->active_fh, fh);
 
   if (fh)
     file_handle_ref (fh);
 
-  g_mutex_unlock (&global_mutex);
+  g_mutex_unlock (&active_shard->mutex);
   return fh;
 }
 
@@ -351,23 +556,160 @@ reindex_file_handle_for_path (const gchar *old_path, const gchar *new_path)
 {
   gchar      *old_path_internal;
   FileHandle *fh;
+  guint       old_index, new_index;
+  PathShard  *old_shard, *new_shard;
+
+  old_index = path_shard_index (old_path);
+  new_index = path_shard_index (new_path);
+  old_shard = &path_shards [old_index];
+  new_shard = &path_shards [new_index];
 
-  g_mutex_lock (&global_mutex);
+  /* Always lock shards in the same order */
+  g_mutex_lock (&path_shards [MIN (old_index, new_index)].mutex);
+  if (old_index != new_index)
+    g_mutex_lock (&path_shards [MAX (old_index, new_index)].mutex);
 
-  if (!g_hash_table_lookup_extended (global_path_to_fh_map, old_path,
+  if (!g_hash_table_lookup_extended (old_shard->path_to_fh, old_path,
                                      (gpointer *) &old_path_internal,
                                      (gpointer *) &fh))
       goto out;
 
-  g_hash_table_steal (global_path_to_fh_map, old_path);
+  g_hash_table_steal (old_shard->path_to_fh, old_path);
 
   g_free (fh->path);
   fh->path = g_strdup (new_path);
+  g_atomic_int_set (&fh->path_shard, new_index);
 
-  g_hash_table_insert (global_path_to_fh_map, fh->path, fh);
+  g_hash_table_insert (new_shard->path_to_fh, fh->path, fh);
 
  out:
-  g_mutex_unlock (&global_mutex);
+  if (old_index != new_index)
+    g_mutex_unlock (&path_shards [MAX (old_index, new_index)].mutex);
+  g_mutex_unlock (&path_shards [MIN (old_index, new_index)].mutex);
+}
+
+static void
+attr_cache_entry_free (AttrCacheEntry *entry)
+{
+  g_object_unref (entry->info);
+  g_slice_free (AttrCacheEntry, entry);
+}
+
+static gboolean
+attr_cache_entry_expired (gpointer key, gpointer value, gpointer user_data)
+{
+  AttrCacheEntry *entry = value;
+  gint64 *now = user_data;
+
+  return entry->expires <= *now;
+}
+
+static AttrCacheShard *
+attr_cache_shard_for_path (const gchar *path)
+{
+  return &attr_cache_shards [g_str_hash (path) % N_SHARDS];
+}
+
+static void
+attr_cache_insert (const gchar *path, GFileInfo *info)
+{
+  AttrCacheShard *shard;
+  AttrCacheEntry *entry;
+  gint64          now;
+
+  now = g_get_monotonic_time ();
+
+  entry = g_slice_new (AttrCacheEntry);
+  entry->info = g_object_ref (info);
+  entry->expires = now + ATTR_CACHE_TTL;
+
+  shard = attr_cache_shard_for_path (path);
+  g_mutex_lock (&shard->mutex);
+
+  /* Don't let entries nobody asked for pile up */
+  if (now >= shard->next_expire)
+    {
+      g_hash_table_foreach_remove (shard->entries, attr_cache_entry_expired, &now);
+      shard->next_expire = now + ATTR_CACHE_TTL;
+    }
+
+  g_hash_table_replace (shard->entries, g_strdup (path), entry);
+
+  g_mutex_unlock (&shard->mutex);
+}
+
+/* Returns a new reference to the cached info, or NULL */
+static GFileInfo *
+attr_cache_lookup (const gchar *path)
+{
+  AttrCacheShard *shard;
+  AttrCacheEntry *entry;
+  GFileInfo      *info = NULL;
+
+  shard = attr_cache_shard_for_path (path);
+  g_mutex_lock (&shard->mutex);
+
+  entry = g_hash_table_lookup (shard->entries, path);
+  if (entry)
+    {
+      if (entry->expires > g_get_monotonic_time ())
+        info = g_object_ref (entry->info);
+      else
+        g_hash_table_remove (shard->entries, path);
+    }
+
+  g_mutex_unlock (&shard->mutex);
+
+  return info;
+}
+
+/* For changes to the contents or attributes of a file */
+static void
+attr_cache_invalidate (const gchar *path)
+{
+  AttrCacheShard *shard;
+
+  shard = attr_cache_shard_for_path (path);
+  g_mutex_lock (&shard->mutex);
+  g_hash_table_remove (shard->entries, path);
+  g_mutex_unlock (&shard->mutex);
+}
+
+static gboolean
+attr_cache_path_is_below (gpointer key, gpointer value, gpointer user_data)
+{
+  const gchar *path = key;
+  const gchar *prefix = user_data;
+  gsize        len = strlen (prefix);
+
+  return strncmp (path, prefix, len) == 0 && path[len] == '/';
+}
+
+/* For files appearing or disappearing; drops the parent directory too,
+ * and everything below @path if it may be a directory */
+static void
+attr_cache_invalidate_entry (const gchar *path, gboolean is_dir)
+{
+  gchar *parent;
+  gint   i;
+
+  parent = g_path_get_dirname (path);
+
+  attr_cache_invalidate (path);
+  attr_cache_invalidate (parent);
+
+  if (is_dir)
+    {
+      for (i = 0; i < N_SHARDS; i++)
+        {
+          g_mutex_lock (&attr_cache_shards [i].mutex);
+          g_hash_table_foreach_remove (attr_cache_shards [i].entries,
+                                       attr_cache_path_is_below, (gpointer) path);
+          g_mutex_unlock (&attr_cache_shards [i].mutex);
+        }
+    }
+
+  g_free (parent);
 }
 
 static MountRecord *
@@ -393,16 +735,29 @@ mount_record_free (MountRecord *mount_record)
   g_free (mount_record);
 }
 
+/* Lookups only need to exclude the signal handlers changing the list */
 static void
 mount_list_lock (void)
 {
-  g_mutex_lock (&mount_list_mutex);
+  g_rw_lock_reader_lock (&mount_list_rwlock);
 }
 
 static void
 mount_list_unlock (void)
 {
-  g_mutex_unlock (&mount_list_mutex);
+  g_rw_lock_reader_unlock (&mount_list_rwlock);
+}
+
+static void
+mount_list_lock_for_write (void)
+{
+  g_rw_lock_writer_lock (&mount_list_rwlock);
+}
+
+static void
+mount_list_unlock_for_write (void)
+{
+  g_rw_lock_writer_unlock (&mount_list_rwlock);
 }
 
 static void
@@ -412,6 +767,7 @@ mount_list_free (void)
   mount_list = NULL;
 }
 
+/* Called with the mount list locked */
 static gboolean
 mount_record_for_mount_exists (GMount *mount)
 {
@@ -425,8 +781,6 @@ mount_record_for_mount_exists (GMount *mount)
 
   res = FALSE;
   
-  mount_list_lock ();
-
   for (l = mount_list; l != NULL; l = l->next)
     {
       MountRecord *this_mount_record = l->data;
@@ -438,13 +792,24 @@ mount_record_for_mount_exists (GMount *mount)
         }
     }
 
-  mount_list_unlock ();
-
   g_object_unref (root);
   
   return res;
 }
 
+static void
+mount_list_add (GMount *mount)
+{
+  /* Check and insert atomically, the initial update and the mount_added
+   * signal may both see the same mount */
+  mount_list_lock_for_write ();
+
+  if (!mount_record_for_mount_exists (mount))
+    mount_list = g_list_prepend (mount_list, mount_record_new (mount));
+
+  mount_list_unlock_for_write ();
+}
+
 static GFile *
 mount_record_find_root_by_mount_name (const gchar *mount_name)
 {
@@ -485,13 +850,7 @@ mount_list_update (void)
     {
       GMount *mount = l->data;
 
-      if (!mount_record_for_mount_exists (mount))
-        {
-          mount_list_lock ();
-          mount_list = g_list_prepend (mount_list, mount_record_new (mount));
-          mount_list_unlock ();
-        }
-      
+      mount_list_add (mount);
       g_object_unref (mount);
     }
   
@@ -724,56 +1083,55 @@ file_info_get_stat_mode (GFileInfo *file_info)
   return unix_mode;
 }
 
-static gint
-getattr_for_file (GFile *file, struct stat *sbuf)
+static void
+file_info_to_stat (GFileInfo *file_info, struct stat *sbuf)
 {
-  GFileInfo *file_info;
-  GError    *error  = NULL;
-  gint       result = 0;
+  GTimeVal mod_time;
 
-  file_info = g_file_query_info (file, 
-                                 G_FILE_ATTRIBUTE_STANDARD_TYPE ","
-                                 G_FILE_ATTRIBUTE_STANDARD_NAME ","
-                                 G_FILE_ATTRIBUTE_STANDARD_IS_SYMLINK ","
-                                 G_FILE_ATTRIBUTE_STANDARD_SIZE ","
-                                 G_FILE_ATTRIBUTE_UNIX_MODE ","
-                                 G_FILE_ATTRIBUTE_TIME_CHANGED ","
-                                 G_FILE_ATTRIBUTE_TIME_MODIFIED ","
-                                 G_FILE_ATTRIBUTE_TIME_ACCESS ","
-                                 G_FILE_ATTRIBUTE_UNIX_BLOCK_SIZE ","
-                                 G_FILE_ATTRIBUTE_UNIX_BLOCKS ","
-				 "access::*",
-                                 0, NULL, &error);
+  sbuf->st_mode = file_info_get_stat_mode (file_info);
+  sbuf->st_size = g_file_info_get_size (file_info);
+  sbuf->st_uid = daemon_uid;
+  sbuf->st_gid = daemon_gid;
 
-  if (file_info)
-    {
-      GTimeVal mod_time;
+  g_file_info_get_modification_time (file_info, &mod_time);
+  sbuf->st_mtime = mod_time.tv_sec;
+  sbuf->st_ctime = mod_time.tv_sec;
+  sbuf->st_atime = mod_time.tv_sec;
 
-      sbuf->st_mode = file_info_get_stat_mode (file_info);
-      sbuf->st_size = g_file_info_get_size (file_info);
-      sbuf->st_uid = daemon_uid;
-      sbuf->st_gid = daemon_gid;
+  if (g_file_info_has_attribute (file_info, G_FILE_ATTRIBUTE_TIME_CHANGED))
+    sbuf->st_ctime = file_info_get_attribute_as_uint (file_info, G_FILE_ATTRIBUTE_TIME_CHANGED);
+  if (g_file_info_has_attribute (file_info, G_FILE_ATTRIBUTE_TIME_ACCESS))
+    sbuf->st_atime = file_info_get_attribute_as_uint (file_info, G_FILE_ATTRIBUTE_TIME_ACCESS);
 
-      g_file_info_get_modification_time (file_info, &mod_time);
-      sbuf->st_mtime = mod_time.tv_sec;
-      sbuf->st_ctime = mod_time.tv_sec;
-      sbuf->st_atime = mod_time.tv_sec;
+  if (g_file_info_has_attribute (file_info, G_FILE_ATTRIBUTE_UNIX_BLOCK_SIZE))
+    sbuf->st_blksize = file_info_get_attribute_as_uint (file_info, G_FILE_ATTRIBUTE_UNIX_BLOCK_SIZE);
+  if (g_file_info_has_attribute (file_info, G_FILE_ATTRIBUTE_UNIX_BLOCKS))
+    sbuf->st_blocks = file_info_get_attribute_as_uint (file_info, G_FILE_ATTRIBUTE_UNIX_BLOCKS);
+  else /* fake it to make 'du' work like 'du --apparent'. */
+    sbuf->st_blocks = (sbuf->st_size + 511) / 512;
 
-      if (g_file_info_has_attribute (file_info, G_FILE_ATTRIBUTE_TIME_CHANGED))
-        sbuf->st_ctime = file_info_get_attribute_as_uint (file_info, G_FILE_ATTRIBUTE_TIME_CHANGED);
-      if (g_file_info_has_attribute (file_info, G_FILE_ATTRIBUTE_TIME_ACCESS))
-        sbuf->st_atime = file_info_get_attribute_as_uint (file_info, G_FILE_ATTRIBUTE_TIME_ACCESS);
+  /* Setting st_nlink to 1 for directories makes 'find' work */
+  sbuf->st_nlink = 1;
+}
 
-      if (g_file_info_has_attribute (file_info, G_FILE_ATTRIBUTE_UNIX_BLOCK_SIZE))
-	sbuf->st_blksize = file_info_get_attribute_as_uint (file_info, G_FILE_ATTRIBUTE_UNIX_BLOCK_SIZE);
-      if (g_file_info_has_attribute (file_info, G_FILE_ATTRIBUTE_UNIX_BLOCKS))
-	sbuf->st_blocks = file_info_get_attribute_as_uint (file_info, G_FILE_ATTRIBUTE_UNIX_BLOCKS);
-      else /* fake it to make 'du' work like 'du --apparent'. */
-	sbuf->st_blocks = (sbuf->st_size + 511) / 512;
+static gint
+getattr_for_file (const gchar *path, GFile *file, struct stat *sbuf)
+{
+  GFileInfo *file_info;
+  GError    *error  = NULL;
+  gint       result = 0;
 
-      /* Setting st_nlink to 1 for directories makes 'find' work */
-      sbuf->st_nlink = 1;
+  file_info = attr_cache_lookup (path);
+  if (file_info == NULL)
+    {
+      file_info = g_file_query_info (file, STAT_ATTRIBUTES, 0, NULL, &error);
+      if (file_info)
+        attr_cache_insert (path, file_info);
+    }
 
+  if (file_info)
+    {
+      file_info_to_stat (file_info, sbuf);
       g_object_unref (file_info);
     }
   else
@@ -802,6 +1160,8 @@ getattr_for_file_handle (FileHandle *fh, struct stat *sbuf)
   sbuf->st_gid = daemon_gid;
   sbuf->st_nlink = 1;
   sbuf->st_size = fh->pos;
+  if (fh->write_buffer)
+    sbuf->st_size += fh->write_buffer->len;
   sbuf->st_blksize = 512;
   sbuf->st_blocks = (sbuf->st_size + 511) / 512;
 }
@@ -832,8 +1192,10 @@ vfs_getattr (const gchar *path, struct stat *sbuf)
     {
       /* Mount list */
 
+      mount_list_lock ();
       sbuf->st_mode = S_IFDIR | 0500;                   /* mode_t    protection */
       sbuf->st_nlink = 2 + g_list_length (mount_list);  /* nlink_t   number of hard links */
+      mount_list_unlock ();
       sbuf->st_atime = daemon_creation_time;
       sbuf->st_mtime = daemon_creation_time;
       sbuf->st_ctime = daemon_creation_time;
@@ -844,9 +1206,25 @@ vfs_getattr (const gchar *path, struct stat *sbuf)
     {
       /* Submount */
 
-      result = getattr_for_file (file, sbuf);
+      result = getattr_for_file (path, file, sbuf);
 
-      if (result != 0)
+      if (result == 0)
+        {
+          FileHandle *fh = get_file_handle_for_path (path);
+
+          /* Account for writes that are still buffered */
+          if (fh != NULL)
+            {
+              g_mutex_lock (&fh->mutex);
+              if (fh->op == FILE_OP_WRITE && fh->write_buffer != NULL &&
+                  fh->write_buffer->len > 0)
+                sbuf->st_size = MAX (sbuf->st_size, fh->pos + fh->write_buffer->len);
+              g_mutex_unlock (&fh->mutex);
+
+              file_handle_unref (fh);
+            }
+        }
+      else
         {
           FileHandle *fh = get_file_handle_for_path (path);
 
@@ -908,6 +1286,7 @@ setup_input_stream (GFile *file, FileHandle *fh)
         {
           debug_print ("setup_input_stream: doing write\n");
 
+          file_handle_flush_write_buffer (fh);
           g_output_stream_close (fh->stream, NULL, NULL);
           g_object_unref (fh->stream);
           fh->stream = NULL;
@@ -942,6 +1321,9 @@ setup_output_stream (GFile *file, FileHandle *fh, int flags)
   GError *error  = NULL;
   gint    result = 0;
 
+  /* Don't let later reads see what was there before the write */
+  file_handle_close_read_streams (fh);
+
   if (fh->stream)
     {
       if (fh->op == FILE_OP_WRITE)
@@ -995,7 +1377,10 @@ open_common (const gchar *path, struct fuse_file_info *fi, GFile *file, int outp
   set_pid_for_file (file);
 
   if (fi->flags & O_WRONLY || fi->flags & O_RDWR)
-    result = setup_output_stream (file, fh, fi->flags | output_flags);
+    {
+      result = setup_output_stream (file, fh, fi->flags | output_flags);
+      attr_cache_invalidate (path);
+    }
   else
     result = setup_input_stream (file, fh);
 
@@ -1020,7 +1405,10 @@ vfs_open (const gchar *path, struct fuse_file_info *fi)
       GFileInfo *file_info;
       GError    *error = NULL;
 
-      file_info = g_file_query_info (file, G_FILE_ATTRIBUTE_STANDARD_TYPE, 0, NULL, &error);
+      /* Opens usually follow a getattr, with auto_cache always */
+      file_info = attr_cache_lookup (path);
+      if (file_info == NULL)
+        file_info = g_file_query_info (file, G_FILE_ATTRIBUTE_STANDARD_TYPE, 0, NULL, &error);
 
       if (file_info)
         {
@@ -1105,6 +1493,7 @@ vfs_create (const gchar *path, mode_t mode, struct fuse_file_info *fi)
             }
 
           file_output_stream = g_file_create (file, 0, NULL, &error);
+          attr_cache_invalidate_entry (path, FALSE);
           if (file_output_stream)
             {
               FileHandle *fh = get_or_create_file_handle_for_path (path);
@@ -1160,7 +1549,7 @@ vfs_release (const gchar *path, struct fuse_file_info *fi)
 }
 
 static gint
-read_stream (FileHandle *fh, gchar *output_buf, size_t output_buf_size, off_t offset)
+read_stream (ReadStream *rstream, gchar *output_buf, size_t output_buf_size, off_t offset)
 {
   GInputStream *input_stream;
   gint          n_bytes_skipped = 0;
@@ -1168,9 +1557,9 @@ read_stream (FileHandle *fh, gchar *output_buf, size_t output_buf_size, off_t of
   gint          result          = 0;
   GError       *error           = NULL;
 
-  input_stream = fh->stream;
+  input_stream = rstream->stream;
 
-  if (offset != fh->pos)
+  if (offset != rstream->pos)
     {
       if (g_seekable_can_seek (G_SEEKABLE (input_stream)))
         {
@@ -1180,7 +1569,7 @@ read_stream (FileHandle *fh, gchar *output_buf, size_t output_buf_size, off_t of
 
           if (g_seekable_seek (G_SEEKABLE (input_stream), offset, G_SEEK_SET, NULL, &error))
             {
-              fh->pos = offset;
+              rstream->pos = offset;
             }
           else
             {
@@ -1188,18 +1577,18 @@ read_stream (FileHandle *fh, gchar *output_buf, size_t output_buf_size, off_t of
               g_error_free (error);
             }
         }
-      else if (offset > fh->pos)
+      else if (offset > rstream->pos)
         {
           /* Can skip ahead */
 
           debug_print ("read_stream: skipping to offset %d.\n", offset);
 
-          n_bytes_skipped = g_input_stream_skip (input_stream, offset - fh->pos, NULL, &error);
+          n_bytes_skipped = g_input_stream_skip (input_stream, offset - rstream->pos, NULL, &error);
 
           if (n_bytes_skipped > 0)
-            fh->pos += n_bytes_skipped;
+            rstream->pos += n_bytes_skipped;
 
-          if (n_bytes_skipped != offset - fh->pos)
+          if (rstream->pos != offset)
             {
               if (error)
                 {
@@ -1237,7 +1626,7 @@ read_stream (FileHandle *fh, gchar *output_buf, size_t output_buf_size, off_t of
                                                  &error);
 
           n_bytes_read += part_bytes_read;
-          fh->pos += part_bytes_read;
+          rstream->pos += part_bytes_read;
 
           if (!part_result || part_bytes_read == 0)
             break;
@@ -1260,6 +1649,109 @@ read_stream (FileHandle *fh, gchar *output_buf, size_t output_buf_size, off_t of
   return result;
 }
 
+/* Called with fh->mutex held, which is dropped while opening a new stream */
+static gint
+file_handle_take_read_stream (FileHandle *fh, GFile *file, off_t offset,
+                              ReadStream **read_stream_out, guint *generation)
+{
+  ReadStream       *rstream;
+  GFileInputStream *stream;
+  GList            *l;
+  GError           *error = NULL;
+  gint              result;
+
+  /* Reading after writing starts over, like in setup_input_stream() */
+  if (fh->op == FILE_OP_WRITE)
+    file_handle_close_stream (fh);
+
+  /* The stream opened by open_common() joins the pool */
+  if (fh->op == FILE_OP_READ)
+    {
+      rstream = g_slice_new (ReadStream);
+      rstream->stream = fh->stream;
+      rstream->pos = fh->pos;
+      fh->read_streams = g_list_prepend (fh->read_streams, rstream);
+      fh->n_read_streams++;
+
+      fh->stream = NULL;
+      fh->op = FILE_OP_NONE;
+    }
+
+  while (TRUE)
+    {
+      /* Best is a stream that doesn't need to seek */
+      for (l = fh->read_streams; l; l = l->next)
+        {
+          rstream = l->data;
+          if (rstream->pos == offset)
+            break;
+        }
+
+      if (l == NULL && fh->n_read_streams < MAX_READ_STREAMS)
+        break;
+
+      /* Otherwise the least recently used one */
+      if (l == NULL)
+        l = g_list_last (fh->read_streams);
+
+      if (l != NULL)
+        {
+          *read_stream_out = l->data;
+          *generation = fh->read_generation;
+          fh->read_streams = g_list_delete_link (fh->read_streams, l);
+          return 0;
+        }
+
+      g_cond_wait (&fh->read_cond, &fh->mutex);
+    }
+
+  /* Open another stream without holding up reads on the others */
+  fh->n_read_streams++;
+  *generation = fh->read_generation;
+
+  g_mutex_unlock (&fh->mutex);
+  set_pid_for_file (file);
+  stream = g_file_read (file, NULL, &error);
+  g_mutex_lock (&fh->mutex);
+
+  if (stream == NULL)
+    {
+      fh->n_read_streams--;
+      g_cond_signal (&fh->read_cond);
+
+      result = -errno_from_error (error);
+      g_error_free (error);
+      return result;
+    }
+
+  rstream = g_slice_new (ReadStream);
+  rstream->stream = G_INPUT_STREAM (stream);
+  rstream->pos = 0;
+  *read_stream_out = rstream;
+
+  return 0;
+}
+
+/* Called with fh->mutex held */
+static void
+file_handle_put_read_stream (FileHandle *fh, ReadStream *rstream,
+                             guint generation, gboolean failed)
+{
+  /* More streams than MAX_READ_STREAMS appear when the file is opened again */
+  if (failed || generation != fh->read_generation ||
+      fh->n_read_streams > MAX_READ_STREAMS)
+    {
+      read_stream_free (rstream);
+      fh->n_read_streams--;
+    }
+  else
+    {
+      fh->read_streams = g_list_prepend (fh->read_streams, rstream);
+    }
+
+  g_cond_signal (&fh->read_cond);
+}
+
 static gint
 vfs_read (const gchar *path, gchar *buf, size_t size,
           off_t offset, struct fuse_file_info *fi)
@@ -1275,20 +1767,27 @@ vfs_read (const gchar *path, gchar *buf, size_t size,
 
       if (fh)
         {
-          g_mutex_lock (&fh->mutex);
+          ReadStream *rstream;
+          guint       generation;
 
-          result = setup_input_stream (file, fh);
+          g_mutex_lock (&fh->mutex);
+          result = file_handle_take_read_stream (fh, file, offset, &rstream, &generation);
+          g_mutex_unlock (&fh->mutex);
 
           if (result == 0)
             {
-              result = read_stream (fh, buf, size, offset);
+              /* Other reads on this handle proceed meanwhile */
+              result = read_stream (rstream, buf, size, offset);
+
+              g_mutex_lock (&fh->mutex);
+              file_handle_put_read_stream (fh, rstream, generation, result < 0);
+              g_mutex_unlock (&fh->mutex);
             }
           else
             {
               debug_print ("vfs_read: failed to setup input_stream!\n");
             }
 
-          g_mutex_unlock (&fh->mutex);
           file_handle_unref (fh);
         }
       else
@@ -1315,7 +1814,6 @@ static gint
 write_stream (FileHandle *fh, const gchar *input_buf, size_t input_buf_size, off_t offset)
 {
   GOutputStream *output_stream;
-  gint           n_bytes_written = 0;
   gint           result          = 0;
   GError        *error           = NULL;
 
@@ -1323,7 +1821,19 @@ write_stream (FileHandle *fh, const gchar *input_buf, size_t input_buf_size, off
 
   output_stream = fh->stream;
 
-  if (offset != fh->pos)
+  if (fh->write_buffer == NULL)
+    fh->write_buffer = g_byte_array_sized_new (WRITE_BUFFER_SIZE);
+
+  /* Anything but appending to the buffer has to write it out first,
+   * fh->pos only moves once the buffer is written */
+  if (offset != fh->pos + fh->write_buffer->len)
+    {
+      result = file_handle_flush_write_buffer (fh);
+      if (result < 0)
+        return result;
+    }
+
+  if (offset != fh->pos + fh->write_buffer->len)
     {
       if (g_seekable_can_seek (G_SEEKABLE (output_stream)))
         {
@@ -1349,39 +1859,16 @@ write_stream (FileHandle *fh, const gchar *input_buf, size_t input_buf_size, off
 
   if (result == 0)
     {
-      while (n_bytes_written < input_buf_size)
-        {
-          gboolean part_result;
-          gsize    part_bytes_written = 0;
-
-          part_result = g_output_stream_write_all (output_stream,
-                                                   (void *) (input_buf + n_bytes_written),
-                                                   input_buf_size - n_bytes_written,
-                                                   &part_bytes_written,
-                                                   NULL,
-                                                   &error);
-
-          n_bytes_written += part_bytes_written;
-          fh->pos += part_bytes_written;
-
-          if (!part_result)
-            break;
-        }
-
-      result = n_bytes_written;
+      g_byte_array_append (fh->write_buffer, (const guint8 *) input_buf, input_buf_size);
+      result = input_buf_size;
 
-      if (n_bytes_written < input_buf_size)
-        {
-          if (error)
-            {
-              result = -errno_from_error (error);
-              g_error_free (error);
-            }
-        }
-      else if (!g_output_stream_flush (output_stream, NULL, &error))
+      if (fh->write_buffer->len >= WRITE_BUFFER_SIZE)
         {
-          result = -errno_from_error (error);
-          g_error_free (error);
+          gint flush_result;
+
+          flush_result = file_handle_flush_write_buffer (fh);
+          if (flush_result < 0)
+            result = flush_result;
         }
     }
 
@@ -1410,6 +1897,7 @@ vfs_write (const gchar *path, const gchar *buf, size_t len, off_t offset,
             {
               result = write_stream (fh, buf, len, offset);
             }
+          attr_cache_invalidate (path);
 
           g_mutex_unlock (&fh->mutex);
           file_handle_unref (fh);
@@ -1438,42 +1926,48 @@ static gint
 vfs_flush (const gchar *path, struct fuse_file_info *fi)
 {
   FileHandle *fh = get_file_handle_from_info (fi);
+  gint        result = 0;
 
   debug_print ("vfs_flush: %s\n", path);
 
   if (fh)
     {
       g_mutex_lock (&fh->mutex);
-      file_handle_close_stream (fh);
+      result = file_handle_close_stream (fh);
       g_mutex_unlock (&fh->mutex);
 
+      /* Some backends only update the file once the stream is closed */
+      attr_cache_invalidate (path);
+
       /* get_file_handle_from_info () adds a "working ref", so release that. */
       file_handle_unref (fh);
     }
 
-  /* TODO: Error handling. */
-  return 0;
+  return result;
 }
 
 static gint
 vfs_fsync (const gchar *path, gint sync_data_only, struct fuse_file_info *fi)
 {
   FileHandle *fh = get_file_handle_from_info (fi);
+  gint        result = 0;
 
   debug_print ("vfs_flush: %s\n", path);
 
   if (fh)
     {
       g_mutex_lock (&fh->mutex);
-      file_handle_close_stream (fh);
+      result = file_handle_close_stream (fh);
       g_mutex_unlock (&fh->mutex);
 
+      /* Some backends only update the file once the stream is closed */
+      attr_cache_invalidate (path);
+
       /* get_file_handle_from_info () adds a "working ref", so release that. */
       file_handle_unref (fh);
     }
 
-  /* TODO: Error handling. */
-  return 0;
+  return result;
 }
 
 static gint
@@ -1507,7 +2001,7 @@ vfs_opendir (const gchar *path, struct fuse_file_info *fi)
 }
 
 static gint
-readdir_for_file (GFile *base_file, gpointer buf, fuse_fill_dir_t filler)
+readdir_for_file (const gchar *path, GFile *base_file, gpointer buf, fuse_fill_dir_t filler)
 {
   GFileEnumerator *enumerator;
   GFileInfo       *file_info;
@@ -1515,7 +2009,9 @@ readdir_for_file (GFile *base_file, gpointer buf, fuse_fill_dir_t filler)
 
   g_assert (base_file != NULL);
 
-  enumerator = g_file_enumerate_children (base_file, G_FILE_ATTRIBUTE_STANDARD_NAME, 0, NULL, &error);
+  /* Get what getattr needs right away, 'ls -l' and 'find' stat every
+   * entry and would otherwise cost a round trip each */
+  enumerator = g_file_enumerate_children (base_file, STAT_ATTRIBUTES, 0, NULL, &error);
   if (!enumerator)
     {
       gint result;
@@ -1540,7 +2036,20 @@ readdir_for_file (GFile *base_file, gpointer buf, fuse_fill_dir_t filler)
 
   while ((file_info = g_file_enumerator_next_file (enumerator, NULL, &error)) != NULL)
     {
-      filler (buf, g_file_info_get_name (file_info), NULL, 0);
+      struct stat  sbuf;
+      const gchar *name;
+      gchar       *child_path;
+
+      name = g_file_info_get_name (file_info);
+
+      memset (&sbuf, 0, sizeof (sbuf));
+      file_info_to_stat (file_info, &sbuf);
+
+      child_path = g_build_filename (path, name, NULL);
+      attr_cache_insert (child_path, file_info);
+      g_free (child_path);
+
+      filler (buf, name, &sbuf, 0);
       g_object_unref (file_info);
     }
 
@@ -1582,7 +2091,7 @@ vfs_readdir (const gchar *path, gpointer buf, fuse_fill_dir_t filler, off_t offs
     {
       /* Submount */
 
-      result = readdir_for_file (base_file, buf, filler);
+      result = readdir_for_file (path, base_file, buf, filler);
 
       g_object_unref (base_file);
     }
@@ -1633,6 +2142,9 @@ vfs_rename (const gchar *old_path, const gchar *new_path)
           reindex_file_handle_for_path (old_path, new_path);
         }
 
+      attr_cache_invalidate_entry (old_path, TRUE);
+      attr_cache_invalidate_entry (new_path, TRUE);
+
       if (fh)
         {
           g_mutex_unlock (&fh->mutex);
@@ -1682,6 +2194,7 @@ vfs_unlink (const gchar *path)
         }
 
       g_file_delete (file, NULL, &error);
+      attr_cache_invalidate_entry (path, FALSE);
 
       if (fh)
         {
@@ -1727,6 +2240,7 @@ vfs_mkdir (const gchar *path, mode_t mode)
           /* Ignore errors setting the mode. We already created the directory, and that's
            * good enough. */
           g_file_set_attribute_uint32 (file, G_FILE_ATTRIBUTE_UNIX_MODE, mode, 0, NULL, NULL);
+          attr_cache_invalidate_entry (path, FALSE);
         }
 
       if (error)
@@ -1768,6 +2282,7 @@ vfs_rmdir (const gchar *path)
           if (g_file_info_get_file_type (file_info) == G_FILE_TYPE_DIRECTORY)
             {
               g_file_delete (file, NULL, &error);
+              attr_cache_invalidate_entry (path, TRUE);
 
               if (error)
                 {
@@ -1880,6 +2395,10 @@ vfs_ftruncate (const gchar *path, off_t size, struct fuse_file_info *fi)
 
           result = setup_output_stream (file, fh, 0);
 
+          /* The stream has to know about everything written so far */
+          if (result == 0)
+            result = file_handle_flush_write_buffer (fh);
+
           if (result == 0)
             {
               if (g_seekable_can_truncate (G_SEEKABLE (fh->stream)))
@@ -1917,7 +2436,10 @@ vfs_ftruncate (const gchar *path, off_t size, struct fuse_file_info *fi)
                       goffset orig_pos = g_seekable_tell (G_SEEKABLE (fh->stream));
                       result = pad_file (fh, size - current_size, current_size);
                       if (result == 0)
-                        g_seekable_seek (G_SEEKABLE (fh->stream), orig_pos, G_SEEK_SET, NULL, &error);
+                        result = file_handle_flush_write_buffer (fh);
+                      if (result == 0 &&
+                          g_seekable_seek (G_SEEKABLE (fh->stream), orig_pos, G_SEEK_SET, NULL, &error))
+                        fh->pos = orig_pos;
                     }
 		}
 	      else
@@ -1940,6 +2462,7 @@ vfs_ftruncate (const gchar *path, off_t size, struct fuse_file_info *fi)
           result = -EINVAL;
         }
 
+      attr_cache_invalidate (path);
       g_object_unref (file);
     }
   else
@@ -1971,17 +2494,27 @@ vfs_truncate (const gchar *path, off_t size)
       /* Get a file handle just to lock the path while we're working */
       fh = get_file_handle_for_path (path);
       if (fh)
-        g_mutex_lock (&fh->mutex);
-
-      if (size == 0)
         {
-          file_output_stream = g_file_replace (file, 0, FALSE, 0, NULL, &error);
+          g_mutex_lock (&fh->mutex);
+
+          /* Buffered data would otherwise land after the truncate and
+           * bring back what was cut off */
+          if (fh->op == FILE_OP_WRITE)
+            result = file_handle_flush_write_buffer (fh);
         }
-      else
+
+      if (result == 0)
         {
-          file_output_stream = g_file_append_to (file, 0, NULL, &error);
-          if (file_output_stream)
-              g_seekable_truncate (G_SEEKABLE (file_output_stream), size, NULL, &error);
+          if (size == 0)
+            {
+              file_output_stream = g_file_replace (file, 0, FALSE, 0, NULL, &error);
+            }
+          else
+            {
+              file_output_stream = g_file_append_to (file, 0, NULL, &error);
+              if (file_output_stream)
+                  g_seekable_truncate (G_SEEKABLE (file_output_stream), size, NULL, &error);
+            }
         }
 
       if (error)
@@ -1996,6 +2529,8 @@ vfs_truncate (const gchar *path, off_t size)
           g_object_unref (file_output_stream);
         }
 
+      attr_cache_invalidate (path);
+
       if (fh)
         {
           g_mutex_unlock (&fh->mutex);
@@ -2028,6 +2563,7 @@ vfs_symlink (const gchar *path_old, const gchar *path_new)
   if (file)
     {
       g_file_make_symbolic_link (file, path_old, NULL, &error);
+      attr_cache_invalidate_entry (path_new, FALSE);
 
       if (error)
         {
@@ -2060,11 +2596,14 @@ vfs_access (const gchar *path, gint mode)
     {
       GFileInfo *file_info;
 
-      file_info = g_file_query_info (file,
-                                     G_FILE_ATTRIBUTE_ACCESS_CAN_READ ","
-                                     G_FILE_ATTRIBUTE_ACCESS_CAN_WRITE ","
-                                     G_FILE_ATTRIBUTE_ACCESS_CAN_EXECUTE ",",
-                                     0, NULL, &error);
+      /* Entries from readdir and getattr have the access attributes too */
+      file_info = attr_cache_lookup (path);
+      if (file_info == NULL)
+        file_info = g_file_query_info (file,
+                                       G_FILE_ATTRIBUTE_ACCESS_CAN_READ ","
+                                       G_FILE_ATTRIBUTE_ACCESS_CAN_WRITE ","
+                                       G_FILE_ATTRIBUTE_ACCESS_CAN_EXECUTE ",",
+                                       0, NULL, &error);
       if (file_info)
         {
           if ((mode & R_OK && (g_file_info_has_attribute (file_info, G_FILE_ATTRIBUTE_ACCESS_CAN_READ) &&
@@ -2163,6 +2702,7 @@ vfs_utimens (const gchar *path, const struct timespec tv [2])
       g_file_info_set_attribute_uint32 (info, G_FILE_ATTRIBUTE_TIME_ACCESS_USEC, atime_usec);
 
       g_file_set_attributes_from_info (file, info, 0, NULL, &error);
+      attr_cache_invalidate (path);
 
       if (error)
         {
@@ -2206,6 +2746,7 @@ vfs_chmod (const gchar *path, mode_t mode)
   if (file)
     {
       g_file_set_attribute_uint32 (file, G_FILE_ATTRIBUTE_UNIX_MODE, mode, 0, NULL, &error);
+      attr_cache_invalidate (path);
 
       if (error)
         {
@@ -2223,16 +2764,7 @@ static void
 mount_tracker_mounted_cb (GVolumeMonitor *volume_monitor,
                           GMount         *mount)
 {
-  MountRecord *mount_record;
-
-  if (mount_record_for_mount_exists (mount))
-    return;
-
-  mount_record = mount_record_new (mount);
-
-  mount_list_lock ();
-  mount_list = g_list_prepend (mount_list, mount_record);
-  mount_list_unlock ();
+  mount_list_add (mount);
 }
 
 static void
@@ -2244,7 +2776,7 @@ mount_tracker_unmounted_cb (GVolumeMonitor *volume_monitor,
 
   root = g_mount_get_root (mount);
 
-  mount_list_lock ();
+  mount_list_lock_for_write ();
 
   for (l = mount_list; l != NULL; l = l->next)
     {
@@ -2258,7 +2790,7 @@ mount_tracker_unmounted_cb (GVolumeMonitor *volume_monitor,
         }
     }
 
-  mount_list_unlock ();
+  mount_list_unlock_for_write ();
 
   g_object_unref (root);
 }
@@ -2266,12 +2798,13 @@ mount_tracker_unmounted_cb (GVolumeMonitor *volume_monitor,
 static gpointer
 subthread_main (gpointer data)
 {
-  
-  mount_list_update ();
-  
+  /* Connect first so that no mount falls between the initial update and
+   * the signals; mount_list_add() ignores duplicates */
   g_signal_connect (volume_monitor, "mount_added", (GCallback) mount_tracker_mounted_cb, NULL);
   g_signal_connect (volume_monitor, "mount_removed", (GCallback) mount_tracker_unmounted_cb, NULL);
 
+  mount_list_update ();
+
   g_main_loop_run (subthread_main_loop);
 
   g_signal_handlers_disconnect_by_func (volume_monitor, mount_tracker_mounted_cb, NULL);
@@ -2328,15 +2861,24 @@ vfs_init (struct fuse_conn_info *conn)
 {
   GVfsDBusMountTracker *proxy;
   GError *error;
+  gint i;
   
   daemon_creation_time = time (NULL);
   daemon_uid = getuid ();
   daemon_gid = getgid ();
 
-  global_path_to_fh_map = g_hash_table_new_full (g_str_hash, g_str_equal,
-                                                 NULL, (GDestroyNotify) file_handle_free);
-  global_active_fh_map = g_hash_table_new_full (g_direct_hash, g_direct_equal,
-                                                NULL, NULL);
+  for (i = 0; i < N_SHARDS; i++)
+    {
+      g_mutex_init (&path_shards [i].mutex);
+      path_shards [i].path_to_fh = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                          NULL, (GDestroyNotify) file_handle_free);
+      g_mutex_init (&active_shards [i].mutex);
+      active_shards [i].active_fh = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+                                                           NULL, NULL);
+      g_mutex_init (&attr_cache_shards [i].mutex);
+      attr_cache_shards [i].entries = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                             g_free, (GDestroyNotify) attr_cache_entry_free);
+    }
 
   
   error = NULL;
@@ -2454,5 +2996,15 @@ static struct fuse_operations vfs_oper =
 gint
 main (gint argc, gchar *argv [])
 {
-  return fuse_main (argc, argv, &vfs_oper, NULL /* user data */);
+  struct fuse_args args = FUSE_ARGS_INIT (argc, argv);
+  gint             result;
+
+  /* Right after the program name, so that later options win */
+  if (fuse_opt_insert_arg (&args, 1, DEFAULT_OPTIONS) != 0)
+    return 1;
+
+  result = fuse_main (args.argc, args.argv, &vfs_oper, NULL /* user data */);
+  fuse_opt_free_args (&args);
+
+  return result;
 }
@@ -2613,21 +2613,117 @@ g_vfs_afp_volume_exchange_files_finish (GVfsAfpVolume  *volume,
   return TRUE;
 }
 
+/* Reads and writes bigger than the server's request size are split into
+ * several requests, which are sent without waiting for each other */
+#define MAX_PIPELINED_REQUESTS 8
+
+typedef struct
+{
+  GVfsAfpVolume *volume;
+  AfpCommandType command_type;
+  guint16 fork_refnum;
+  char *buffer;
+  gsize size;
+  gint64 offset;
+  gsize request_size;
+
+  /* Relative to offset */
+  gsize next;
+  gsize end;
+
+  guint outstanding;
+  gint64 last_written;
+  GError *err;
+
+  GCancellable *cancellable;
+  GSimpleAsyncResult *simple;
+} ForkIOData;
+
+typedef struct
+{
+  ForkIOData *io_data;
+  gsize start;
+  gsize len;
+} ForkIORequest;
+
+static void fork_io_send_requests (ForkIOData *io_data);
+
+static void
+fork_io_data_free (ForkIOData *io_data)
+{
+  g_object_unref (io_data->volume);
+  if (io_data->cancellable)
+    g_object_unref (io_data->cancellable);
+  g_object_unref (io_data->simple);
+
+  g_slice_free (ForkIOData, io_data);
+}
+
+static void
+fork_io_set_error (ForkIOData *io_data, GError *err)
+{
+  /* Report the first error */
+  if (io_data->err)
+    g_error_free (err);
+  else
+    io_data->err = err;
+}
+
+static void
+fork_io_complete (ForkIOData *io_data, gboolean in_idle)
+{
+  if (io_data->err)
+  {
+    g_simple_async_result_take_error (io_data->simple, io_data->err);
+    io_data->err = NULL;
+  }
+  else if (io_data->command_type == AFP_COMMAND_READ_EXT)
+    g_simple_async_result_set_op_res_gssize (io_data->simple, io_data->end);
+  else
+  {
+    gint64 *last_written;
+
+    last_written = g_new (gint64, 1);
+    *last_written = io_data->last_written;
+    g_simple_async_result_set_op_res_gpointer (io_data->simple, last_written, g_free);
+  }
+
+  if (in_idle)
+    g_simple_async_result_complete_in_idle (io_data->simple);
+  else
+    g_simple_async_result_complete (io_data->simple);
+  fork_io_data_free (io_data);
+}
+
+static void
+fork_io_request_done (ForkIORequest *request)
+{
+  ForkIOData *io_data = request->io_data;
+
+  g_slice_free (ForkIORequest, request);
+  io_data->outstanding--;
+
+  fork_io_send_requests (io_data);
+  if (io_data->outstanding == 0)
+    fork_io_complete (io_data, FALSE);
+}
+
 static void
 write_ext_cb (GObject *source_object, GAsyncResult *res, gpointer user_data)
 {
   GVfsAfpConnection *conn = G_VFS_AFP_CONNECTION (source_object);
-  GSimpleAsyncResult *simple = G_SIMPLE_ASYNC_RESULT (user_data);
+  ForkIORequest *request = user_data;
+  ForkIOData *io_data = request->io_data;
 
   GVfsAfpReply *reply;
   GError *err = NULL;
   AfpResultCode res_code;
-  gint64 *last_written;
+  gint64 last_written;
 
   reply = g_vfs_afp_connection_send_command_finish (conn, res, &err);
   if (!reply)
   {
-    g_simple_async_result_take_error (simple, err);
+    fork_io_set_error (io_data, err);
     goto done;
   }
 
@@ -2639,33 +2735,175 @@ write_ext_cb (GObject *source_object, GAsyncResult *res, gpointer user_data)
     switch (res_code)
     {
       case AFP_RESULT_ACCESS_DENIED:
-        g_simple_async_result_set_error (simple, G_IO_ERROR, G_IO_ERROR_FAILED,
-                                  _("File is not open for write access"));
+        err = g_error_new_literal (G_IO_ERROR, G_IO_ERROR_FAILED,
+                                   _("File is not open for write access"));
         break;
       case AFP_RESULT_DISK_FULL:
-        g_simple_async_result_set_error (simple, G_IO_ERROR, G_IO_ERROR_NO_SPACE,
-                                  _("Not enough space on volume"));
+        err = g_error_new_literal (G_IO_ERROR, G_IO_ERROR_NO_SPACE,
+                                   _("Not enough space on volume"));
         break;
       case AFP_RESULT_LOCK_ERR:
-        g_simple_async_result_set_error (simple, G_IO_ERROR, G_IO_ERROR_FAILED,
-                                         _("File is locked by another user"));
+        err = g_error_new_literal (G_IO_ERROR, G_IO_ERROR_FAILED,
+                                   _("File is locked by another user"));
         break;
       default:
-        g_simple_async_result_take_error (simple, afp_result_code_to_gerror (res_code));
+        err = afp_result_code_to_gerror (res_code);
         break;
     }
+    fork_io_set_error (io_data, err);
     goto done;
   }
 
-  last_written = g_new (gint64, 1);
-  g_vfs_afp_reply_read_int64 (reply, last_written);
+  g_vfs_afp_reply_read_int64 (reply, &last_written);
   g_object_unref (reply);
-  
-  g_simple_async_result_set_op_res_gpointer (simple, last_written, g_free); 
+
+  /* With several requests in flight a later one can move last_written
+   * past a request that was cut short, so check each against its own */
+  if (last_written < io_data->offset + request->start + request->len)
+  {
+    fork_io_set_error (io_data,
+                       g_error_new_literal (G_IO_ERROR, G_IO_ERROR_FAILED,
+                                            _("Server wrote less data than requested")));
+    goto done;
+  }
+
+  io_data->last_written = MAX (io_data->last_written, last_written);
 
 done:
-  g_simple_async_result_complete (simple);
-  g_object_unref (simple);
+  fork_io_request_done (request);
+}
+
+static void
+read_ext_cb (GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+  GVfsAfpConnection *conn = G_VFS_AFP_CONNECTION (source_object);
+  ForkIORequest *request = user_data;
+  ForkIOData *io_data = request->io_data;
+
+  GVfsAfpReply *reply;
+  GError *err = NULL;
+  AfpResultCode res_code;
+  gsize size;
+
+  reply = g_vfs_afp_connection_send_command_finish (conn, res, &err);
+  if (!reply)
+  {
+    fork_io_set_error (io_data, err);
+    goto done;
+  }
+
+  res_code = g_vfs_afp_reply_get_result_code (reply);
+  if (!(res_code == AFP_RESULT_NO_ERROR || res_code == AFP_RESULT_LOCK_ERR ||
+        res_code == AFP_RESULT_EOF_ERR))
+  {
+    g_object_unref (reply);
+
+    switch (res_code)
+    {
+      case AFP_RESULT_ACCESS_DENIED:
+        err = g_error_new_literal (G_IO_ERROR, G_IO_ERROR_FAILED,
+                                   _("File is not open for read access"));
+        break;
+      default:
+        err = afp_result_code_to_gerror (res_code);
+        break;
+    }
+    fork_io_set_error (io_data, err);
+    goto done;
+  }
+
+  size = g_vfs_afp_reply_get_size (reply);
+  g_object_unref (reply);
+
+  /* A short read ends the data, requests after it are ignored */
+  if (size < request->len)
+    io_data->end = MIN (io_data->end, request->start + size);
+
+done:
+  fork_io_request_done (request);
+}
+
+static void
+fork_io_send_requests (ForkIOData *io_data)
+{
+  GVfsAfpCommand *comm;
+  ForkIORequest *request;
+
+  while (io_data->outstanding < MAX_PIPELINED_REQUESTS &&
+         io_data->next < io_data->end &&
+         io_data->err == NULL)
+  {
+    request = g_slice_new (ForkIORequest);
+    request->io_data = io_data;
+    request->start = io_data->next;
+    request->len = MIN (io_data->request_size, io_data->end - io_data->next);
+    io_data->next += request->len;
+
+    comm = g_vfs_afp_command_new (io_data->command_type);
+    /* StartEndFlag = 0 for FPWriteExt, pad byte for FPReadExt */
+    g_vfs_afp_command_put_byte (comm, 0);
+
+    /* OForkRefNum */
+    g_vfs_afp_command_put_int16 (comm, io_data->fork_refnum);
+    /* Offset */
+    g_vfs_afp_command_put_int64 (comm, io_data->offset + request->start);
+    /* ReqCount */
+    g_vfs_afp_command_put_int64 (comm, request->len);
+
+    io_data->outstanding++;
+    if (io_data->command_type == AFP_COMMAND_WRITE_EXT)
+    {
+      g_vfs_afp_command_set_buffer (comm, io_data->buffer + request->start,
+                                    request->len);
+      g_vfs_afp_connection_send_command (io_data->volume->priv->conn, comm, NULL,
+                                         write_ext_cb, io_data->cancellable,
+                                         request);
+    }
+    else
+    {
+      g_vfs_afp_connection_send_command (io_data->volume->priv->conn, comm,
+                                         io_data->buffer + request->start,
+                                         read_ext_cb, io_data->cancellable,
+                                         request);
+    }
+    g_object_unref (comm);
+  }
+}
+
+static void
+fork_io_start (GVfsAfpVolume       *volume,
+               AfpCommandType       command_type,
+               guint16              fork_refnum,
+               char                *buffer,
+               gsize                size,
+               gint64               offset,
+               gsize                request_size,
+               GCancellable        *cancellable,
+               GSimpleAsyncResult  *simple)
+{
+  ForkIOData *io_data;
+
+  io_data = g_slice_new0 (ForkIOData);
+  io_data->volume = g_object_ref (volume);
+  io_data->command_type = command_type;
+  io_data->fork_refnum = fork_refnum;
+  io_data->buffer = buffer;
+  io_data->size = MIN (size, G_MAXUINT32);
+  io_data->offset = offset;
+  io_data->request_size = request_size > 0 ? request_size : io_data->size;
+  io_data->end = io_data->size;
+  io_data->last_written = offset;
+  if (cancellable)
+    io_data->cancellable = g_object_ref (cancellable);
+  io_data->simple = simple;
+
+  if (io_data->size == 0)
+  {
+    fork_io_complete (io_data, TRUE);
+    return;
+  }
+
+  fork_io_send_requests (io_data);
 }
 
 /*
@@ -2682,7 +2920,8 @@ done:
  * @user_data: the data to pass to callback function.
  * 
  * Asynchronously writes the data in @buffer to the fork referenced by
- * @fork_refnum.
+ * @fork_refnum. Data that doesn't fit in one request is written with
+ * several requests in flight at once.
  */
 void
 g_vfs_afp_volume_write_to_fork (GVfsAfpVolume       *volume,
@@ -2694,34 +2933,19 @@ g_vfs_afp_volume_write_to_fork (GVfsAfpVolume       *volume,
                                 GAsyncReadyCallback  callback,
                                 gpointer             user_data)
 {
-  GVfsAfpCommand *comm;
-  guint32 max_req_count, req_count;
+  guint32 max_req_count;
   GSimpleAsyncResult *simple;
 
   g_return_if_fail (G_VFS_IS_AFP_VOLUME (volume));
-  
-  comm = g_vfs_afp_command_new (AFP_COMMAND_WRITE_EXT);
-  /* StartEndFlag = 0 */
-  g_vfs_afp_command_put_byte (comm, 0);
 
-  /* OForkRefNum */
-  g_vfs_afp_command_put_int16 (comm, fork_refnum);
-  /* Offset */
-  g_vfs_afp_command_put_int64 (comm, offset);
-  
-  /* ReqCount */
+  /* The request size includes the 20 byte FPWriteExt header */
   max_req_count = g_vfs_afp_server_get_max_request_size (volume->priv->server) - 20;
-  req_count = MIN (buffer_size, G_MAXUINT32);
-  g_vfs_afp_command_put_int64 (comm, req_count);
-
-  g_vfs_afp_command_set_buffer (comm, buffer, req_count);
 
   simple = g_simple_async_result_new (G_OBJECT (volume), callback, user_data,
                                       g_vfs_afp_volume_write_to_fork);
-  
-  g_vfs_afp_connection_send_command (volume->priv->conn, comm, NULL,
-                                     write_ext_cb, cancellable, simple);
-  g_object_unref (comm);
+
+  fork_io_start (volume, AFP_COMMAND_WRITE_EXT, fork_refnum, buffer, buffer_size,
+                 offset, max_req_count, cancellable, simple);
 }
 
 /*
@@ -2760,50 +2984,6 @@ g_vfs_afp_volume_write_to_fork_finish (GVfsAfpVolume  *volume,
   return TRUE;
 }
 
-static void
-read_ext_cb (GObject *source_object, GAsyncResult *res, gpointer user_data)
-{
-  GVfsAfpConnection *conn = G_VFS_AFP_CONNECTION (source_object);
-  GSimpleAsyncResult *simple = G_SIMPLE_ASYNC_RESULT (user_data);
-
-  GVfsAfpReply *reply;
-  GError *err = NULL;
-  AfpResultCode res_code;
-
-  reply = g_vfs_afp_connection_send_command_finish (conn, res, &err);
-  if (!reply)
-  {
-    g_simple_async_result_take_error (simple, err);
-    goto done;
-  }
-
-  res_code = g_vfs_afp_reply_get_result_code (reply);
-  if (!(res_code == AFP_RESULT_NO_ERROR || res_code == AFP_RESULT_LOCK_ERR ||
-        res_code == AFP_RESULT_EOF_ERR))
-  {
-    g_object_unref (reply);
-
-    switch (res_code)
-    {
-      case AFP_RESULT_ACCESS_DENIED:
-        g_simple_async_result_set_error (simple, G_IO_ERROR, G_IO_ERROR_FAILED,
-                                  _("File is not open for read access"));
-        break;
-      default:
-        g_simple_async_result_take_error (simple, afp_result_code_to_gerror (res_code));
-        break;
-    }
-    goto done;
-  }
-
-  g_simple_async_result_set_op_res_gssize (simple, g_vfs_afp_reply_get_size (reply));
-  g_object_unref (reply);
-
-done:
-  g_simple_async_result_complete (simple);
-  g_object_unref (simple);
-}
-
 /*
  * g_vfs_afp_volume_read_from_fork:
  * 
@@ -2816,7 +2996,9 @@ done:
  * @callback: callback to call when the request is satisfied.
  * @user_data: the data to pass to callback function.
  * 
- * Asynchronously reads data from the fork referenced by @fork_refnum.
+ * Asynchronously reads data from the fork referenced by @fork_refnum. Reads
+ * bigger than what the server replies with at once are split into several
+ * requests in flight at once, and reassembled in @buffer.
  */
 void
 g_vfs_afp_volume_read_from_fork (GVfsAfpVolume       *volume,
@@ -2828,30 +3010,18 @@ g_vfs_afp_volume_read_from_fork (GVfsAfpVolume       *volume,
                                  GAsyncReadyCallback  callback,
                                  gpointer             user_data)
 {
-  GVfsAfpCommand *comm;
-  guint32 req_count;
+  guint32 max_req_count;
   GSimpleAsyncResult *simple;
 
   g_return_if_fail (G_VFS_IS_AFP_VOLUME (volume));
-  
-  comm = g_vfs_afp_command_new (AFP_COMMAND_READ_EXT);
-  /* pad byte */
-  g_vfs_afp_command_put_byte (comm, 0);
 
-  /* OForkRefNum */
-  g_vfs_afp_command_put_int16 (comm, fork_refnum);
-  /* Offset */
-  g_vfs_afp_command_put_int64 (comm, offset);
-  /* ReqCount */
-  req_count = MIN (bytes_requested, G_MAXUINT32);
-  g_vfs_afp_command_put_int64 (comm, req_count);
+  max_req_count = g_vfs_afp_server_get_max_request_size (volume->priv->server);
 
   simple = g_simple_async_result_new (G_OBJECT (volume), callback, user_data,
                                       g_vfs_afp_volume_read_from_fork);
-  
-  g_vfs_afp_connection_send_command (volume->priv->conn, comm, buffer,
-                                     read_ext_cb, cancellable, simple);
-  g_object_unref (comm);
+
+  fork_io_start (volume, AFP_COMMAND_READ_EXT, fork_refnum, buffer, bytes_requested,
+                 offset, max_req_count, cancellable, simple);
 }
 
 /*
@@ -52,6 +52,8 @@
 #include "gvfsjobsetdisplayname.h"
 #include "gvfsjobmove.h"
 #include "gvfsjobcopy.h"
+#include "gvfsjobpull.h"
+#include "gvfsjobpush.h"
 
 #include "gvfsafpserver.h"
 #include "gvfsafpvolume.h"
@@ -115,6 +117,20 @@ typedef enum
   AFP_HANDLE_TYPE_APPEND_TO_FILE
 } AfpHandleType;
 
+/* Sequential reads are served from chunks that are read ahead of them,
+ * so that several requests are in flight while the data is consumed */
+#define READ_AHEAD_CHUNKS     4
+#define READ_AHEAD_CHUNK_SIZE (256 * 1024)
+
+typedef enum
+{
+  CHUNK_STATE_FREE,
+  CHUNK_STATE_PENDING,
+  CHUNK_STATE_READY
+} ChunkState;
+
+typedef struct _ReadAheadChunk ReadAheadChunk;
+
 typedef struct
 {
   GVfsBackendAfp *backend;
@@ -126,238 +142,1385 @@ typedef struct
   /* Used if type == AFP_HANDLE_TYPE_REPLACE_FILE_DIRECT */
   gint64 size;
 
-  /* Used if type == AFP_HANDLE_TYPE_REPLACE_FILE_TEMP */
-  char *filename;
-  char *tmp_filename;
-  gboolean make_backup;
-} AfpHandle;
+  /* Used if type == AFP_HANDLE_TYPE_REPLACE_FILE_TEMP */
+  char *filename;
+  char *tmp_filename;
+  gboolean make_backup;
+
+  /* Used if type == AFP_HANDLE_TYPE_READ_FILE */
+  gint64 last_read_end;
+  ReadAheadChunk *chunks;
+  gboolean read_ahead_active;
+  gboolean read_ahead_eof;
+  gint64 read_ahead_offset;
+  guint read_ahead_pending;
+
+  GSimpleAsyncResult *waiting_read;
+  char *waiting_buffer;
+  gsize waiting_size;
+
+  /* Closing waits for chunks that are still being read */
+  gboolean closing;
+  GCancellable *close_cancellable;
+  GAsyncReadyCallback close_callback;
+  gpointer close_user_data;
+} AfpHandle;
+
+struct _ReadAheadChunk
+{
+  AfpHandle *afp_handle;
+  ChunkState state;
+  gboolean stale;
+
+  gint64 offset;
+  char *buffer;
+  gsize size;
+  GError *err;
+};
+
+static AfpHandle *
+afp_handle_new (GVfsBackendAfp *backend, gint16 fork_refnum)
+{
+  AfpHandle *afp_handle;
+
+  afp_handle = g_slice_new0 (AfpHandle);
+  afp_handle->backend = backend;
+  afp_handle->fork_refnum = fork_refnum;
+
+  return afp_handle;
+}
+
+static void
+afp_handle_free (AfpHandle *afp_handle)
+{
+  guint i;
+
+  g_free (afp_handle->filename);
+  g_free (afp_handle->tmp_filename);
+
+  if (afp_handle->chunks)
+  {
+    for (i = 0; i < READ_AHEAD_CHUNKS; i++)
+    {
+      g_free (afp_handle->chunks[i].buffer);
+      g_clear_error (&afp_handle->chunks[i].err);
+    }
+    g_free (afp_handle->chunks);
+  }
+  if (afp_handle->close_cancellable)
+    g_object_unref (afp_handle->close_cancellable);
+  
+  g_slice_free (AfpHandle, afp_handle);
+}
+
+static void
+afp_handle_close_now (AfpHandle           *afp_handle,
+                      GCancellable        *cancellable,
+                      GAsyncReadyCallback  callback,
+                      gpointer             user_data)
+{
+  g_vfs_afp_volume_close_fork (afp_handle->backend->volume, afp_handle->fork_refnum,
+                               cancellable, callback, user_data);
+  afp_handle_free (afp_handle);
+}
+
+static void
+read_ahead_reset (AfpHandle *afp_handle)
+{
+  ReadAheadChunk *chunk;
+  guint i;
+
+  afp_handle->read_ahead_active = FALSE;
+  if (afp_handle->chunks == NULL)
+    return;
+
+  for (i = 0; i < READ_AHEAD_CHUNKS; i++)
+  {
+    chunk = &afp_handle->chunks[i];
+    /* The reply still goes into the buffer, so it can't be reused yet */
+    if (chunk->state == CHUNK_STATE_PENDING)
+      chunk->stale = TRUE;
+    else
+    {
+      chunk->state = CHUNK_STATE_FREE;
+      g_clear_error (&chunk->err);
+    }
+  }
+}
+
+/*
+ * afp_handle_close:
+ *
+ * Closes the fork and frees @afp_handle, once no chunks are being read
+ * ahead for it anymore. @callback gets the volume as source object.
+ */
+static void
+afp_handle_close (AfpHandle           *afp_handle,
+                  GCancellable        *cancellable,
+                  GAsyncReadyCallback  callback,
+                  gpointer             user_data)
+{
+  if (afp_handle->read_ahead_pending == 0)
+  {
+    afp_handle_close_now (afp_handle, cancellable, callback, user_data);
+    return;
+  }
+
+  read_ahead_reset (afp_handle);
+  afp_handle->closing = TRUE;
+  if (cancellable)
+    afp_handle->close_cancellable = g_object_ref (cancellable);
+  afp_handle->close_callback = callback;
+  afp_handle->close_user_data = user_data;
+}
+
+static ReadAheadChunk *
+read_ahead_find_chunk (AfpHandle *afp_handle, gint64 offset)
+{
+  ReadAheadChunk *chunk;
+  guint i;
+
+  for (i = 0; i < READ_AHEAD_CHUNKS; i++)
+  {
+    chunk = &afp_handle->chunks[i];
+    if (chunk->state != CHUNK_STATE_FREE && !chunk->stale &&
+        offset >= chunk->offset && offset < chunk->offset + READ_AHEAD_CHUNK_SIZE)
+      return chunk;
+  }
+
+  return NULL;
+}
+
+/* Hands out what the chunks have at the current offset, which has to be
+ * in a ready chunk */
+static void
+read_ahead_complete_read (AfpHandle          *afp_handle,
+                          GSimpleAsyncResult *simple,
+                          char               *buffer,
+                          gsize               size)
+{
+  ReadAheadChunk *chunk;
+  gsize copied, n;
+
+  copied = 0;
+  while (copied < size)
+  {
+    chunk = read_ahead_find_chunk (afp_handle, afp_handle->offset);
+    if (chunk == NULL || chunk->state != CHUNK_STATE_READY)
+      break;
+
+    if (chunk->err)
+    {
+      /* Report the error once there's nothing before it to hand out */
+      if (copied == 0)
+      {
+        g_simple_async_result_take_error (simple, chunk->err);
+        chunk->err = NULL;
+        chunk->state = CHUNK_STATE_FREE;
+        return;
+      }
+      break;
+    }
+
+    n = MIN (size - copied, chunk->offset + chunk->size - afp_handle->offset);
+    if (n == 0)
+      break; /* End of file */
+
+    memcpy (buffer + copied, chunk->buffer + (afp_handle->offset - chunk->offset), n);
+    copied += n;
+    afp_handle->offset += n;
+
+    if (afp_handle->offset == chunk->offset + READ_AHEAD_CHUNK_SIZE)
+      chunk->state = CHUNK_STATE_FREE;
+  }
+
+  afp_handle->last_read_end = afp_handle->offset;
+  g_simple_async_result_set_op_res_gssize (simple, copied);
+}
+
+static void afp_handle_read_direct (AfpHandle          *afp_handle,
+                                    GSimpleAsyncResult *simple,
+                                    char               *buffer,
+                                    gsize               size,
+                                    GCancellable       *cancellable);
+static void read_ahead_fill        (AfpHandle          *afp_handle);
+
+static void
+read_ahead_chunk_cb (GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+  GVfsAfpVolume *volume = G_VFS_AFP_VOLUME (source_object);
+  ReadAheadChunk *chunk = user_data;
+  AfpHandle *afp_handle = chunk->afp_handle;
+
+  GError *err = NULL;
+  gsize bytes_read;
+  GSimpleAsyncResult *simple;
+
+  afp_handle->read_ahead_pending--;
+
+  if (!g_vfs_afp_volume_read_from_fork_finish (volume, res, &bytes_read, &err))
+    bytes_read = 0;
+
+  if (chunk->stale)
+  {
+    /* Nobody wants this data anymore */
+    g_clear_error (&err);
+    chunk->stale = FALSE;
+    chunk->state = CHUNK_STATE_FREE;
+  }
+  else
+  {
+    chunk->state = CHUNK_STATE_READY;
+    chunk->size = bytes_read;
+    chunk->err = err;
+    if (err || bytes_read < READ_AHEAD_CHUNK_SIZE)
+      afp_handle->read_ahead_eof = TRUE;
+  }
+
+  if (afp_handle->closing)
+  {
+    if (afp_handle->read_ahead_pending == 0)
+      afp_handle_close_now (afp_handle, afp_handle->close_cancellable,
+                            afp_handle->close_callback,
+                            afp_handle->close_user_data);
+    return;
+  }
+
+  if (afp_handle->waiting_read)
+  {
+    simple = afp_handle->waiting_read;
+    chunk = read_ahead_find_chunk (afp_handle, afp_handle->offset);
+    if (chunk == NULL)
+    {
+      afp_handle->waiting_read = NULL;
+      afp_handle_read_direct (afp_handle, simple, afp_handle->waiting_buffer,
+                              afp_handle->waiting_size, NULL);
+    }
+    else if (chunk->state == CHUNK_STATE_READY)
+    {
+      afp_handle->waiting_read = NULL;
+      read_ahead_complete_read (afp_handle, simple, afp_handle->waiting_buffer,
+                                afp_handle->waiting_size);
+      g_simple_async_result_complete (simple);
+      g_object_unref (simple);
+    }
+  }
+
+  read_ahead_fill (afp_handle);
+}
+
+static void
+read_ahead_fill (AfpHandle *afp_handle)
+{
+  ReadAheadChunk *chunk;
+  guint i;
+
+  if (!afp_handle->read_ahead_active)
+    return;
+
+  for (i = 0; i < READ_AHEAD_CHUNKS && !afp_handle->read_ahead_eof; i++)
+  {
+    chunk = &afp_handle->chunks[i];
+    if (chunk->state != CHUNK_STATE_FREE)
+      continue;
+
+    if (chunk->buffer == NULL)
+      chunk->buffer = g_malloc (READ_AHEAD_CHUNK_SIZE);
+    chunk->afp_handle = afp_handle;
+    chunk->state = CHUNK_STATE_PENDING;
+    chunk->offset = afp_handle->read_ahead_offset;
+    chunk->size = 0;
+    afp_handle->read_ahead_offset += READ_AHEAD_CHUNK_SIZE;
+    afp_handle->read_ahead_pending++;
+
+    g_vfs_afp_volume_read_from_fork (afp_handle->backend->volume,
+                                     afp_handle->fork_refnum,
+                                     chunk->buffer, READ_AHEAD_CHUNK_SIZE,
+                                     chunk->offset, NULL,
+                                     read_ahead_chunk_cb, chunk);
+  }
+}
+
+static void
+read_ahead_start (AfpHandle *afp_handle)
+{
+  if (afp_handle->chunks == NULL)
+    afp_handle->chunks = g_new0 (ReadAheadChunk, READ_AHEAD_CHUNKS);
+
+  afp_handle->read_ahead_active = TRUE;
+  afp_handle->read_ahead_eof = FALSE;
+  afp_handle->read_ahead_offset = afp_handle->offset;
+  read_ahead_fill (afp_handle);
+}
+
+static void
+read_direct_cb (GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+  GVfsAfpVolume *volume = G_VFS_AFP_VOLUME (source_object);
+  GSimpleAsyncResult *simple = G_SIMPLE_ASYNC_RESULT (user_data);
+  AfpHandle *afp_handle;
+
+  GError *err = NULL;
+  gsize bytes_read;
+
+  afp_handle = g_object_get_data (G_OBJECT (simple), "afp-handle");
+
+  if (!g_vfs_afp_volume_read_from_fork_finish (volume, res, &bytes_read, &err))
+    g_simple_async_result_take_error (simple, err);
+  else
+  {
+    afp_handle->offset += bytes_read;
+    afp_handle->last_read_end = afp_handle->offset;
+    g_simple_async_result_set_op_res_gssize (simple, bytes_read);
+  }
+
+  g_simple_async_result_complete (simple);
+  g_object_unref (simple);
+}
+
+static void
+afp_handle_read_direct (AfpHandle          *afp_handle,
+                        GSimpleAsyncResult *simple,
+                        char               *buffer,
+                        gsize               size,
+                        GCancellable       *cancellable)
+{
+  g_object_set_data (G_OBJECT (simple), "afp-handle", afp_handle);
+  g_vfs_afp_volume_read_from_fork (afp_handle->backend->volume,
+                                   afp_handle->fork_refnum, buffer, size,
+                                   afp_handle->offset, cancellable,
+                                   read_direct_cb, simple);
+}
+
+/*
+ * afp_handle_read:
+ *
+ * Reads from the current offset of a handle opened for reading. Once
+ * reads turn out to be sequential they are served from the read-ahead.
+ */
+static void
+afp_handle_read (AfpHandle           *afp_handle,
+                 char                *buffer,
+                 gsize                size,
+                 GCancellable        *cancellable,
+                 GAsyncReadyCallback  callback,
+                 gpointer             user_data)
+{
+  GSimpleAsyncResult *simple;
+  ReadAheadChunk *chunk;
+
+  simple = g_simple_async_result_new (G_OBJECT (afp_handle->backend), callback,
+                                      user_data, afp_handle_read);
+
+  if (!afp_handle->read_ahead_active &&
+      afp_handle->offset > 0 &&
+      afp_handle->offset == afp_handle->last_read_end)
+    read_ahead_start (afp_handle);
+
+  if (afp_handle->read_ahead_active)
+  {
+    chunk = read_ahead_find_chunk (afp_handle, afp_handle->offset);
+    if (chunk == NULL)
+    {
+      /* Seeked away from what was read ahead */
+      read_ahead_reset (afp_handle);
+    }
+    else if (chunk->state == CHUNK_STATE_PENDING)
+    {
+      afp_handle->waiting_read = simple;
+      afp_handle->waiting_buffer = buffer;
+      afp_handle->waiting_size = size;
+      return;
+    }
+    else
+    {
+      read_ahead_complete_read (afp_handle, simple, buffer, size);
+      g_simple_async_result_complete_in_idle (simple);
+      g_object_unref (simple);
+
+      read_ahead_fill (afp_handle);
+      return;
+    }
+  }
+
+  afp_handle_read_direct (afp_handle, simple, buffer, size, cancellable);
+}
+
+static gboolean
+afp_handle_read_finish (AfpHandle     *afp_handle,
+                        GAsyncResult  *res,
+                        gsize         *bytes_read,
+                        GError       **error)
+{
+  GSimpleAsyncResult *simple;
+
+  g_return_val_if_fail (g_simple_async_result_is_valid (res,
+                                                        G_OBJECT (afp_handle->backend),
+                                                        afp_handle_read),
+                        FALSE);
+
+  simple = (GSimpleAsyncResult *)res;
+
+  if (g_simple_async_result_propagate_error (simple, error))
+    return FALSE;
+
+  if (bytes_read)
+    *bytes_read = g_simple_async_result_get_op_res_gssize (simple);
+
+  return TRUE;
+}
+
+/*
+ * Backend code
+ */
+
+typedef struct
+{
+  GVfsJobCopy  *job;
+  GAsyncResult *source_parms_res;
+  GAsyncResult *dest_parms_res;
+} CopyData;
+
+static void
+copy_data_free (CopyData *copy_data)
+{
+  g_object_unref (copy_data->source_parms_res);
+  g_object_unref (copy_data->dest_parms_res);
+
+  g_slice_free (CopyData, copy_data);
+}
+
+static void
+copy_copy_file_cb (GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+  GVfsAfpVolume *volume = G_VFS_AFP_VOLUME (source_object);
+  GVfsJobCopy *job = G_VFS_JOB_COPY (user_data);
+
+  GError *err = NULL;
+  
+  if (!g_vfs_afp_volume_copy_file_finish (volume, res, &err))
+  {
+    g_vfs_job_failed_from_error (G_VFS_JOB (job), err);
+    g_error_free (err);
+    return;
+  }
+
+  g_vfs_job_succeeded (G_VFS_JOB (job));
+}
+
+static void
+copy_delete_cb (GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+  GVfsAfpVolume *volume = G_VFS_AFP_VOLUME (source_object);
+  GVfsJobCopy *job = G_VFS_JOB_COPY (user_data);
+  GVfsBackendAfp *afp_backend = G_VFS_BACKEND_AFP (job->backend);
+
+  GError *err = NULL;
+  
+  if (!g_vfs_afp_volume_delete_finish (volume, res, &err))
+  {
+    g_vfs_job_failed_from_error (G_VFS_JOB (job), err);
+    g_error_free (err);
+    return;
+  }
+
+  g_vfs_afp_volume_copy_file (afp_backend->volume, job->source, job->destination,
+                              G_VFS_JOB (job)->cancellable, copy_copy_file_cb, job);
+}
+
+static void
+do_copy (CopyData *copy_data)
+{
+  GVfsJobCopy *job = copy_data->job;
+  GVfsBackendAfp *afp_backend = G_VFS_BACKEND_AFP (job->backend);
+  
+  GFileInfo *info;
+  GError *err = NULL;
+
+  gboolean source_is_dir;
+  gboolean dest_exists;
+  gboolean dest_is_dir;
+  
+  info = g_vfs_afp_volume_get_filedir_parms_finish (afp_backend->volume, copy_data->source_parms_res, &err);
+  if (!info)
+  {
+    g_vfs_job_failed_from_error (G_VFS_JOB (job), err);
+    g_error_free (err);
+    goto done;
+  }
+
+  /* If the source is a directory, don't fail with WOULD_RECURSE immediately,
+   * as that is less useful to the app. Better check for errors on the
+   * target instead.
+   */
+  source_is_dir = g_file_info_get_file_type (info) == G_FILE_TYPE_DIRECTORY ? TRUE : FALSE;
+  g_object_unref (info);
+
+  info = g_vfs_afp_volume_get_filedir_parms_finish (afp_backend->volume, copy_data->dest_parms_res, &err);
+  if (!info)
+  {
+    if (g_error_matches (err, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+    {
+      g_clear_error (&err);
+      dest_exists = FALSE;
+    }
+    else
+    {
+      g_vfs_job_failed_from_error (G_VFS_JOB (job), err);
+      g_error_free (err);
+      goto done;
+    }
+  }
+  else
+  {
+    dest_exists = TRUE;
+    dest_is_dir = g_file_info_get_file_type (info) == G_FILE_TYPE_DIRECTORY ? TRUE : FALSE;
+    g_object_unref (info);
+  }
+
+  /* Check target errors */
+  if (dest_exists)
+  {
+    if ((job->flags & G_FILE_COPY_OVERWRITE))
+    {
+      /* Always fail on dirs, even with overwrite */
+      if (dest_is_dir)
+      {
+        if (source_is_dir)
+          g_vfs_job_failed_literal (G_VFS_JOB (job), G_IO_ERROR, G_IO_ERROR_WOULD_MERGE,
+                                    _("Can't copy directory over directory"));
+        else
+          g_vfs_job_failed_literal (G_VFS_JOB (job), G_IO_ERROR, G_IO_ERROR_IS_DIRECTORY,
+                                    _("File is directory"));
+        goto done;
+      }
+    }
+    else
+    {
+      g_vfs_job_failed (G_VFS_JOB (job), G_IO_ERROR, G_IO_ERROR_EXISTS,
+                        _("Target file already exists"));
+      goto done;
+    }
+  }
+
+  /* Now we fail if the source is a directory */
+  if (source_is_dir)
+  {
+    g_vfs_job_failed (G_VFS_JOB (job), G_IO_ERROR, G_IO_ERROR_WOULD_RECURSE,
+                      _("Can't recursively copy directory"));
+    goto done;
+  }
+
+  if (dest_exists)
+  {
+    g_vfs_afp_volume_delete (afp_backend->volume, job->destination,
+                             G_VFS_JOB (job)->cancellable, copy_delete_cb, job);
+  }
+  else
+  {
+    g_vfs_afp_volume_copy_file (afp_backend->volume, job->source, job->destination,
+                                G_VFS_JOB (job)->cancellable, copy_copy_file_cb, job);
+  }
+  
+done:
+  copy_data_free (copy_data);
+  return;
+}
+
+static void
+copy_get_dest_parms_cb (GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+  CopyData *copy_data = (CopyData *)user_data;
+  
+  copy_data->dest_parms_res = g_object_ref (res);
+  if (copy_data->source_parms_res)
+    do_copy (copy_data);
+}
+
+static void
+copy_get_source_parms_cb (GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+  CopyData *copy_data = (CopyData *)user_data;
+
+  copy_data->source_parms_res = g_object_ref (res);
+  if (copy_data->dest_parms_res)
+    do_copy (copy_data);
+}
+
+static gboolean
+try_copy (GVfsBackend *backend,
+          GVfsJobCopy *job,
+          const char *source,
+          const char *destination,
+          GFileCopyFlags flags,
+          GFileProgressCallback progress_callback,
+          gpointer progress_callback_data)
+{
+  GVfsBackendAfp *afp_backend = G_VFS_BACKEND_AFP (backend);
+
+  CopyData *copy_data;
+
+  copy_data = g_slice_new0 (CopyData);
+  copy_data->job = job;
+
+  g_vfs_afp_volume_get_filedir_parms (afp_backend->volume, source,
+                                      AFP_FILEDIR_BITMAP_ATTRIBUTE_BIT,
+                                      AFP_FILEDIR_BITMAP_ATTRIBUTE_BIT,
+                                      G_VFS_JOB (job)->cancellable, copy_get_source_parms_cb,
+                                      copy_data);
+
+  g_vfs_afp_volume_get_filedir_parms (afp_backend->volume, destination,
+                                      AFP_FILEDIR_BITMAP_ATTRIBUTE_BIT,
+                                      AFP_FILEDIR_BITMAP_ATTRIBUTE_BIT,
+                                      G_VFS_JOB (job)->cancellable, copy_get_dest_parms_cb,
+                                      copy_data);
+
+  return TRUE;
+}
+
+#define PULL_BUFFER_SIZE READ_AHEAD_CHUNK_SIZE
+#define PUSH_BUFFER_SIZE (1024 * 1024)
+
+typedef struct
+{
+  GVfsJobPull *job;
+  AfpHandle *afp_handle;
+  GFile *file;
+  gboolean file_existed;
+  GOutputStream *stream;
+  GError *error;
+
+  char *buffer;
+  gsize buffer_len;
+  gsize buffer_pos;
+
+  goffset size;
+  goffset transferred;
+  GFileProgressCallback progress_callback;
+  gpointer progress_callback_data;
+} PullData;
+
+static void
+pull_data_free (PullData *pull_data)
+{
+  /* Only set if we bailed out early */
+  if (pull_data->afp_handle)
+    afp_handle_close (pull_data->afp_handle, NULL, NULL, NULL);
+  if (pull_data->stream)
+    g_object_unref (pull_data->stream);
+  g_object_unref (pull_data->file);
+  g_free (pull_data->buffer);
+
+  g_slice_free (PullData, pull_data);
+}
+
+static void
+pull_cleanup_done (PullData *pull_data)
+{
+  g_vfs_job_failed_from_error (G_VFS_JOB (pull_data->job), pull_data->error);
+  g_error_free (pull_data->error);
+  pull_data_free (pull_data);
+}
+
+static void
+pull_delete_local_cb (GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+  PullData *pull_data = (PullData *)user_data;
+
+  g_file_delete_finish (pull_data->file, res, NULL);
+  pull_cleanup_done (pull_data);
+}
+
+static void
+pull_discard_stream_cb (GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+  PullData *pull_data = (PullData *)user_data;
+
+  g_output_stream_close_finish (pull_data->stream, res, NULL);
+  g_clear_object (&pull_data->stream);
+
+  /* A replace of an existing file was discarded above, otherwise
+   * the partial file was written in place */
+  if (!pull_data->file_existed)
+  {
+    g_file_delete_async (pull_data->file, G_PRIORITY_DEFAULT, NULL,
+                         pull_delete_local_cb, pull_data);
+    return;
+  }
+
+  pull_cleanup_done (pull_data);
+}
+
+static void
+pull_failed (PullData *pull_data, GError *err)
+{
+  GCancellable *discard;
+
+  pull_data->error = err;
+
+  /* Only set while the local file is incomplete */
+  if (!pull_data->stream)
+  {
+    pull_cleanup_done (pull_data);
+    return;
+  }
+
+  /* Closing with a cancelled cancellable discards a replace instead of
+   * committing it */
+  discard = g_cancellable_new ();
+  g_cancellable_cancel (discard);
+  g_output_stream_close_async (pull_data->stream, G_PRIORITY_DEFAULT, discard,
+                               pull_discard_stream_cb, pull_data);
+  g_object_unref (discard);
+}
+
+static void pull_read (PullData *pull_data);
+
+static void
+pull_delete_cb (GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+  GVfsAfpVolume *volume = G_VFS_AFP_VOLUME (source_object);
+  PullData *pull_data = (PullData *)user_data;
+
+  GError *err = NULL;
+
+  if (!g_vfs_afp_volume_delete_finish (volume, res, &err))
+  {
+    pull_failed (pull_data, err);
+    return;
+  }
+
+  g_vfs_job_succeeded (G_VFS_JOB (pull_data->job));
+  pull_data_free (pull_data);
+}
+
+static void
+pull_close_fork_cb (GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+  GVfsAfpVolume *volume = G_VFS_AFP_VOLUME (source_object);
+  PullData *pull_data = (PullData *)user_data;
+  GVfsJobPull *job = pull_data->job;
+
+  GError *err = NULL;
+
+  if (!g_vfs_afp_volume_close_fork_finish (volume, res, &err))
+  {
+    pull_failed (pull_data, err);
+    return;
+  }
+
+  if (job->remove_source)
+  {
+    g_vfs_afp_volume_delete (volume, job->source, G_VFS_JOB (job)->cancellable,
+                             pull_delete_cb, pull_data);
+    return;
+  }
+
+  g_vfs_job_succeeded (G_VFS_JOB (job));
+  pull_data_free (pull_data);
+}
+
+static void
+pull_close_stream_cb (GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+  PullData *pull_data = (PullData *)user_data;
+  AfpHandle *afp_handle;
+
+  GError *err = NULL;
+
+  if (!g_output_stream_close_finish (pull_data->stream, res, &err))
+  {
+    pull_failed (pull_data, err);
+    return;
+  }
+  g_clear_object (&pull_data->stream);
+
+  afp_handle = pull_data->afp_handle;
+  pull_data->afp_handle = NULL;
+  afp_handle_close (afp_handle, G_VFS_JOB (pull_data->job)->cancellable,
+                    pull_close_fork_cb, pull_data);
+}
+
+static void
+pull_write_cb (GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+  PullData *pull_data = (PullData *)user_data;
+
+  GError *err = NULL;
+  gssize written;
+
+  written = g_output_stream_write_finish (pull_data->stream, res, &err);
+  if (written < 0)
+  {
+    pull_failed (pull_data, err);
+    return;
+  }
+
+  pull_data->buffer_pos += written;
+  pull_data->transferred += written;
+  if (pull_data->progress_callback)
+    pull_data->progress_callback (pull_data->transferred, pull_data->size,
+                                  pull_data->progress_callback_data);
+
+  if (pull_data->buffer_pos < pull_data->buffer_len)
+  {
+    g_output_stream_write_async (pull_data->stream,
+                                 pull_data->buffer + pull_data->buffer_pos,
+                                 pull_data->buffer_len - pull_data->buffer_pos,
+                                 G_PRIORITY_DEFAULT,
+                                 G_VFS_JOB (pull_data->job)->cancellable,
+                                 pull_write_cb, pull_data);
+    return;
+  }
+
+  pull_read (pull_data);
+}
+
+static void
+pull_read_cb (GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+  PullData *pull_data = (PullData *)user_data;
+
+  GError *err = NULL;
+  gsize bytes_read;
+
+  if (!afp_handle_read_finish (pull_data->afp_handle, res, &bytes_read, &err))
+  {
+    pull_failed (pull_data, err);
+    return;
+  }
+
+  if (bytes_read == 0)
+  {
+    g_output_stream_close_async (pull_data->stream, G_PRIORITY_DEFAULT,
+                                 G_VFS_JOB (pull_data->job)->cancellable,
+                                 pull_close_stream_cb, pull_data);
+    return;
+  }
+
+  pull_data->buffer_len = bytes_read;
+  pull_data->buffer_pos = 0;
+  g_output_stream_write_async (pull_data->stream, pull_data->buffer, bytes_read,
+                               G_PRIORITY_DEFAULT,
+                               G_VFS_JOB (pull_data->job)->cancellable,
+                               pull_write_cb, pull_data);
+}
+
+static void
+pull_read (PullData *pull_data)
+{
+  afp_handle_read (pull_data->afp_handle, pull_data->buffer, PULL_BUFFER_SIZE,
+                   G_VFS_JOB (pull_data->job)->cancellable,
+                   pull_read_cb, pull_data);
+}
+
+static void
+pull_create_local_cb (GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+  PullData *pull_data = (PullData *)user_data;
+
+  GError *err = NULL;
+  GFileOutputStream *stream;
+
+  if (pull_data->job->flags & G_FILE_COPY_OVERWRITE)
+    stream = g_file_replace_finish (pull_data->file, res, &err);
+  else
+    stream = g_file_create_finish (pull_data->file, res, &err);
+  if (!stream)
+  {
+    pull_failed (pull_data, err);
+    return;
+  }
+  pull_data->stream = G_OUTPUT_STREAM (stream);
+
+  /* The whole file is wanted, so don't wait for a second read to read ahead */
+  read_ahead_start (pull_data->afp_handle);
+  pull_read (pull_data);
+}
+
+static void
+pull_query_local_cb (GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+  PullData *pull_data = (PullData *)user_data;
+  GVfsJobPull *job = pull_data->job;
+
+  GError *err = NULL;
+  GFileInfo *info;
+
+  info = g_file_query_info_finish (pull_data->file, res, &err);
+  if (info)
+  {
+    pull_data->file_existed = TRUE;
+    g_object_unref (info);
+  }
+  else if (!g_error_matches (err, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+  {
+    pull_failed (pull_data, err);
+    return;
+  }
+  else
+    g_clear_error (&err);
+
+  g_file_replace_async (pull_data->file, NULL, FALSE,
+                        G_FILE_CREATE_REPLACE_DESTINATION, G_PRIORITY_DEFAULT,
+                        G_VFS_JOB (job)->cancellable,
+                        pull_create_local_cb, pull_data);
+}
+
+static void
+pull_open_fork_cb (GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+  GVfsAfpVolume *volume = G_VFS_AFP_VOLUME (source_object);
+  PullData *pull_data = (PullData *)user_data;
+  GVfsJobPull *job = pull_data->job;
+  GVfsBackendAfp *afp_backend = G_VFS_BACKEND_AFP (job->backend);
+
+  GError *err = NULL;
+  gint16 fork_refnum;
+  GFileInfo *info;
+
+  if (!g_vfs_afp_volume_open_fork_finish (volume, res, &fork_refnum, &info, &err))
+  {
+    /* Let the generic code deal with directories */
+    if (g_error_matches (err, G_IO_ERROR, G_IO_ERROR_IS_DIRECTORY))
+    {
+      g_clear_error (&err);
+      g_set_error_literal (&err, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                           _("Operation not supported"));
+    }
+    pull_failed (pull_data, err);
+    return;
+  }
+
+  pull_data->size = g_file_info_get_size (info);
+  g_object_unref (info);
+
+  pull_data->afp_handle = afp_handle_new (afp_backend, fork_refnum);
+  pull_data->afp_handle->type = AFP_HANDLE_TYPE_READ_FILE;
+
+  /* Whether a failed pull has to remove the local file depends on
+   * whether it was there before */
+  if (job->flags & G_FILE_COPY_OVERWRITE)
+    g_file_query_info_async (pull_data->file, G_FILE_ATTRIBUTE_STANDARD_TYPE,
+                             G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS, G_PRIORITY_DEFAULT,
+                             G_VFS_JOB (job)->cancellable,
+                             pull_query_local_cb, pull_data);
+  else
+    g_file_create_async (pull_data->file, G_FILE_CREATE_NONE, G_PRIORITY_DEFAULT,
+                         G_VFS_JOB (job)->cancellable,
+                         pull_create_local_cb, pull_data);
+}
+
+static void
+pull_get_filedir_parms_cb (GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+  GVfsAfpVolume *volume = G_VFS_AFP_VOLUME (source_object);
+  PullData *pull_data = (PullData *)user_data;
+  GVfsJobPull *job = pull_data->job;
+
+  GError *err = NULL;
+  GFileInfo *info;
+  gboolean regular;
+
+  info = g_vfs_afp_volume_get_filedir_parms_finish (volume, res, &err);
+  if (!info)
+  {
+    pull_failed (pull_data, err);
+    return;
+  }
+
+  regular = g_file_info_get_file_type (info) == G_FILE_TYPE_REGULAR;
+  if (g_file_info_has_attribute (info, G_FILE_ATTRIBUTE_UNIX_MODE) &&
+      S_ISLNK (g_file_info_get_attribute_uint32 (info, G_FILE_ATTRIBUTE_UNIX_MODE)))
+    regular = FALSE;
+  g_object_unref (info);
+
+  /* Let the generic code deal with directories and symlinks */
+  if (!regular)
+  {
+    g_set_error_literal (&err, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                         _("Operation not supported"));
+    pull_failed (pull_data, err);
+    return;
+  }
+
+  g_vfs_afp_volume_open_fork (volume, job->source,
+                              AFP_ACCESS_MODE_READ_BIT,
+                              AFP_FILE_BITMAP_EXT_DATA_FORK_LEN_BIT,
+                              G_VFS_JOB (job)->cancellable, pull_open_fork_cb,
+                              pull_data);
+}
+
+static gboolean
+try_pull (GVfsBackend *backend,
+          GVfsJobPull *job,
+          const char *source,
+          const char *local_path,
+          GFileCopyFlags flags,
+          gboolean remove_source,
+          GFileProgressCallback progress_callback,
+          gpointer progress_callback_data)
+{
+  GVfsBackendAfp *afp_backend = G_VFS_BACKEND_AFP (backend);
+
+  PullData *pull_data;
+  guint16 file_bitmap;
+
+  /* Fall back to the generic copy, which knows how to make backups */
+  if (flags & G_FILE_COPY_BACKUP)
+  {
+    g_vfs_job_failed_literal (G_VFS_JOB (job), G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                              _("Operation not supported"));
+    return TRUE;
+  }
+
+  pull_data = g_slice_new0 (PullData);
+  pull_data->job = job;
+  pull_data->file = g_file_new_for_path (local_path);
+  pull_data->buffer = g_malloc (PULL_BUFFER_SIZE);
+  pull_data->progress_callback = progress_callback;
+  pull_data->progress_callback_data = progress_callback_data;
+
+  /* Symlinks can only be told apart by the mode bits */
+  file_bitmap = 0;
+  if (g_vfs_afp_volume_get_attributes (afp_backend->volume) & AFP_VOLUME_ATTRIBUTES_BITMAP_SUPPORTS_UNIX_PRIVS)
+    file_bitmap |= AFP_FILE_BITMAP_UNIX_PRIVS_BIT;
+
+  g_vfs_afp_volume_get_filedir_parms (afp_backend->volume, source,
+                                      file_bitmap, 0,
+                                      G_VFS_JOB (job)->cancellable,
+                                      pull_get_filedir_parms_cb, pull_data);
+  return TRUE;
+}
 
-static AfpHandle *
-afp_handle_new (GVfsBackendAfp *backend, gint16 fork_refnum)
+typedef struct
 {
-  AfpHandle *afp_handle;
+  GVfsJobPush *job;
+  gint16 fork_refnum;
+  gboolean fork_open;
+  gboolean created;
+  GFile *file;
+  GInputStream *stream;
 
-  afp_handle = g_slice_new0 (AfpHandle);
-  afp_handle->backend = backend;
-  afp_handle->fork_refnum = fork_refnum;
+  char *buffer;
+  gsize buffer_len;
+  gsize buffer_pos;
 
-  return afp_handle;
-}
+  goffset size;
+  goffset transferred;
+  GFileProgressCallback progress_callback;
+  gpointer progress_callback_data;
+} PushData;
 
 static void
-afp_handle_free (AfpHandle *afp_handle)
+push_data_free (PushData *push_data)
 {
-  g_free (afp_handle->filename);
-  g_free (afp_handle->tmp_filename);
-  
-  g_slice_free (AfpHandle, afp_handle);
-}
+  GVfsBackendAfp *afp_backend = G_VFS_BACKEND_AFP (push_data->job->backend);
 
-/*
- * Backend code
- */
+  /* Only set if we bailed out early */
+  if (push_data->fork_open)
+    g_vfs_afp_volume_close_fork (afp_backend->volume, push_data->fork_refnum,
+                                 NULL, NULL, NULL);
+  if (push_data->stream)
+    g_object_unref (push_data->stream);
+  g_object_unref (push_data->file);
+  g_free (push_data->buffer);
 
-typedef struct
-{
-  GVfsJobCopy  *job;
-  GAsyncResult *source_parms_res;
-  GAsyncResult *dest_parms_res;
-} CopyData;
+  g_slice_free (PushData, push_data);
+}
 
 static void
-copy_data_free (CopyData *copy_data)
+push_failed (PushData *push_data, GError *err)
 {
-  g_object_unref (copy_data->source_parms_res);
-  g_object_unref (copy_data->dest_parms_res);
+  GVfsJobPush *job = push_data->job;
+  GVfsBackendAfp *afp_backend = G_VFS_BACKEND_AFP (job->backend);
+  gboolean created = push_data->created;
 
-  g_slice_free (CopyData, copy_data);
+  /* Closes the fork first, the server handles requests in order */
+  push_data_free (push_data);
+
+  /* Don't leave a truncated copy behind */
+  if (created)
+    g_vfs_afp_volume_delete (afp_backend->volume, job->destination,
+                             NULL, NULL, NULL);
+
+  g_vfs_job_failed_from_error (G_VFS_JOB (job), err);
+  g_error_free (err);
 }
 
+static void push_read (PushData *push_data);
+
 static void
-copy_copy_file_cb (GObject *source_object, GAsyncResult *res, gpointer user_data)
+push_delete_local_cb (GObject *source_object, GAsyncResult *res, gpointer user_data)
 {
-  GVfsAfpVolume *volume = G_VFS_AFP_VOLUME (source_object);
-  GVfsJobCopy *job = G_VFS_JOB_COPY (user_data);
+  PushData *push_data = (PushData *)user_data;
 
   GError *err = NULL;
-  
-  if (!g_vfs_afp_volume_copy_file_finish (volume, res, &err))
+
+  if (!g_file_delete_finish (push_data->file, res, &err))
   {
-    g_vfs_job_failed_from_error (G_VFS_JOB (job), err);
-    g_error_free (err);
+    push_failed (push_data, err);
     return;
   }
 
-  g_vfs_job_succeeded (G_VFS_JOB (job));
+  g_vfs_job_succeeded (G_VFS_JOB (push_data->job));
+  push_data_free (push_data);
 }
 
 static void
-copy_delete_cb (GObject *source_object, GAsyncResult *res, gpointer user_data)
+push_close_fork_cb (GObject *source_object, GAsyncResult *res, gpointer user_data)
 {
   GVfsAfpVolume *volume = G_VFS_AFP_VOLUME (source_object);
-  GVfsJobCopy *job = G_VFS_JOB_COPY (user_data);
-  GVfsBackendAfp *afp_backend = G_VFS_BACKEND_AFP (job->backend);
+  PushData *push_data = (PushData *)user_data;
+  GVfsJobPush *job = push_data->job;
 
   GError *err = NULL;
-  
-  if (!g_vfs_afp_volume_delete_finish (volume, res, &err))
+
+  if (!g_vfs_afp_volume_close_fork_finish (volume, res, &err))
   {
-    g_vfs_job_failed_from_error (G_VFS_JOB (job), err);
-    g_error_free (err);
+    push_failed (push_data, err);
     return;
   }
+  push_data->created = FALSE;
 
-  g_vfs_afp_volume_copy_file (afp_backend->volume, job->source, job->destination,
-                              G_VFS_JOB (job)->cancellable, copy_copy_file_cb, job);
+  if (job->remove_source)
+  {
+    /* Close the local file before removing it */
+    g_clear_object (&push_data->stream);
+    g_file_delete_async (push_data->file, G_PRIORITY_DEFAULT,
+                         G_VFS_JOB (job)->cancellable,
+                         push_delete_local_cb, push_data);
+    return;
+  }
+
+  g_vfs_job_succeeded (G_VFS_JOB (job));
+  push_data_free (push_data);
 }
 
 static void
-do_copy (CopyData *copy_data)
+push_write_fork (PushData *push_data);
+
+static void
+push_write_fork_cb (GObject *source_object, GAsyncResult *res, gpointer user_data)
 {
-  GVfsJobCopy *job = copy_data->job;
-  GVfsBackendAfp *afp_backend = G_VFS_BACKEND_AFP (job->backend);
-  
-  GFileInfo *info;
+  GVfsAfpVolume *volume = G_VFS_AFP_VOLUME (source_object);
+  PushData *push_data = (PushData *)user_data;
+
   GError *err = NULL;
+  gint64 last_written;
+  gsize written;
 
-  gboolean source_is_dir;
-  gboolean dest_exists;
-  gboolean dest_is_dir;
-  
-  info = g_vfs_afp_volume_get_filedir_parms_finish (afp_backend->volume, copy_data->source_parms_res, &err);
-  if (!info)
+  if (!g_vfs_afp_volume_write_to_fork_finish (volume, res, &last_written, &err))
   {
-    g_vfs_job_failed_from_error (G_VFS_JOB (job), err);
-    g_error_free (err);
-    goto done;
+    push_failed (push_data, err);
+    return;
   }
 
-  /* If the source is a directory, don't fail with WOULD_RECURSE immediately,
-   * as that is less useful to the app. Better check for errors on the
-   * target instead.
-   */
-  source_is_dir = g_file_info_get_file_type (info) == G_FILE_TYPE_DIRECTORY ? TRUE : FALSE;
-  g_object_unref (info);
-
-  info = g_vfs_afp_volume_get_filedir_parms_finish (afp_backend->volume, copy_data->dest_parms_res, &err);
-  if (!info)
+  if (last_written <= push_data->transferred)
   {
-    if (g_error_matches (err, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
-    {
-      g_clear_error (&err);
-      dest_exists = FALSE;
-    }
-    else
-    {
-      g_vfs_job_failed_from_error (G_VFS_JOB (job), err);
-      g_error_free (err);
-      goto done;
-    }
+    g_set_error_literal (&err, G_IO_ERROR, G_IO_ERROR_FAILED,
+                         _("Server wrote less data than requested"));
+    push_failed (push_data, err);
+    return;
   }
+
+  written = last_written - push_data->transferred;
+  push_data->buffer_pos += written;
+  push_data->transferred = last_written;
+  if (push_data->progress_callback)
+    push_data->progress_callback (push_data->transferred, push_data->size,
+                                  push_data->progress_callback_data);
+
+  /* The server may accept less than we gave it */
+  if (push_data->buffer_pos < push_data->buffer_len)
+    push_write_fork (push_data);
   else
-  {
-    dest_exists = TRUE;
-    dest_is_dir = g_file_info_get_file_type (info) == G_FILE_TYPE_DIRECTORY ? TRUE : FALSE;
-    g_object_unref (info);
-  }
+    push_read (push_data);
+}
 
-  /* Check target errors */
-  if (dest_exists)
+static void
+push_write_fork (PushData *push_data)
+{
+  GVfsBackendAfp *afp_backend = G_VFS_BACKEND_AFP (push_data->job->backend);
+
+  g_vfs_afp_volume_write_to_fork (afp_backend->volume, push_data->fork_refnum,
+                                  push_data->buffer + push_data->buffer_pos,
+                                  push_data->buffer_len - push_data->buffer_pos,
+                                  push_data->transferred,
+                                  G_VFS_JOB (push_data->job)->cancellable,
+                                  push_write_fork_cb, push_data);
+}
+
+static void
+push_read_cb (GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+  PushData *push_data = (PushData *)user_data;
+  GVfsBackendAfp *afp_backend = G_VFS_BACKEND_AFP (push_data->job->backend);
+
+  GError *err = NULL;
+  gssize bytes_read;
+
+  bytes_read = g_input_stream_read_finish (push_data->stream, res, &err);
+  if (bytes_read < 0)
   {
-    if ((job->flags & G_FILE_COPY_OVERWRITE))
-    {
-      /* Always fail on dirs, even with overwrite */
-      if (dest_is_dir)
-      {
-        if (source_is_dir)
-          g_vfs_job_failed_literal (G_VFS_JOB (job), G_IO_ERROR, G_IO_ERROR_WOULD_MERGE,
-                                    _("Can't copy directory over directory"));
-        else
-          g_vfs_job_failed_literal (G_VFS_JOB (job), G_IO_ERROR, G_IO_ERROR_IS_DIRECTORY,
-                                    _("File is directory"));
-        goto done;
-      }
-    }
-    else
-    {
-      g_vfs_job_failed (G_VFS_JOB (job), G_IO_ERROR, G_IO_ERROR_EXISTS,
-                        _("Target file already exists"));
-      goto done;
-    }
+    push_failed (push_data, err);
+    return;
   }
 
-  /* Now we fail if the source is a directory */
-  if (source_is_dir)
+  if (bytes_read == 0)
   {
-    g_vfs_job_failed (G_VFS_JOB (job), G_IO_ERROR, G_IO_ERROR_WOULD_RECURSE,
-                      _("Can't recursively copy directory"));
-    goto done;
+    push_data->fork_open = FALSE;
+    g_vfs_afp_volume_close_fork (afp_backend->volume, push_data->fork_refnum,
+                                 G_VFS_JOB (push_data->job)->cancellable,
+                                 push_close_fork_cb, push_data);
+    return;
   }
 
-  if (dest_exists)
+  push_data->buffer_len = bytes_read;
+  push_data->buffer_pos = 0;
+  push_write_fork (push_data);
+}
+
+static void
+push_read (PushData *push_data)
+{
+  g_input_stream_read_async (push_data->stream, push_data->buffer,
+                             PUSH_BUFFER_SIZE, G_PRIORITY_DEFAULT,
+                             G_VFS_JOB (push_data->job)->cancellable,
+                             push_read_cb, push_data);
+}
+
+static void
+push_open_fork_cb (GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+  GVfsAfpVolume *volume = G_VFS_AFP_VOLUME (source_object);
+  PushData *push_data = (PushData *)user_data;
+
+  GError *err = NULL;
+
+  if (!g_vfs_afp_volume_open_fork_finish (volume, res, &push_data->fork_refnum,
+                                          NULL, &err))
   {
-    g_vfs_afp_volume_delete (afp_backend->volume, job->destination,
-                             G_VFS_JOB (job)->cancellable, copy_delete_cb, job);
+    push_failed (push_data, err);
+    return;
   }
-  else
+  push_data->fork_open = TRUE;
+
+  push_read (push_data);
+}
+
+static void
+push_create_cb (GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+  GVfsAfpVolume *volume = G_VFS_AFP_VOLUME (source_object);
+  PushData *push_data = (PushData *)user_data;
+  GVfsJobPush *job = push_data->job;
+
+  GError *err = NULL;
+
+  if (!g_vfs_afp_volume_create_file_finish (volume, res, &err))
   {
-    g_vfs_afp_volume_copy_file (afp_backend->volume, job->source, job->destination,
-                                G_VFS_JOB (job)->cancellable, copy_copy_file_cb, job);
+    push_failed (push_data, err);
+    return;
   }
-  
-done:
-  copy_data_free (copy_data);
-  return;
+  push_data->created = TRUE;
+
+  g_vfs_afp_volume_open_fork (volume, job->destination, AFP_ACCESS_MODE_WRITE_BIT, 0,
+                              G_VFS_JOB (job)->cancellable, push_open_fork_cb,
+                              push_data);
 }
 
 static void
-copy_get_dest_parms_cb (GObject *source_object, GAsyncResult *res, gpointer user_data)
+push_read_local_cb (GObject *source_object, GAsyncResult *res, gpointer user_data)
 {
-  CopyData *copy_data = (CopyData *)user_data;
-  
-  copy_data->dest_parms_res = g_object_ref (res);
-  if (copy_data->source_parms_res)
-    do_copy (copy_data);
+  PushData *push_data = (PushData *)user_data;
+  GVfsJobPush *job = push_data->job;
+  GVfsBackendAfp *afp_backend = G_VFS_BACKEND_AFP (job->backend);
+
+  GError *err = NULL;
+  GFileInputStream *stream;
+
+  stream = g_file_read_finish (push_data->file, res, &err);
+  if (!stream)
+  {
+    push_failed (push_data, err);
+    return;
+  }
+  push_data->stream = G_INPUT_STREAM (stream);
+
+  g_vfs_afp_volume_create_file (afp_backend->volume, job->destination,
+                                (job->flags & G_FILE_COPY_OVERWRITE) ? TRUE : FALSE,
+                                G_VFS_JOB (job)->cancellable, push_create_cb,
+                                push_data);
 }
 
 static void
-copy_get_source_parms_cb (GObject *source_object, GAsyncResult *res, gpointer user_data)
+push_query_info_cb (GObject *source_object, GAsyncResult *res, gpointer user_data)
 {
-  CopyData *copy_data = (CopyData *)user_data;
+  PushData *push_data = (PushData *)user_data;
 
-  copy_data->source_parms_res = g_object_ref (res);
-  if (copy_data->dest_parms_res)
-    do_copy (copy_data);
+  GError *err = NULL;
+  GFileInfo *info;
+  GFileType type;
+
+  info = g_file_query_info_finish (push_data->file, res, &err);
+  if (!info)
+  {
+    push_failed (push_data, err);
+    return;
+  }
+
+  type = g_file_info_get_file_type (info);
+  push_data->size = g_file_info_get_size (info);
+  g_object_unref (info);
+
+  /* Let the generic code deal with directories and symlinks */
+  if (type != G_FILE_TYPE_REGULAR)
+  {
+    g_set_error_literal (&err, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                         _("Operation not supported"));
+    push_failed (push_data, err);
+    return;
+  }
+
+  g_file_read_async (push_data->file, G_PRIORITY_DEFAULT,
+                     G_VFS_JOB (push_data->job)->cancellable,
+                     push_read_local_cb, push_data);
 }
 
 static gboolean
-try_copy (GVfsBackend *backend,
-          GVfsJobCopy *job,
-          const char *source,
+try_push (GVfsBackend *backend,
+          GVfsJobPush *job,
           const char *destination,
+          const char *local_path,
           GFileCopyFlags flags,
+          gboolean remove_source,
           GFileProgressCallback progress_callback,
           gpointer progress_callback_data)
 {
-  GVfsBackendAfp *afp_backend = G_VFS_BACKEND_AFP (backend);
+  PushData *push_data;
 
-  CopyData *copy_data;
-
-  copy_data = g_slice_new0 (CopyData);
-  copy_data->job = job;
-
-  g_vfs_afp_volume_get_filedir_parms (afp_backend->volume, source,
-                                      AFP_FILEDIR_BITMAP_ATTRIBUTE_BIT,
-                                      AFP_FILEDIR_BITMAP_ATTRIBUTE_BIT,
-                                      G_VFS_JOB (job)->cancellable, copy_get_source_parms_cb,
-                                      copy_data);
+  /* Fall back to the generic copy, which knows how to make backups */
+  if (flags & G_FILE_COPY_BACKUP)
+  {
+    g_vfs_job_failed_literal (G_VFS_JOB (job), G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                              _("Operation not supported"));
+    return TRUE;
+  }
 
-  g_vfs_afp_volume_get_filedir_parms (afp_backend->volume, destination,
-                                      AFP_FILEDIR_BITMAP_ATTRIBUTE_BIT,
-                                      AFP_FILEDIR_BITMAP_ATTRIBUTE_BIT,
-                                      G_VFS_JOB (job)->cancellable, copy_get_dest_parms_cb,
-                                      copy_data);
+  push_data = g_slice_new0 (PushData);
+  push_data->job = job;
+  push_data->file = g_file_new_for_path (local_path);
+  push_data->buffer = g_malloc (PUSH_BUFFER_SIZE);
+  push_data->progress_callback = progress_callback;
+  push_data->progress_callback_data = progress_callback_data;
 
+  g_file_query_info_async (push_data->file,
+                           G_FILE_ATTRIBUTE_STANDARD_TYPE ","
+                           G_FILE_ATTRIBUTE_STANDARD_SIZE,
+                           G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                           G_PRIORITY_DEFAULT, G_VFS_JOB (job)->cancellable,
+                           push_query_info_cb, push_data);
   return TRUE;
 }
 
@@ -855,21 +2018,19 @@ try_seek_on_read (GVfsBackend *backend,
 static void
 read_cb (GObject *source_object, GAsyncResult *res, gpointer user_data)
 {
-  GVfsAfpVolume *volume = G_VFS_AFP_VOLUME (source_object);
   GVfsJobRead *job = G_VFS_JOB_READ (user_data);
   AfpHandle *afp_handle = (AfpHandle *)job->handle;
 
   GError *err = NULL;
   gsize bytes_read;
 
-  if (!g_vfs_afp_volume_read_from_fork_finish (volume, res, &bytes_read, &err))
+  if (!afp_handle_read_finish (afp_handle, res, &bytes_read, &err))
   {
     g_vfs_job_failed_from_error (G_VFS_JOB (job), err);
     g_error_free (err);
     return;
   }
 
-  afp_handle->offset += bytes_read;
   g_vfs_job_read_set_size (job, bytes_read);
   
   g_vfs_job_succeeded (G_VFS_JOB (job));
@@ -882,12 +2043,10 @@ try_read (GVfsBackend *backend,
           char *buffer,
           gsize bytes_requested)
 {
-  GVfsBackendAfp *afp_backend = G_VFS_BACKEND_AFP (backend);
   AfpHandle *afp_handle = (AfpHandle *)handle;
 
-  g_vfs_afp_volume_read_from_fork (afp_backend->volume, afp_handle->fork_refnum,
-                                   buffer, bytes_requested, afp_handle->offset,
-                                   G_VFS_JOB (job)->cancellable, read_cb, job);
+  afp_handle_read (afp_handle, buffer, bytes_requested,
+                   G_VFS_JOB (job)->cancellable, read_cb, job);
   return TRUE;
 }
 
@@ -1007,10 +2166,8 @@ close_fork (GVfsAfpVolume  *volume,
             GVfsJob        *job,
             AfpHandle      *afp_handle)
 {
-  g_vfs_afp_volume_close_fork (volume, afp_handle->fork_refnum,
-                               G_VFS_JOB (job)->cancellable,
-                               close_fork_cb, job);
-  afp_handle_free (afp_handle);
+  afp_handle_close (afp_handle, G_VFS_JOB (job)->cancellable,
+                    close_fork_cb, job);
 }
 
 static void
@@ -2184,6 +3341,8 @@ g_vfs_backend_afp_class_init (GVfsBackendAfpClass *klass)
   backend_class->try_set_display_name = try_set_display_name;
   backend_class->try_move = try_move;
   backend_class->try_copy = try_copy;
+  backend_class->try_pull = try_pull;
+  backend_class->try_push = try_push;
 }
 
 void
@@ -1199,6 +1199,7 @@ do_enumerate (GVfsBackend *backend,
       g_vfs_job_enumerate_add_info (job, matched_info);
       g_object_unref (matched_info);
       g_object_unref (walk->data);
+      g_vfs_job_enumerate_wait_for_client (job);
     }
   g_vfs_job_enumerate_done (job);
 
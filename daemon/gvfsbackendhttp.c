@@ -28,6 +28,7 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <string.h>
+#include <stdlib.h>
 
 #include <glib/gstdio.h>
 #include <glib/gi18n.h>
@@ -78,10 +79,19 @@ g_vfs_backend_http_finalize (GObject *object)
 
 #define DEBUG_MAX_BODY_SIZE (100 * 1024 * 1024)
 
+/* Number of parallel keep-alive connections we allow per host
+ * (libsoup defaults to 2), overridable with GVFS_HTTP_MAX_CONNECTIONS
+ * up to the limit. The total over all hosts is libsoup's default, or
+ * the per host number if that is larger */
+#define HTTP_DEFAULT_MAX_CONNS_PER_HOST 4
+#define HTTP_MAX_CONNS_PER_HOST_LIMIT   32
+#define HTTP_DEFAULT_MAX_CONNS          10
+
 static void
 g_vfs_backend_http_init (GVfsBackendHttp *backend)
 {
   const char         *debug;
+  const char         *max_conns;
   SoupSessionFeature *proxy_resolver;
   SoupSessionFeature *cookie_jar;
   SoupSessionFeature *content_decoder;
@@ -98,6 +108,17 @@ g_vfs_backend_http_init (GVfsBackendHttp *backend)
   /* SoupRequester seems to depend on use-thread-context */
   g_object_set (G_OBJECT (backend->session_async), "use-thread-context", TRUE, NULL);
 
+  /* Connection pool; idle connections are never timed out so that
+   * subsequent requests can reuse a warm keep-alive connection */
+  g_object_set (backend->session, "idle-timeout", 0, NULL);
+  g_object_set (backend->session_async, "idle-timeout", 0, NULL);
+  max_conns = g_getenv ("GVFS_HTTP_MAX_CONNECTIONS");
+  if (max_conns != NULL && atoi (max_conns) > 0)
+    http_backend_set_max_connections (G_VFS_BACKEND (backend), atoi (max_conns));
+  else
+    http_backend_set_max_connections (G_VFS_BACKEND (backend),
+                                      HTTP_DEFAULT_MAX_CONNS_PER_HOST);
+
   /* Proxy handling */
   proxy_resolver = g_object_new (SOUP_TYPE_PROXY_RESOLVER_GNOME, NULL);
   soup_session_add_feature (backend->session, proxy_resolver);
@@ -283,6 +304,26 @@ http_backend_queue_message (GVfsBackend         *backend,
   soup_session_queue_message (op_backend->session_async, msg, 
                               callback, user_data);
 }
+
+/* Sets the size of the per-host connection pool of both sessions, i.e.
+ * the number of requests that may be in flight to the server at once */
+void
+http_backend_set_max_connections (GVfsBackend *backend,
+                                  guint        max_conns)
+{
+  GVfsBackendHttp *op_backend = G_VFS_BACKEND_HTTP (backend);
+
+  max_conns = CLAMP (max_conns, 1, HTTP_MAX_CONNS_PER_HOST_LIMIT);
+
+  g_object_set (op_backend->session,
+                "max-conns-per-host", max_conns,
+                "max-conns", MAX (max_conns, HTTP_DEFAULT_MAX_CONNS),
+                NULL);
+  g_object_set (op_backend->session_async,
+                "max-conns-per-host", max_conns,
+                "max-conns", MAX (max_conns, HTTP_DEFAULT_MAX_CONNS),
+                NULL);
+}
 /* ************************************************************************* */
 /* virtual functions overrides */
 
@@ -73,6 +73,9 @@ void          http_backend_queue_message     (GVfsBackend         *backend,
                                               SoupSessionCallback  callback,
                                               gpointer             user_data);
 
+void          http_backend_set_max_connections (GVfsBackend       *backend,
+                                                guint              max_conns);
+
 void          http_backend_open_for_read     (GVfsBackend         *backend,
 					      GVfsJob             *job,
 					      SoupURI             *uri);
@@ -47,6 +47,9 @@
 #include "gvfsjobqueryfsinfo.h"
 #include "gvfsjobqueryattributes.h"
 #include "gvfsjobenumerate.h"
+#include "gvfsjobcopy.h"
+#include "gvfsjobpull.h"
+#include "gvfsjobpush.h"
 #include "gvfsdaemonprotocol.h"
 #include "gvfskeyring.h"
 
@@ -62,6 +65,37 @@
 #define DEBUG(...)
 #endif
 
+/* How long stat results gathered by enumerate are used by query_info */
+#define STAT_CACHE_EXPIRATION_TIME 10 /* in seconds */
+
+/* Maximum number of libsmbclient contexts, i.e. connections to the
+   server, per mount. Keep in sync with MAX_JOB_THREADS. */
+#define MAX_SMB_CONTEXTS 4
+
+typedef struct _SmbContext SmbContext;
+
+/* libsmbclient contexts are not thread safe, each one is only used
+   by one job at a time (guarded by lock). dying is set when unmount
+   takes the context out of the pool, smb_context is NULL once it was
+   shut down, the struct lives on until the last user is gone. */
+struct _SmbContext
+{
+  GVfsBackendSmb *backend;
+  SMBCCTX *smb_context;
+  GMutex lock;
+  volatile gint dying;
+
+  /* Number of jobs and open files using this context */
+  int users;
+
+  /* Cache */
+  char *cached_server_name;
+  char *cached_share_name;
+  char *cached_domain;
+  char *cached_username;
+  SMBCSRV *cached_server;
+};
+
 struct _GVfsBackendSmb
 {
   GVfsBackend parent_instance;
@@ -73,8 +107,13 @@ struct _GVfsBackendSmb
   char *path;
   char *default_workgroup;
   
-  SMBCCTX *smb_context;
+  GMutex contexts_lock;
+  GPtrArray *contexts;
+  gboolean unmounting; /* No new contexts, guarded by contexts_lock */
 
+  /* Credentials that worked, reused by the auth callback of all
+     contexts, guarded by auth_lock */
+  GMutex auth_lock;
   char *last_user;
   char *last_domain;
   char *last_password;
@@ -86,15 +125,17 @@ struct _GVfsBackendSmb
 	
   gboolean password_in_keyring;
   GPasswordSave password_save;
-  
-  /* Cache */
-  char *cached_server_name;
-  char *cached_share_name;
-  char *cached_domain;
-  char *cached_username;
-  SMBCSRV *cached_server;
+
+  /* uri -> CachedStat, filled from directory listings */
+  GMutex stat_cache_lock;
+  GHashTable *stat_cache;
 };
 
+typedef struct {
+  struct stat st;
+  time_t stamp;
+} CachedStat;
+
 
 G_DEFINE_TYPE (GVfsBackendSmb, g_vfs_backend_smb, G_VFS_TYPE_BACKEND)
 
@@ -103,6 +144,7 @@ static void set_info_from_stat (GVfsBackendSmb *backend,
 				struct stat *statbuf,
 				const char *basename,
 				GFileAttributeMatcher *matcher);
+static void smb_context_free (SmbContext *context);
 
 
 static void
@@ -118,6 +160,15 @@ g_vfs_backend_smb_finalize (GObject *object)
   g_free (backend->domain);
   g_free (backend->path);
   g_free (backend->default_workgroup);
+  g_hash_table_destroy (backend->stat_cache);
+  g_mutex_clear (&backend->stat_cache_lock);
+  g_ptr_array_foreach (backend->contexts, (GFunc) smb_context_free, NULL);
+  g_ptr_array_free (backend->contexts, TRUE);
+  g_mutex_clear (&backend->contexts_lock);
+  g_free (backend->last_user);
+  g_free (backend->last_domain);
+  g_free (backend->last_password);
+  g_mutex_clear (&backend->auth_lock);
   
   if (G_OBJECT_CLASS (g_vfs_backend_smb_parent_class)->finalize)
     (*G_OBJECT_CLASS (g_vfs_backend_smb_parent_class)->finalize) (object);
@@ -140,6 +191,15 @@ g_vfs_backend_smb_init (GVfsBackendSmb *backend)
 
   g_object_unref (settings);
 
+  backend->stat_cache = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                               g_free, g_free);
+  g_mutex_init (&backend->stat_cache_lock);
+
+  /* Not owning, contexts shut down by unmount are freed by their last user */
+  backend->contexts = g_ptr_array_new ();
+  g_mutex_init (&backend->contexts_lock);
+  g_mutex_init (&backend->auth_lock);
+
   DEBUG ("g_vfs_backend_smb_init: default workgroup = '%s'\n", backend->default_workgroup ? backend->default_workgroup : "NULL");
 }
 
@@ -173,11 +233,13 @@ auth_callback (SMBCCTX *context,
 	       char *username_out, int unmaxlen,
 	       char *password_out, int pwmaxlen)
 {
+  SmbContext *data;
   GVfsBackendSmb *backend;
   char *ask_password, *ask_user, *ask_domain;
   gboolean handled, abort;
 
-  backend = smbc_getOptionUserData (context);
+  data = smbc_getOptionUserData (context);
+  backend = data->backend;
 
   strncpy (password_out, "", pwmaxlen);
   
@@ -198,12 +260,14 @@ auth_callback (SMBCCTX *context,
   if (backend->mount_source == NULL)
     {
       /* Not during mount, use last password */
+      g_mutex_lock (&backend->auth_lock);
       if (backend->last_user)
 	strncpy (username_out, backend->last_user, unmaxlen);
       if (backend->last_domain)
 	strncpy (domain_out, backend->last_domain, domainmaxlen);
       if (backend->last_password)
 	strncpy (password_out, backend->last_password, pwmaxlen);
+      g_mutex_unlock (&backend->auth_lock);
       
       return;
     }
@@ -298,11 +362,16 @@ auth_callback (SMBCCTX *context,
       g_free (ask_domain);
     }
 
+  g_mutex_lock (&backend->auth_lock);
+  g_free (backend->last_user);
+  g_free (backend->last_domain);
+  g_free (backend->last_password);
   backend->last_user = g_strdup (username_out);
   backend->last_domain = g_strdup (domain_out);
   backend->last_password = g_strdup (password_out);
+  g_mutex_unlock (&backend->auth_lock);
   DEBUG ("auth_callback - out: last_user = '%s', last_domain = '%s'\n",
-         backend->last_user, backend->last_domain);
+         username_out, domain_out);
 }
 
 /* Add a server to the cache system
@@ -321,18 +390,18 @@ add_cached_server (SMBCCTX *context, SMBCSRV *new,
 		   const char *server_name, const char *share_name, 
 		   const char *domain, const char *username)
 {
-  GVfsBackendSmb *backend;
+  SmbContext *data;
 
-  backend = smbc_getOptionUserData (context);
+  data = smbc_getOptionUserData (context);
   
-  if (backend->cached_server != NULL)
+  if (data->cached_server != NULL)
     return 1;
 
-  backend->cached_server_name = g_strdup (server_name);
-  backend->cached_share_name = g_strdup (share_name);
-  backend->cached_domain = g_strdup (domain);
-  backend->cached_username = g_strdup (username);
-  backend->cached_server = new;
+  data->cached_server_name = g_strdup (server_name);
+  data->cached_share_name = g_strdup (share_name);
+  data->cached_domain = g_strdup (domain);
+  data->cached_username = g_strdup (username);
+  data->cached_server = new;
 
   return 0;
 }
@@ -347,21 +416,21 @@ add_cached_server (SMBCCTX *context, SMBCSRV *new,
 static int
 remove_cached_server(SMBCCTX * context, SMBCSRV * server)
 {
-  GVfsBackendSmb *backend;
+  SmbContext *data;
 
-  backend = smbc_getOptionUserData (context);
+  data = smbc_getOptionUserData (context);
   
-  if (backend->cached_server == server)
-    {
-      g_free (backend->cached_server_name);
-      backend->cached_server_name = NULL;
-      g_free (backend->cached_share_name);
-      backend->cached_share_name = NULL;
-      g_free (backend->cached_domain);
-      backend->cached_domain = NULL;
-      g_free (backend->cached_username);
-      backend->cached_username = NULL;
-      backend->cached_server = NULL;
+  if (data->cached_server == server)
+    {
+      g_free (data->cached_server_name);
+      data->cached_server_name = NULL;
+      g_free (data->cached_share_name);
+      data->cached_share_name = NULL;
+      g_free (data->cached_domain);
+      data->cached_domain = NULL;
+      g_free (data->cached_username);
+      data->cached_username = NULL;
+      data->cached_server = NULL;
       return 0;
     }
   return 1;
@@ -383,16 +452,16 @@ get_cached_server (SMBCCTX * context,
 		   const char *server_name, const char *share_name,
 		   const char *domain, const char *username)
 {
-  GVfsBackendSmb *backend;
+  SmbContext *data;
 
-  backend = smbc_getOptionUserData (context);
+  data = smbc_getOptionUserData (context);
 
-  if (backend->cached_server != NULL &&
-      strcmp (backend->cached_server_name, server_name) == 0 &&
-      strcmp (backend->cached_share_name, share_name) == 0 &&
-      strcmp (backend->cached_domain, domain) == 0 &&
-      strcmp (backend->cached_username, username) == 0)
-    return backend->cached_server;
+  if (data->cached_server != NULL &&
+      strcmp (data->cached_server_name, server_name) == 0 &&
+      strcmp (data->cached_share_name, share_name) == 0 &&
+      strcmp (data->cached_domain, domain) == 0 &&
+      strcmp (data->cached_username, username) == 0)
+    return data->cached_server;
 
   return NULL;
 }
@@ -407,16 +476,239 @@ get_cached_server (SMBCCTX * context,
 static int
 purge_cached (SMBCCTX * context)
 {
-  GVfsBackendSmb *backend;
+  SmbContext *data;
   
-  backend = smbc_getOptionUserData (context);
+  data = smbc_getOptionUserData (context);
 
-  if (backend->cached_server)
-    remove_cached_server(context, backend->cached_server);
+  if (data->cached_server)
+    remove_cached_server(context, data->cached_server);
   
   return 0;
 }
 
+/* Creates a new libsmbclient context for backend. Contexts created after
+ * the mount succeeded inherit the authentication options of the first one
+ * and get their credentials from the auth callback (last_user etc.) */
+static SmbContext *
+smb_context_new (GVfsBackendSmb *backend)
+{
+  SmbContext *context;
+  SMBCCTX *smb_context;
+  const char *debug;
+  int debug_val;
+
+  smb_context = smbc_new_context ();
+  if (smb_context == NULL)
+    return NULL;
+
+  context = g_new0 (SmbContext, 1);
+  context->backend = backend;
+  context->smb_context = smb_context;
+  g_mutex_init (&context->lock);
+
+  smbc_setOptionUserData (smb_context, context);
+
+  debug = g_getenv ("GVFS_SMB_DEBUG");
+  if (debug)
+    debug_val = atoi (debug);
+  else
+    debug_val = 0;
+
+  smbc_setDebug (smb_context, debug_val);
+  smbc_setFunctionAuthDataWithContext (smb_context, auth_callback);
+  
+  smbc_setFunctionAddCachedServer (smb_context, add_cached_server);
+  smbc_setFunctionGetCachedServer (smb_context, get_cached_server);
+  smbc_setFunctionRemoveCachedServer (smb_context, remove_cached_server);
+  smbc_setFunctionPurgeCachedServers (smb_context, purge_cached);
+
+  /* FIXME: is strdup() still needed here? -- removed */
+  if (backend->default_workgroup != NULL)
+    smbc_setWorkgroup (smb_context, backend->default_workgroup);
+
+#ifndef DEPRECATED_SMBC_INTERFACE
+  smb_context->flags = 0;
+#endif
+  
+  /* Initial settings:
+   *   - use Kerberos (always)
+   *   - in case of no username specified, try anonymous login
+   */
+  smbc_setOptionUseKerberos (smb_context, 1);
+  if (backend->contexts->len > 0)
+    {
+      SMBCCTX *first = ((SmbContext *) g_ptr_array_index (backend->contexts, 0))->smb_context;
+
+      smbc_setOptionFallbackAfterKerberos (smb_context,
+                                           smbc_getOptionFallbackAfterKerberos (first));
+      smbc_setOptionNoAutoAnonymousLogin (smb_context,
+                                          smbc_getOptionNoAutoAnonymousLogin (first));
+    }
+  else
+    {
+      smbc_setOptionFallbackAfterKerberos (smb_context,
+                                           backend->user != NULL);
+      smbc_setOptionNoAutoAnonymousLogin (smb_context,
+                                          backend->user != NULL);
+    }
+
+  
+#if 0
+  smbc_setOptionDebugToStderr (smb_context, 1);
+#endif
+  
+  if (!smbc_init_context (smb_context))
+    {
+      smbc_free_context (smb_context, FALSE);
+      g_mutex_clear (&context->lock);
+      g_free (context);
+      return NULL;
+    }
+
+  return context;
+}
+
+static void
+smb_context_free (SmbContext *context)
+{
+  if (context->smb_context)
+    smbc_free_context (context->smb_context, TRUE);
+  g_free (context->cached_server_name);
+  g_free (context->cached_share_name);
+  g_free (context->cached_domain);
+  g_free (context->cached_username);
+  g_mutex_clear (&context->lock);
+  g_free (context);
+}
+
+/* Takes a reference on an idle context, creating a new one while the
+ * pool is not full. Otherwise the least used context is shared.
+ * Returns NULL if there is none and none can be created, or if the
+ * backend is being unmounted (unmounting is set then). */
+static SmbContext *
+smb_context_ref (GVfsBackendSmb *backend,
+                 gboolean *unmounting)
+{
+  SmbContext *context, *best;
+  guint i;
+
+  g_mutex_lock (&backend->contexts_lock);
+
+  *unmounting = backend->unmounting;
+  if (backend->unmounting)
+    {
+      g_mutex_unlock (&backend->contexts_lock);
+      return NULL;
+    }
+
+  best = NULL;
+  for (i = 0; i < backend->contexts->len; i++)
+    {
+      context = g_ptr_array_index (backend->contexts, i);
+      if (best == NULL || context->users < best->users)
+        best = context;
+    }
+
+  if ((best == NULL || best->users > 0) &&
+      backend->contexts->len < MAX_SMB_CONTEXTS)
+    {
+      context = smb_context_new (backend);
+      if (context != NULL)
+        {
+          g_ptr_array_add (backend->contexts, context);
+          best = context;
+        }
+    }
+
+  if (best != NULL)
+    best->users++;
+
+  g_mutex_unlock (&backend->contexts_lock);
+
+  return best;
+}
+
+static void
+smb_context_unref (GVfsBackendSmb *backend,
+                   SmbContext *context)
+{
+  g_mutex_lock (&backend->contexts_lock);
+  context->users--;
+  /* Shut down by unmount and no longer in the pool */
+  if (context->users == 0 && context->smb_context == NULL)
+    smb_context_free (context);
+  g_mutex_unlock (&backend->contexts_lock);
+}
+
+/* Gets a context for exclusive use by the calling job, or fails the
+ * job and returns NULL */
+static SmbContext *
+smb_context_acquire (GVfsBackendSmb *backend,
+                     GVfsJob *job)
+{
+  SmbContext *context;
+  gboolean unmounting;
+
+  context = smb_context_ref (backend, &unmounting);
+  if (context == NULL)
+    {
+      if (unmounting)
+        g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_NOT_MOUNTED,
+                          _("The specified location is not mounted"));
+      else
+        g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_FAILED,
+                          _("Internal Error (%s)"), "Failed to allocate smb context");
+      return NULL;
+    }
+
+  g_mutex_lock (&context->lock);
+  if (context->smb_context == NULL)
+    {
+      /* Unmounted while we were waiting */
+      g_mutex_unlock (&context->lock);
+      smb_context_unref (backend, context);
+      g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_NOT_MOUNTED,
+                        _("The specified location is not mounted"));
+      return NULL;
+    }
+
+  return context;
+}
+
+/* Locks the context an open file belongs to, failing the job if the
+ * mount went away underneath it */
+static gboolean
+smb_context_lock_for_handle (SmbContext *context,
+                             GVfsJob *job)
+{
+  g_mutex_lock (&context->lock);
+  if (context->smb_context == NULL)
+    {
+      g_mutex_unlock (&context->lock);
+      g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_CLOSED,
+                        _("The file was closed by unmounting"));
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static void
+smb_context_release (GVfsBackendSmb *backend,
+                     SmbContext *context)
+{
+  g_mutex_unlock (&context->lock);
+  smb_context_unref (backend, context);
+}
+
+/* Long transfers check this between chunks and give up, so that
+ * unmount doesn't have to wait for them to finish */
+static gboolean
+smb_context_is_dying (SmbContext *context)
+{
+  return g_atomic_int_get (&context->dying);
+}
+
 #define SUB_DELIM_CHARS  "!$&'()*+,;="
 
 static gboolean
@@ -492,6 +784,88 @@ create_smb_uri (const char *server,
   return g_string_free (uri, FALSE);
 }
 
+static void
+stat_cache_add (GVfsBackendSmb *backend,
+		const char *uri,
+		struct stat *st)
+{
+  CachedStat *cached;
+
+  cached = g_new (CachedStat, 1);
+  cached->st = *st;
+  cached->stamp = time (NULL);
+
+  g_mutex_lock (&backend->stat_cache_lock);
+  g_hash_table_replace (backend->stat_cache, g_strdup (uri), cached);
+  g_mutex_unlock (&backend->stat_cache_lock);
+}
+
+static gboolean
+stat_cache_lookup (GVfsBackendSmb *backend,
+		   const char *uri,
+		   struct stat *st)
+{
+  CachedStat *cached;
+  gboolean found;
+  time_t now;
+
+  g_mutex_lock (&backend->stat_cache_lock);
+
+  found = FALSE;
+  cached = g_hash_table_lookup (backend->stat_cache, uri);
+  if (cached != NULL)
+    {
+      now = time (NULL);
+      if (now < cached->stamp ||
+          (now - cached->stamp) > STAT_CACHE_EXPIRATION_TIME)
+        g_hash_table_remove (backend->stat_cache, uri);
+      else
+        {
+          *st = cached->st;
+          found = TRUE;
+        }
+    }
+
+  g_mutex_unlock (&backend->stat_cache_lock);
+
+  return found;
+}
+
+static gboolean
+stat_cache_entry_expired (gpointer key,
+			  gpointer value,
+			  gpointer user_data)
+{
+  CachedStat *cached = value;
+  time_t now = *(time_t *)user_data;
+
+  return now < cached->stamp ||
+    (now - cached->stamp) > STAT_CACHE_EXPIRATION_TIME;
+}
+
+static void
+stat_cache_expire (GVfsBackendSmb *backend)
+{
+  time_t now;
+
+  now = time (NULL);
+
+  g_mutex_lock (&backend->stat_cache_lock);
+  g_hash_table_foreach_remove (backend->stat_cache,
+			       stat_cache_entry_expired, &now);
+  g_mutex_unlock (&backend->stat_cache_lock);
+}
+
+/* Called on every modification; renames and deletes of directories
+ * affect all entries below them, so just drop everything */
+static void
+stat_cache_invalidate (GVfsBackendSmb *backend)
+{
+  g_mutex_lock (&backend->stat_cache_lock);
+  g_hash_table_remove_all (backend->stat_cache);
+  g_mutex_unlock (&backend->stat_cache_lock);
+}
+
 static void
 do_mount (GVfsBackend *backend,
 	  GVfsJobMount *job,
@@ -500,73 +874,27 @@ do_mount (GVfsBackend *backend,
 	  gboolean is_automount)
 {
   GVfsBackendSmb *op_backend = G_VFS_BACKEND_SMB (backend);
+  SmbContext *context;
   SMBCCTX *smb_context;
   struct stat st;
   char *uri;
   int res;
   char *display_name;
-  const char *debug;
-  int debug_val;
   GMountSpec *smb_mount_spec;
   smbc_stat_fn smbc_stat;
 
-  smb_context = smbc_new_context ();
-  if (smb_context == NULL)
-    {
-      g_vfs_job_failed (G_VFS_JOB (job),
-			G_IO_ERROR, G_IO_ERROR_FAILED,
-			_("Internal Error (%s)"), "Failed to allocate smb context");
-      return;
-    }
-  smbc_setOptionUserData (smb_context, backend);
-
-  debug = g_getenv ("GVFS_SMB_DEBUG");
-  if (debug)
-    debug_val = atoi (debug);
-  else
-    debug_val = 0;
-
-  smbc_setDebug (smb_context, debug_val);
-  smbc_setFunctionAuthDataWithContext (smb_context, auth_callback);
-  
-  smbc_setFunctionAddCachedServer (smb_context, add_cached_server);
-  smbc_setFunctionGetCachedServer (smb_context, get_cached_server);
-  smbc_setFunctionRemoveCachedServer (smb_context, remove_cached_server);
-  smbc_setFunctionPurgeCachedServers (smb_context, purge_cached);
-
-  /* FIXME: is strdup() still needed here? -- removed */
-  if (op_backend->default_workgroup != NULL)
-    smbc_setWorkgroup (smb_context, op_backend->default_workgroup);
-
-#ifndef DEPRECATED_SMBC_INTERFACE
-  smb_context->flags = 0;
-#endif
-  
-  /* Initial settings:
-   *   - use Kerberos (always)
-   *   - in case of no username specified, try anonymous login
-   */
-  smbc_setOptionUseKerberos (smb_context, 1);
-  smbc_setOptionFallbackAfterKerberos (smb_context,
-                                       op_backend->user != NULL);
-  smbc_setOptionNoAutoAnonymousLogin (smb_context,
-                                      op_backend->user != NULL);
-
-  
-#if 0
-  smbc_setOptionDebugToStderr (smb_context, 1);
-#endif
-  
-  if (!smbc_init_context (smb_context))
+  context = smb_context_new (op_backend);
+  if (context == NULL)
     {
       g_vfs_job_failed (G_VFS_JOB (job),
 			G_IO_ERROR, G_IO_ERROR_FAILED,
 			_("Internal Error (%s)"), "Failed to initialize smb context");
-      smbc_free_context (smb_context, FALSE);
       return;
     }
 
-  op_backend->smb_context = smb_context;
+  /* The first context; more are created on demand once mounted */
+  g_ptr_array_add (op_backend->contexts, context);
+  smb_context = context->smb_context;
 
   /* Set the mountspec according to original uri, no matter whether user changes
      credentials during mount loop. Nautilus and other gio clients depend
@@ -634,8 +962,8 @@ do_mount (GVfsBackend *backend,
       if (op_backend->mount_try == 0)
         {
           DEBUG ("do_mount - after anon, enabling NTLMSSP fallback\n");
-          smbc_setOptionFallbackAfterKerberos (op_backend->smb_context, 1);
-          smbc_setOptionNoAutoAnonymousLogin (op_backend->smb_context, 1);
+          smbc_setOptionFallbackAfterKerberos (smb_context, 1);
+          smbc_setOptionNoAutoAnonymousLogin (smb_context, 1);
         }
       op_backend->mount_try ++;
     }
@@ -666,6 +994,7 @@ do_mount (GVfsBackend *backend,
   DEBUG ("do_mount - login successful\n");
 
   g_vfs_backend_set_default_location (backend, op_backend->path);
+  g_mutex_lock (&op_backend->auth_lock);
   g_vfs_keyring_save_password (op_backend->last_user,
 			       op_backend->server,
 			       op_backend->last_domain,
@@ -675,6 +1004,7 @@ do_mount (GVfsBackend *backend,
 			       0,
 			       op_backend->last_password,
 			       op_backend->password_save);
+  g_mutex_unlock (&op_backend->auth_lock);
   
   g_vfs_job_succeeded (G_VFS_JOB (job));
 }
@@ -720,25 +1050,86 @@ do_unmount (GVfsBackend *backend,
 	    GMountSource *mount_source)
 {
   GVfsBackendSmb *op_backend = G_VFS_BACKEND_SMB (backend);
-  int res;
+  SmbContext *context;
+  GPtrArray *dying;
+  int res, errsv;
+  guint i;
+
+  g_mutex_lock (&op_backend->contexts_lock);
 
-  if (op_backend->smb_context == NULL)
+  if (op_backend->contexts->len == 0 || op_backend->unmounting)
     {
+      g_mutex_unlock (&op_backend->contexts_lock);
       g_vfs_job_failed (G_VFS_JOB (job),
 			G_IO_ERROR, G_IO_ERROR_FAILED,
 			_("Internal Error (%s)"), "SMB context has not been initialized");
       return;
     }
 
-  /* shutdown_ctx = TRUE, "all connections and files will be closed even if they are busy" */
-  res = smbc_free_context (op_backend->smb_context, TRUE);
+  /* Take all contexts out of the pool so that new jobs fail right
+     away instead of queueing up behind the ones in libsmbclient */
+  dying = g_ptr_array_new ();
+  for (i = 0; i < op_backend->contexts->len; i++)
+    {
+      context = g_ptr_array_index (op_backend->contexts, i);
+      g_atomic_int_set (&context->dying, TRUE);
+      g_ptr_array_add (dying, context);
+    }
+  g_ptr_array_set_size (op_backend->contexts, 0);
+  op_backend->unmounting = TRUE;
+
+  g_mutex_unlock (&op_backend->contexts_lock);
+
+  /* Wait for the jobs currently in libsmbclient without holding
+     contexts_lock, transfers notice dying and stop early */
+  res = 0;
+  errsv = 0;
+  for (i = 0; i < dying->len; i++)
+    {
+      context = g_ptr_array_index (dying, i);
+
+      g_mutex_lock (&context->lock);
+      /* shutdown_ctx = TRUE, "all connections and files will be closed even if they are busy" */
+      res = smbc_free_context (context->smb_context, TRUE);
+      if (res != 0)
+        {
+          errsv = errno;
+          g_mutex_unlock (&context->lock);
+          break;
+        }
+
+      /* Jobs drop their last reference under contexts_lock once they
+         see smb_context is NULL */
+      g_mutex_lock (&op_backend->contexts_lock);
+      context->smb_context = NULL;
+      g_mutex_unlock (&context->lock);
+      /* Otherwise open files and waiting jobs still point to it */
+      if (context->users == 0)
+        smb_context_free (context);
+      g_mutex_unlock (&op_backend->contexts_lock);
+    }
+
+  /* If one can't be freed the mount keeps working on the rest and
+     the unmount fails */
   if (res != 0)
     {
-      g_vfs_job_failed_from_errno (G_VFS_JOB (job), errno);
-      return;
+      g_mutex_lock (&op_backend->contexts_lock);
+      for (; i < dying->len; i++)
+        {
+          context = g_ptr_array_index (dying, i);
+          g_atomic_int_set (&context->dying, FALSE);
+          g_ptr_array_add (op_backend->contexts, context);
+        }
+      op_backend->unmounting = FALSE;
+      g_mutex_unlock (&op_backend->contexts_lock);
     }
 
-  g_vfs_job_succeeded (G_VFS_JOB (job));
+  g_ptr_array_free (dying, TRUE);
+
+  if (res != 0)
+    g_vfs_job_failed_from_errno (G_VFS_JOB (job), errsv);
+  else
+    g_vfs_job_succeeded (G_VFS_JOB (job));
 }
 
 static int
@@ -750,12 +1141,20 @@ fixup_open_errno (int err)
   return err;
 }
 
+/* Open files stay bound to the context they were opened in */
+typedef struct {
+  SmbContext *context;
+  SMBCFILE *file;
+} SmbReadHandle;
+
 static void 
 do_open_for_read (GVfsBackend *backend,
 		  GVfsJobOpenForRead *job,
 		  const char *filename)
 {
   GVfsBackendSmb *op_backend = G_VFS_BACKEND_SMB (backend);
+  SmbContext *context;
+  SmbReadHandle *handle;
   char *uri;
   SMBCFILE *file;
   struct stat st;
@@ -765,17 +1164,20 @@ do_open_for_read (GVfsBackend *backend,
   int olderr;
 
 
+  context = smb_context_acquire (op_backend, G_VFS_JOB (job));
+  if (context == NULL)
+    return;
   uri = create_smb_uri (op_backend->server, op_backend->share, filename);
-  smbc_open = smbc_getFunctionOpen (op_backend->smb_context);
+  smbc_open = smbc_getFunctionOpen (context->smb_context);
   errno = 0;
-  file = smbc_open (op_backend->smb_context, uri, O_RDONLY, 0);
+  file = smbc_open (context->smb_context, uri, O_RDONLY, 0);
 
   if (file == NULL)
     {
       olderr = fixup_open_errno (errno);
       
-      smbc_stat = smbc_getFunctionStat (op_backend->smb_context);
-      res = smbc_stat (op_backend->smb_context, uri, &st);
+      smbc_stat = smbc_getFunctionStat (context->smb_context);
+      res = smbc_stat (context->smb_context, uri, &st);
       g_free (uri);
       if ((res == 0) && (S_ISDIR (st.st_mode)))
             g_vfs_job_failed (G_VFS_JOB (job),
@@ -783,12 +1185,20 @@ do_open_for_read (GVfsBackend *backend,
                              _("Can't open directory"));
       else
         g_vfs_job_failed_from_errno (G_VFS_JOB (job), olderr);
+
+      smb_context_release (op_backend, context);
   }
   else
     {
+      handle = g_new (SmbReadHandle, 1);
+      handle->context = context;
+      handle->file = file;
+
+      /* Keep the reference for the handle, until close */
+      g_mutex_unlock (&context->lock);
       
       g_vfs_job_open_for_read_set_can_seek (job, TRUE);
-      g_vfs_job_open_for_read_set_handle (job, file);
+      g_vfs_job_open_for_read_set_handle (job, handle);
       g_vfs_job_succeeded (G_VFS_JOB (job));
     }
 }
@@ -796,11 +1206,12 @@ do_open_for_read (GVfsBackend *backend,
 static void
 do_read (GVfsBackend *backend,
 	 GVfsJobRead *job,
-	 GVfsBackendHandle handle,
+	 GVfsBackendHandle _handle,
 	 char *buffer,
 	 gsize bytes_requested)
 {
-  GVfsBackendSmb *op_backend = G_VFS_BACKEND_SMB (backend);
+  SmbReadHandle *handle = _handle;
+  SmbContext *context = handle->context;
   ssize_t res;
   smbc_read_fn smbc_read;
 
@@ -812,8 +1223,11 @@ do_read (GVfsBackend *backend,
   if (bytes_requested > 65534)
     bytes_requested = 65534;
 
-  smbc_read = smbc_getFunctionRead (op_backend->smb_context);
-  res = smbc_read (op_backend->smb_context, (SMBCFILE *)handle, buffer, bytes_requested);
+  if (!smb_context_lock_for_handle (context, G_VFS_JOB (job)))
+    return;
+  smbc_read = smbc_getFunctionRead (context->smb_context);
+  res = smbc_read (context->smb_context, handle->file, buffer, bytes_requested);
+  g_mutex_unlock (&context->lock);
 
   if (res == -1)
     g_vfs_job_failed_from_errno (G_VFS_JOB (job), errno);
@@ -827,11 +1241,12 @@ do_read (GVfsBackend *backend,
 static void
 do_seek_on_read (GVfsBackend *backend,
 		 GVfsJobSeekRead *job,
-		 GVfsBackendHandle handle,
+		 GVfsBackendHandle _handle,
 		 goffset    offset,
 		 GSeekType  type)
 {
-  GVfsBackendSmb *op_backend = G_VFS_BACKEND_SMB (backend);
+  SmbReadHandle *handle = _handle;
+  SmbContext *context = handle->context;
   int whence;
   off_t res;
   smbc_lseek_fn smbc_lseek;
@@ -854,8 +1269,11 @@ do_seek_on_read (GVfsBackend *backend,
       return;
     }
 
-  smbc_lseek = smbc_getFunctionLseek (op_backend->smb_context);
-  res = smbc_lseek (op_backend->smb_context, (SMBCFILE *)handle, offset, whence);
+  if (!smb_context_lock_for_handle (context, G_VFS_JOB (job)))
+    return;
+  smbc_lseek = smbc_getFunctionLseek (context->smb_context);
+  res = smbc_lseek (context->smb_context, handle->file, offset, whence);
+  g_mutex_unlock (&context->lock);
 
   if (res == (off_t)-1)
     g_vfs_job_failed_from_errno (G_VFS_JOB (job), errno);
@@ -871,18 +1289,23 @@ do_seek_on_read (GVfsBackend *backend,
 static void
 do_query_info_on_read (GVfsBackend *backend,
 		       GVfsJobQueryInfoRead *job,
-		       GVfsBackendHandle handle,
+		       GVfsBackendHandle _handle,
 		       GFileInfo *info,
 		       GFileAttributeMatcher *matcher)
 {
   GVfsBackendSmb *op_backend = G_VFS_BACKEND_SMB (backend);
+  SmbReadHandle *handle = _handle;
+  SmbContext *context = handle->context;
   struct stat st = {0};
   int res, saved_errno;
   smbc_fstat_fn smbc_fstat;
 
-  smbc_fstat = smbc_getFunctionFstat (op_backend->smb_context);
-  res = smbc_fstat (op_backend->smb_context, (SMBCFILE *)handle, &st);
+  if (!smb_context_lock_for_handle (context, G_VFS_JOB (job)))
+    return;
+  smbc_fstat = smbc_getFunctionFstat (context->smb_context);
+  res = smbc_fstat (context->smb_context, handle->file, &st);
   saved_errno = errno;
+  g_mutex_unlock (&context->lock);
 
   if (res == 0)
     {
@@ -898,21 +1321,35 @@ do_query_info_on_read (GVfsBackend *backend,
 static void
 do_close_read (GVfsBackend *backend,
 	       GVfsJobCloseRead *job,
-	       GVfsBackendHandle handle)
+	       GVfsBackendHandle _handle)
 {
   GVfsBackendSmb *op_backend = G_VFS_BACKEND_SMB (backend);
+  SmbReadHandle *handle = _handle;
+  SmbContext *context = handle->context;
   ssize_t res;
+  int errsv;
   smbc_close_fn smbc_close;
 
-  smbc_close = smbc_getFunctionClose (op_backend->smb_context);
-  res = smbc_close (op_backend->smb_context, (SMBCFILE *)handle);
+  if (!smb_context_lock_for_handle (context, G_VFS_JOB (job)))
+    {
+      smb_context_unref (op_backend, context);
+      g_free (handle);
+      return;
+    }
+  smbc_close = smbc_getFunctionClose (context->smb_context);
+  res = smbc_close (context->smb_context, handle->file);
+  errsv = errno;
+  smb_context_release (op_backend, context);
+  g_free (handle);
+
   if (res == -1)
-    g_vfs_job_failed_from_errno (G_VFS_JOB (job), errno);
+    g_vfs_job_failed_from_errno (G_VFS_JOB (job), errsv);
   else
     g_vfs_job_succeeded (G_VFS_JOB (job));
 }
 
 typedef struct {
+  SmbContext *context;
   SMBCFILE *file;
   char *uri;
   char *tmp_uri;
@@ -936,15 +1373,21 @@ do_create (GVfsBackend *backend,
 {
   GVfsBackendSmb *op_backend = G_VFS_BACKEND_SMB (backend);
   char *uri;
+  SmbContext *context;
   SMBCFILE *file;
   SmbWriteHandle *handle;
   smbc_open_fn smbc_open;
   int errsv;
 
+  stat_cache_invalidate (op_backend);
+
+  context = smb_context_acquire (op_backend, G_VFS_JOB (job));
+  if (context == NULL)
+    return;
   uri = create_smb_uri (op_backend->server, op_backend->share, filename);
-  smbc_open = smbc_getFunctionOpen (op_backend->smb_context);
+  smbc_open = smbc_getFunctionOpen (context->smb_context);
   errno = 0;
-  file = smbc_open (op_backend->smb_context, uri,
+  file = smbc_open (context->smb_context, uri,
 		    O_CREAT|O_WRONLY|O_EXCL, 0666);
   g_free (uri);
 
@@ -956,12 +1399,17 @@ do_create (GVfsBackend *backend,
       if (errsv == EISDIR)
 	errsv = EEXIST;
       g_vfs_job_failed_from_errno (G_VFS_JOB (job), errsv);
+      smb_context_release (op_backend, context);
     }
   else
     {
       handle = g_new0 (SmbWriteHandle, 1);
+      handle->context = context;
       handle->file = file;
 
+      /* Keep the reference for the handle, until close */
+      g_mutex_unlock (&context->lock);
+
       g_vfs_job_open_for_write_set_can_seek (job, TRUE);
       g_vfs_job_open_for_write_set_handle (job, handle);
       g_vfs_job_succeeded (G_VFS_JOB (job));
@@ -976,29 +1424,43 @@ do_append_to (GVfsBackend *backend,
 {
   GVfsBackendSmb *op_backend = G_VFS_BACKEND_SMB (backend);
   char *uri;
+  SmbContext *context;
   SMBCFILE *file;
   SmbWriteHandle *handle;
   off_t initial_offset;
   smbc_open_fn smbc_open;
   smbc_lseek_fn smbc_lseek;
 
+  stat_cache_invalidate (op_backend);
+
+  context = smb_context_acquire (op_backend, G_VFS_JOB (job));
+  if (context == NULL)
+    return;
   uri = create_smb_uri (op_backend->server, op_backend->share, filename);
-  smbc_open = smbc_getFunctionOpen (op_backend->smb_context);
+  smbc_open = smbc_getFunctionOpen (context->smb_context);
   errno = 0;
-  file = smbc_open (op_backend->smb_context, uri,
+  file = smbc_open (context->smb_context, uri,
 					O_CREAT|O_WRONLY|O_APPEND, 0666);
   g_free (uri);
 
   if (file == NULL)
-    g_vfs_job_failed_from_errno (G_VFS_JOB (job), fixup_open_errno (errno));
+    {
+      g_vfs_job_failed_from_errno (G_VFS_JOB (job), fixup_open_errno (errno));
+      smb_context_release (op_backend, context);
+    }
   else
     {
       handle = g_new0 (SmbWriteHandle, 1);
+      handle->context = context;
       handle->file = file;
 
-      smbc_lseek = smbc_getFunctionLseek (op_backend->smb_context);
-      initial_offset = smbc_lseek (op_backend->smb_context, file,
+      smbc_lseek = smbc_getFunctionLseek (context->smb_context);
+      initial_offset = smbc_lseek (context->smb_context, file,
 						       0, SEEK_CUR);
+
+      /* Keep the reference for the handle, until close */
+      g_mutex_unlock (&context->lock);
+
       if (initial_offset == (off_t) -1)
 	g_vfs_job_open_for_write_set_can_seek (job, FALSE);
       else
@@ -1044,6 +1506,7 @@ get_dir_from_uri (const char *uri)
 
 static SMBCFILE *
 open_tmpfile (GVfsBackendSmb *backend,
+	      SmbContext *context,
 	      const char *uri,
 	      char **tmp_uri_out)
 {
@@ -1058,9 +1521,9 @@ open_tmpfile (GVfsBackendSmb *backend,
     random_chars (filename + 4, 4);
     tmp_uri = g_strconcat (dir_uri, filename, NULL);
 
-    smbc_open = smbc_getFunctionOpen (backend->smb_context);
+    smbc_open = smbc_getFunctionOpen (context->smb_context);
     errno = 0;
-    file = smbc_open (backend->smb_context, tmp_uri,
+    file = smbc_open (context->smb_context, tmp_uri,
 		      O_CREAT|O_WRONLY|O_EXCL, 0666);
   } while (file == NULL && errno == EEXIST);
 
@@ -1078,51 +1541,171 @@ open_tmpfile (GVfsBackendSmb *backend,
     }
 }
 
+/* libsmbclient splits big reads and writes into several SMB requests
+ * and keeps them in flight at once, so bulk transfers use large blocks */
+#define SMB_BULK_BUFFER_SIZE (1024 * 1024)
+
+typedef struct {
+  GVfsJob *job;
+  SmbContext *context;
+  goffset total_size;
+  GFileProgressCallback progress_callback;
+  gpointer progress_callback_data;
+} SmbCopyData;
+
+#ifdef HAVE_SAMBA_SPLICE
+static int
+copy_file_splice_cb (off_t n, void *priv)
+{
+  SmbCopyData *data = priv;
+
+  if (data->progress_callback)
+    data->progress_callback (n, data->total_size, data->progress_callback_data);
+
+  return !g_vfs_job_is_cancelled (data->job) &&
+    !smb_context_is_dying (data->context);
+}
+#endif
+
+static void
+set_error_from_errno (GError **error,
+		      int errsv)
+{
+  g_set_error_literal (error, G_IO_ERROR,
+		       g_io_error_from_errno (errsv),
+		       g_strerror (errsv));
+}
+
+/* Checked between chunks of a copy */
+static gboolean
+copy_file_stopped (SmbContext *context,
+		   GVfsJob *job,
+		   GError **error)
+{
+  if (g_vfs_job_is_cancelled (job))
+    g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_CANCELLED,
+			 _("Operation was cancelled"));
+  else if (smb_context_is_dying (context))
+    g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_NOT_MOUNTED,
+			 _("The specified location is not mounted"));
+  else
+    return FALSE;
+
+  return TRUE;
+}
+
+/* Copies from_uri to to_uri, preferably server-side so that the data
+ * never passes through this machine */
 static gboolean
 copy_file (GVfsBackendSmb *backend,
+	   SmbContext *context,
 	   GVfsJob *job,
 	   const char *from_uri,
-	   const char *to_uri)
+	   const char *to_uri,
+	   GFileProgressCallback progress_callback,
+	   gpointer progress_callback_data,
+	   GError **error)
 {
   SMBCFILE *from_file, *to_file;
-  char buffer[4096];
+  SmbCopyData data;
+  struct stat st;
+  char *buffer;
   size_t buffer_size;
   ssize_t res;
+  goffset current;
   char *p;
   gboolean succeeded;
   smbc_open_fn smbc_open;
   smbc_read_fn smbc_read;
   smbc_write_fn smbc_write;
   smbc_close_fn smbc_close;
-  
+  smbc_fstat_fn smbc_fstat;
+#ifdef HAVE_SAMBA_SPLICE
+  smbc_splice_fn smbc_splice;
+#endif
 
   from_file = NULL;
   to_file = NULL;
+  buffer = NULL;
 
   succeeded = FALSE;
 
-  smbc_open = smbc_getFunctionOpen (backend->smb_context);
-  smbc_read = smbc_getFunctionRead (backend->smb_context);
-  smbc_write = smbc_getFunctionWrite (backend->smb_context);
-  smbc_close = smbc_getFunctionClose (backend->smb_context);
+  smbc_open = smbc_getFunctionOpen (context->smb_context);
+  smbc_read = smbc_getFunctionRead (context->smb_context);
+  smbc_write = smbc_getFunctionWrite (context->smb_context);
+  smbc_close = smbc_getFunctionClose (context->smb_context);
+  smbc_fstat = smbc_getFunctionFstat (context->smb_context);
 
-  from_file = smbc_open (backend->smb_context, from_uri,
+  errno = 0;
+  from_file = smbc_open (context->smb_context, from_uri,
 			 O_RDONLY, 0666);
-  if (from_file == NULL || g_vfs_job_is_cancelled (job))
+  if (from_file == NULL)
+    {
+      set_error_from_errno (error, fixup_open_errno (errno));
+      goto out;
+    }
+  if (copy_file_stopped (context, job, error))
     goto out;
   
-  to_file = smbc_open (backend->smb_context, to_uri,
+  errno = 0;
+  to_file = smbc_open (context->smb_context, to_uri,
 		       O_CREAT|O_WRONLY|O_TRUNC, 0666);
-  
-  if (from_file == NULL || g_vfs_job_is_cancelled (job))
+  if (to_file == NULL)
+    {
+      set_error_from_errno (error, fixup_open_errno (errno));
+      goto out;
+    }
+  if (copy_file_stopped (context, job, error))
     goto out;
 
+  data.job = job;
+  data.context = context;
+  data.total_size = 0;
+  data.progress_callback = progress_callback;
+  data.progress_callback_data = progress_callback_data;
+
+  if (smbc_fstat (context->smb_context, from_file, &st) == 0)
+    data.total_size = st.st_size;
+
+#ifdef HAVE_SAMBA_SPLICE
+  /* Uses SMB2 copychunk when the server supports it, libsmbclient
+   * falls back to reading and writing by itself otherwise */
+  smbc_splice = smbc_getFunctionSplice (context->smb_context);
+  if (smbc_splice != NULL && data.total_size > 0)
+    {
+      off_t spliced;
+
+      errno = 0;
+      spliced = smbc_splice (context->smb_context, from_file, to_file,
+                             data.total_size, copy_file_splice_cb, &data);
+      if (copy_file_stopped (context, job, error))
+        goto out;
+      if (spliced < 0 && errno != 0)
+        set_error_from_errno (error, errno);
+      else if (spliced != data.total_size)
+        /* errno is not reliable after a short splice */
+        g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                             _("Server copied less data than requested"));
+      else
+        succeeded = TRUE;
+      goto out;
+    }
+#endif
+
+  buffer = g_malloc (SMB_BULK_BUFFER_SIZE);
+  current = 0;
+
   while (1)
     {
       
-      res = smbc_read (backend->smb_context, from_file,
-					buffer, sizeof(buffer));
-      if (res < 0 || g_vfs_job_is_cancelled (job))
+      res = smbc_read (context->smb_context, from_file,
+					buffer, SMB_BULK_BUFFER_SIZE);
+      if (res < 0)
+	{
+	  set_error_from_errno (error, errno);
+	  goto out;
+	}
+      if (copy_file_stopped (context, job, error))
 	goto out;
       if (res == 0)
 	break; /* Succeeded */
@@ -1131,21 +1714,38 @@ copy_file (GVfsBackendSmb *backend,
       p = buffer;
       while (buffer_size > 0)
 	{
-	  res = smbc_write (backend->smb_context, to_file,
+	  res = smbc_write (context->smb_context, to_file,
 					     p, buffer_size);
-	  if (res < 0 || g_vfs_job_is_cancelled (job))
+	  if (res < 0)
+	    {
+	      set_error_from_errno (error, errno);
+	      goto out;
+	    }
+	  /* Would loop forever otherwise */
+	  if (res == 0)
+	    {
+	      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+				   _("Server wrote less data than requested"));
+	      goto out;
+	    }
+	  if (copy_file_stopped (context, job, error))
 	    goto out;
 	  buffer_size -= res;
 	  p += res;
+	  current += res;
 	}
+
+      if (progress_callback)
+        progress_callback (current, data.total_size, progress_callback_data);
     }
   succeeded = TRUE;
  
  out: 
+  g_free (buffer);
   if (to_file)
-	  smbc_close (backend->smb_context, to_file);
+	  smbc_close (context->smb_context, to_file);
   if (from_file)
-	  smbc_close (backend->smb_context, from_file);
+	  smbc_close (context->smb_context, from_file);
   return succeeded;
 }
 
@@ -1169,10 +1769,16 @@ do_replace (GVfsBackend *backend,
   char *uri, *tmp_uri, *backup_uri, *current_etag;
   SMBCFILE *file;
   GError *error = NULL;
+  SmbContext *context;
   SmbWriteHandle *handle;
   smbc_open_fn smbc_open;
   smbc_stat_fn smbc_stat;
 
+  stat_cache_invalidate (op_backend);
+
+  context = smb_context_acquire (op_backend, G_VFS_JOB (job));
+  if (context == NULL)
+    return;
   uri = create_smb_uri (op_backend->server, op_backend->share, filename);
   tmp_uri = NULL;
   if (make_backup)
@@ -1180,11 +1786,11 @@ do_replace (GVfsBackend *backend,
   else
     backup_uri = NULL;
 
-  smbc_open = smbc_getFunctionOpen (op_backend->smb_context);
-  smbc_stat = smbc_getFunctionStat (op_backend->smb_context);
+  smbc_open = smbc_getFunctionOpen (context->smb_context);
+  smbc_stat = smbc_getFunctionStat (context->smb_context);
   
   errno = 0;
-  file = smbc_open (op_backend->smb_context, uri,
+  file = smbc_open (context->smb_context, uri,
 		    O_CREAT|O_WRONLY|O_EXCL, 0);
   if (file == NULL && errno != EEXIST)
     {
@@ -1199,7 +1805,7 @@ do_replace (GVfsBackend *backend,
     {
       if (etag != NULL)
 	{
-	  res = smbc_stat (op_backend->smb_context, uri, &original_stat);
+	  res = smbc_stat (context->smb_context, uri, &original_stat);
 	  
 	  if (res == 0)
 	    {
@@ -1230,23 +1836,22 @@ do_replace (GVfsBackend *backend,
        * copied directly to the backup filename.
        */
 
-      file = open_tmpfile (op_backend, uri, &tmp_uri);
+      file = open_tmpfile (op_backend, context, uri, &tmp_uri);
       if (file == NULL)
 	{
 	  if (make_backup)
 	    {
-	      if (!copy_file (op_backend, G_VFS_JOB (job), uri, backup_uri))
+	      if (!copy_file (op_backend, context, G_VFS_JOB (job), uri, backup_uri,
+			      NULL, NULL, &error))
 		{
-		  if (g_vfs_job_is_cancelled (G_VFS_JOB (job)))
-		    g_set_error_literal (&error,
-					 G_IO_ERROR,
-					 G_IO_ERROR_CANCELLED,
-					 _("Operation was cancelled"));
-		  else
-		    g_set_error_literal (&error,
-					 G_IO_ERROR,
-					 G_IO_ERROR_CANT_CREATE_BACKUP,
-					 _("Backup file creation failed"));
+		  if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+		    {
+		      g_clear_error (&error);
+		      g_set_error_literal (&error,
+					   G_IO_ERROR,
+					   G_IO_ERROR_CANT_CREATE_BACKUP,
+					   _("Backup file creation failed"));
+		    }
 		  goto error;
 		}
 	      g_free (backup_uri);
@@ -1254,7 +1859,7 @@ do_replace (GVfsBackend *backend,
 	    }
 	  
 	  errno = 0;
-	  file = smbc_open (op_backend->smb_context, uri,
+	  file = smbc_open (context->smb_context, uri,
 			    O_CREAT|O_WRONLY|O_TRUNC, 0);
 	  if (file == NULL)
 	    {
@@ -1275,10 +1880,14 @@ do_replace (GVfsBackend *backend,
     }
 
   handle = g_new (SmbWriteHandle, 1);
+  handle->context = context;
   handle->file = file;
   handle->uri = uri;
   handle->tmp_uri = tmp_uri;
   handle->backup_uri = backup_uri;
+
+  /* Keep the reference for the handle, until close */
+  g_mutex_unlock (&context->lock);
   
   g_vfs_job_open_for_write_set_can_seek (job, TRUE);
   g_vfs_job_open_for_write_set_handle (job, handle);
@@ -1287,6 +1896,7 @@ do_replace (GVfsBackend *backend,
   return;
   
  error:
+  smb_context_release (op_backend, context);
   g_vfs_job_failed_from_error (G_VFS_JOB (job), error);
   g_error_free (error);
   g_free (backup_uri);
@@ -1304,14 +1914,23 @@ do_write (GVfsBackend *backend,
 {
   GVfsBackendSmb *op_backend = G_VFS_BACKEND_SMB (backend);
   SmbWriteHandle *handle = _handle;
+  SmbContext *context = handle->context;
   ssize_t res;
+  int errsv;
   smbc_write_fn smbc_write;
 
-  smbc_write = smbc_getFunctionWrite (op_backend->smb_context);
-  res = smbc_write (op_backend->smb_context, handle->file,
+  if (!smb_context_lock_for_handle (context, G_VFS_JOB (job)))
+    return;
+  smbc_write = smbc_getFunctionWrite (context->smb_context);
+  res = smbc_write (context->smb_context, handle->file,
 					buffer, buffer_size);
+  errsv = errno;
+  g_mutex_unlock (&context->lock);
+
+  /* The size and mtime changed */
+  stat_cache_invalidate (op_backend);
   if (res == -1)
-    g_vfs_job_failed_from_errno (G_VFS_JOB (job), errno);
+    g_vfs_job_failed_from_errno (G_VFS_JOB (job), errsv);
   else
     {
       g_vfs_job_write_set_written_size (job, res);
@@ -1328,7 +1947,8 @@ do_seek_on_write (GVfsBackend *backend,
 {
   GVfsBackendSmb *op_backend = G_VFS_BACKEND_SMB (backend);
   SmbWriteHandle *handle = _handle;
-  int whence;
+  SmbContext *context = handle->context;
+  int whence, errsv;
   off_t res;
   smbc_lseek_fn smbc_lseek;
 
@@ -1350,11 +1970,19 @@ do_seek_on_write (GVfsBackend *backend,
       return;
     }
 
-  smbc_lseek = smbc_getFunctionLseek (op_backend->smb_context);
-  res = smbc_lseek (op_backend->smb_context, handle->file, offset, whence);
+  if (!smb_context_lock_for_handle (context, G_VFS_JOB (job)))
+    return;
+  smbc_lseek = smbc_getFunctionLseek (context->smb_context);
+  res = smbc_lseek (context->smb_context, handle->file, offset, whence);
+  errsv = errno;
+  g_mutex_unlock (&context->lock);
+
+  /* Seeking past the end grows the file on the next write, and some
+     servers extend it right away */
+  stat_cache_invalidate (op_backend);
 
   if (res == (off_t)-1)
-    g_vfs_job_failed_from_errno (G_VFS_JOB (job), errno);
+    g_vfs_job_failed_from_errno (G_VFS_JOB (job), errsv);
   else
     {
       g_vfs_job_seek_write_set_offset (job, res);
@@ -1374,12 +2002,16 @@ do_query_info_on_write (GVfsBackend *backend,
   GVfsBackendSmb *op_backend = G_VFS_BACKEND_SMB (backend);
   struct stat st = {0};
   SmbWriteHandle *handle = _handle;
+  SmbContext *context = handle->context;
   int res, saved_errno;
   smbc_fstat_fn smbc_fstat;
 
-  smbc_fstat = smbc_getFunctionFstat (op_backend->smb_context);
-  res = smbc_fstat (op_backend->smb_context, handle->file, &st);
+  if (!smb_context_lock_for_handle (context, G_VFS_JOB (job)))
+    return;
+  smbc_fstat = smbc_getFunctionFstat (context->smb_context);
+  res = smbc_fstat (context->smb_context, handle->file, &st);
   saved_errno = errno;
+  g_mutex_unlock (&context->lock);
 
   if (res == 0)
     {
@@ -1399,6 +2031,7 @@ do_close_write (GVfsBackend *backend,
 {
   GVfsBackendSmb *op_backend = G_VFS_BACKEND_SMB (backend);
   SmbWriteHandle *handle = _handle;
+  SmbContext *context = handle->context;
   struct stat stat_at_close;
   int stat_res;
   ssize_t res;
@@ -1407,21 +2040,30 @@ do_close_write (GVfsBackend *backend,
   smbc_unlink_fn smbc_unlink;
   smbc_rename_fn smbc_rename;
 
-  smbc_fstat = smbc_getFunctionFstat (op_backend->smb_context);
-  smbc_close = smbc_getFunctionClose (op_backend->smb_context);
-  smbc_unlink = smbc_getFunctionUnlink (op_backend->smb_context);
-  smbc_rename = smbc_getFunctionRename (op_backend->smb_context);
+  stat_cache_invalidate (op_backend);
+
+  if (!smb_context_lock_for_handle (context, G_VFS_JOB (job)))
+    {
+      smb_context_unref (op_backend, context);
+      smb_write_handle_free (handle);
+      return;
+    }
+
+  smbc_fstat = smbc_getFunctionFstat (context->smb_context);
+  smbc_close = smbc_getFunctionClose (context->smb_context);
+  smbc_unlink = smbc_getFunctionUnlink (context->smb_context);
+  smbc_rename = smbc_getFunctionRename (context->smb_context);
   
-  stat_res = smbc_fstat (op_backend->smb_context, handle->file, &stat_at_close);
+  stat_res = smbc_fstat (context->smb_context, handle->file, &stat_at_close);
   
-  res = smbc_close (op_backend->smb_context, handle->file);
+  res = smbc_close (context->smb_context, handle->file);
 
   if (res == -1)
     {
       g_vfs_job_failed_from_errno (G_VFS_JOB (job), errno);
       
       if (handle->tmp_uri)
-    	  smbc_unlink (op_backend->smb_context, handle->tmp_uri);
+    	  smbc_unlink (context->smb_context, handle->tmp_uri);
       goto out;
     }
 
@@ -1429,13 +2071,13 @@ do_close_write (GVfsBackend *backend,
     {
       if (handle->backup_uri)
 	{
-	  res = smbc_rename (op_backend->smb_context, handle->uri,
-						 op_backend->smb_context, handle->backup_uri);
+	  res = smbc_rename (context->smb_context, handle->uri,
+						 context->smb_context, handle->backup_uri);
 	  if (res ==  -1)
 	    {
               int errsv = errno;
 
-          smbc_unlink (op_backend->smb_context, handle->tmp_uri);
+          smbc_unlink (context->smb_context, handle->tmp_uri);
 	      g_vfs_job_failed (G_VFS_JOB (job),
 				G_IO_ERROR, G_IO_ERROR_CANT_CREATE_BACKUP,
 				_("Backup file creation failed: %s"), g_strerror (errsv));
@@ -1443,13 +2085,13 @@ do_close_write (GVfsBackend *backend,
 	    }
 	}
       else
-	smbc_unlink (op_backend->smb_context, handle->uri);
+	smbc_unlink (context->smb_context, handle->uri);
       
-      res = smbc_rename (op_backend->smb_context, handle->tmp_uri,
-					     op_backend->smb_context, handle->uri);
+      res = smbc_rename (context->smb_context, handle->tmp_uri,
+					     context->smb_context, handle->uri);
       if (res ==  -1)
 	{
-	  smbc_unlink (op_backend->smb_context, handle->tmp_uri);
+	  smbc_unlink (context->smb_context, handle->tmp_uri);
 	  g_vfs_job_failed_from_errno (G_VFS_JOB (job), errno);
 	  goto out;
 	}
@@ -1466,6 +2108,7 @@ do_close_write (GVfsBackend *backend,
   g_vfs_job_succeeded (G_VFS_JOB (job));
 
  out:
+  smb_context_release (op_backend, context);
   smb_write_handle_free (handle);  
 }
 
@@ -1603,10 +2246,13 @@ set_info_from_stat (GVfsBackendSmb *backend,
     }
   
   /* Don't trust n_link, uid, gid, etc returned from libsmb, its just made up.
-     These are ok though: */
+     These are ok though (but not available from directory listings): */
 
-  g_file_info_set_attribute_uint32 (info, G_FILE_ATTRIBUTE_UNIX_DEVICE, statbuf->st_dev);
-  g_file_info_set_attribute_uint64 (info, G_FILE_ATTRIBUTE_UNIX_INODE, statbuf->st_ino);
+  if (statbuf->st_ino != 0)
+    {
+      g_file_info_set_attribute_uint32 (info, G_FILE_ATTRIBUTE_UNIX_DEVICE, statbuf->st_dev);
+      g_file_info_set_attribute_uint64 (info, G_FILE_ATTRIBUTE_UNIX_INODE, statbuf->st_ino);
+    }
 
   /* If file is dos-readonly, libsmbclient doesn't set S_IWUSR, we use this to
      trigger ACCESS_WRITE = FALSE. Only set for regular files, see
@@ -1657,6 +2303,7 @@ do_query_info (GVfsBackend *backend,
 	       GFileAttributeMatcher *matcher)
 {
   GVfsBackendSmb *op_backend = G_VFS_BACKEND_SMB (backend);
+  SmbContext *context;
   struct stat st = {0};
   char *uri;
   int res, saved_errno;
@@ -1664,9 +2311,24 @@ do_query_info (GVfsBackend *backend,
   smbc_stat_fn smbc_stat;
 
   uri = create_smb_uri (op_backend->server, op_backend->share, filename);
-  smbc_stat = smbc_getFunctionStat (op_backend->smb_context);
-  res = smbc_stat (op_backend->smb_context, uri, &st);
-  saved_errno = errno;
+  if (stat_cache_lookup (op_backend, uri, &st))
+    {
+      res = 0;
+      saved_errno = 0;
+    }
+  else
+    {
+      context = smb_context_acquire (op_backend, G_VFS_JOB (job));
+      if (context == NULL)
+        {
+          g_free (uri);
+          return;
+        }
+      smbc_stat = smbc_getFunctionStat (context->smb_context);
+      res = smbc_stat (context->smb_context, uri, &st);
+      saved_errno = errno;
+      smb_context_release (op_backend, context);
+    }
   g_free (uri);
 
   if (res == 0)
@@ -1694,6 +2356,7 @@ do_query_fs_info (GVfsBackend *backend,
   g_file_info_set_attribute_string (info, G_FILE_ATTRIBUTE_FILESYSTEM_TYPE, "cifs");
 
 #ifdef HAVE_SAMBA_STAT_VFS
+  SmbContext *context;
   smbc_statvfs_fn smbc_statvfs;
   struct statvfs st = {0};
   char *uri;
@@ -1707,9 +2370,16 @@ do_query_fs_info (GVfsBackend *backend,
 					G_FILE_ATTRIBUTE_FILESYSTEM_READONLY))
     {
       uri = create_smb_uri (op_backend->server, op_backend->share, filename);
-      smbc_statvfs = smbc_getFunctionStatVFS (op_backend->smb_context);
-      res = smbc_statvfs (op_backend->smb_context, uri, &st);
+      context = smb_context_acquire (op_backend, G_VFS_JOB (job));
+      if (context == NULL)
+        {
+          g_free (uri);
+          return;
+        }
+      smbc_statvfs = smbc_getFunctionStatVFS (context->smb_context);
+      res = smbc_statvfs (context->smb_context, uri, &st);
       saved_errno = errno;
+      smb_context_release (op_backend, context);
       g_free (uri);
 
       if (res == 0)
@@ -1784,6 +2454,7 @@ do_set_attribute (GVfsBackend *backend,
                   GFileQueryInfoFlags flags)
 {
   GVfsBackendSmb *op_backend;
+  SmbContext *context;
   char *uri;
   int res, errsv;
   struct timeval tbuf[2];
@@ -1794,6 +2465,7 @@ do_set_attribute (GVfsBackend *backend,
 
 
   op_backend = G_VFS_BACKEND_SMB (backend);
+  stat_cache_invalidate (op_backend);
 
   if (strcmp (attribute, G_FILE_ATTRIBUTE_TIME_MODIFIED) != 0
 #if 0
@@ -1807,6 +2479,9 @@ do_set_attribute (GVfsBackend *backend,
       return;
     }
 
+  context = smb_context_acquire (op_backend, G_VFS_JOB (job));
+  if (context == NULL)
+    return;
   uri = create_smb_uri (op_backend->server, op_backend->share, filename);
   res = -1;
 
@@ -1821,24 +2496,25 @@ do_set_attribute (GVfsBackend *backend,
                             _("Invalid attribute type (uint64 expected)"));
         }
 
-      smbc_utimes = smbc_getFunctionUtimes (op_backend->smb_context);
+      smbc_utimes = smbc_getFunctionUtimes (context->smb_context);
       tbuf[1].tv_sec = (*(guint64 *)value_p);  /* mtime */
       tbuf[1].tv_usec = 0;
       /* atime = mtime (atimes are usually disabled on desktop systems) */
       tbuf[0].tv_sec = tbuf[1].tv_sec;  
       tbuf[0].tv_usec = 0;
-      res = smbc_utimes (op_backend->smb_context, uri, &tbuf[0]);
+      res = smbc_utimes (context->smb_context, uri, &tbuf[0]);
     }
 #if 0
   else
   if (strcmp (attribute, G_FILE_ATTRIBUTE_UNIX_MODE) == 0)
     {
-      smbc_chmod = smbc_getFunctionChmod (op_backend->smb_context);
-      res = smbc_chmod (op_backend->smb_context, uri, (*(guint32 *)value_p) & 0777);
+      smbc_chmod = smbc_getFunctionChmod (context->smb_context);
+      res = smbc_chmod (context->smb_context, uri, (*(guint32 *)value_p) & 0777);
     }
 #endif    
 
   errsv = errno;
+  smb_context_release (op_backend, context);
   g_free (uri);
 
   if (res != 0)
@@ -1847,6 +2523,69 @@ do_set_attribute (GVfsBackend *backend,
     g_vfs_job_succeeded (G_VFS_JOB (job));
 }
 
+#ifdef HAVE_SAMBA_READDIRPLUS
+/* Mirrors how libsmbclient fills in struct stat from the DOS attributes,
+   so that listings and smbc_stat give the same file info */
+static void
+stat_from_file_info (const struct libsmb_file_info *finfo,
+		     struct stat *st)
+{
+  memset (st, 0, sizeof (struct stat));
+
+  if (finfo->attrs & SMBC_DOS_MODE_DIRECTORY)
+    st->st_mode = S_IFDIR | 0555;
+  else
+    st->st_mode = S_IFREG | 0444;
+
+  if (finfo->attrs & SMBC_DOS_MODE_ARCHIVE)
+    st->st_mode |= S_IXUSR;
+  if (finfo->attrs & SMBC_DOS_MODE_SYSTEM)
+    st->st_mode |= S_IXGRP;
+  if (finfo->attrs & SMBC_DOS_MODE_HIDDEN)
+    st->st_mode |= S_IXOTH;
+  if (!(finfo->attrs & SMBC_DOS_MODE_READONLY))
+    st->st_mode |= S_IWUSR;
+
+  st->st_size = finfo->size;
+
+  st->st_mtime = finfo->mtime_ts.tv_sec;
+  st->st_atime = finfo->atime_ts.tv_sec;
+  st->st_ctime = finfo->ctime_ts.tv_sec;
+#if defined (HAVE_STRUCT_STAT_ST_MTIMENSEC)
+  st->st_mtimensec = finfo->mtime_ts.tv_nsec;
+#elif defined (HAVE_STRUCT_STAT_ST_MTIM_TV_NSEC)
+  st->st_mtim.tv_nsec = finfo->mtime_ts.tv_nsec;
+#endif
+#if defined (HAVE_STRUCT_STAT_ST_ATIMENSEC)
+  st->st_atimensec = finfo->atime_ts.tv_nsec;
+#elif defined (HAVE_STRUCT_STAT_ST_ATIM_TV_NSEC)
+  st->st_atim.tv_nsec = finfo->atime_ts.tv_nsec;
+#endif
+#if defined (HAVE_STRUCT_STAT_ST_CTIMENSEC)
+  st->st_ctimensec = finfo->ctime_ts.tv_nsec;
+#elif defined (HAVE_STRUCT_STAT_ST_CTIM_TV_NSEC)
+  st->st_ctim.tv_nsec = finfo->ctime_ts.tv_nsec;
+#endif
+}
+
+/* Number of infos sent to the client at once */
+#define ENUMERATE_BATCH_SIZE 100
+#endif
+
+/* Lets a slow client catch up without keeping other jobs off the
+ * context. Returns FALSE if the mount went away meanwhile, the open
+ * directory is gone then too. */
+static gboolean
+enumerate_wait_for_client (SmbContext *context,
+			   GVfsJobEnumerate *job)
+{
+  g_mutex_unlock (&context->lock);
+  g_vfs_job_enumerate_wait_for_client (job);
+  g_mutex_lock (&context->lock);
+
+  return context->smb_context != NULL;
+}
+
 static void
 do_enumerate (GVfsBackend *backend,
 	      GVfsJobEnumerate *job,
@@ -1855,29 +2594,44 @@ do_enumerate (GVfsBackend *backend,
 	      GFileQueryInfoFlags flags)
 {
   GVfsBackendSmb *op_backend = G_VFS_BACKEND_SMB (backend);
+  SmbContext *context;
   struct stat st;
   int res;
   GError *error;
   SMBCFILE *dir;
-  char dirents[1024*4];
-  struct smbc_dirent *dirp;
   GList *files;
   GFileInfo *info;
   GString *uri;
   int uri_start_len;
+  gboolean dir_gone;
   smbc_opendir_fn smbc_opendir;
+  smbc_closedir_fn smbc_closedir;
+#ifdef HAVE_SAMBA_READDIRPLUS
+  const struct libsmb_file_info *finfo;
+  int n_files;
+  smbc_readdirplus_fn smbc_readdirplus;
+#else
+  char dirents[1024*4];
+  struct smbc_dirent *dirp;
   smbc_getdents_fn smbc_getdents;
   smbc_stat_fn smbc_stat;
-  smbc_closedir_fn smbc_closedir;
+#endif
 
+  context = smb_context_acquire (op_backend, G_VFS_JOB (job));
+  if (context == NULL)
+    return;
   uri = create_smb_uri_string (op_backend->server, op_backend->share, filename);
   
-  smbc_opendir = smbc_getFunctionOpendir (op_backend->smb_context);
-  smbc_getdents = smbc_getFunctionGetdents (op_backend->smb_context);
-  smbc_stat = smbc_getFunctionStat (op_backend->smb_context);
-  smbc_closedir = smbc_getFunctionClosedir (op_backend->smb_context);
+  smbc_opendir = smbc_getFunctionOpendir (context->smb_context);
+  smbc_closedir = smbc_getFunctionClosedir (context->smb_context);
+#ifdef HAVE_SAMBA_READDIRPLUS
+  smbc_readdirplus = smbc_getFunctionReaddirPlus (context->smb_context);
+#else
+  smbc_getdents = smbc_getFunctionGetdents (context->smb_context);
+  smbc_stat = smbc_getFunctionStat (context->smb_context);
+#endif
   
-  dir = smbc_opendir (op_backend->smb_context, uri->str);
+  dir = smbc_opendir (context->smb_context, uri->str);
 
   if (dir == NULL)
     {
@@ -1892,15 +2646,66 @@ do_enumerate (GVfsBackend *backend,
 
   g_vfs_job_succeeded (G_VFS_JOB (job));
 
+  stat_cache_expire (op_backend);
+
   if (uri->str[uri->len - 1] != '/')
     g_string_append_c (uri, '/');
   uri_start_len = uri->len;
+  dir_gone = FALSE;
+
+#ifdef HAVE_SAMBA_READDIRPLUS
+  /* The listing already carries size, times and DOS attributes, so
+     there is no need for a round trip to stat every entry */
+  files = NULL;
+  n_files = 0;
+  while ((finfo = smbc_readdirplus (context->smb_context, dir)) != NULL)
+    {
+      if (finfo->name == NULL ||
+	  strcmp (finfo->name, ".") == 0 ||
+	  strcmp (finfo->name, "..") == 0 ||
+	  (finfo->attrs & SMBC_DOS_MODE_VOLUME_ID))
+	continue;
+
+      g_string_truncate (uri, uri_start_len);
+      g_string_append_encoded (uri,
+			       finfo->name,
+			       SUB_DELIM_CHARS ":@/");
+
+      stat_from_file_info (finfo, &st);
+      stat_cache_add (op_backend, uri->str, &st);
+
+      info = g_file_info_new ();
+      set_info_from_stat (op_backend, info, &st, finfo->name, matcher);
+      files = g_list_prepend (files, info);
+
+      if (++n_files == ENUMERATE_BATCH_SIZE)
+	{
+	  files = g_list_reverse (files);
+	  g_vfs_job_enumerate_add_infos (job, files);
+	  g_list_free_full (files, g_object_unref);
+	  files = NULL;
+	  n_files = 0;
+
+	  if (!enumerate_wait_for_client (context, job))
+	    {
+	      dir_gone = TRUE;
+	      break;
+	    }
+	}
+    }
 
+  if (files)
+    {
+      files = g_list_reverse (files);
+      g_vfs_job_enumerate_add_infos (job, files);
+      g_list_free_full (files, g_object_unref);
+    }
+#else
   while (TRUE)
     {
       files = NULL;
       
-      res = smbc_getdents (op_backend->smb_context, dir, (struct smbc_dirent *)dirents, sizeof (dirents));
+      res = smbc_getdents (context->smb_context, dir, (struct smbc_dirent *)dirents, sizeof (dirents));
       if (res <= 0)
 	break;
       
@@ -1909,8 +2714,6 @@ do_enumerate (GVfsBackend *backend,
 	{
 	  unsigned int dirlen;
 
-	  /* TODO: Only do stat if required for flags */
-	  
 	  if ((dirp->smbc_type == SMBC_DIR ||
 	       dirp->smbc_type == SMBC_FILE ||
 	       dirp->smbc_type == SMBC_LINK) &&
@@ -1932,10 +2735,11 @@ do_enumerate (GVfsBackend *backend,
 		}
 	      else
 		{
-		  stat_res = smbc_stat (op_backend->smb_context,
+		  stat_res = smbc_stat (context->smb_context,
 							    uri->str, &st);
 		  if (stat_res == 0)
 		    {
+		      stat_cache_add (op_backend, uri->str, &st);
 		      info = g_file_info_new ();
 		      set_info_from_stat (op_backend, info, &st, dirp->name, matcher);
 		      files = g_list_prepend (files, info);
@@ -1953,10 +2757,19 @@ do_enumerate (GVfsBackend *backend,
 	  files = g_list_reverse (files);
 	  g_vfs_job_enumerate_add_infos (job, files);
 	  g_list_free_full (files, g_object_unref);
+
+	  if (!enumerate_wait_for_client (context, job))
+	    {
+	      dir_gone = TRUE;
+	      break;
+	    }
 	}
     }
+#endif
       
-  res = smbc_closedir (op_backend->smb_context, dir);
+  if (!dir_gone)
+    res = smbc_closedir (context->smb_context, dir);
+  smb_context_release (op_backend, context);
 
   g_vfs_job_enumerate_done (job);
 
@@ -1964,6 +2777,7 @@ do_enumerate (GVfsBackend *backend,
   return;
   
  error:
+  smb_context_release (op_backend, context);
   g_vfs_job_failed_from_error (G_VFS_JOB (job), error);
   g_error_free (error);
   g_string_free (uri, TRUE);
@@ -1976,6 +2790,7 @@ do_set_display_name (GVfsBackend *backend,
 		     const char *display_name)
 {
   GVfsBackendSmb *op_backend = G_VFS_BACKEND_SMB (backend);
+  SmbContext *context;
   char *from_uri, *to_uri;
   char *dirname, *new_path;
   int res, errsv;
@@ -1983,6 +2798,11 @@ do_set_display_name (GVfsBackend *backend,
   smbc_rename_fn smbc_rename;
   smbc_stat_fn smbc_stat;
 
+  stat_cache_invalidate (op_backend);
+  context = smb_context_acquire (op_backend, G_VFS_JOB (job));
+  if (context == NULL)
+    return;
+
   dirname = g_path_get_dirname (filename);
 
   /* TODO: display name is in utf8, atm we assume libsmb uris
@@ -1999,8 +2819,8 @@ do_set_display_name (GVfsBackend *backend,
   /* We can't rely on libsmbclient reporting EEXIST, let's always stat first.
    * https://bugzilla.gnome.org/show_bug.cgi?id=616645
    */
-  smbc_stat = smbc_getFunctionStat (op_backend->smb_context);
-  res = smbc_stat (op_backend->smb_context, to_uri, &st);
+  smbc_stat = smbc_getFunctionStat (context->smb_context);
+  res = smbc_stat (context->smb_context, to_uri, &st);
   if (res == 0)
     {
       g_vfs_job_failed (G_VFS_JOB (job),
@@ -2009,9 +2829,9 @@ do_set_display_name (GVfsBackend *backend,
       goto out;
     }
 
-  smbc_rename = smbc_getFunctionRename (op_backend->smb_context);
-  res = smbc_rename (op_backend->smb_context, from_uri,
-                     op_backend->smb_context, to_uri);
+  smbc_rename = smbc_getFunctionRename (context->smb_context);
+  res = smbc_rename (context->smb_context, from_uri,
+                     context->smb_context, to_uri);
   errsv = errno;
 
   if (res != 0)
@@ -2023,6 +2843,7 @@ do_set_display_name (GVfsBackend *backend,
     }
 
  out:
+  smb_context_release (op_backend, context);
   g_free (from_uri);
   g_free (to_uri);
   g_free (new_path);
@@ -2034,6 +2855,7 @@ do_delete (GVfsBackend *backend,
 	   const char *filename)
 {
   GVfsBackendSmb *op_backend = G_VFS_BACKEND_SMB (backend);
+  SmbContext *context;
   struct stat statbuf;
   char *uri;
   int errsv, res;
@@ -2041,14 +2863,18 @@ do_delete (GVfsBackend *backend,
   smbc_rmdir_fn smbc_rmdir;
   smbc_unlink_fn smbc_unlink;
 
+  stat_cache_invalidate (op_backend);
+  context = smb_context_acquire (op_backend, G_VFS_JOB (job));
+  if (context == NULL)
+    return;
 
   uri = create_smb_uri (op_backend->server, op_backend->share, filename);
 
-  smbc_stat = smbc_getFunctionStat (op_backend->smb_context);
-  smbc_rmdir = smbc_getFunctionRmdir (op_backend->smb_context);
-  smbc_unlink = smbc_getFunctionUnlink (op_backend->smb_context);
+  smbc_stat = smbc_getFunctionStat (context->smb_context);
+  smbc_rmdir = smbc_getFunctionRmdir (context->smb_context);
+  smbc_unlink = smbc_getFunctionUnlink (context->smb_context);
 
-  res = smbc_stat (op_backend->smb_context, uri, &statbuf);
+  res = smbc_stat (context->smb_context, uri, &statbuf);
   if (res == -1)
     {
       errsv = errno;
@@ -2059,13 +2885,14 @@ do_delete (GVfsBackend *backend,
 			_("Error deleting file: %s"),
 			g_strerror (errsv));
       g_free (uri);
+      smb_context_release (op_backend, context);
       return;
     }
 
   if (S_ISDIR (statbuf.st_mode))
-    res = smbc_rmdir (op_backend->smb_context, uri);
+    res = smbc_rmdir (context->smb_context, uri);
   else
-    res = smbc_unlink (op_backend->smb_context, uri);
+    res = smbc_unlink (context->smb_context, uri);
   errsv = errno;
   g_free (uri);
 
@@ -2073,6 +2900,8 @@ do_delete (GVfsBackend *backend,
     g_vfs_job_failed_from_errno (G_VFS_JOB (job), errsv);
   else
     g_vfs_job_succeeded (G_VFS_JOB (job));
+
+  smb_context_release (op_backend, context);
 }
 
 static void
@@ -2081,13 +2910,19 @@ do_make_directory (GVfsBackend *backend,
 		   const char *filename)
 {
   GVfsBackendSmb *op_backend = G_VFS_BACKEND_SMB (backend);
+  SmbContext *context;
   char *uri;
   int errsv, res;
   smbc_mkdir_fn smbc_mkdir;
 
+  stat_cache_invalidate (op_backend);
+  context = smb_context_acquire (op_backend, G_VFS_JOB (job));
+  if (context == NULL)
+    return;
+
   uri = create_smb_uri (op_backend->server, op_backend->share, filename);
-  smbc_mkdir = smbc_getFunctionMkdir (op_backend->smb_context);
-  res = smbc_mkdir (op_backend->smb_context, uri, 0666);
+  smbc_mkdir = smbc_getFunctionMkdir (context->smb_context);
+  res = smbc_mkdir (context->smb_context, uri, 0666);
   errsv = errno;
   g_free (uri);
 
@@ -2095,6 +2930,8 @@ do_make_directory (GVfsBackend *backend,
     g_vfs_job_failed_from_errno (G_VFS_JOB (job), errsv);
   else
     g_vfs_job_succeeded (G_VFS_JOB (job));
+
+  smb_context_release (op_backend, context);
 }
 
 static void
@@ -2107,6 +2944,7 @@ do_move (GVfsBackend *backend,
 	 gpointer progress_callback_data)
 {
   GVfsBackendSmb *op_backend = G_VFS_BACKEND_SMB (backend);
+  SmbContext *context;
   char *source_uri, *dest_uri, *backup_uri;
   gboolean destination_exist, source_is_dir;
   struct stat statbuf;
@@ -2115,14 +2953,18 @@ do_move (GVfsBackend *backend,
   smbc_rename_fn smbc_rename;
   smbc_unlink_fn smbc_unlink;
 
-  
+  stat_cache_invalidate (op_backend);
+  context = smb_context_acquire (op_backend, G_VFS_JOB (job));
+  if (context == NULL)
+    return;
+
   source_uri = create_smb_uri (op_backend->server, op_backend->share, source);
 
-  smbc_stat = smbc_getFunctionStat (op_backend->smb_context);
-  smbc_rename = smbc_getFunctionRename (op_backend->smb_context);
-  smbc_unlink = smbc_getFunctionUnlink (op_backend->smb_context);
+  smbc_stat = smbc_getFunctionStat (context->smb_context);
+  smbc_rename = smbc_getFunctionRename (context->smb_context);
+  smbc_unlink = smbc_getFunctionUnlink (context->smb_context);
 
-  res = smbc_stat (op_backend->smb_context, source_uri, &statbuf);
+  res = smbc_stat (context->smb_context, source_uri, &statbuf);
   if (res == -1)
     {
       errsv = errno;
@@ -2133,6 +2975,7 @@ do_move (GVfsBackend *backend,
 			_("Error moving file: %s"),
 			g_strerror (errsv));
       g_free (source_uri);
+      smb_context_release (op_backend, context);
       return;
     }
   else
@@ -2141,7 +2984,7 @@ do_move (GVfsBackend *backend,
   dest_uri = create_smb_uri (op_backend->server, op_backend->share, destination);
   
   destination_exist = FALSE;
-  res = smbc_stat (op_backend->smb_context, dest_uri, &statbuf);
+  res = smbc_stat (context->smb_context, dest_uri, &statbuf);
   if (res == 0)
     {
       destination_exist = TRUE; /* Target file exists */
@@ -2157,6 +3000,7 @@ do_move (GVfsBackend *backend,
 				_("Can't move directory over directory"));
 	      g_free (source_uri);
 	      g_free (dest_uri);
+	      smb_context_release (op_backend, context);
 	      return;
 	    }
 	}
@@ -2168,6 +3012,7 @@ do_move (GVfsBackend *backend,
 			    _("Target file already exists"));
 	  g_free (source_uri);
 	  g_free (dest_uri);
+	  smb_context_release (op_backend, context);
 	  return;
 	}
     }
@@ -2175,8 +3020,8 @@ do_move (GVfsBackend *backend,
   if (flags & G_FILE_COPY_BACKUP && destination_exist)
     {
       backup_uri = g_strconcat (dest_uri, "~", NULL);
-      res = smbc_rename (op_backend->smb_context, dest_uri,
-					     op_backend->smb_context, backup_uri);
+      res = smbc_rename (context->smb_context, dest_uri,
+					     context->smb_context, backup_uri);
       if (res == -1)
 	{
 	  g_vfs_job_failed (G_VFS_JOB (job),
@@ -2186,6 +3031,7 @@ do_move (GVfsBackend *backend,
 	  g_free (source_uri);
 	  g_free (dest_uri);
 	  g_free (backup_uri);
+	  smb_context_release (op_backend, context);
 	  return;
 	}
       g_free (backup_uri);
@@ -2196,7 +3042,7 @@ do_move (GVfsBackend *backend,
     {
       /* Source is a dir, destination exists (and is not a dir, because that would have failed
 	 earlier), and we're overwriting. Manually remove the target so we can do the rename. */
-      res = smbc_unlink (op_backend->smb_context, dest_uri);
+      res = smbc_unlink (context->smb_context, dest_uri);
       errsv = errno;
       if (res == -1)
 	{
@@ -2206,13 +3052,14 @@ do_move (GVfsBackend *backend,
 			    g_strerror (errsv));
 	  g_free (source_uri);
 	  g_free (dest_uri);
+	  smb_context_release (op_backend, context);
 	  return;
 	}
     }
 
   
-  res = smbc_rename (op_backend->smb_context, source_uri,
-					 op_backend->smb_context, dest_uri);
+  res = smbc_rename (context->smb_context, source_uri,
+					 context->smb_context, dest_uri);
   errsv = errno;
   g_free (source_uri);
   g_free (dest_uri);
@@ -2232,6 +3079,482 @@ do_move (GVfsBackend *backend,
     }
   else
     g_vfs_job_succeeded (G_VFS_JOB (job));
+
+  smb_context_release (op_backend, context);
+}
+
+/* Checks the destination of a copy, pull or push and moves an existing
+ * file out of the way if a backup was requested */
+static gboolean
+prepare_copy_destination (GVfsBackendSmb *op_backend,
+			  SmbContext *context,
+			  GVfsJob *job,
+			  const char *dest_uri,
+			  gboolean source_is_dir,
+			  GFileCopyFlags flags)
+{
+  struct stat statbuf;
+  char *backup_uri;
+  int res;
+  smbc_stat_fn smbc_stat;
+  smbc_rename_fn smbc_rename;
+
+  smbc_stat = smbc_getFunctionStat (context->smb_context);
+  smbc_rename = smbc_getFunctionRename (context->smb_context);
+
+  res = smbc_stat (context->smb_context, dest_uri, &statbuf);
+  if (res == 0)
+    {
+      if (!(flags & G_FILE_COPY_OVERWRITE))
+	{
+	  g_vfs_job_failed (job,
+			    G_IO_ERROR,
+			    G_IO_ERROR_EXISTS,
+			    _("Target file already exists"));
+	  return FALSE;
+	}
+
+      if (S_ISDIR (statbuf.st_mode))
+	{
+	  if (source_is_dir)
+	    g_vfs_job_failed (job,
+			      G_IO_ERROR,
+			      G_IO_ERROR_WOULD_MERGE,
+			      _("Can't copy directory over directory"));
+	  else
+	    g_vfs_job_failed (job,
+			      G_IO_ERROR,
+			      G_IO_ERROR_IS_DIRECTORY,
+			      _("Can't copy file over directory"));
+	  return FALSE;
+	}
+    }
+
+  if (source_is_dir)
+    {
+      g_vfs_job_failed (job,
+			G_IO_ERROR,
+			G_IO_ERROR_WOULD_RECURSE,
+			_("Can't recursively copy directory"));
+      return FALSE;
+    }
+
+  if (res == 0 && (flags & G_FILE_COPY_BACKUP))
+    {
+      backup_uri = g_strconcat (dest_uri, "~", NULL);
+      res = smbc_rename (context->smb_context, dest_uri,
+			 context->smb_context, backup_uri);
+      g_free (backup_uri);
+      if (res == -1)
+	{
+	  g_vfs_job_failed (job,
+			    G_IO_ERROR,
+			    G_IO_ERROR_CANT_CREATE_BACKUP,
+			    _("Backup file creation failed"));
+	  return FALSE;
+	}
+    }
+
+  return TRUE;
+}
+
+static void
+do_copy (GVfsBackend *backend,
+	 GVfsJobCopy *job,
+	 const char *source,
+	 const char *destination,
+	 GFileCopyFlags flags,
+	 GFileProgressCallback progress_callback,
+	 gpointer progress_callback_data)
+{
+  GVfsBackendSmb *op_backend = G_VFS_BACKEND_SMB (backend);
+  SmbContext *context;
+  char *source_uri, *dest_uri;
+  struct stat statbuf;
+  int res;
+  GError *error;
+  smbc_stat_fn smbc_stat;
+  smbc_unlink_fn smbc_unlink;
+
+  stat_cache_invalidate (op_backend);
+  context = smb_context_acquire (op_backend, G_VFS_JOB (job));
+  if (context == NULL)
+    return;
+
+  source_uri = create_smb_uri (op_backend->server, op_backend->share, source);
+  dest_uri = create_smb_uri (op_backend->server, op_backend->share, destination);
+
+  smbc_stat = smbc_getFunctionStat (context->smb_context);
+  smbc_unlink = smbc_getFunctionUnlink (context->smb_context);
+
+  res = smbc_stat (context->smb_context, source_uri, &statbuf);
+  if (res == -1)
+    {
+      g_vfs_job_failed_from_errno (G_VFS_JOB (job), errno);
+      goto out;
+    }
+
+  if (!prepare_copy_destination (op_backend, context, G_VFS_JOB (job), dest_uri,
+				 S_ISDIR (statbuf.st_mode), flags))
+    goto out;
+
+  error = NULL;
+  if (copy_file (op_backend, context, G_VFS_JOB (job), source_uri, dest_uri,
+		 progress_callback, progress_callback_data, &error))
+    {
+      g_vfs_job_succeeded (G_VFS_JOB (job));
+      goto out;
+    }
+
+  smbc_unlink (context->smb_context, dest_uri);
+
+  g_vfs_job_failed_from_error (G_VFS_JOB (job), error);
+  g_error_free (error);
+
+ out:
+  smb_context_release (op_backend, context);
+  g_free (source_uri);
+  g_free (dest_uri);
+}
+
+static void
+do_pull (GVfsBackend *backend,
+	 GVfsJobPull *job,
+	 const char *source,
+	 const char *local_path,
+	 GFileCopyFlags flags,
+	 gboolean remove_source,
+	 GFileProgressCallback progress_callback,
+	 gpointer progress_callback_data)
+{
+  GVfsBackendSmb *op_backend = G_VFS_BACKEND_SMB (backend);
+  SmbContext *context;
+  GCancellable *cancellable = G_VFS_JOB (job)->cancellable;
+  char *uri;
+  struct stat statbuf;
+  SMBCFILE *file;
+  GFile *dest;
+  GFileOutputStream *output;
+  GCancellable *abort;
+  gboolean dest_existed;
+  GError *error;
+  char *buffer;
+  ssize_t res;
+  goffset current;
+  smbc_stat_fn smbc_stat;
+  smbc_open_fn smbc_open;
+  smbc_read_fn smbc_read;
+  smbc_close_fn smbc_close;
+  smbc_unlink_fn smbc_unlink;
+
+  if (remove_source)
+    stat_cache_invalidate (op_backend);
+  context = smb_context_acquire (op_backend, G_VFS_JOB (job));
+  if (context == NULL)
+    return;
+
+  uri = create_smb_uri (op_backend->server, op_backend->share, source);
+  dest = g_file_new_for_path (local_path);
+  file = NULL;
+  output = NULL;
+  buffer = NULL;
+  error = NULL;
+
+  smbc_stat = smbc_getFunctionStat (context->smb_context);
+  smbc_open = smbc_getFunctionOpen (context->smb_context);
+  smbc_read = smbc_getFunctionRead (context->smb_context);
+  smbc_close = smbc_getFunctionClose (context->smb_context);
+  smbc_unlink = smbc_getFunctionUnlink (context->smb_context);
+
+  res = smbc_stat (context->smb_context, uri, &statbuf);
+  if (res == -1)
+    {
+      g_vfs_job_failed_from_errno (G_VFS_JOB (job), errno);
+      goto out;
+    }
+
+  if (S_ISDIR (statbuf.st_mode))
+    {
+      GFileType file_type;
+
+      file_type = g_file_query_file_type (dest, G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+					  cancellable);
+      if (file_type != G_FILE_TYPE_UNKNOWN && !(flags & G_FILE_COPY_OVERWRITE))
+	g_vfs_job_failed (G_VFS_JOB (job), G_IO_ERROR, G_IO_ERROR_EXISTS,
+			  _("Target file already exists"));
+      else if (file_type == G_FILE_TYPE_DIRECTORY)
+	g_vfs_job_failed (G_VFS_JOB (job), G_IO_ERROR, G_IO_ERROR_WOULD_MERGE,
+			  _("Can't copy directory over directory"));
+      else
+	g_vfs_job_failed (G_VFS_JOB (job), G_IO_ERROR, G_IO_ERROR_WOULD_RECURSE,
+			  _("Can't recursively copy directory"));
+      goto out;
+    }
+
+  errno = 0;
+  file = smbc_open (context->smb_context, uri, O_RDONLY, 0);
+  if (file == NULL)
+    {
+      g_vfs_job_failed_from_errno (G_VFS_JOB (job), fixup_open_errno (errno));
+      goto out;
+    }
+
+  /* A replace of a file that didn't exist writes it in place */
+  dest_existed = FALSE;
+  if (flags & G_FILE_COPY_OVERWRITE)
+    dest_existed = g_file_query_file_type (dest, G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+					   cancellable) != G_FILE_TYPE_UNKNOWN;
+
+  if (flags & G_FILE_COPY_OVERWRITE)
+    output = g_file_replace (dest,
+			     NULL,
+			     flags & G_FILE_COPY_BACKUP ? TRUE : FALSE,
+			     G_FILE_CREATE_REPLACE_DESTINATION,
+			     cancellable, &error);
+  else
+    output = g_file_create (dest, 0, cancellable, &error);
+  if (output == NULL)
+    goto error;
+
+  buffer = g_malloc (SMB_BULK_BUFFER_SIZE);
+  current = 0;
+
+  while (TRUE)
+    {
+      res = smbc_read (context->smb_context, file, buffer, SMB_BULK_BUFFER_SIZE);
+      if (res == -1)
+	{
+	  int errsv = errno;
+
+	  g_set_error_literal (&error, G_IO_ERROR,
+			       g_io_error_from_errno (errsv),
+			       g_strerror (errsv));
+	  goto error;
+	}
+      if (res == 0)
+	break;
+
+      if (smb_context_is_dying (context))
+	{
+	  g_set_error_literal (&error, G_IO_ERROR, G_IO_ERROR_NOT_MOUNTED,
+			       _("The specified location is not mounted"));
+	  goto error;
+	}
+
+      if (!g_output_stream_write_all (G_OUTPUT_STREAM (output), buffer, res,
+				      NULL, cancellable, &error))
+	goto error;
+
+      current += res;
+      if (progress_callback)
+	progress_callback (current, statbuf.st_size, progress_callback_data);
+    }
+
+  if (!g_output_stream_close (G_OUTPUT_STREAM (output), cancellable, &error))
+    goto error;
+
+  if (remove_source &&
+      smbc_unlink (context->smb_context, uri) == -1)
+    {
+      g_vfs_job_failed_from_errno (G_VFS_JOB (job), errno);
+      goto out;
+    }
+
+  g_vfs_job_succeeded (G_VFS_JOB (job));
+  goto out;
+
+ error:
+  g_vfs_job_failed_from_error (G_VFS_JOB (job), error);
+  g_error_free (error);
+
+  if (output)
+    {
+      /* Closing with a cancelled cancellable discards a replace and
+         keeps the original, a new file has to go though */
+      abort = g_cancellable_new ();
+      g_cancellable_cancel (abort);
+      g_output_stream_close (G_OUTPUT_STREAM (output), abort, NULL);
+      g_object_unref (abort);
+
+      if (!dest_existed)
+	g_file_delete (dest, NULL, NULL);
+    }
+
+ out:
+  if (file)
+    smbc_close (context->smb_context, file);
+  smb_context_release (op_backend, context);
+  if (output)
+    g_object_unref (output);
+  g_object_unref (dest);
+  g_free (buffer);
+  g_free (uri);
+}
+
+static void
+do_push (GVfsBackend *backend,
+	 GVfsJobPush *job,
+	 const char *destination,
+	 const char *local_path,
+	 GFileCopyFlags flags,
+	 gboolean remove_source,
+	 GFileProgressCallback progress_callback,
+	 gpointer progress_callback_data)
+{
+  GVfsBackendSmb *op_backend = G_VFS_BACKEND_SMB (backend);
+  SmbContext *context;
+  GCancellable *cancellable = G_VFS_JOB (job)->cancellable;
+  char *uri;
+  SMBCFILE *file;
+  GFile *source;
+  GFileInfo *info;
+  GFileInputStream *input;
+  GError *error;
+  char *buffer, *p;
+  gssize res;
+  ssize_t written;
+  goffset current, total_size;
+  smbc_open_fn smbc_open;
+  smbc_write_fn smbc_write;
+  smbc_close_fn smbc_close;
+  smbc_unlink_fn smbc_unlink;
+
+  stat_cache_invalidate (op_backend);
+  context = smb_context_acquire (op_backend, G_VFS_JOB (job));
+  if (context == NULL)
+    return;
+
+  uri = create_smb_uri (op_backend->server, op_backend->share, destination);
+  source = g_file_new_for_path (local_path);
+  file = NULL;
+  input = NULL;
+  buffer = NULL;
+  error = NULL;
+
+  smbc_open = smbc_getFunctionOpen (context->smb_context);
+  smbc_write = smbc_getFunctionWrite (context->smb_context);
+  smbc_close = smbc_getFunctionClose (context->smb_context);
+  smbc_unlink = smbc_getFunctionUnlink (context->smb_context);
+
+  info = g_file_query_info (source,
+			    G_FILE_ATTRIBUTE_STANDARD_TYPE ","
+			    G_FILE_ATTRIBUTE_STANDARD_SIZE,
+			    G_FILE_QUERY_INFO_NONE,
+			    cancellable, &error);
+  if (info == NULL)
+    goto error;
+
+  total_size = g_file_info_get_size (info);
+
+  if (!prepare_copy_destination (op_backend, context, G_VFS_JOB (job), uri,
+				 g_file_info_get_file_type (info) == G_FILE_TYPE_DIRECTORY,
+				 flags))
+    {
+      g_object_unref (info);
+      goto out;
+    }
+  g_object_unref (info);
+
+  input = g_file_read (source, cancellable, &error);
+  if (input == NULL)
+    goto error;
+
+  errno = 0;
+  file = smbc_open (context->smb_context, uri,
+		    O_CREAT|O_WRONLY|O_TRUNC, 0666);
+  if (file == NULL)
+    {
+      g_vfs_job_failed_from_errno (G_VFS_JOB (job), fixup_open_errno (errno));
+      goto out;
+    }
+
+  buffer = g_malloc (SMB_BULK_BUFFER_SIZE);
+  current = 0;
+
+  while (TRUE)
+    {
+      res = g_input_stream_read (G_INPUT_STREAM (input), buffer, SMB_BULK_BUFFER_SIZE,
+				 cancellable, &error);
+      if (res == -1)
+	goto error_unlink;
+      if (res == 0)
+	break;
+
+      if (smb_context_is_dying (context))
+	{
+	  g_set_error_literal (&error, G_IO_ERROR, G_IO_ERROR_NOT_MOUNTED,
+			       _("The specified location is not mounted"));
+	  goto error_unlink;
+	}
+
+      p = buffer;
+      while (res > 0)
+	{
+	  written = smbc_write (context->smb_context, file, p, res);
+	  if (written == -1)
+	    {
+	      int errsv = errno;
+
+	      g_set_error_literal (&error, G_IO_ERROR,
+				   g_io_error_from_errno (errsv),
+				   g_strerror (errsv));
+	      goto error_unlink;
+	    }
+	  /* Would loop forever otherwise */
+	  if (written == 0)
+	    {
+	      g_set_error_literal (&error, G_IO_ERROR, G_IO_ERROR_FAILED,
+				   _("Server wrote less data than requested"));
+	      goto error_unlink;
+	    }
+	  res -= written;
+	  p += written;
+	  current += written;
+	}
+
+      if (progress_callback)
+	progress_callback (current, total_size, progress_callback_data);
+    }
+
+  res = smbc_close (context->smb_context, file);
+  file = NULL;
+  if (res == -1)
+    {
+      int errsv = errno;
+
+      g_set_error_literal (&error, G_IO_ERROR,
+			   g_io_error_from_errno (errsv),
+			   g_strerror (errsv));
+      goto error_unlink;
+    }
+
+  if (remove_source && !g_file_delete (source, cancellable, &error))
+    goto error;
+
+  g_vfs_job_succeeded (G_VFS_JOB (job));
+  goto out;
+
+ error_unlink:
+  if (file)
+    {
+      smbc_close (context->smb_context, file);
+      file = NULL;
+    }
+  smbc_unlink (context->smb_context, uri);
+
+ error:
+  g_vfs_job_failed_from_error (G_VFS_JOB (job), error);
+  g_error_free (error);
+
+ out:
+  if (file)
+    smbc_close (context->smb_context, file);
+  smb_context_release (op_backend, context);
+  if (input)
+    g_object_unref (input);
+  g_object_unref (source);
+  g_free (buffer);
+  g_free (uri);
 }
 
 static void
@@ -2264,6 +3587,9 @@ g_vfs_backend_smb_class_init (GVfsBackendSmbClass *klass)
   backend_class->delete = do_delete;
   backend_class->make_directory = do_make_directory;
   backend_class->move = do_move;
+  backend_class->copy = do_copy;
+  backend_class->pull = do_pull;
+  backend_class->push = do_push;
   backend_class->try_query_settable_attributes = try_query_settable_attributes;
   backend_class->set_attribute = do_set_attribute;
 }
@@ -2272,4 +3598,9 @@ void
 g_vfs_smb_daemon_init (void)
 {
   g_set_application_name (_("Windows Shares File System Service"));
+
+#ifdef HAVE_SAMBA_THREAD_POSIX
+  /* Contexts are used from several job threads */
+  smbc_thread_posix ();
+#endif
 }
@@ -41,6 +41,8 @@
 #include "gvfsjobseekread.h"
 #include "gvfsjobqueryinfo.h"
 #include "gvfsjobenumerate.h"
+#include "gvfsjobcreatemonitor.h"
+#include "gvfsmonitor.h"
 #include "gvfsdaemonprotocol.h"
 #include "gvfskeyring.h"
 #include "gmounttracker.h"
@@ -54,6 +56,11 @@
 /* Time in seconds before we mark dirents cache outdated */
 #define DEFAULT_CACHE_EXPIRATION_TIME 10
 
+/* Time in seconds a browse list saved on disk is considered for use
+   on mount; it is refreshed in the background right away anyway */
+#define BROWSE_CACHE_MAX_AGE (7 * 24 * 60 * 60)
+
+#define BROWSE_CACHE_GROUP "Browse"
 
 #define PRINT_DEBUG 
 
@@ -99,6 +106,10 @@ struct _GVfsBackendSmbBrowse
   time_t last_entry_update;
   GList *entries;
   int entry_errno;
+  gboolean entries_from_disk;
+  volatile gint refreshing;
+
+  GVfsMonitor *root_monitor;
 };
 
 
@@ -169,6 +180,24 @@ smb_name_to_utf8 (const char *name, gboolean *valid_utf8_out)
   return g_string_free (string, FALSE);
 }
 
+static BrowseEntry *
+browse_entry_new (unsigned int smbc_type,
+		  const char *name,
+		  const char *comment)
+{
+  BrowseEntry *entry;
+  gboolean valid_utf8;
+
+  entry = g_new (BrowseEntry, 1);
+  entry->smbc_type = smbc_type;
+  entry->name = g_strdup (name);
+  entry->name_utf8 = smb_name_to_utf8 (name, &valid_utf8);
+  entry->name_normalized = normalize_smb_name_helper (name, -1, valid_utf8);
+  entry->comment = smb_name_to_utf8 (comment, NULL);
+
+  return entry;
+}
+
 static void
 browse_entry_free (BrowseEntry *entry)
 {
@@ -232,6 +261,9 @@ g_vfs_backend_smb_browse_finalize (GObject *object)
   smbc_free_context (backend->smb_context, TRUE);
   
   g_list_free_full (backend->entries, (GDestroyNotify)browse_entry_free);
+
+  if (backend->root_monitor)
+    g_object_unref (backend->root_monitor);
   
   if (G_OBJECT_CLASS (g_vfs_backend_smb_browse_parent_class)->finalize)
     (*G_OBJECT_CLASS (g_vfs_backend_smb_browse_parent_class)->finalize) (object);
@@ -595,6 +627,256 @@ g_string_append_encoded (GString *string,
     }
 }
 
+static char *
+get_browse_cache_filename (GVfsBackendSmbBrowse *backend)
+{
+  char *name, *escaped, *basename, *filename;
+
+  /* Only anonymous browse lists are shared between mounts */
+  if (backend->user != NULL || backend->domain != NULL)
+    return NULL;
+
+  /* Prefixed so that a server called "network" gets its own file */
+  if (backend->server)
+    {
+      name = normalize_smb_name (backend->server, -1);
+      escaped = g_uri_escape_string (name, NULL, FALSE);
+      basename = g_strconcat ("server-", escaped, NULL);
+      g_free (escaped);
+      g_free (name);
+    }
+  else
+    basename = g_strdup ("network");
+
+  filename = g_build_filename (g_get_user_cache_dir (),
+			       "gvfs", "smb-browse", basename, NULL);
+  g_free (basename);
+
+  return filename;
+}
+
+/* Loads the browse list saved by an earlier mount of the same
+ * workgroup or server, so it can be served before the browse master
+ * answers. */
+static gboolean
+load_browse_cache (GVfsBackendSmbBrowse *backend)
+{
+  GKeyFile *key_file;
+  char *filename;
+  char **names, **comments;
+  gint *types;
+  gsize n_names, n_types, n_comments, i;
+  gint64 timestamp, now;
+  GList *entries;
+  gboolean res;
+
+  filename = get_browse_cache_filename (backend);
+  if (filename == NULL)
+    return FALSE;
+
+  res = FALSE;
+  names = NULL;
+  comments = NULL;
+  types = NULL;
+
+  key_file = g_key_file_new ();
+  if (!g_key_file_load_from_file (key_file, filename, G_KEY_FILE_NONE, NULL))
+    goto out;
+
+  timestamp = g_key_file_get_int64 (key_file, BROWSE_CACHE_GROUP, "Timestamp", NULL);
+  now = g_get_real_time () / G_USEC_PER_SEC;
+  if (timestamp > now || now - timestamp > BROWSE_CACHE_MAX_AGE)
+    goto out;
+
+  names = g_key_file_get_string_list (key_file, BROWSE_CACHE_GROUP, "Names", &n_names, NULL);
+  types = g_key_file_get_integer_list (key_file, BROWSE_CACHE_GROUP, "Types", &n_types, NULL);
+  comments = g_key_file_get_string_list (key_file, BROWSE_CACHE_GROUP, "Comments", &n_comments, NULL);
+  if (names == NULL || types == NULL || comments == NULL ||
+      n_names == 0 || n_names != n_types || n_names != n_comments)
+    goto out;
+
+  entries = NULL;
+  for (i = 0; i < n_names; i++)
+    entries = g_list_prepend (entries, browse_entry_new (types[i], names[i], comments[i]));
+
+  g_mutex_lock (&backend->entries_lock);
+  g_list_free_full (backend->entries, (GDestroyNotify)browse_entry_free);
+  backend->entries = g_list_reverse (entries);
+  backend->entry_errno = 0;
+  backend->entries_from_disk = TRUE;
+  backend->last_entry_update = time (NULL);
+  g_mutex_unlock (&backend->entries_lock);
+
+  DEBUG ("load_browse_cache - loaded %d entries from %s\n", (int)n_names, filename);
+  res = TRUE;
+
+ out:
+  g_strfreev (names);
+  g_strfreev (comments);
+  g_free (types);
+  g_key_file_free (key_file);
+  g_free (filename);
+
+  return res;
+}
+
+static void
+save_browse_cache (GVfsBackendSmbBrowse *backend,
+		   GList *entries)
+{
+  GKeyFile *key_file;
+  GError *error;
+  GList *l;
+  char *filename, *dirname, *data;
+  const char **names, **comments;
+  gint *types;
+  gsize length, n;
+
+  filename = get_browse_cache_filename (backend);
+  if (filename == NULL)
+    return;
+
+  length = g_list_length (entries);
+  names = g_new0 (const char *, length + 1);
+  comments = g_new0 (const char *, length + 1);
+  types = g_new0 (gint, length + 1);
+
+  n = 0;
+  for (l = entries; l != NULL; l = l->next)
+    {
+      BrowseEntry *entry = l->data;
+
+      /* Key file values have to be UTF-8 */
+      if (!g_utf8_validate (entry->name, -1, NULL))
+	continue;
+
+      names[n] = entry->name;
+      comments[n] = entry->comment;
+      types[n] = entry->smbc_type;
+      n++;
+    }
+
+  key_file = g_key_file_new ();
+  g_key_file_set_int64 (key_file, BROWSE_CACHE_GROUP, "Timestamp",
+			g_get_real_time () / G_USEC_PER_SEC);
+  g_key_file_set_string_list (key_file, BROWSE_CACHE_GROUP, "Names", names, n);
+  g_key_file_set_integer_list (key_file, BROWSE_CACHE_GROUP, "Types", types, n);
+  g_key_file_set_string_list (key_file, BROWSE_CACHE_GROUP, "Comments", comments, n);
+  data = g_key_file_to_data (key_file, &length, NULL);
+
+  dirname = g_path_get_dirname (filename);
+  g_mkdir_with_parents (dirname, 0700);
+
+  error = NULL;
+  if (!g_file_set_contents (filename, data, length, &error))
+    {
+      DEBUG ("save_browse_cache - failed to write %s: %s\n", filename, error->message);
+      g_error_free (error);
+    }
+
+  g_free (dirname);
+  g_free (data);
+  g_key_file_free (key_file);
+  g_free (names);
+  g_free (comments);
+  g_free (types);
+  g_free (filename);
+}
+
+typedef struct {
+  GVfsBackendSmbBrowse *backend;
+  GList *created;
+  GList *deleted;
+} CacheDelta;
+
+static gboolean
+entries_contain_name (GList *entries,
+		      const char *name)
+{
+  GList *l;
+
+  for (l = entries; l != NULL; l = l->next)
+    {
+      BrowseEntry *entry = l->data;
+
+      if (strcmp (entry->name, name) == 0)
+	return TRUE;
+    }
+
+  return FALSE;
+}
+
+static void
+emit_cache_delta_events (GVfsMonitor *monitor,
+			 GList *names,
+			 GFileMonitorEvent event_type)
+{
+  GList *l;
+  char *path;
+
+  for (l = names; l != NULL; l = l->next)
+    {
+      path = g_strconcat ("/", (char *)l->data, NULL);
+      g_vfs_monitor_emit_event (monitor, event_type, path, NULL);
+      g_free (path);
+    }
+}
+
+/* Monitor subscribers are only touched from the main thread */
+static gboolean
+emit_cache_delta_idle (gpointer user_data)
+{
+  CacheDelta *delta = user_data;
+
+  emit_cache_delta_events (delta->backend->root_monitor, delta->deleted,
+			   G_FILE_MONITOR_EVENT_DELETED);
+  emit_cache_delta_events (delta->backend->root_monitor, delta->created,
+			   G_FILE_MONITOR_EVENT_CREATED);
+
+  g_list_free_full (delta->created, g_free);
+  g_list_free_full (delta->deleted, g_free);
+  g_object_unref (delta->backend);
+  g_free (delta);
+
+  return FALSE;
+}
+
+static void
+queue_cache_delta (GVfsBackendSmbBrowse *backend,
+		   GList *old_entries,
+		   GList *new_entries)
+{
+  CacheDelta *delta;
+  GList *l;
+
+  delta = g_new0 (CacheDelta, 1);
+
+  for (l = new_entries; l != NULL; l = l->next)
+    {
+      BrowseEntry *entry = l->data;
+
+      if (!entries_contain_name (old_entries, entry->name))
+	delta->created = g_list_prepend (delta->created, g_strdup (entry->name));
+    }
+
+  for (l = old_entries; l != NULL; l = l->next)
+    {
+      BrowseEntry *entry = l->data;
+
+      if (!entries_contain_name (new_entries, entry->name))
+	delta->deleted = g_list_prepend (delta->deleted, g_strdup (entry->name));
+    }
+
+  if (delta->created == NULL && delta->deleted == NULL)
+    {
+      g_free (delta);
+      return;
+    }
+
+  delta->backend = g_object_ref (backend);
+  g_idle_add (emit_cache_delta_idle, delta);
+}
+
 static gboolean
 update_cache (GVfsBackendSmbBrowse *backend, SMBCFILE *supplied_dir)
 {
@@ -661,15 +943,9 @@ update_cache (GVfsBackendSmbBrowse *backend, SMBCFILE *supplied_dir)
 	      strcmp (dirp->name, ".") != 0 &&
 	      strcmp (dirp->name, "..") != 0)
 	    {
-	      BrowseEntry *entry = g_new (BrowseEntry, 1);
-	      gboolean valid_utf8;
-
-	      entry->smbc_type = dirp->smbc_type;
-	      entry->name = g_strdup (dirp->name);
-	      entry->name_utf8 = smb_name_to_utf8 (dirp->name, &valid_utf8);
-	      entry->name_normalized = normalize_smb_name_helper (dirp->name, -1, valid_utf8);
-	      entry->comment = smb_name_to_utf8 (dirp->comment, NULL);
-	      
+	      BrowseEntry *entry;
+
+	      entry = browse_entry_new (dirp->smbc_type, dirp->name, dirp->comment);
 	      entries = g_list_prepend (entries, entry);
 	    }
 		  
@@ -688,16 +964,34 @@ update_cache (GVfsBackendSmbBrowse *backend, SMBCFILE *supplied_dir)
  out:
 
   g_mutex_lock (&backend->entries_lock);
-  
-  /* Clear old cache */
-  g_list_free_full (backend->entries, (GDestroyNotify)browse_entry_free);
-  backend->entries = entries;
-  backend->entry_errno = entry_errno;
+
+  if (res < 0 && backend->entries_from_disk)
+    {
+      /* Keep serving the saved list, the browse master may just be slow */
+      DEBUG ("update_cache - failed, keeping persistent cache\n");
+      g_list_free_full (entries, (GDestroyNotify)browse_entry_free);
+    }
+  else
+    {
+      if (backend->root_monitor)
+        queue_cache_delta (backend, backend->entries, entries);
+
+      /* Clear old cache */
+      g_list_free_full (backend->entries, (GDestroyNotify)browse_entry_free);
+      backend->entries = entries;
+      backend->entry_errno = entry_errno;
+      backend->entries_from_disk = FALSE;
+    }
   backend->last_entry_update = time (NULL);
 
   DEBUG ("update_cache - done.\n");
 
   g_mutex_unlock (&backend->entries_lock);
+
+  /* The entries list is only replaced with update_cache_lock held */
+  if (res >= 0)
+    save_browse_cache (backend, backend->entries);
+
   g_mutex_unlock (&backend->update_cache_lock);
 
   return (res >= 0);
@@ -813,6 +1107,10 @@ cache_needs_updating (GVfsBackendSmbBrowse *backend)
   time_t now;
   gboolean res;
 
+  /* Serve the persistent cache while it is being refreshed */
+  if (g_atomic_int_get (&backend->refreshing))
+    return FALSE;
+
   /*  If there's already cache update in progress, lock and wait until update is finished, then recheck  */
   g_mutex_lock (&backend->update_cache_lock);
   now = time (NULL);
@@ -823,6 +1121,19 @@ cache_needs_updating (GVfsBackendSmbBrowse *backend)
   return res; 
 }
 
+static gpointer
+refresh_cache_thread (gpointer user_data)
+{
+  GVfsBackendSmbBrowse *backend = user_data;
+
+  update_cache (backend, NULL);
+  g_atomic_int_set (&backend->refreshing, FALSE);
+
+  g_object_unref (backend);
+
+  return NULL;
+}
+
 static void
 do_mount (GVfsBackend *backend,
 	  GVfsJobMount *job,
@@ -945,10 +1256,26 @@ do_mount (GVfsBackend *backend,
   g_vfs_backend_set_mount_spec (backend, browse_mount_spec);
   g_mount_spec_unref (browse_mount_spec);
 
-  op_backend->mount_source = mount_source;
+  op_backend->root_monitor = g_vfs_monitor_new (backend);
+
   op_backend->mount_try = 0;
   op_backend->password_save = G_PASSWORD_SAVE_NEVER;
 
+  /* Browsing the network can take many seconds on large domains, so
+   * when a list was saved earlier finish the mount right away and
+   * refresh it in the background. Changes are pushed to monitors. */
+  if (load_browse_cache (op_backend))
+    {
+      DEBUG ("do_mount - using persistent cache, refreshing in background\n");
+      g_atomic_int_set (&op_backend->refreshing, TRUE);
+      g_thread_unref (g_thread_new ("smb-browse-refresh", refresh_cache_thread,
+				    g_object_ref (op_backend)));
+      g_vfs_job_succeeded (G_VFS_JOB (job));
+      return;
+    }
+
+  op_backend->mount_source = mount_source;
+
   smbc_opendir = smbc_getFunctionOpendir (smb_context);
   smbc_closedir = smbc_getFunctionClosedir (smb_context);
 
@@ -1503,6 +1830,28 @@ try_enumerate (GVfsBackend *backend,
   return TRUE;
 }
 
+static gboolean
+try_create_dir_monitor (GVfsBackend *backend,
+			GVfsJobCreateMonitor *job,
+			const char *filename,
+			GFileMonitorFlags flags)
+{
+  GVfsBackendSmbBrowse *op_backend = G_VFS_BACKEND_SMB_BROWSE (backend);
+
+  if (!is_root (filename) || op_backend->root_monitor == NULL)
+    {
+      g_vfs_job_failed (G_VFS_JOB (job),
+			G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+			_("Can't monitor file or directory."));
+      return TRUE;
+    }
+
+  g_vfs_job_create_monitor_set_monitor (job, op_backend->root_monitor);
+  g_vfs_job_succeeded (G_VFS_JOB (job));
+
+  return TRUE;
+}
+
 static void
 g_vfs_backend_smb_browse_class_init (GVfsBackendSmbBrowseClass *klass)
 {
@@ -1524,6 +1873,7 @@ g_vfs_backend_smb_browse_class_init (GVfsBackendSmbBrowseClass *klass)
   backend_class->try_query_info = try_query_info;
   backend_class->enumerate = do_enumerate;
   backend_class->try_enumerate = try_enumerate;
+  backend_class->try_create_dir_monitor = try_create_dir_monitor;
 }
 
 void
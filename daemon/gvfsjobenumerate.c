@@ -33,6 +33,18 @@
 #include "gvfsdaemonprotocol.h"
 #include <gvfsdbus.h>
 
+/* The first batch is sent early so the client can show something,
+ * later ones when they reach about this size */
+#define FIRST_BATCH_INFOS 50
+#define BATCH_SIZE (64 * 1024)
+
+/* The client replies to GotInfo once it has room for more, backends
+ * enumerating on a thread can wait while this many batches are
+ * unanswered */
+#define MAX_BATCHES_IN_FLIGHT 4
+/* Don't let a client that never reads hold the thread forever */
+#define IN_FLIGHT_TIMEOUT (60 * G_TIME_SPAN_SECOND)
+
 G_DEFINE_TYPE (GVfsJobEnumerate, g_vfs_job_enumerate, G_VFS_TYPE_JOB_DBUS)
 
 static void         run        (GVfsJob        *job);
@@ -54,6 +66,8 @@ g_vfs_job_enumerate_finalize (GObject *object)
   g_file_attribute_matcher_unref (job->attribute_matcher);
   g_free (job->object_path);
   g_free (job->uri);
+  g_mutex_clear (&job->in_flight_lock);
+  g_cond_clear (&job->in_flight_cond);
   
   if (G_OBJECT_CLASS (g_vfs_job_enumerate_parent_class)->finalize)
     (*G_OBJECT_CLASS (g_vfs_job_enumerate_parent_class)->finalize) (object);
@@ -76,6 +90,8 @@ g_vfs_job_enumerate_class_init (GVfsJobEnumerateClass *klass)
 static void
 g_vfs_job_enumerate_init (GVfsJobEnumerate *job)
 {
+  g_mutex_init (&job->in_flight_lock);
+  g_cond_init (&job->in_flight_cond);
 }
 
 gboolean 
@@ -121,12 +137,20 @@ create_enumerator_proxy (GVfsJobEnumerate *job)
   connection = g_dbus_method_invocation_get_connection (G_VFS_JOB_DBUS (job)->invocation);
   sender = g_dbus_method_invocation_get_sender (G_VFS_JOB_DBUS (job)->invocation);
 
-  return gvfs_dbus_enumerator_proxy_new_sync (connection,
-                                              G_DBUS_PROXY_FLAGS_DO_NOT_LOAD_PROPERTIES | G_DBUS_PROXY_FLAGS_DO_NOT_CONNECT_SIGNALS,
-                                              sender,
-                                              job->object_path,
-                                              NULL,
-                                              NULL);
+  GVfsDBusEnumerator *proxy;
+
+  proxy = gvfs_dbus_enumerator_proxy_new_sync (connection,
+                                               G_DBUS_PROXY_FLAGS_DO_NOT_LOAD_PROPERTIES | G_DBUS_PROXY_FLAGS_DO_NOT_CONNECT_SIGNALS,
+                                               sender,
+                                               job->object_path,
+                                               NULL,
+                                               NULL);
+
+  /* The client delays its reply to GotInfo until it has room */
+  if (proxy != NULL)
+    g_dbus_proxy_set_default_timeout (G_DBUS_PROXY (proxy), G_MAXINT);
+
+  return proxy;
 }
 
 static void
@@ -134,6 +158,7 @@ send_infos_cb (GVfsDBusEnumerator *proxy,
                GAsyncResult *res,
                gpointer user_data)
 {
+  GVfsJobEnumerate *job = user_data;
   GError *error = NULL;
   
   gvfs_dbus_enumerator_call_got_info_finish (proxy, res, &error);
@@ -143,6 +168,40 @@ send_infos_cb (GVfsDBusEnumerator *proxy,
       g_warning ("send_infos_cb: %s (%s, %d)\n", error->message, g_quark_to_string (error->domain), error->code);
       g_error_free (error);
     }
+
+  g_mutex_lock (&job->in_flight_lock);
+  job->n_in_flight--;
+  /* The client is reading again after a timeout */
+  job->ignore_in_flight = FALSE;
+  g_cond_signal (&job->in_flight_cond);
+  g_mutex_unlock (&job->in_flight_lock);
+
+  g_object_unref (job);
+}
+
+/* Blocks a backend enumerating on a thread until the client has caught
+ * up, to keep huge directories from piling up in its memory. Adding
+ * infos never blocks, backends call this between batches while they
+ * hold no locks or connections that other jobs may need. Backends
+ * using try_enumerate() add infos on the main thread and can't wait. */
+void
+g_vfs_job_enumerate_wait_for_client (GVfsJobEnumerate *job)
+{
+  gint64 end_time;
+
+  if (g_main_context_is_owner (g_main_context_default ()))
+    return;
+
+  end_time = g_get_monotonic_time () + IN_FLIGHT_TIMEOUT;
+
+  g_mutex_lock (&job->in_flight_lock);
+  while (job->n_in_flight >= MAX_BATCHES_IN_FLIGHT &&
+         !job->ignore_in_flight)
+    {
+      if (!g_cond_wait_until (&job->in_flight_cond, &job->in_flight_lock, end_time))
+        job->ignore_in_flight = TRUE;
+    }
+  g_mutex_unlock (&job->in_flight_lock);
 }
 
 static void
@@ -152,16 +211,22 @@ send_infos (GVfsJobEnumerate *job)
 
   proxy = create_enumerator_proxy (job);
   g_assert (proxy != NULL);
+
+  g_mutex_lock (&job->in_flight_lock);
+  job->n_in_flight++;
+  g_mutex_unlock (&job->in_flight_lock);
   
   gvfs_dbus_enumerator_call_got_info (proxy,
                                       g_variant_builder_end (job->building_infos),
                                       NULL,
                                       (GAsyncReadyCallback) send_infos_cb,
-                                      NULL);
+                                      g_object_ref (job));
   g_object_unref (proxy);
 
   job->building_infos = NULL;
   job->n_building_infos = 0;
+  job->building_infos_size = 0;
+  job->sent_infos = TRUE;
 }
 
 void
@@ -175,6 +240,7 @@ g_vfs_job_enumerate_add_info (GVfsJobEnumerate *job,
     {
       job->building_infos = g_variant_builder_new (G_VARIANT_TYPE ("aa(suv)"));
       job->n_building_infos = 0;
+      job->building_infos_size = 0;
     }
 
   uri = NULL;
@@ -197,10 +263,15 @@ g_vfs_job_enumerate_add_info (GVfsJobEnumerate *job,
   g_file_info_set_attribute_mask (info, job->attribute_matcher);
 
   v = _g_dbus_append_file_info (info);
+  job->building_infos_size += g_variant_get_size (v);
   g_variant_builder_add_value (job->building_infos, v);
   job->n_building_infos++;
 
-  if (job->n_building_infos == 50)
+  /* Few large batches cost less than many small ones, but the
+   * byte size keeps infos with many attributes from piling up */
+  if (job->sent_infos ?
+      job->building_infos_size >= BATCH_SIZE :
+      job->n_building_infos == FIRST_BATCH_INFOS)
     send_infos (job);
 }
 
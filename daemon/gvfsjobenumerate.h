@@ -53,6 +53,14 @@ struct _GVfsJobEnumerate
 
   GVariantBuilder *building_infos;
   int n_building_infos;
+  gsize building_infos_size;
+  gboolean sent_infos;
+
+  /* GotInfo calls the client hasn't replied to yet */
+  GMutex in_flight_lock;
+  GCond in_flight_cond;
+  int n_in_flight;
+  gboolean ignore_in_flight;
 };
 
 struct _GVfsJobEnumerateClass
@@ -76,6 +84,7 @@ void     g_vfs_job_enumerate_add_info   (GVfsJobEnumerate      *job,
 void     g_vfs_job_enumerate_add_infos  (GVfsJobEnumerate      *job,
 					 const GList           *info);
 void     g_vfs_job_enumerate_done       (GVfsJobEnumerate      *job);
+void     g_vfs_job_enumerate_wait_for_client (GVfsJobEnumerate *job);
 
 G_END_DECLS
 
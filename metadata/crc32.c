@@ -44,6 +44,14 @@
  *
  */
 
+#include <config.h>
+
+#include <string.h>
+#ifdef HAVE_PCLMUL_CRC32
+#include <wmmintrin.h>
+#include <smmintrin.h>
+#endif
+
 #include "crc32.h"
 
 static const guint32 crcTable[256] = {
@@ -81,15 +89,230 @@ static const guint32 crcTable[256] = {
   0xB3667A2EUL, 0xC4614AB8UL, 0x5D681B02UL, 0x2A6F2B94UL, 0xB40BBE37UL, 0xC30C8EA1UL, 0x5A05DF1BUL, 0x2D02EF8DUL
 };
 
-guint32
-metadata_crc32 (const void *ptr, size_t len)
+/* Slice-by-8 tables, crcTables[0] is crcTable and crcTables[k][i] is
+ * the crc of byte i followed by k zero bytes. Filled in on first use.
+ */
+static guint32 crcTables[8][256];
+
+static void
+init_slice_tables (void)
+{
+  guint32 crc;
+  int i, k;
+
+  for (i = 0; i < 256; i++)
+    {
+      crc = crcTable[i];
+      crcTables[0][i] = crc;
+      for (k = 1; k < 8; k++)
+        {
+          crc = crcTable[crc & 0xFF] ^ (crc >> 8);
+          crcTables[k][i] = crc;
+        }
+    }
+}
+
+static guint32
+crc32_bytes (guint32 crc, const guint8 *bp, size_t len)
 {
-  guint32 crc = 0xFFFFFFFF;
-  const guint8 *bp = (const guint8 *) ptr;
   size_t i;
 
   for (i=0; i<len; i++)
     crc = crcTable[(crc ^ bp[i]) & 0xFF] ^ (crc >> 8);
 
-  return crc ^ 0xFFFFFFFF;
+  return crc;
+}
+
+static guint32
+crc32_slice8 (guint32 crc, const guint8 *bp, size_t len)
+{
+#if G_BYTE_ORDER == G_LITTLE_ENDIAN
+  guint32 one, two;
+
+  while (len >= 8)
+    {
+      memcpy (&one, bp, 4);
+      memcpy (&two, bp + 4, 4);
+      one ^= crc;
+      crc =
+        crcTables[7][one & 0xFF] ^
+        crcTables[6][(one >> 8) & 0xFF] ^
+        crcTables[5][(one >> 16) & 0xFF] ^
+        crcTables[4][one >> 24] ^
+        crcTables[3][two & 0xFF] ^
+        crcTables[2][(two >> 8) & 0xFF] ^
+        crcTables[1][(two >> 16) & 0xFF] ^
+        crcTables[0][two >> 24];
+      bp += 8;
+      len -= 8;
+    }
+#endif
+
+  return crc32_bytes (crc, bp, len);
+}
+
+#ifdef HAVE_PCLMUL_CRC32
+
+/* Folding with carry-less multiplication, see "Fast CRC Computation for
+ * Generic Polynomials Using PCLMULQDQ Instruction" (Intel, 2009). The
+ * constants are the bit-reflected ones for the CRC-32 polynomial.
+ * Note that the SSE4.2 crc32 instruction uses the Castagnoli polynomial,
+ * so it can't be used for the existing on-disk checksums.
+ */
+#define PCLMUL_MIN_LEN 64
+
+__attribute__ ((target ("pclmul,sse4.1")))
+static guint32
+crc32_pclmul_fold (guint32 crc, const guint8 *bp, size_t len)
+{
+  static const guint64 k1k2[2] __attribute__ ((aligned (16))) = { 0x0154442bd4, 0x01c6e41596 };
+  static const guint64 k3k4[2] __attribute__ ((aligned (16))) = { 0x01751997d0, 0x00ccaa009e };
+  static const guint64 k5k0[2] __attribute__ ((aligned (16))) = { 0x0163cd6124, 0x0000000000 };
+  static const guint64 poly[2] __attribute__ ((aligned (16))) = { 0x01db710641, 0x01f7011641 };
+  __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+  /* len >= 64 and a multiple of 16 */
+  x1 = _mm_loadu_si128 ((const __m128i *)(bp + 0x00));
+  x2 = _mm_loadu_si128 ((const __m128i *)(bp + 0x10));
+  x3 = _mm_loadu_si128 ((const __m128i *)(bp + 0x20));
+  x4 = _mm_loadu_si128 ((const __m128i *)(bp + 0x30));
+  x1 = _mm_xor_si128 (x1, _mm_cvtsi32_si128 (crc));
+  x0 = _mm_load_si128 ((const __m128i *)k1k2);
+  bp += 64;
+  len -= 64;
+
+  /* Fold four blocks of 16 bytes in parallel */
+  while (len >= 64)
+    {
+      x5 = _mm_clmulepi64_si128 (x1, x0, 0x00);
+      x6 = _mm_clmulepi64_si128 (x2, x0, 0x00);
+      x7 = _mm_clmulepi64_si128 (x3, x0, 0x00);
+      x8 = _mm_clmulepi64_si128 (x4, x0, 0x00);
+
+      x1 = _mm_clmulepi64_si128 (x1, x0, 0x11);
+      x2 = _mm_clmulepi64_si128 (x2, x0, 0x11);
+      x3 = _mm_clmulepi64_si128 (x3, x0, 0x11);
+      x4 = _mm_clmulepi64_si128 (x4, x0, 0x11);
+
+      y5 = _mm_loadu_si128 ((const __m128i *)(bp + 0x00));
+      y6 = _mm_loadu_si128 ((const __m128i *)(bp + 0x10));
+      y7 = _mm_loadu_si128 ((const __m128i *)(bp + 0x20));
+      y8 = _mm_loadu_si128 ((const __m128i *)(bp + 0x30));
+
+      x1 = _mm_xor_si128 (_mm_xor_si128 (x1, x5), y5);
+      x2 = _mm_xor_si128 (_mm_xor_si128 (x2, x6), y6);
+      x3 = _mm_xor_si128 (_mm_xor_si128 (x3, x7), y7);
+      x4 = _mm_xor_si128 (_mm_xor_si128 (x4, x8), y8);
+
+      bp += 64;
+      len -= 64;
+    }
+
+  /* Fold into 128 bits */
+  x0 = _mm_load_si128 ((const __m128i *)k3k4);
+
+  x5 = _mm_clmulepi64_si128 (x1, x0, 0x00);
+  x1 = _mm_clmulepi64_si128 (x1, x0, 0x11);
+  x1 = _mm_xor_si128 (_mm_xor_si128 (x1, x2), x5);
+
+  x5 = _mm_clmulepi64_si128 (x1, x0, 0x00);
+  x1 = _mm_clmulepi64_si128 (x1, x0, 0x11);
+  x1 = _mm_xor_si128 (_mm_xor_si128 (x1, x3), x5);
+
+  x5 = _mm_clmulepi64_si128 (x1, x0, 0x00);
+  x1 = _mm_clmulepi64_si128 (x1, x0, 0x11);
+  x1 = _mm_xor_si128 (_mm_xor_si128 (x1, x4), x5);
+
+  /* Remaining blocks of 16 bytes */
+  while (len >= 16)
+    {
+      x2 = _mm_loadu_si128 ((const __m128i *)bp);
+
+      x5 = _mm_clmulepi64_si128 (x1, x0, 0x00);
+      x1 = _mm_clmulepi64_si128 (x1, x0, 0x11);
+      x1 = _mm_xor_si128 (_mm_xor_si128 (x1, x2), x5);
+
+      bp += 16;
+      len -= 16;
+    }
+
+  /* Fold 128 bits to 64 bits */
+  x2 = _mm_clmulepi64_si128 (x1, x0, 0x10);
+  x3 = _mm_setr_epi32 (~0, 0, ~0, 0);
+  x1 = _mm_srli_si128 (x1, 8);
+  x1 = _mm_xor_si128 (x1, x2);
+
+  x0 = _mm_loadl_epi64 ((const __m128i *)k5k0);
+
+  x2 = _mm_srli_si128 (x1, 4);
+  x1 = _mm_and_si128 (x1, x3);
+  x1 = _mm_clmulepi64_si128 (x1, x0, 0x00);
+  x1 = _mm_xor_si128 (x1, x2);
+
+  /* Barrett reduction to 32 bits */
+  x0 = _mm_load_si128 ((const __m128i *)poly);
+
+  x2 = _mm_and_si128 (x1, x3);
+  x2 = _mm_clmulepi64_si128 (x2, x0, 0x10);
+  x2 = _mm_and_si128 (x2, x3);
+  x2 = _mm_clmulepi64_si128 (x2, x0, 0x00);
+  x1 = _mm_xor_si128 (x1, x2);
+
+  return (guint32) _mm_extract_epi32 (x1, 1);
+}
+
+static guint32
+crc32_pclmul (guint32 crc, const guint8 *bp, size_t len)
+{
+  size_t chunk;
+
+  if (len >= PCLMUL_MIN_LEN)
+    {
+      chunk = len & ~(size_t)15;
+      crc = crc32_pclmul_fold (crc, bp, chunk);
+      bp += chunk;
+      len -= chunk;
+    }
+
+  return crc32_slice8 (crc, bp, len);
+}
+
+#endif /* HAVE_PCLMUL_CRC32 */
+
+typedef guint32 (*crc32_func) (guint32 crc, const guint8 *bp, size_t len);
+
+static crc32_func
+get_crc32_func (void)
+{
+  static gsize func = 0;
+
+  if (g_once_init_enter (&func))
+    {
+      crc32_func f;
+
+      init_slice_tables ();
+      f = crc32_slice8;
+#ifdef HAVE_PCLMUL_CRC32
+      __builtin_cpu_init ();
+      if (__builtin_cpu_supports ("pclmul") &&
+          __builtin_cpu_supports ("sse4.1"))
+        f = crc32_pclmul;
+#endif
+      g_once_init_leave (&func, (gsize)f);
+    }
+
+  return (crc32_func)func;
+}
+
+guint32
+metadata_crc32 (const void *ptr, size_t len)
+{
+  return get_crc32_func () (0xFFFFFFFF, ptr, len) ^ 0xFFFFFFFF;
+}
+
+/* Byte at a time, for checking and benchmarking the above */
+guint32
+metadata_crc32_reference (const void *ptr, size_t len)
+{
+  return crc32_bytes (0xFFFFFFFF, ptr, len) ^ 0xFFFFFFFF;
 }
@@ -47,3 +47,4 @@
 #include <glib.h>
 
 guint32 metadata_crc32(const void *ptr, size_t len);
+guint32 metadata_crc32_reference(const void *ptr, size_t len);
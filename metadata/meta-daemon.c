@@ -37,6 +37,8 @@ typedef struct {
   char *filename;
   MetaTree *tree;
   guint writeout_timeout;
+  gboolean writeout_running;
+  gboolean writeout_again;
 } TreeInfo;
 
 static GHashTable *tree_infos = NULL;
@@ -53,13 +55,62 @@ tree_info_free (TreeInfo *info)
   g_free (info);
 }
 
+static void tree_info_start_writeout (TreeInfo *info);
+
 static gboolean
-writeout_timeout (gpointer data)
+writeout_done (gpointer data)
+{
+  TreeInfo *info = data;
+
+  info->writeout_running = FALSE;
+  if (info->writeout_again)
+    {
+      info->writeout_again = FALSE;
+      tree_info_start_writeout (info);
+    }
+
+  return FALSE;
+}
+
+static gpointer
+writeout_thread (gpointer data)
 {
   TreeInfo *info = data;
 
   meta_tree_flush (info->tree);
+  g_idle_add (writeout_done, info);
+
+  return NULL;
+}
+
+/* The tree is written out in a thread, the journal takes new writes
+   meanwhile and what they add is carried over to the new journal */
+static void
+tree_info_start_writeout (TreeInfo *info)
+{
+  if (info->writeout_timeout)
+    {
+      g_source_remove (info->writeout_timeout);
+      info->writeout_timeout = 0;
+    }
+
+  if (info->writeout_running)
+    {
+      info->writeout_again = TRUE;
+      return;
+    }
+
+  info->writeout_running = TRUE;
+  g_thread_unref (g_thread_new ("metadata writeout", writeout_thread, info));
+}
+
+static gboolean
+writeout_timeout (gpointer data)
+{
+  TreeInfo *info = data;
+
   info->writeout_timeout = 0;
+  tree_info_start_writeout (info);
 
   return FALSE;
 }
@@ -67,7 +118,11 @@ writeout_timeout (gpointer data)
 static void
 tree_info_schedule_writeout (TreeInfo *info)
 {
-  if (info->writeout_timeout == 0)
+  /* Don't wait for the timeout when the journal is filling up, so
+     writers don't run out of space before the flush is done */
+  if (meta_tree_needs_flush (info->tree))
+    tree_info_start_writeout (info);
+  else if (info->writeout_timeout == 0)
     info->writeout_timeout =
       g_timeout_add_seconds (WRITEOUT_TIMEOUT_SECS,
 			     writeout_timeout, info);
@@ -117,10 +172,10 @@ handle_set (GVfsMetadata *object,
             GVfsMetadata *daemon)
 {
   TreeInfo *info;
+  MetaTreeBatch *batch;
   const gchar *str;
   const gchar **strv;
   const gchar *key;
-  GError *error;
   GVariantIter iter;
   GVariant *value;
 
@@ -135,8 +190,8 @@ handle_set (GVfsMetadata *object,
       return TRUE;
     }
 
-  error = NULL;
-
+  /* All keys go to the journal at once */
+  batch = meta_tree_batch_new ();
   g_variant_iter_init (&iter, arg_data);
   while (g_variant_iter_next (&iter, "{&sv}", &key, &value))
     {
@@ -144,50 +199,116 @@ handle_set (GVfsMetadata *object,
 	{
 	  /* stringv */
           strv = g_variant_get_strv (value, NULL);
-	  if (!meta_tree_set_stringv (info->tree, arg_path, key, (gchar **) strv))
-	    {
-	      g_set_error_literal (&error, G_IO_ERROR,
-                                   G_IO_ERROR_FAILED,
-                                  _("Unable to set metadata key"));
-	    }
+	  meta_tree_batch_set_stringv (batch, arg_path, key, (gchar **) strv);
 	  g_free (strv);
 	}
       else if (g_variant_is_of_type (value, G_VARIANT_TYPE_STRING))
 	{
 	  /* string */
           str = g_variant_get_string (value, NULL);
-	  if (!meta_tree_set_string (info->tree, arg_path, key, str))
-	    {
-              g_set_error_literal (&error, G_IO_ERROR,
-                                   G_IO_ERROR_FAILED,
-                                   _("Unable to set metadata key"));
-	    }
+	  meta_tree_batch_set_string (batch, arg_path, key, str);
 	}
       else if (g_variant_is_of_type (value, G_VARIANT_TYPE_BYTE))
 	{
 	  /* Unset */
-	  if (!meta_tree_unset (info->tree, arg_path, key))
-	    {
-              g_set_error_literal (&error, G_IO_ERROR,
-                                   G_IO_ERROR_FAILED,
-                                   _("Unable to unset metadata key"));
-	    }
+	  meta_tree_batch_unset (batch, arg_path, key);
 	}
       g_variant_unref (value);
     }
 
+  if (!meta_tree_batch_commit (info->tree, batch))
+    {
+      meta_tree_batch_free (batch);
+      g_dbus_method_invocation_return_error_literal (invocation,
+                                                     G_IO_ERROR,
+                                                     G_IO_ERROR_FAILED,
+                                                     _("Unable to set metadata key"));
+      return TRUE;
+    }
+  meta_tree_batch_free (batch);
+
   tree_info_schedule_writeout (info);
+  gvfs_metadata_complete_set (object, invocation);
+  
+  return TRUE;
+}
 
-  if (error)
+static gboolean
+handle_set_multi (GVfsMetadata *object,
+                  GDBusMethodInvocation *invocation,
+                  const gchar *arg_treefile,
+                  const gchar *const *arg_paths,
+                  GVariant *arg_data,
+                  GVfsMetadata *daemon)
+{
+  TreeInfo *info;
+  MetaTreeBatch *batch;
+  const gchar **strv;
+  const gchar *key;
+  GVariantIter iter;
+  GVariant *dict, *value;
+  gsize i;
+
+  info = tree_info_lookup (arg_treefile);
+  if (info == NULL)
     {
-      g_dbus_method_invocation_return_gerror (invocation, error);
-      g_error_free (error);
+      g_dbus_method_invocation_return_error (invocation,
+                                             G_IO_ERROR,
+                                             G_IO_ERROR_NOT_FOUND,
+                                             _("Can't find metadata file %s"),
+                                             arg_treefile);
+      return TRUE;
     }
-  else
+
+  if (g_strv_length ((gchar **) arg_paths) != g_variant_n_children (arg_data))
     {
-      gvfs_metadata_complete_set (object, invocation);
+      g_dbus_method_invocation_return_error_literal (invocation,
+                                                     G_IO_ERROR,
+                                                     G_IO_ERROR_INVALID_ARGUMENT,
+                                                     "Number of paths and data sets differ");
+      return TRUE;
     }
-  
+
+  /* All changes go to the journal at once */
+  batch = meta_tree_batch_new ();
+  for (i = 0; arg_paths[i] != NULL; i++)
+    {
+      dict = g_variant_get_child_value (arg_data, i);
+
+      g_variant_iter_init (&iter, dict);
+      while (g_variant_iter_next (&iter, "{&sv}", &key, &value))
+        {
+          if (g_variant_is_of_type (value, G_VARIANT_TYPE_STRING_ARRAY))
+            {
+              strv = g_variant_get_strv (value, NULL);
+              meta_tree_batch_set_stringv (batch, arg_paths[i], key, (gchar **) strv);
+              g_free (strv);
+            }
+          else if (g_variant_is_of_type (value, G_VARIANT_TYPE_STRING))
+            meta_tree_batch_set_string (batch, arg_paths[i], key,
+                                        g_variant_get_string (value, NULL));
+          else if (g_variant_is_of_type (value, G_VARIANT_TYPE_BYTE))
+            meta_tree_batch_unset (batch, arg_paths[i], key);
+          g_variant_unref (value);
+        }
+
+      g_variant_unref (dict);
+    }
+
+  if (!meta_tree_batch_commit (info->tree, batch))
+    {
+      meta_tree_batch_free (batch);
+      g_dbus_method_invocation_return_error_literal (invocation,
+                                                     G_IO_ERROR,
+                                                     G_IO_ERROR_FAILED,
+                                                     _("Unable to set metadata key"));
+      return TRUE;
+    }
+  meta_tree_batch_free (batch);
+
+  tree_info_schedule_writeout (info);
+  gvfs_metadata_complete_set_multi (object, invocation);
+
   return TRUE;
 }
 
@@ -229,6 +350,39 @@ enum_keys (const char *key,
   return TRUE;
 }
 
+/* keys == NULL means all keys */
+static void
+append_keys (GVariantBuilder *builder,
+             MetaTree *tree,
+             const char *path,
+             const gchar *const *keys)
+{
+  GPtrArray *meta_keys;
+  gboolean free_keys;
+  gchar **iter_keys;
+  gchar **i;
+
+  if (keys == NULL)
+    {
+      /* Get all keys */
+      free_keys = TRUE;
+      meta_keys = g_ptr_array_new ();
+      meta_tree_enumerate_keys (tree, path, enum_keys, meta_keys);
+      g_ptr_array_add (meta_keys, NULL);
+      iter_keys = (gchar **) g_ptr_array_free (meta_keys, FALSE);
+    }
+  else
+    {
+      free_keys = FALSE;
+      iter_keys = (gchar **) keys;
+    }
+
+  for (i = iter_keys; *i; i++)
+    append_key (builder, tree, path, *i);
+  if (free_keys)
+    g_strfreev (iter_keys);
+}
+
 static gboolean
 handle_get (GVfsMetadata *object,
             GDBusMethodInvocation *invocation,
@@ -238,10 +392,6 @@ handle_get (GVfsMetadata *object,
             GVfsMetadata *daemon)
 {
   TreeInfo *info;
-  GPtrArray *meta_keys;
-  gboolean free_keys;
-  gchar **iter_keys;
-  gchar **i;
   GVariantBuilder *builder;
 
   info = tree_info_lookup (arg_treefile);
@@ -255,29 +405,55 @@ handle_get (GVfsMetadata *object,
       return TRUE;
     }
 
-  if (arg_keys == NULL)
+  builder = g_variant_builder_new (G_VARIANT_TYPE_VARDICT);
+  append_keys (builder, info->tree, arg_path, arg_keys);
+  
+  gvfs_metadata_complete_get (object, invocation,
+                              g_variant_builder_end (builder));
+  g_variant_builder_unref (builder);
+
+  return TRUE;
+}
+
+static gboolean
+handle_get_multi (GVfsMetadata *object,
+                  GDBusMethodInvocation *invocation,
+                  const gchar *arg_treefile,
+                  const gchar *const *arg_paths,
+                  const gchar *const *arg_keys,
+                  GVfsMetadata *daemon)
+{
+  TreeInfo *info;
+  GVariantBuilder *builder;
+  const gchar *const *keys;
+  int i;
+
+  info = tree_info_lookup (arg_treefile);
+  if (info == NULL)
     {
-      /* Get all keys */
-      free_keys = TRUE;
-      meta_keys = g_ptr_array_new ();
-      meta_tree_enumerate_keys (info->tree, arg_path, enum_keys, meta_keys);
-      iter_keys = (gchar **) g_ptr_array_free (meta_keys, FALSE);
+      g_dbus_method_invocation_return_error (invocation,
+                                             G_IO_ERROR,
+                                             G_IO_ERROR_NOT_FOUND,
+                                             _("Can't find metadata file %s"),
+                                             arg_treefile);
+      return TRUE;
     }
-  else
+
+  /* No keys given means all keys */
+  keys = arg_keys;
+  if (keys != NULL && keys[0] == NULL)
+    keys = NULL;
+
+  builder = g_variant_builder_new (G_VARIANT_TYPE ("aa{sv}"));
+  for (i = 0; arg_paths[i] != NULL; i++)
     {
-      free_keys = FALSE;
-      iter_keys = (gchar **) arg_keys;
+      g_variant_builder_open (builder, G_VARIANT_TYPE_VARDICT);
+      append_keys (builder, info->tree, arg_paths[i], keys);
+      g_variant_builder_close (builder);
     }
 
-  builder = g_variant_builder_new (G_VARIANT_TYPE_VARDICT);
-
-  for (i = iter_keys; *i; i++)
-    append_key (builder, info->tree, arg_path, *i);
-  if (free_keys)
-    g_strfreev (iter_keys);
-  
-  gvfs_metadata_complete_get (object, invocation,
-                              g_variant_builder_end (builder));
+  gvfs_metadata_complete_get_multi (object, invocation,
+                                    g_variant_builder_end (builder));
   g_variant_builder_unref (builder);
 
   return TRUE;
@@ -363,6 +539,7 @@ handle_move (GVfsMetadata *object,
              GVfsMetadata *daemon)
 {
   TreeInfo *info;
+  MetaTreeBatch *batch;
 
   info = tree_info_lookup (arg_treefile);
   if (info == NULL)
@@ -375,18 +552,20 @@ handle_move (GVfsMetadata *object,
       return TRUE;
     }
 
-  /* Overwrites any dest */
-  if (!meta_tree_copy (info->tree, arg_path, arg_dest_path))
+  /* Copy, overwriting any dest, and remove the source in one go */
+  batch = meta_tree_batch_new ();
+  meta_tree_batch_copy (batch, arg_path, arg_dest_path);
+  meta_tree_batch_remove (batch, arg_path);
+  if (!meta_tree_batch_commit (info->tree, batch))
     {
+      meta_tree_batch_free (batch);
       g_dbus_method_invocation_return_error_literal (invocation,
                                                      G_IO_ERROR,
                                                      G_IO_ERROR_FAILED,
                                                      _("Unable to move metadata keys"));
       return TRUE;
     }
-
-  /* Remove source if copy succeeded (ignoring errors) */
-  meta_tree_remove (info->tree, arg_path);
+  meta_tree_batch_free (batch);
 
   tree_info_schedule_writeout (info);
   gvfs_metadata_complete_move (object, invocation);
@@ -394,6 +573,15 @@ handle_move (GVfsMetadata *object,
   return TRUE;
 }
 
+static void
+flush_tree_info (gpointer key,
+		 TreeInfo *info,
+		 gpointer user_data)
+{
+  if (info->writeout_running)
+    meta_tree_flush (info->tree);
+}
+
 static void
 on_name_acquired (GDBusConnection *connection,
                   const gchar     *name,
@@ -408,6 +596,8 @@ on_name_acquired (GDBusConnection *connection,
   g_signal_connect (skeleton, "handle-get", G_CALLBACK (handle_get), skeleton);
   g_signal_connect (skeleton, "handle-remove", G_CALLBACK (handle_remove), skeleton);
   g_signal_connect (skeleton, "handle-move", G_CALLBACK (handle_move), skeleton);
+  g_signal_connect (skeleton, "handle-set-multi", G_CALLBACK (handle_set_multi), skeleton);
+  g_signal_connect (skeleton, "handle-get-multi", G_CALLBACK (handle_get_multi), skeleton);
 
   error = NULL;
   if (!g_dbus_interface_skeleton_export (G_DBUS_INTERFACE_SKELETON (skeleton), connection,
@@ -509,6 +699,9 @@ main (int argc, char *argv[])
 				      (GDestroyNotify)tree_info_free);
 
   g_main_loop_run (loop);
+
+  /* Wait for writeouts that are still running */
+  g_hash_table_foreach (tree_infos, (GHFunc)flush_tree_info, NULL);
   
   if (skeleton)
     g_dbus_interface_skeleton_unexport (G_DBUS_INTERFACE_SKELETON (skeleton));
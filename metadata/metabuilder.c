@@ -1,14 +1,19 @@
+#include "config.h"
 #include "metabuilder.h"
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <sys/mman.h>
 #include <glib/gstdio.h>
+#ifdef HAVE_LINUX_FS_H
+#include <linux/fs.h>
+#endif
 
-#define MAJOR_VERSION 1
+#define MAJOR_VERSION 2
 #define MINOR_VERSION 0
 #define MAJOR_JOURNAL_VERSION 1
 #define MINOR_JOURNAL_VERSION 0
@@ -16,9 +21,17 @@
 
 #define RANDOM_TAG_OFFSET 12
 #define ROTATED_OFFSET 8
+#define ROOT_OFFSET 16
+#define ATTRIBUTES_OFFSET 20
+#define TIME_T_BASE_OFFSET 24
+#define HEADER_SIZE 32
+#define FULL_SIZE_OFFSET HEADER_SIZE /* Version 2 only */
 
 #define KEY_IS_LIST_MASK (1<<31)
 
+#define CHILDREN_RESTART_INTERVAL 16
+#define CHILDREN_NUM_RESTARTS(n) (((n) + CHILDREN_RESTART_INTERVAL - 1) / CHILDREN_RESTART_INTERVAL)
+
 MetaBuilder *
 meta_builder_new (void)
 {
@@ -69,8 +82,11 @@ metafile_new (const char *name,
   f = g_new0 (MetaFile, 1);
   f->name = g_strdup (name);
   if (parent)
-    parent->children = g_list_insert_sorted (parent->children, f,
-					     compare_metafile);
+    {
+      parent->children = g_list_insert_sorted (parent->children, f,
+					       compare_metafile);
+      parent->children_changed = TRUE;
+    }
 
   return f;
 }
@@ -85,7 +101,10 @@ metadata_new (const char *key,
   data->key = g_strdup (key);
 
   if (file)
-    file->data = g_list_insert_sorted (file->data, data, compare_metadata);
+    {
+      file->data = g_list_insert_sorted (file->data, data, compare_metadata);
+      file->metadata_changed = TRUE;
+    }
 
   return data;
 }
@@ -214,6 +233,7 @@ meta_builder_remove (MetaBuilder *builder,
   if (parent != NULL)
     {
       parent->children = g_list_remove (parent->children, f);
+      parent->children_changed = TRUE;
       metafile_free (f);
       if (mtime)
 	parent->last_changed = mtime;
@@ -223,6 +243,7 @@ meta_builder_remove (MetaBuilder *builder,
       /* Removing root not allowed, just remove children */
       g_list_free_full (f->children, (GDestroyNotify)metafile_free);
       f->children = NULL;
+      f->children_changed = TRUE;
       if (mtime)
 	f->last_changed = mtime;
     }
@@ -279,6 +300,21 @@ metafile_set_mtime (MetaFile    *file,
   file->last_changed = mtime;
 }
 
+/* Records that the file, as it is now, is stored at these offsets in
+   the tree file it was read from. Call it once its children are read. */
+void
+metafile_set_stored (MetaFile    *file,
+		     guint32      children,
+		     guint32      metadata)
+{
+  file->stored = TRUE;
+  file->stored_children = children;
+  file->stored_metadata = metadata;
+  file->stored_last_changed = file->last_changed;
+  file->children_changed = FALSE;
+  file->metadata_changed = FALSE;
+}
+
 MetaData *
 metafile_key_lookup (MetaFile *file,
 		     const char *key,
@@ -325,6 +361,7 @@ metafile_key_unset (MetaFile *metafile,
   if (data)
     {
       metafile->data = g_list_remove (metafile->data, data);
+      metafile->metadata_changed = TRUE;
       metadata_free (data);
     }
 }
@@ -340,6 +377,7 @@ metafile_key_set_value (MetaFile *metafile,
   metadata_clear (data);
   data->is_list = FALSE;
   data->value = g_strdup (value);
+  metafile->metadata_changed = TRUE;
 }
 
 void
@@ -356,6 +394,7 @@ metafile_key_list_set (MetaFile    *metafile,
     }
   g_list_free_full (data->values, g_free);
   data->values = NULL;
+  metafile->metadata_changed = TRUE;
 }
 
 void
@@ -373,6 +412,7 @@ metafile_key_list_add (MetaFile *metafile,
     }
 
   data->values = g_list_append (data->values, g_strdup (value));
+  metafile->metadata_changed = TRUE;
 }
 
 static void
@@ -455,18 +495,33 @@ append_uint32 (GString *s, guint32 val, guint32 *offset)
 }
 
 static GString *
-append_time_t (GString *s, gint64 val, MetaBuilder *builder)
+append_varint (GString *s, guint32 val)
 {
-  guint32 offset;
+  while (val >= 0x80)
+    {
+      g_string_append_c (s, (val & 0x7f) | 0x80);
+      val >>= 7;
+    }
+  g_string_append_c (s, val);
 
+  return s;
+}
+
+static guint32
+get_time_t_offset (gint64 val, MetaBuilder *builder)
+{
   if (val == 0)
-    offset = 0;
+    return 0;
   else if (val <= builder->time_t_base)
-    offset = 1;
+    return 1;
   else
-    offset = val - builder->time_t_base;
+    return val - builder->time_t_base;
+}
 
-  return append_uint32 (s, offset, NULL);
+static GString *
+append_time_t (GString *s, gint64 val, MetaBuilder *builder)
+{
+  return append_uint32 (s, get_time_t_offset (val, builder), NULL);
 }
 
 static GString *
@@ -788,13 +843,289 @@ write_metadata (GString *out,
     }
 }
 
+/* Version 2: everything is written children first, so all offsets
+   point backwards and can be written as varints right away */
+typedef struct {
+  GString *out;
+  guint32 base; /* File offset of out, when appending to a tree */
+  gboolean reuse; /* Point to unchanged parts of that tree */
+  MetaBuilder *builder;
+  GHashTable *key_hash;
+  GHashTable *values; /* value -> offset in the value dictionary */
+} WriteContext;
+
 static gboolean
-write_all_data_and_close (int fd, char *data, gsize len)
+metafile_is_empty (MetaFile *file)
 {
-  gssize written;
-  gboolean res;
+  /* No mtime, children or metadata, no need for this
+     to be in the file */
+  return
+    file->last_changed == 0 &&
+    file->children == NULL &&
+    file->data == NULL;
+}
 
-  res = FALSE;
+static void
+metafile_collect_values (MetaFile *file,
+			 GHashTable *counts)
+{
+  GList *l, *v;
+  MetaData *data;
+
+  for (l = file->data; l != NULL; l = l->next)
+    {
+      data = l->data;
+      if (data->is_list)
+	{
+	  for (v = data->values; v != NULL; v = v->next)
+	    g_hash_table_insert (counts, v->data,
+				 GUINT_TO_POINTER (GPOINTER_TO_UINT (g_hash_table_lookup (counts, v->data)) + 1));
+	}
+      else
+	g_hash_table_insert (counts, data->value,
+			     GUINT_TO_POINTER (GPOINTER_TO_UINT (g_hash_table_lookup (counts, data->value)) + 1));
+    }
+
+  for (l = file->children; l != NULL; l = l->next)
+    metafile_collect_values (l->data, counts);
+}
+
+static GHashTable *value_counts_for_sort;
+
+static gint
+compare_value_counts (gconstpointer a,
+		      gconstpointer b)
+{
+  guint count_a, count_b;
+
+  count_a = GPOINTER_TO_UINT (g_hash_table_lookup (value_counts_for_sort, a));
+  count_b = GPOINTER_TO_UINT (g_hash_table_lookup (value_counts_for_sort, b));
+
+  if (count_a != count_b)
+    return count_a > count_b ? -1 : 1;
+
+  return strcmp (a, b);
+}
+
+/* Every distinct value is stored once, most used first so that the
+   references to the common ones (icon positions, emblems...) are short */
+static void
+write_value_dictionary (WriteContext *ctx)
+{
+  GHashTable *counts;
+  GHashTableIter iter;
+  GList *values, *l;
+  char *value;
+  gsize start;
+
+  counts = g_hash_table_new (g_str_hash, g_str_equal);
+  metafile_collect_values (ctx->builder->root, counts);
+
+  values = NULL;
+  g_hash_table_iter_init (&iter, counts);
+  while (g_hash_table_iter_next (&iter, (gpointer *)&value, NULL))
+    values = g_list_prepend (values, value);
+
+  value_counts_for_sort = counts;
+  values = g_list_sort (values, compare_value_counts);
+  value_counts_for_sort = NULL;
+
+  start = ctx->out->len;
+  for (l = values; l != NULL; l = l->next)
+    {
+      value = l->data;
+      g_hash_table_insert (ctx->values, value,
+			   GUINT_TO_POINTER (ctx->out->len - start));
+      g_string_append_len (ctx->out, value, strlen (value) + 1);
+    }
+
+  g_list_free (values);
+  g_hash_table_destroy (counts);
+}
+
+static void
+append_value (WriteContext *ctx,
+	      const char *value)
+{
+  append_varint (ctx->out,
+		 GPOINTER_TO_UINT (g_hash_table_lookup (ctx->values, value)));
+}
+
+static guint32
+write_metadata_v2 (WriteContext *ctx,
+		   MetaFile *file)
+{
+  GList *l, *v;
+  MetaData *data;
+  guint32 offset, key;
+
+  offset = ctx->base + ctx->out->len;
+  append_varint (ctx->out, g_list_length (file->data));
+
+  /* file->data is sorted by key, and so are the key ids */
+  for (l = file->data; l != NULL; l = l->next)
+    {
+      data = l->data;
+
+      key = GPOINTER_TO_UINT (g_hash_table_lookup (ctx->key_hash, data->key));
+      append_varint (ctx->out, key << 1 | (data->is_list ? 1 : 0));
+      if (data->is_list)
+	{
+	  append_varint (ctx->out, g_list_length (data->values));
+	  for (v = data->values; v != NULL; v = v->next)
+	    append_value (ctx, v->data);
+	}
+      else
+	append_value (ctx, data->value);
+    }
+
+  return offset;
+}
+
+static guint32 write_children_v2 (WriteContext *ctx,
+				   MetaFile *file);
+
+static guint32
+children_offset_v2 (WriteContext *ctx,
+		    MetaFile *file)
+{
+  if (ctx->reuse && file->stored && !file->children_changed)
+    return file->stored_children;
+
+  if (file->children == NULL)
+    return 0;
+
+  return write_children_v2 (ctx, file);
+}
+
+static guint32
+metadata_offset_v2 (WriteContext *ctx,
+		    MetaFile *file)
+{
+  if (ctx->reuse && file->stored && !file->metadata_changed)
+    return file->stored_metadata;
+
+  if (file->data == NULL)
+    return 0;
+
+  return write_metadata_v2 (ctx, file);
+}
+
+static guint32
+write_children_v2 (WriteContext *ctx,
+		   MetaFile *file)
+{
+  GPtrArray *children;
+  guint32 *children_pointers, *metadata_pointers;
+  guint32 offset, restarts, entries, i, shared;
+  MetaFile *child;
+  const char *prev_name;
+  GList *l;
+
+  children = g_ptr_array_new ();
+  for (l = file->children; l != NULL; l = l->next)
+    {
+      child = l->data;
+      if (!metafile_is_empty (child))
+	g_ptr_array_add (children, child);
+    }
+
+  /* Write what the entries point to first */
+  children_pointers = g_new0 (guint32, children->len);
+  metadata_pointers = g_new0 (guint32, children->len);
+  for (i = 0; i < children->len; i++)
+    {
+      child = g_ptr_array_index (children, i);
+      children_pointers[i] = children_offset_v2 (ctx, child);
+      metadata_pointers[i] = metadata_offset_v2 (ctx, child);
+    }
+
+  offset = ctx->base + ctx->out->len;
+  append_varint (ctx->out, children->len);
+
+  /* Offsets of the names stored in full, for binary search */
+  restarts = ctx->out->len;
+  for (i = 0; i < CHILDREN_NUM_RESTARTS (children->len); i++)
+    append_uint32 (ctx->out, 0, NULL);
+  entries = ctx->out->len;
+
+  /* Children are sorted by name, so store only what differs from
+     the previous one */
+  prev_name = NULL;
+  for (i = 0; i < children->len; i++)
+    {
+      child = g_ptr_array_index (children, i);
+
+      shared = 0;
+      if (i % CHILDREN_RESTART_INTERVAL == 0)
+	set_uint32 (ctx->out, restarts + (i / CHILDREN_RESTART_INTERVAL) * 4,
+		    ctx->out->len - entries);
+      else
+	while (prev_name[shared] != 0 &&
+	       prev_name[shared] == child->name[shared])
+	  shared++;
+
+      append_varint (ctx->out, shared);
+      g_string_append_len (ctx->out, child->name + shared,
+			   strlen (child->name + shared) + 1);
+      append_varint (ctx->out, children_pointers[i]);
+      append_varint (ctx->out, metadata_pointers[i]);
+      append_varint (ctx->out, get_time_t_offset (child->last_changed, ctx->builder));
+
+      prev_name = child->name;
+    }
+
+  g_free (children_pointers);
+  g_free (metadata_pointers);
+  g_ptr_array_free (children, TRUE);
+
+  return offset;
+}
+
+static void
+write_tree_v2 (GString *out,
+	       MetaBuilder *builder,
+	       GList *keys,
+	       GHashTable *key_hash)
+{
+  WriteContext ctx;
+  guint32 root_children, root_metadata, root;
+  GList *l;
+
+  ctx.out = out;
+  ctx.base = 0;
+  ctx.reuse = FALSE;
+  ctx.builder = builder;
+  ctx.key_hash = key_hash;
+  ctx.values = g_hash_table_new (g_str_hash, g_str_equal);
+
+  /* Keys, followed directly by the value dictionary */
+  append_varint (out, g_list_length (keys));
+  for (l = keys; l != NULL; l = l->next)
+    g_string_append_len (out, l->data, strlen (l->data) + 1);
+  write_value_dictionary (&ctx);
+
+  root_children = 0;
+  if (builder->root->children != NULL)
+    root_children = write_children_v2 (&ctx, builder->root);
+
+  root_metadata = 0;
+  if (builder->root->data != NULL)
+    root_metadata = write_metadata_v2 (&ctx, builder->root);
+
+  root = out->len;
+  append_varint (out, root_children);
+  append_varint (out, root_metadata);
+  append_varint (out, get_time_t_offset (builder->root->last_changed, builder));
+  set_uint32 (out, builder->root_pointer, root);
+
+  g_hash_table_destroy (ctx.values);
+}
+
+static gboolean
+write_all_data (int fd, const char *data, gsize len)
+{
+  gssize written;
 
   while (len > 0)
     {
@@ -802,17 +1133,30 @@ write_all_data_and_close (int fd, char *data, gsize len)
 
       if (written < 0)
 	{
-	  if (errno == EAGAIN)
+	  if (errno == EAGAIN || errno == EINTR)
 	    continue;
-	  goto out;
+	  return FALSE;
 	}
       else if (written == 0)
-	goto out; /* WTH? Don't loop forever*/
+	return FALSE; /* WTH? Don't loop forever*/
 
       len -= written;
       data += written;
     }
 
+  return TRUE;
+}
+
+static gboolean
+write_all_data_and_close (int fd, char *data, gsize len)
+{
+  gboolean res;
+
+  res = FALSE;
+
+  if (!write_all_data (fd, data, len))
+    goto out;
+
   if (fsync (fd) == -1)
     goto out;
 
@@ -843,8 +1187,15 @@ get_journal_filename (const char *filename, guint32 random_tag)
   return g_strconcat (filename, "-", tag, ".log", NULL);
 }
 
+/* The journal starts out with the given entries, which were added to
+   the previous journal after the tree was read for writing */
 static gboolean
-create_new_journal (const char *filename, guint32 random_tag)
+create_new_journal (const char *filename,
+		    guint32 random_tag,
+		    gsize size,
+		    const char *entries,
+		    gsize entries_len,
+		    guint32 num_entries)
 {
   char *journal_name;
   guint32 size_offset;
@@ -870,11 +1221,13 @@ create_new_journal (const char *filename, guint32 random_tag)
 
   append_uint32 (out, random_tag, NULL);
   append_uint32 (out, 0, &size_offset);
-  append_uint32 (out, 0, NULL); /* Num entries, none so far */
+  append_uint32 (out, num_entries, NULL);
+
+  g_string_append_len (out, entries, entries_len);
 
   pos = out->len;
 
-  g_string_set_size (out, NEW_JOURNAL_SIZE);
+  g_string_set_size (out, MAX (size, pos));
   memset (out->str + pos, 0, out->len - pos);
 
   set_uint32 (out, size_offset, out->len);
@@ -891,6 +1244,7 @@ create_new_journal (const char *filename, guint32 random_tag)
 
 static GString *
 metadata_create_static (MetaBuilder *builder,
+			int version,
 			guint32 *random_tag_out)
 {
   GString *out;
@@ -900,7 +1254,7 @@ metadata_create_static (MetaBuilder *builder,
   GList *keys, *l;
   GHashTable *strings;
   guint32 index;
-  guint32 attributes_pointer;
+  guint32 attributes_pointer, size_pointer;
   gint64 time_t_min;
   gint64 time_t_max;
   guint32 random_tag, root_name;
@@ -916,7 +1270,7 @@ metadata_create_static (MetaBuilder *builder,
   g_string_append_c (out, 'a');
 
   /* VERSION */
-  g_string_append_c (out, MAJOR_VERSION);
+  g_string_append_c (out, version);
   g_string_append_c (out, MINOR_VERSION);
 
   append_uint32 (out, 0, NULL); /* Rotated */
@@ -952,17 +1306,27 @@ metadata_create_static (MetaBuilder *builder,
   g_hash_table_destroy (hash);
   keys = g_list_sort (keys, (GCompareFunc)strcmp);
 
-  /* Write keys to file and collect mapping for keys */
-  set_uint32 (out, attributes_pointer, out->len);
   key_hash = g_hash_table_new (g_str_hash, g_str_equal);
-  strings = string_block_begin ();
-  append_uint32 (out, g_list_length (keys), NULL);
   for (l = keys, index = 0; l != NULL; l = l->next, index++)
+    g_hash_table_insert (key_hash, l->data, GUINT_TO_POINTER (index));
+
+  if (version != 1)
     {
-      key = l->data;
-      append_string (out, key, strings);
-      g_hash_table_insert (key_hash, key, GUINT_TO_POINTER (index));
+      /* Tells the incremental writer how much of the file is garbage */
+      append_uint32 (out, 0, &size_pointer);
+      set_uint32 (out, attributes_pointer, out->len);
+      write_tree_v2 (out, builder, keys, key_hash);
+      set_uint32 (out, size_pointer, out->len);
+      goto out;
     }
+
+  set_uint32 (out, attributes_pointer, out->len);
+
+  /* Write keys to file */
+  strings = string_block_begin ();
+  append_uint32 (out, g_list_length (keys), NULL);
+  for (l = keys; l != NULL; l = l->next)
+    append_string (out, l->data, strings);
   string_block_end (out, strings);
 
   /* update root pointer */
@@ -991,6 +1355,7 @@ metadata_create_static (MetaBuilder *builder,
   write_children (out, builder);
   write_metadata (out, builder, key_hash);
 
+ out:
   g_hash_table_destroy (key_hash);
   g_list_free (keys);
 
@@ -1000,23 +1365,368 @@ metadata_create_static (MetaBuilder *builder,
 gboolean
 meta_builder_write (MetaBuilder *builder,
 		    const char *filename)
+{
+  return meta_builder_write_version (builder, filename, MAJOR_VERSION);
+}
+
+static char *
+write_tmp_file (MetaBuilder *builder,
+		const char *filename,
+		int version,
+		guint32 *random_tag)
 {
   GString *out;
-  guint32 random_tag;
-  int fd, fd2, fd_dir;
-  char *tmp_name, *dirname;
+  char *tmp_name;
+  int fd;
 
-  out = metadata_create_static (builder, &random_tag);
+  out = metadata_create_static (builder, version, random_tag);
 
   tmp_name = g_strdup_printf ("%s.XXXXXX", filename);
   fd = g_mkstemp (tmp_name);
   if (fd == -1)
+    {
+      g_free (tmp_name);
+      tmp_name = NULL;
+    }
+  else if (!write_all_data_and_close (fd, out->str, out->len))
+    {
+      g_unlink (tmp_name);
+      g_free (tmp_name);
+      tmp_name = NULL;
+    }
+
+  g_string_free (out, TRUE);
+
+  return tmp_name;
+}
+
+/* Version 1 is only written for comparing the formats */
+gboolean
+meta_builder_write_version (MetaBuilder *builder,
+			    const char *filename,
+			    int version)
+{
+  guint32 random_tag;
+  char *tmp_name;
+  gboolean res;
+
+  tmp_name = write_tmp_file (builder, filename, version, &random_tag);
+  if (tmp_name == NULL)
+    return FALSE;
+
+  res = meta_builder_install_tmp (filename, tmp_name, random_tag,
+				  NEW_JOURNAL_SIZE, NULL, 0, 0);
+  g_free (tmp_name);
+
+  return res;
+}
+
+/* Writes the tree next to filename and syncs it to disk. This is the
+   slow part of writing, and doesn't touch the current tree or journal.
+   Returns the name of the new file, or NULL on failure. */
+char *
+meta_builder_write_tmp (MetaBuilder *builder,
+			const char  *filename,
+			guint32     *random_tag)
+{
+  return write_tmp_file (builder, filename, MAJOR_VERSION, random_tag);
+}
+
+static guint32
+get_base_uint32 (const char *base_data, gsize pos)
+{
+  guint32 val;
+
+  memcpy (&val, base_data + pos, 4);
+  return GUINT32_FROM_BE (val);
+}
+
+static void
+set_header_uint32 (char *header, gsize pos, guint32 val)
+{
+  val = GUINT32_TO_BE (val);
+  memcpy (header + pos, &val, 4);
+}
+
+static gboolean
+read_base_varint (const char *base_data,
+		  gsize base_len,
+		  gsize *pos,
+		  guint32 *val)
+{
+  guint32 res;
+  guchar c;
+  int shift;
+
+  res = 0;
+  for (shift = 0; shift < 35; shift += 7)
+    {
+      if (*pos >= base_len)
+	return FALSE;
+
+      c = base_data[(*pos)++];
+      res |= (guint32)(c & 0x7f) << shift;
+      if ((c & 0x80) == 0)
+	{
+	  *val = res;
+	  return TRUE;
+	}
+    }
+
+  return FALSE;
+}
+
+/* Marks the directories whose children have to be written again
+   because something below them changed. Returns whether the entry
+   for file in its parent changes. */
+static gboolean
+metafile_propagate_changes (MetaFile *file)
+{
+  GList *l;
+
+  for (l = file->children; l != NULL; l = l->next)
+    {
+      if (metafile_propagate_changes (l->data))
+	file->children_changed = TRUE;
+    }
+
+  return
+    !file->stored ||
+    file->children_changed ||
+    file->metadata_changed ||
+    file->last_changed != file->stored_last_changed;
+}
+
+static gboolean
+time_t_fits (gint64 val, MetaBuilder *builder)
+{
+  return val == 0 || val - builder->time_t_base <= G_MAXUINT32;
+}
+
+/* Collects the values of everything that will be written again, and
+   checks that it can be written with the keys and time base of the
+   existing tree */
+static gboolean
+metafile_collect_new_values (MetaFile *file,
+			     WriteContext *ctx,
+			     GPtrArray *new_values)
+{
+  GList *l, *v;
+  MetaData *data;
+  MetaFile *child;
+
+  if (!file->stored || file->metadata_changed)
+    {
+      for (l = file->data; l != NULL; l = l->next)
+	{
+	  data = l->data;
+	  if (!g_hash_table_contains (ctx->key_hash, data->key))
+	    return FALSE;
+
+	  for (v = data->is_list ? data->values : NULL; v != NULL; v = v->next)
+	    {
+	      if (!g_hash_table_contains (ctx->values, v->data))
+		{
+		  g_hash_table_add (ctx->values, v->data);
+		  g_ptr_array_add (new_values, v->data);
+		}
+	    }
+	  if (!data->is_list && !g_hash_table_contains (ctx->values, data->value))
+	    {
+	      g_hash_table_add (ctx->values, data->value);
+	      g_ptr_array_add (new_values, data->value);
+	    }
+	}
+    }
+
+  if (!file->stored || file->children_changed)
+    {
+      for (l = file->children; l != NULL; l = l->next)
+	{
+	  child = l->data;
+	  if (!time_t_fits (child->last_changed, ctx->builder) ||
+	      !metafile_collect_new_values (child, ctx, new_values))
+	    return FALSE;
+	}
+    }
+
+  return TRUE;
+}
+
+/* Shares the blocks of the old file where the filesystem can do that,
+   so only what gets appended has to reach the disk */
+static gboolean
+copy_base_file (int fd,
+		int base_fd,
+		const char *base_data,
+		gsize base_len)
+{
+#ifdef FICLONE
+  if (ioctl (fd, FICLONE, base_fd) == 0)
+    return
+      ftruncate (fd, base_len) == 0 &&
+      lseek (fd, base_len, SEEK_SET) == (off_t)base_len;
+#endif
+
+  return write_all_data (fd, base_data, base_len);
+}
+
+/* Writes a copy of the version 2 tree in base_data, the file the
+   builder was read from, with only the changed directories and
+   metadata appended and the header pointing to the new root.
+   Unchanged subtrees are not written again. Returns NULL if that
+   isn't possible, e.g. for new keys, or if it is time to compact
+   because the file has grown to twice its size when last written in
+   full. Use meta_builder_write_tmp() then. */
+char *
+meta_builder_write_tmp_incremental (MetaBuilder *builder,
+				    const char  *filename,
+				    int          base_fd,
+				    const char  *base_data,
+				    gsize        base_len,
+				    guint32     *random_tag)
+{
+  WriteContext ctx;
+  GPtrArray *new_values;
+  GString *out;
+  char header[HEADER_SIZE];
+  char *tmp_name, *key, *value;
+  gsize pos;
+  guint32 attributes, full_size, values, num_keys, i;
+  guint32 root_children, root_metadata, root;
+  gint64 time_t_base;
+  gboolean res;
+  int fd;
+
+  if (base_len < HEADER_SIZE + 4 ||
+      base_len > G_MAXUINT32 ||
+      base_data[6] != MAJOR_VERSION ||
+      !builder->root->stored)
+    return NULL;
+
+  /* Trees written before the full size was recorded are compacted */
+  attributes = get_base_uint32 (base_data, ATTRIBUTES_OFFSET);
+  if (attributes < FULL_SIZE_OFFSET + 4)
+    return NULL;
+  full_size = get_base_uint32 (base_data, FULL_SIZE_OFFSET);
+
+  memset (&ctx, 0, sizeof (ctx));
+  ctx.base = base_len;
+  ctx.reuse = TRUE;
+  ctx.builder = builder;
+  ctx.key_hash = g_hash_table_new (g_str_hash, g_str_equal);
+  ctx.values = g_hash_table_new (g_str_hash, g_str_equal);
+  new_values = g_ptr_array_new ();
+  out = NULL;
+  tmp_name = NULL;
+
+  /* Key ids stay the same, so new keys need a full write */
+  pos = attributes;
+  if (!read_base_varint (base_data, base_len, &pos, &num_keys) ||
+      num_keys > base_len - pos)
     goto out;
+  for (i = 0; i < num_keys; i++)
+    {
+      key = memchr (base_data + pos, 0, base_len - pos);
+      if (key == NULL)
+	goto out;
+      g_hash_table_insert (ctx.key_hash, (char *)base_data + pos, GUINT_TO_POINTER (i));
+      pos = key - base_data + 1;
+    }
+  values = pos;
+
+  memcpy (&time_t_base, base_data + TIME_T_BASE_OFFSET, 8);
+  builder->time_t_base = GINT64_FROM_BE (time_t_base);
+
+  metafile_propagate_changes (builder->root);
+  if (!time_t_fits (builder->root->last_changed, builder) ||
+      !metafile_collect_new_values (builder->root, &ctx, new_values))
+    goto out;
+
+  /* New values go after the old ones, readers accept any offset
+     past the start of the dictionary */
+  out = g_string_new (NULL);
+  for (i = 0; i < new_values->len; i++)
+    {
+      value = g_ptr_array_index (new_values, i);
+      g_hash_table_insert (ctx.values, value,
+			   GUINT_TO_POINTER (ctx.base + out->len - values));
+      g_string_append_len (out, value, strlen (value) + 1);
+    }
+
+  ctx.out = out;
+  root_children = children_offset_v2 (&ctx, builder->root);
+  root_metadata = metadata_offset_v2 (&ctx, builder->root);
 
-  if (!write_all_data_and_close (fd, out->str, out->len))
+  root = ctx.base + out->len;
+  append_varint (out, root_children);
+  append_varint (out, root_metadata);
+  append_varint (out, get_time_t_offset (builder->root->last_changed, builder));
+
+  if ((guint64)base_len + out->len > 2 * (guint64)full_size ||
+      (guint64)base_len + out->len > G_MAXUINT32)
     goto out;
 
-  if (!create_new_journal (filename, random_tag))
+  memcpy (header, base_data, HEADER_SIZE);
+  *random_tag = g_random_int ();
+  set_header_uint32 (header, ROTATED_OFFSET, 0);
+  set_header_uint32 (header, RANDOM_TAG_OFFSET, *random_tag);
+  set_header_uint32 (header, ROOT_OFFSET, root);
+
+  tmp_name = g_strdup_printf ("%s.XXXXXX", filename);
+  fd = g_mkstemp (tmp_name);
+  if (fd == -1)
+    {
+      g_free (tmp_name);
+      tmp_name = NULL;
+      goto out;
+    }
+
+  if (copy_base_file (fd, base_fd, base_data, base_len) &&
+      write_all_data (fd, out->str, out->len) &&
+      pwrite (fd, header, HEADER_SIZE, 0) == HEADER_SIZE)
+    res = write_all_data_and_close (fd, NULL, 0);
+  else
+    {
+      close (fd);
+      res = FALSE;
+    }
+
+  if (!res)
+    {
+      g_unlink (tmp_name);
+      g_free (tmp_name);
+      tmp_name = NULL;
+    }
+
+ out:
+  if (out)
+    g_string_free (out, TRUE);
+  g_ptr_array_free (new_values, TRUE);
+  g_hash_table_destroy (ctx.values);
+  g_hash_table_destroy (ctx.key_hash);
+
+  return tmp_name;
+}
+
+/* Replaces filename with a tree from meta_builder_write_tmp(), with a new
+   journal of journal_size bytes holding the given entries. The temporary
+   file is removed on failure. */
+gboolean
+meta_builder_install_tmp (const char  *filename,
+			  const char  *tmp_name,
+			  guint32      random_tag,
+			  gsize        journal_size,
+			  const char  *journal_entries,
+			  gsize        journal_entries_len,
+			  guint32      num_journal_entries)
+{
+  int fd2, fd_dir;
+  char *dirname;
+
+  if (!create_new_journal (filename, random_tag, journal_size,
+			   journal_entries, journal_entries_len,
+			   num_journal_entries))
     goto out;
 
   /* Open old file so we can set it rotated */
@@ -1061,14 +1771,9 @@ meta_builder_write (MetaBuilder *builder,
 	}
     }
 
-  g_string_free (out, TRUE);
-  g_free (tmp_name);
   return TRUE;
 
  out:
-  if (fd != -1)
-    g_unlink (tmp_name);
-  g_string_free (out, TRUE);
-  g_free (tmp_name);
+  g_unlink (tmp_name);
   return FALSE;
 }
@@ -44,6 +44,15 @@ struct _MetaFile {
 
   guint32 metadata_pointer;
   guint32 children_pointer;
+
+  /* Where the file is in the tree it was read from, and what changed
+     since, so that unchanged parts can be reused when writing */
+  gboolean stored;
+  guint32 stored_children;
+  guint32 stored_metadata;
+  gint64 stored_last_changed;
+  gboolean children_changed;
+  gboolean metadata_changed;
 };
 
 struct _MetaData {
@@ -68,11 +77,33 @@ void         meta_builder_copy      (MetaBuilder *builder,
 				     guint64      mtime);
 gboolean     meta_builder_write     (MetaBuilder *builder,
 				     const char  *filename);
+gboolean     meta_builder_write_version (MetaBuilder *builder,
+					 const char  *filename,
+					 int          version);
+char *       meta_builder_write_tmp (MetaBuilder *builder,
+				     const char  *filename,
+				     guint32     *random_tag);
+char *       meta_builder_write_tmp_incremental (MetaBuilder *builder,
+						 const char  *filename,
+						 int          base_fd,
+						 const char  *base_data,
+						 gsize        base_len,
+						 guint32     *random_tag);
+gboolean     meta_builder_install_tmp (const char  *filename,
+				       const char  *tmp_name,
+				       guint32      random_tag,
+				       gsize        journal_size,
+				       const char  *journal_entries,
+				       gsize        journal_entries_len,
+				       guint32      num_journal_entries);
 MetaFile *   metafile_new           (const char  *name,
 				     MetaFile    *parent);
 void         metafile_free          (MetaFile    *file);
 void         metafile_set_mtime     (MetaFile    *file,
 				     guint64      mtime);
+void         metafile_set_stored    (MetaFile    *file,
+				     guint32      children,
+				     guint32      metadata);
 MetaFile *   metafile_lookup_child  (MetaFile    *metafile,
 				     const char  *name,
 				     gboolean     create);
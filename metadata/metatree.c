@@ -59,16 +59,25 @@
 
 #define MAGIC "\xda\x1ameta"
 #define MAGIC_LEN 6
-#define MAJOR_VERSION 1
+#define MAJOR_VERSION 2
 #define MINOR_VERSION 0
 #define JOURNAL_MAGIC "\xda\x1ajour"
 #define JOURNAL_MAGIC_LEN 6
 #define JOURNAL_MAJOR_VERSION 1
 #define JOURNAL_MINOR_VERSION 0
 
+/* New journals are sized after how fast the last one filled up, so
+   that bursts of writes rarely have to wait for a flush */
+#define MIN_JOURNAL_SIZE (32*1024)
+#define MAX_JOURNAL_SIZE (1024*1024)
+#define JOURNAL_FILL_TARGET_SECS 60
+
 #define KEY_IS_LIST_MASK (1<<31)
 
-static GRWLock metatree_lock;
+/* Version 2 children blocks store every n:th name in full */
+#define CHILDREN_RESTART_INTERVAL 16
+#define CHILDREN_NUM_RESTARTS(n) (((n) + CHILDREN_RESTART_INTERVAL - 1) / CHILDREN_RESTART_INTERVAL)
+
 
 typedef enum {
   JOURNAL_OP_SET_KEY,
@@ -116,6 +125,24 @@ typedef struct {
   MetaFileDataEnt keys[1];
 } MetaFileData;
 
+/* A directory entry read from either file format version, offsets are
+   in host order and 0 if not set */
+typedef struct {
+  const char *name;
+  guint32 children;
+  guint32 metadata;
+  guint32 last_changed;
+} MetaTreeDirEnt;
+
+/* A metadata key read from either file format version. For version 1
+   value is the offset of the string or string list, for version 2 it
+   is the dictionary offset of the string or the position of the list */
+typedef struct {
+  guint32 key;
+  gboolean is_list;
+  guint32 value;
+} MetaTreeDataEnt;
+
 typedef struct {
   guchar magic[6];
   guchar major;
@@ -133,11 +160,18 @@ typedef struct {
   char path[1];
 } MetaJournalEntry;
 
+/* A mmapped file, shared between the snapshots that use it */
 typedef struct {
-  char *filename;
+  volatile guint ref_count;
   int fd;
   char *data;
   gsize len;
+} MetaMapping;
+
+typedef struct {
+  MetaMapping *mapping;
+  char *data;
+  gsize len;
 
   MetaJournalHeader *header;
   MetaJournalEntry *first_entry;
@@ -145,15 +179,21 @@ typedef struct {
   MetaJournalEntry *last_entry;
 
   gboolean journal_valid; /* True if all entries validated on open */
+
+  /* Index over the validated entries, so lookups don't have to scan
+     the whole journal. Maps paths to sorted arrays of entry offsets */
+  GHashTable *path_index; /* entries for exactly this path */
+  GHashTable *child_index; /* entries for paths below this path */
+  gboolean index_valid; /* False if some entry path couldn't be indexed */
 } MetaJournal;
 
-struct _MetaTree {
+/* The tree file and the part of the journal that was validated when it
+   was taken. Snapshots are never modified once published, refreshes and
+   writes create a new one, so readers only need to hold a reference. */
+typedef struct {
   volatile guint ref_count;
-  char *filename;
-  gboolean for_write;
-  gboolean on_nfs;
 
-  int fd;
+  MetaMapping *mapping; /* NULL if the tree couldn't be opened */
   char *data;
   gsize len;
   ino_t inode;
@@ -161,119 +201,549 @@ struct _MetaTree {
   guint32 tag;
   gint64 time_t_base;
   MetaFileHeader *header;
-  MetaFileDirEnt *root;
+  int version;
+  gboolean has_root;
+  MetaTreeDirEnt root;
+  guint32 values; /* Start of the value dictionary, version 2 only */
 
   int num_attributes;
   char **attributes;
 
   MetaJournal *journal;
+} MetaTreeSnapshot;
+
+struct _MetaTree {
+  volatile guint ref_count;
+  char *filename;
+  gboolean for_write;
+  gboolean on_nfs;
+
+  /* Only held while taking a reference to or replacing the snapshot */
+  GMutex snapshot_lock;
+  MetaTreeSnapshot *snapshot;
+
+  /* Serializes refreshes and writes, readers never take it */
+  GMutex update_lock;
+
+  /* Set while a flush writes the new file without the update lock */
+  gboolean flushing;
+  gboolean flush_result;
+  GCond flush_cond;
+
+  gint64 journal_created; /* Monotonic time, 0 if not created by us */
 };
 
 static void         meta_tree_refresh_locked   (MetaTree    *tree);
+static gboolean     meta_tree_flush_locked     (MetaTree    *tree,
+						gsize        needed);
 static MetaJournal *meta_journal_open          (MetaTree    *tree,
 						const char  *filename,
 						gboolean     for_write,
 						guint32      tag);
+static MetaJournal *meta_journal_copy          (MetaJournal *journal);
 static void         meta_journal_free          (MetaJournal *journal);
 static void         meta_journal_validate_more (MetaJournal *journal);
 
+/* Positions passed to the verify_ and read_ functions are in host order */
 static gpointer
-verify_block_pointer (MetaTree *tree, guint32 pos, guint32 len)
+verify_block_pointer (MetaTreeSnapshot *snapshot, guint32 pos, guint32 len)
 {
-  pos = GUINT32_FROM_BE (pos);
-
   /* Ensure 32bit aligned */
   if (pos %4 != 0)
     return NULL;
 
-  if (pos > tree->len)
+  if (pos > snapshot->len)
     return NULL;
 
   if (pos + len < pos ||
-      pos + len > tree->len)
+      pos + len > snapshot->len)
     return NULL;
 
-  return tree->data + pos;
+  return snapshot->data + pos;
 }
 
 static gpointer
-verify_array_block (MetaTree *tree, guint32 pos, gsize element_size)
+verify_array_block (MetaTreeSnapshot *snapshot, guint32 pos, gsize element_size)
 {
   guint32 *nump, num;
 
-  nump = verify_block_pointer (tree, pos, sizeof (guint32));
+  nump = verify_block_pointer (snapshot, pos, sizeof (guint32));
   if (nump == NULL)
     return NULL;
 
   num = GUINT32_FROM_BE (*nump);
 
-  return verify_block_pointer (tree, pos, sizeof (guint32) + num * element_size);
+  if (num > (snapshot->len - sizeof (guint32)) / element_size)
+    return NULL;
+
+  return verify_block_pointer (snapshot, pos, sizeof (guint32) + num * element_size);
 }
 
 static gpointer
-verify_children_block (MetaTree *tree, guint32 pos)
+verify_children_block (MetaTreeSnapshot *snapshot, guint32 pos)
 {
-  return verify_array_block (tree, pos, sizeof (MetaFileDirEnt));
+  return verify_array_block (snapshot, pos, sizeof (MetaFileDirEnt));
 }
 
 static gpointer
-verify_metadata_block (MetaTree *tree, guint32 pos)
+verify_metadata_block (MetaTreeSnapshot *snapshot, guint32 pos)
 {
-  return verify_array_block (tree, pos, sizeof (MetaFileDataEnt));
+  return verify_array_block (snapshot, pos, sizeof (MetaFileDataEnt));
 }
 
 static char *
-verify_string (MetaTree *tree, guint32 pos)
+verify_string (MetaTreeSnapshot *snapshot, guint32 pos)
 {
-  char *str, *ptr, *end;
+  char *str, *end;
 
-  pos = GUINT32_FROM_BE (pos);
+  if (pos >= snapshot->len)
+    return NULL;
 
-  if (pos > tree->len)
+  str = snapshot->data + pos;
+  end = memchr (str, 0, snapshot->len - pos);
+  if (end == NULL)
     return NULL;
 
-  str = ptr = tree->data + pos;
-  end = tree->data + tree->len;
+  return str;
+}
+
+/* Unsigned LEB128, used for all offsets and times in version 2 */
+static gboolean
+read_varint (MetaTreeSnapshot *snapshot, guint32 *pos, guint32 *val)
+{
+  guint32 res;
+  guchar c;
+  int shift;
 
-  while (ptr < end && *ptr != 0)
-    ptr++;
+  res = 0;
+  for (shift = 0; shift < 35; shift += 7)
+    {
+      if (*pos >= snapshot->len)
+	return FALSE;
 
-  if (ptr == end)
-    return NULL;
+      c = snapshot->data[(*pos)++];
+      res |= (guint32)(c & 0x7f) << shift;
+      if ((c & 0x80) == 0)
+	{
+	  *val = res;
+	  return TRUE;
+	}
+    }
+
+  return FALSE;
+}
+
+static char *
+read_string (MetaTreeSnapshot *snapshot, guint32 *pos)
+{
+  char *str;
+
+  str = verify_string (snapshot, *pos);
+  if (str != NULL)
+    *pos += strlen (str) + 1;
 
   return str;
 }
 
+static gboolean
+read_dirent (MetaTreeSnapshot *snapshot, guint32 *pos, MetaTreeDirEnt *dirent)
+{
+  return
+    read_varint (snapshot, pos, &dirent->children) &&
+    read_varint (snapshot, pos, &dirent->metadata) &&
+    read_varint (snapshot, pos, &dirent->last_changed);
+}
+
 static void
-meta_tree_clear (MetaTree *tree)
+dirent_from_v1 (MetaTreeDirEnt *dirent, const MetaFileDirEnt *file_dirent)
+{
+  dirent->children = GUINT32_FROM_BE (file_dirent->children);
+  dirent->metadata = GUINT32_FROM_BE (file_dirent->metadata);
+  dirent->last_changed = GUINT32_FROM_BE (file_dirent->last_changed);
+}
+
+/* Walks the children of a directory in either format. In version 2
+   the names are front coded, so they are rebuilt in a buffer that is
+   only valid until the next call. */
+typedef struct {
+  MetaTreeSnapshot *snapshot;
+  guint32 num_children;
+  guint32 i;
+  MetaFileDir *dir; /* version 1 */
+  guint32 restarts; /* version 2 */
+  guint32 entries;
+  guint32 pos;
+  GString *name;
+} MetaTreeChildIter;
+
+static gboolean
+child_iter_init (MetaTreeChildIter *iter,
+		 MetaTreeSnapshot *snapshot,
+		 guint32 children)
+{
+  guint32 pos;
+  guint64 end;
+
+  memset (iter, 0, sizeof (MetaTreeChildIter));
+  iter->snapshot = snapshot;
+
+  if (children == 0)
+    return FALSE;
+
+  if (snapshot->version == 1)
+    {
+      iter->dir = verify_children_block (snapshot, children);
+      if (iter->dir == NULL)
+	return FALSE;
+      iter->num_children = GUINT32_FROM_BE (iter->dir->num_children);
+      return TRUE;
+    }
+
+  pos = children;
+  if (!read_varint (snapshot, &pos, &iter->num_children))
+    return FALSE;
+
+  end = (guint64)pos + (guint64)CHILDREN_NUM_RESTARTS (iter->num_children) * 4;
+  if (end > snapshot->len)
+    return FALSE;
+
+  iter->restarts = pos;
+  iter->entries = iter->pos = end;
+  return TRUE;
+}
+
+static void
+child_iter_clear (MetaTreeChildIter *iter)
+{
+  if (iter->name)
+    g_string_free (iter->name, TRUE);
+  iter->name = NULL;
+}
+
+/* Starts over at the given restart point, version 2 only. Returns
+   the name there, which is stored in full. */
+static char *
+child_iter_seek (MetaTreeChildIter *iter,
+		 guint32 restart)
+{
+  MetaTreeSnapshot *snapshot;
+  guint32 offset, pos, shared;
+
+  snapshot = iter->snapshot;
+  memcpy (&offset, snapshot->data + iter->restarts + restart * 4, 4);
+  pos = iter->entries + GUINT32_FROM_BE (offset);
+  if (pos < iter->entries)
+    return NULL;
+
+  iter->i = restart * CHILDREN_RESTART_INTERVAL;
+  iter->pos = pos;
+  if (iter->name)
+    g_string_truncate (iter->name, 0);
+
+  if (!read_varint (snapshot, &pos, &shared) || shared != 0)
+    return NULL;
+
+  return verify_string (snapshot, pos);
+}
+
+static gboolean
+child_iter_next (MetaTreeChildIter *iter,
+		 MetaTreeDirEnt *dirent)
+{
+  MetaTreeSnapshot *snapshot;
+  MetaFileDirEnt *file_dirent;
+  guint32 shared;
+  char *suffix;
+
+  snapshot = iter->snapshot;
+  while (iter->i < iter->num_children)
+    {
+      iter->i++;
+
+      if (iter->dir)
+	{
+	  file_dirent = &iter->dir->children[iter->i - 1];
+	  dirent->name = verify_string (snapshot, GUINT32_FROM_BE (file_dirent->name));
+	  if (dirent->name == NULL)
+	    continue;
+	  dirent_from_v1 (dirent, file_dirent);
+	  return TRUE;
+	}
+
+      if (iter->name == NULL)
+	iter->name = g_string_new (NULL);
+
+      if (!read_varint (snapshot, &iter->pos, &shared) ||
+	  shared > iter->name->len ||
+	  (suffix = read_string (snapshot, &iter->pos)) == NULL ||
+	  !read_dirent (snapshot, &iter->pos, dirent))
+	{
+	  /* Can't find the following entries either */
+	  iter->i = iter->num_children;
+	  return FALSE;
+	}
+
+      g_string_truncate (iter->name, shared);
+      g_string_append (iter->name, suffix);
+      dirent->name = iter->name->str;
+      return TRUE;
+    }
+
+  return FALSE;
+}
+
+typedef struct {
+  MetaTreeSnapshot *snapshot;
+  guint32 num_keys;
+  guint32 i;
+  MetaFileData *data; /* version 1 */
+  guint32 pos; /* version 2 */
+} MetaTreeDataIter;
+
+static gboolean
+data_iter_init (MetaTreeDataIter *iter,
+		MetaTreeSnapshot *snapshot,
+		guint32 metadata)
 {
-  if (tree->journal)
+  memset (iter, 0, sizeof (MetaTreeDataIter));
+  iter->snapshot = snapshot;
+
+  if (metadata == 0)
+    return FALSE;
+
+  if (snapshot->version == 1)
+    {
+      iter->data = verify_metadata_block (snapshot, metadata);
+      if (iter->data == NULL)
+	return FALSE;
+      iter->num_keys = GUINT32_FROM_BE (iter->data->num_keys);
+      return TRUE;
+    }
+
+  iter->pos = metadata;
+  return read_varint (snapshot, &iter->pos, &iter->num_keys);
+}
+
+static gboolean
+data_iter_next (MetaTreeDataIter *iter,
+		MetaTreeDataEnt *ent)
+{
+  MetaTreeSnapshot *snapshot;
+  MetaFileDataEnt *file_ent;
+  guint32 key, num_values, i, value;
+
+  snapshot = iter->snapshot;
+  if (iter->i >= iter->num_keys)
+    return FALSE;
+  iter->i++;
+
+  if (iter->data)
+    {
+      file_ent = &iter->data->keys[iter->i - 1];
+      key = GUINT32_FROM_BE (file_ent->key);
+      ent->key = key & ~KEY_IS_LIST_MASK;
+      ent->is_list = (key & KEY_IS_LIST_MASK) != 0;
+      ent->value = GUINT32_FROM_BE (file_ent->value);
+      return TRUE;
+    }
+
+  if (!read_varint (snapshot, &iter->pos, &key))
+    goto err;
+
+  ent->key = key >> 1;
+  ent->is_list = (key & 1) != 0;
+  if (!ent->is_list)
+    {
+      if (!read_varint (snapshot, &iter->pos, &ent->value))
+	goto err;
+      return TRUE;
+    }
+
+  ent->value = iter->pos;
+  if (!read_varint (snapshot, &iter->pos, &num_values))
+    goto err;
+  for (i = 0; i < num_values; i++)
+    {
+      if (!read_varint (snapshot, &iter->pos, &value))
+	goto err;
+    }
+  return TRUE;
+
+ err:
+  iter->i = iter->num_keys;
+  return FALSE;
+}
+
+static char *
+get_value_string (MetaTreeSnapshot *snapshot,
+		  guint32 value)
+{
+  if (snapshot->version == 1)
+    return verify_string (snapshot, value);
+
+  if (value >= snapshot->len - snapshot->values)
+    return NULL;
+
+  return verify_string (snapshot, snapshot->values + value);
+}
+
+static char *
+data_ent_get_string (MetaTreeSnapshot *snapshot,
+		     MetaTreeDataEnt *ent)
+{
+  return get_value_string (snapshot, ent->value);
+}
+
+/* Returns the strings that could be read, pointing into the file.
+   Free the array with g_free() */
+static char **
+data_ent_get_stringv (MetaTreeSnapshot *snapshot,
+		      MetaTreeDataEnt *ent)
+{
+  MetaFileStringv *stringv;
+  guint32 pos, num_strings, value, i, j;
+  char **res;
+
+  if (snapshot->version == 1)
     {
-      meta_journal_free (tree->journal);
-      tree->journal = NULL;
+      stringv = verify_array_block (snapshot, ent->value, sizeof (guint32));
+      if (stringv == NULL)
+	return NULL;
+
+      num_strings = GUINT32_FROM_BE (stringv->num_strings);
+      res = g_new (char *, num_strings + 1);
+      for (i = 0, j = 0; i < num_strings; i++)
+	{
+	  res[j] = verify_string (snapshot, GUINT32_FROM_BE (stringv->strings[i]));
+	  if (res[j] != NULL)
+	    j++;
+	}
+      res[j] = NULL;
+      return res;
     }
 
-  g_free (tree->attributes);
-  tree->num_attributes = 0;
-  tree->attributes = NULL;
+  pos = ent->value;
+  if (!read_varint (snapshot, &pos, &num_strings) ||
+      num_strings > snapshot->len - pos)
+    return NULL;
+
+  res = g_new (char *, num_strings + 1);
+  for (i = 0, j = 0; i < num_strings; i++)
+    {
+      if (!read_varint (snapshot, &pos, &value))
+	break;
+      res[j] = get_value_string (snapshot, value);
+      if (res[j] != NULL)
+	j++;
+    }
+  res[j] = NULL;
+  return res;
+}
+
+static MetaMapping *
+meta_mapping_new (int fd, char *data, gsize len)
+{
+  MetaMapping *mapping;
 
-  tree->tag = 0;
-  tree->time_t_base = 0;
-  tree->header = NULL;
-  tree->root = NULL;
+  mapping = g_new0 (MetaMapping, 1);
+  mapping->ref_count = 1;
+  mapping->fd = fd;
+  mapping->data = data;
+  mapping->len = len;
 
-  if (tree->data)
+  return mapping;
+}
+
+static MetaMapping *
+meta_mapping_ref (MetaMapping *mapping)
+{
+  g_atomic_int_inc ((int *)&mapping->ref_count);
+  return mapping;
+}
+
+static void
+meta_mapping_unref (MetaMapping *mapping)
+{
+  if (g_atomic_int_dec_and_test ((int *)&mapping->ref_count))
     {
-      munmap(tree->data, tree->len);
-      tree->data = NULL;
+      munmap (mapping->data, mapping->len);
+      close (mapping->fd);
+      g_free (mapping);
     }
+}
+
+static MetaTreeSnapshot *
+meta_tree_snapshot_ref (MetaTreeSnapshot *snapshot)
+{
+  g_atomic_int_inc ((int *)&snapshot->ref_count);
+  return snapshot;
+}
 
-  tree->len = 0;
-  if (tree->fd != -1)
+static void
+meta_tree_snapshot_unref (MetaTreeSnapshot *snapshot)
+{
+  if (!g_atomic_int_dec_and_test ((int *)&snapshot->ref_count))
+    return;
+
+  if (snapshot->journal)
+    meta_journal_free (snapshot->journal);
+  g_free (snapshot->attributes);
+  if (snapshot->mapping)
+    meta_mapping_unref (snapshot->mapping);
+  g_free (snapshot);
+}
+
+/* Same tree file, with the journal validated up to what's in it now */
+static MetaTreeSnapshot *
+meta_tree_snapshot_extend (MetaTreeSnapshot *old)
+{
+  MetaTreeSnapshot *snapshot;
+
+  snapshot = g_new0 (MetaTreeSnapshot, 1);
+  *snapshot = *old;
+  snapshot->ref_count = 1;
+
+  if (old->mapping)
+    meta_mapping_ref (old->mapping);
+  snapshot->attributes = g_memdup (old->attributes,
+				   old->num_attributes * sizeof (char *));
+  if (old->journal)
     {
-      close (tree->fd);
-      tree->fd = 0;
+      snapshot->journal = meta_journal_copy (old->journal);
+      meta_journal_validate_more (snapshot->journal);
     }
+
+  return snapshot;
+}
+
+/* Returns a reference to the current snapshot. This never waits for a
+   refresh or a write, those build the next snapshot on the side. */
+static MetaTreeSnapshot *
+meta_tree_get_snapshot (MetaTree *tree)
+{
+  MetaTreeSnapshot *snapshot;
+
+  g_mutex_lock (&tree->snapshot_lock);
+  snapshot = meta_tree_snapshot_ref (tree->snapshot);
+  g_mutex_unlock (&tree->snapshot_lock);
+
+  return snapshot;
+}
+
+/* Takes ownership of snapshot, call with the update lock held */
+static void
+meta_tree_set_snapshot (MetaTree *tree,
+			MetaTreeSnapshot *snapshot)
+{
+  MetaTreeSnapshot *old;
+
+  g_mutex_lock (&tree->snapshot_lock);
+  old = tree->snapshot;
+  tree->snapshot = snapshot;
+  g_mutex_unlock (&tree->snapshot_lock);
+
+  if (old)
+    meta_tree_snapshot_unref (old);
 }
 
 static gboolean
@@ -418,15 +888,20 @@ safe_open (MetaTree *tree,
 
 }
 
-static gboolean
-meta_tree_init (MetaTree *tree)
+static MetaTreeSnapshot *
+meta_tree_snapshot_open (MetaTree *tree)
 {
+  MetaTreeSnapshot *snapshot;
   struct stat statbuf;
   int fd;
   void *data;
+  MetaFileDirEnt *root;
   guint32 *attributes;
+  guint32 num_attributes, pos, i;
   gboolean retried;
-  int i;
+
+  snapshot = g_new0 (MetaTreeSnapshot, 1);
+  snapshot->ref_count = 1;
 
   retried = FALSE;
  retry:
@@ -452,71 +927,98 @@ meta_tree_init (MetaTree *tree)
 	    }
 	  meta_builder_free (builder);
 	}
-      tree->fd = -1;
-      return FALSE;
+      return snapshot;
     }
 
   if (fstat (fd, &statbuf) != 0 ||
       statbuf.st_size < sizeof (MetaFileHeader))
     {
       close (fd);
-      return FALSE;
+      return snapshot;
     }
 
   data = mmap (NULL, statbuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
   if (data == MAP_FAILED)
     {
       close (fd);
-      return FALSE;
+      return snapshot;
     }
 
-  tree->fd = fd;
-  tree->len = statbuf.st_size;
-  tree->inode = statbuf.st_ino;
-  tree->data = data;
-  tree->header = (MetaFileHeader *)data;
+  snapshot->mapping = meta_mapping_new (fd, data, statbuf.st_size);
+  snapshot->len = statbuf.st_size;
+  snapshot->inode = statbuf.st_ino;
+  snapshot->data = data;
+  snapshot->header = (MetaFileHeader *)data;
 
-  if (memcmp (tree->header->magic, MAGIC, MAGIC_LEN) != 0)
+  if (memcmp (snapshot->header->magic, MAGIC, MAGIC_LEN) != 0)
     goto err;
 
-  if (tree->header->major != MAJOR_VERSION)
-    goto err;
-
-  tree->root = verify_block_pointer (tree, tree->header->root, sizeof (MetaFileDirEnt));
-  if (tree->root == NULL)
-    goto err;
+  /* Version 1 is still read, it gets converted on the next write */
+  snapshot->version = snapshot->header->major;
+  if (snapshot->version == 1)
+    {
+      root = verify_block_pointer (snapshot, GUINT32_FROM_BE (snapshot->header->root),
+				   sizeof (MetaFileDirEnt));
+      if (root == NULL)
+	goto err;
+      dirent_from_v1 (&snapshot->root, root);
 
-  attributes = verify_array_block (tree, tree->header->attributes, sizeof (guint32));
-  if (attributes == NULL)
-    goto err;
+      attributes = verify_array_block (snapshot, GUINT32_FROM_BE (snapshot->header->attributes),
+				       sizeof (guint32));
+      if (attributes == NULL)
+	goto err;
 
-  tree->num_attributes = GUINT32_FROM_BE (*attributes);
-  attributes++;
-  tree->attributes = g_new (char *, tree->num_attributes);
-  for (i = 0; i < tree->num_attributes; i++)
+      num_attributes = GUINT32_FROM_BE (*attributes);
+      attributes++;
+      snapshot->attributes = g_new (char *, num_attributes);
+      for (i = 0; i < num_attributes; i++)
+	{
+	  snapshot->attributes[i] = verify_string (snapshot, GUINT32_FROM_BE (attributes[i]));
+	  if (snapshot->attributes[i] == NULL)
+	    goto err;
+	}
+      snapshot->num_attributes = num_attributes;
+    }
+  else if (snapshot->version == MAJOR_VERSION)
     {
-      tree->attributes[i] = verify_string (tree, attributes[i]);
-      if (tree->attributes[i] == NULL)
+      pos = GUINT32_FROM_BE (snapshot->header->root);
+      if (!read_dirent (snapshot, &pos, &snapshot->root))
 	goto err;
+
+      /* The attribute names, followed by the value dictionary */
+      pos = GUINT32_FROM_BE (snapshot->header->attributes);
+      if (!read_varint (snapshot, &pos, &num_attributes) ||
+	  num_attributes > snapshot->len - pos)
+	goto err;
+
+      snapshot->attributes = g_new (char *, num_attributes);
+      for (i = 0; i < num_attributes; i++)
+	{
+	  snapshot->attributes[i] = read_string (snapshot, &pos);
+	  if (snapshot->attributes[i] == NULL)
+	    goto err;
+	}
+      snapshot->num_attributes = num_attributes;
+      snapshot->values = pos;
     }
+  else
+    goto err;
 
-  tree->tag = GUINT32_FROM_BE (tree->header->random_tag);
-  tree->time_t_base = GINT64_FROM_BE (tree->header->time_t_base);
+  snapshot->root.name = "/";
+  snapshot->has_root = TRUE;
 
-  tree->journal = meta_journal_open (tree, tree->filename, tree->for_write, tree->tag);
+  snapshot->tag = GUINT32_FROM_BE (snapshot->header->random_tag);
+  snapshot->time_t_base = GINT64_FROM_BE (snapshot->header->time_t_base);
 
-  /* There is a race with tree replacing, where the journal could have been
-     deleted (and the tree replaced) inbetween opening the tree file and the
-     journal. However we can detect this case by looking at the tree and see
-     if its been rotated, we do this to ensure we have an uptodate tree+journal
-     combo. */
-  meta_tree_refresh_locked (tree);
+  snapshot->journal = meta_journal_open (tree, tree->filename, tree->for_write, snapshot->tag);
 
-  return TRUE;
+  return snapshot;
 
  err:
-  meta_tree_clear (tree);
-  return FALSE;
+  meta_tree_snapshot_unref (snapshot);
+  snapshot = g_new0 (MetaTreeSnapshot, 1);
+  snapshot->ref_count = 1;
+  return snapshot;
 }
 
 MetaTree *
@@ -533,9 +1035,24 @@ meta_tree_open (const char *filename,
   tree->ref_count = 1;
   tree->filename = g_strdup (filename);
   tree->for_write = for_write;
-  tree->fd = -1;
+  g_mutex_init (&tree->snapshot_lock);
+  g_mutex_init (&tree->update_lock);
+  g_cond_init (&tree->flush_cond);
+
+  tree->snapshot = meta_tree_snapshot_open (tree);
+  if (tree->snapshot->mapping != NULL)
+    meta_tree_refresh_locked (tree);
 
-  meta_tree_init (tree);
+  /* Convert trees written in an older format, so readers get the
+     smaller one as soon as the writer has looked at it */
+  if (for_write &&
+      tree->snapshot->has_root &&
+      tree->snapshot->version != MAJOR_VERSION)
+    {
+      g_mutex_lock (&tree->update_lock);
+      meta_tree_flush_locked (tree, 0);
+      g_mutex_unlock (&tree->update_lock);
+    }
 
   return tree;
 }
@@ -549,7 +1066,14 @@ meta_tree_get_filename (MetaTree *tree)
 gboolean
 meta_tree_exists (MetaTree *tree)
 {
-  return tree->fd != -1;
+  MetaTreeSnapshot *snapshot;
+  gboolean res;
+
+  snapshot = meta_tree_get_snapshot (tree);
+  res = snapshot->mapping != NULL;
+  meta_tree_snapshot_unref (snapshot);
+
+  return res;
 }
 
 static GHashTable *cached_trees = NULL;
@@ -607,22 +1131,26 @@ meta_tree_unref (MetaTree *tree)
   is_zero = g_atomic_int_dec_and_test ((int *)&tree->ref_count);
   if (is_zero)
     {
-      meta_tree_clear (tree);
+      meta_tree_snapshot_unref (tree->snapshot);
+      g_mutex_clear (&tree->snapshot_lock);
+      g_mutex_clear (&tree->update_lock);
+      g_cond_clear (&tree->flush_cond);
       g_free (tree->filename);
       g_free (tree);
     }
 }
 
 static gboolean
-meta_tree_needs_rereading (MetaTree *tree)
+meta_tree_needs_rereading (MetaTree *tree,
+			   MetaTreeSnapshot *snapshot)
 {
   struct stat statbuf;
 
-  if (tree->fd == -1)
+  if (snapshot->mapping == NULL)
     return TRUE;
 
-  if (tree->header != NULL &&
-      GUINT32_FROM_BE (tree->header->rotated) == 0)
+  if (snapshot->header != NULL &&
+      GUINT32_FROM_BE (snapshot->header->rotated) == 0)
     return FALSE; /* Got a valid tree and its not rotated */
 
   /* Sanity check to avoid infinite loops when a stable file
@@ -631,22 +1159,22 @@ meta_tree_needs_rereading (MetaTree *tree)
   if (lstat (tree->filename, &statbuf) != 0)
     return FALSE;
 
-  if (tree->inode == statbuf.st_ino)
+  if (snapshot->inode == statbuf.st_ino)
     return FALSE;
 
   return TRUE;
 }
 
 static gboolean
-meta_tree_has_new_journal_entries (MetaTree *tree)
+meta_tree_has_new_journal_entries (MetaTreeSnapshot *snapshot)
 {
   guint32 num_entries;
   MetaJournal *journal;
 
-  journal = tree->journal;
+  journal = snapshot->journal;
 
   if (journal == NULL ||
-      !tree->journal->journal_valid)
+      !journal->journal_valid)
     return FALSE; /* Once we've seen a failure, never look for more */
 
   /* TODO: Use atomic read here? */
@@ -656,42 +1184,74 @@ meta_tree_has_new_journal_entries (MetaTree *tree)
 }
 
 
-/* Must be called with a write lock held */
+/* Publishes the entries added to the journal since the current snapshot
+   was taken. Call with the update lock held. */
+static void
+meta_tree_journal_updated_locked (MetaTree *tree)
+{
+  MetaTreeSnapshot *snapshot;
+
+  g_mutex_lock (&tree->snapshot_lock);
+  snapshot = tree->snapshot;
+  if (snapshot->ref_count == 1)
+    {
+      /* No reader holds it, and new ones need the snapshot lock, so
+	 there is no need to copy the journal index */
+      meta_journal_validate_more (snapshot->journal);
+      g_mutex_unlock (&tree->snapshot_lock);
+      return;
+    }
+  g_mutex_unlock (&tree->snapshot_lock);
+
+  meta_tree_set_snapshot (tree, meta_tree_snapshot_extend (snapshot));
+}
+
+/* Must be called with the update lock held, or before the tree is
+   visible to other threads */
 static void
 meta_tree_refresh_locked (MetaTree *tree)
 {
-  /* Needs to recheck since we dropped read lock */
-  if (meta_tree_needs_rereading (tree))
+  /* There is a race with tree replacing, where the journal could have been
+     deleted (and the tree replaced) inbetween opening the tree file and the
+     journal. However we can detect this case by looking at the tree and see
+     if its been rotated, we do this to ensure we have an uptodate tree+journal
+     combo. */
+  while (meta_tree_needs_rereading (tree, tree->snapshot))
     {
-      if (tree->header)
-	meta_tree_clear (tree);
-      meta_tree_init (tree);
+      meta_tree_set_snapshot (tree, meta_tree_snapshot_open (tree));
+      if (tree->snapshot->mapping == NULL)
+	return;
     }
-  else if (meta_tree_has_new_journal_entries (tree))
-    meta_journal_validate_more (tree->journal);
+
+  if (meta_tree_has_new_journal_entries (tree->snapshot))
+    meta_tree_journal_updated_locked (tree);
 }
 
 void
 meta_tree_refresh (MetaTree *tree)
 {
+  MetaTreeSnapshot *snapshot;
   gboolean needs_refresh;
 
-  g_rw_lock_reader_lock (&metatree_lock);
+  snapshot = meta_tree_get_snapshot (tree);
   needs_refresh =
-    meta_tree_needs_rereading (tree) ||
-    meta_tree_has_new_journal_entries (tree);
-  g_rw_lock_reader_unlock (&metatree_lock);
-
-  if (needs_refresh)
+    meta_tree_needs_rereading (tree, snapshot) ||
+    meta_tree_has_new_journal_entries (snapshot);
+  meta_tree_snapshot_unref (snapshot);
+
+  /* If another thread is refreshing or writing it will publish a new
+     snapshot when done, keep using the current one until then rather
+     than waiting for it */
+  if (needs_refresh &&
+      g_mutex_trylock (&tree->update_lock))
     {
-      g_rw_lock_writer_lock (&metatree_lock);
       meta_tree_refresh_locked (tree);
-      g_rw_lock_writer_unlock (&metatree_lock);
+      g_mutex_unlock (&tree->update_lock);
     }
 }
 
 struct FindName {
-  MetaTree *tree;
+  MetaTreeSnapshot *snapshot;
   const char *name;
 };
 
@@ -702,34 +1262,118 @@ find_dir_element (const void *_key, const void *_dirent)
   const MetaFileDirEnt *dirent = _dirent;
   char *dirent_name;
 
-  dirent_name = verify_string (key->tree, dirent->name);
+  dirent_name = verify_string (key->snapshot, GUINT32_FROM_BE (dirent->name));
   if (dirent_name == NULL)
     return -1;
   return strcmp (key->name, dirent_name);
 }
 
+/* Sets everything but the name of child */
+static gboolean
+dir_find_child (MetaTreeSnapshot *snapshot,
+		guint32 children,
+		const char *name,
+		MetaTreeDirEnt *child)
+{
+  MetaTreeChildIter iter;
+  MetaFileDirEnt *file_dirent;
+  struct FindName key;
+  guint32 lo, hi, mid, shared, matched, k;
+  char *restart_name, *suffix;
+  gboolean found;
+
+  if (!child_iter_init (&iter, snapshot, children))
+    return FALSE;
+
+  if (iter.dir)
+    {
+      key.name = name;
+      key.snapshot = snapshot;
+      file_dirent = bsearch (&key, &iter.dir->children[0],
+			     iter.num_children, sizeof (MetaFileDirEnt),
+			     find_dir_element);
+      if (file_dirent == NULL)
+	return FALSE;
+
+      dirent_from_v1 (child, file_dirent);
+      child->name = NULL;
+      return TRUE;
+    }
+
+  /* Find the last restart point with a name <= name... */
+  lo = 0;
+  hi = CHILDREN_NUM_RESTARTS (iter.num_children);
+  while (lo < hi)
+    {
+      mid = lo + (hi - lo) / 2;
+      restart_name = child_iter_seek (&iter, mid);
+      if (restart_name == NULL)
+	return FALSE;
+
+      if (strcmp (name, restart_name) < 0)
+	hi = mid;
+      else
+	lo = mid + 1;
+    }
+
+  if (lo == 0 ||
+      child_iter_seek (&iter, lo - 1) == NULL)
+    return FALSE;
+
+  /* ...and scan forward from it. The names are sorted, so knowing how
+     much of name the previous entry matched and how much this one
+     shares with it is enough to skip most of them without comparing */
+  found = FALSE;
+  matched = 0;
+  for (; iter.i < iter.num_children; iter.i++)
+    {
+      if (!read_varint (snapshot, &iter.pos, &shared) ||
+	  (suffix = read_string (snapshot, &iter.pos)) == NULL ||
+	  !read_dirent (snapshot, &iter.pos, child))
+	break;
+
+      if (shared > matched)
+	continue; /* Same as the previous one where it was smaller */
+      if (shared < matched)
+	break; /* Bigger than the previous one where it matched */
+
+      k = 0;
+      while (suffix[k] != 0 && suffix[k] == name[matched + k])
+	k++;
+
+      if (suffix[k] == name[matched + k])
+	{
+	  found = TRUE;
+	  break;
+	}
+
+      if ((guchar)suffix[k] > (guchar)name[matched + k])
+	break;
+
+      matched += k;
+    }
+
+  child->name = NULL;
+
+  return found;
+}
+
 /* modifies path!!! */
-static MetaFileDirEnt *
-dir_lookup_path (MetaTree *tree,
-		 MetaFileDirEnt *dirent,
+static gboolean
+dir_lookup_path (MetaTreeSnapshot *snapshot,
+		 MetaTreeDirEnt *dirent,
 		 char *path)
 {
   char *end_path;
-  MetaFileDir *dir;
-  struct FindName key;
 
   while (*path == '/')
     path++;
 
   if (*path == 0)
-    return dirent;
+    return TRUE;
 
   if (dirent->children == 0)
-    return NULL;
-
-  dir = verify_children_block (tree, dirent->children);
-  if (dir == NULL)
-    return NULL;
+    return FALSE;
 
   end_path = path;
   while (*end_path != 0 &&
@@ -739,48 +1383,42 @@ dir_lookup_path (MetaTree *tree,
   if (*end_path != 0)
     *end_path++ = 0;
 
-  key.name = path;
-  key.tree = tree;
-  dirent = bsearch (&key, &dir->children[0],
-		    GUINT32_FROM_BE (dir->num_children), sizeof (MetaFileDirEnt),
-		    find_dir_element);
-
-  if (dirent == NULL)
-    return NULL;
+  if (!dir_find_child (snapshot, dirent->children, path, dirent))
+    return FALSE;
 
-  return dir_lookup_path (tree, dirent, end_path);
+  return dir_lookup_path (snapshot, dirent, end_path);
 }
 
-static MetaFileDirEnt *
-meta_tree_lookup (MetaTree *tree,
-		  const char *path)
+static gboolean
+meta_tree_lookup (MetaTreeSnapshot *snapshot,
+		  const char *path,
+		  MetaTreeDirEnt *dirent)
 {
-  MetaFileDirEnt *dirent;
   char *path_copy;
+  gboolean res;
 
-  if (tree->root == NULL)
-    return NULL;
+  if (!snapshot->has_root)
+    return FALSE;
 
+  *dirent = snapshot->root;
   path_copy = g_strdup (path);
-  dirent = dir_lookup_path (tree, tree->root, path_copy);
+  res = dir_lookup_path (snapshot, dirent, path_copy);
   g_free (path_copy);
 
-  return dirent;
+  return res;
 }
 
-static MetaFileData *
-meta_tree_lookup_data (MetaTree *tree,
+/* Returns the position of the metadata for path, or 0 */
+static guint32
+meta_tree_lookup_data (MetaTreeSnapshot *snapshot,
 		       const char *path)
 {
-  MetaFileDirEnt *dirent;
-  MetaFileData *data;
+  MetaTreeDirEnt dirent;
 
-  data = NULL;
-  dirent = meta_tree_lookup (tree, path);
-  if (dirent)
-    data = verify_metadata_block (tree, dirent->metadata);
+  if (meta_tree_lookup (snapshot, path, &dirent))
+    return dirent.metadata;
 
-  return data;
+  return 0;
 }
 
 static int
@@ -795,23 +1433,23 @@ find_attribute_id (const void *_key, const void *_entry)
 #define NO_KEY ((guint32)-1)
 
 static guint32
-get_id_for_key (MetaTree *tree,
+get_id_for_key (MetaTreeSnapshot *snapshot,
 		const char *attribute)
 {
   char **attribute_ptr;
 
-  attribute_ptr = bsearch (attribute, tree->attributes,
-			   tree->num_attributes, sizeof (char *),
+  attribute_ptr = bsearch (attribute, snapshot->attributes,
+			   snapshot->num_attributes, sizeof (char *),
 			   find_attribute_id);
 
   if (attribute_ptr == NULL)
     return NO_KEY;
 
-  return attribute_ptr - tree->attributes;
+  return attribute_ptr - snapshot->attributes;
 }
 
 struct FindId {
-  MetaTree *tree;
+  MetaTreeSnapshot *snapshot;
   guint32 id;
 };
 
@@ -827,21 +1465,48 @@ find_data_element (const void *_key, const void *_dataent)
   return key->id - key_id;
 }
 
-static MetaFileDataEnt *
-meta_data_get_key (MetaTree *tree,
-		   MetaFileData *data,
-		   const char *attribute)
+static gboolean
+meta_data_get_key (MetaTreeSnapshot *snapshot,
+		   guint32 metadata,
+		   const char *attribute,
+		   MetaTreeDataEnt *ent)
 {
+  MetaTreeDataIter iter;
   MetaFileDataEnt *dataent;
   struct FindId key;
+  guint32 id;
+
+  id = get_id_for_key (snapshot, attribute);
+  if (id == NO_KEY ||
+      !data_iter_init (&iter, snapshot, metadata))
+    return FALSE;
+
+  if (iter.data)
+    {
+      key.id = id;
+      key.snapshot = snapshot;
+      dataent = bsearch (&key, &iter.data->keys[0],
+			 iter.num_keys, sizeof (MetaFileDataEnt),
+			 find_data_element);
+      if (dataent == NULL)
+	return FALSE;
 
-  key.id = get_id_for_key (tree, attribute);
-  key.tree = tree;
-  dataent = bsearch (&key, &data->keys[0],
-		     GUINT32_FROM_BE (data->num_keys), sizeof (MetaFileDataEnt),
-		     find_data_element);
+      ent->key = id;
+      ent->is_list = (GUINT32_FROM_BE (dataent->key) & KEY_IS_LIST_MASK) != 0;
+      ent->value = GUINT32_FROM_BE (dataent->value);
+      return TRUE;
+    }
 
-  return dataent;
+  /* Keys are sorted, and there are only a few per file */
+  while (data_iter_next (&iter, ent))
+    {
+      if (ent->key == id)
+	return TRUE;
+      if (ent->key > id)
+	break;
+    }
+
+  return FALSE;
 }
 
 static char *
@@ -857,68 +1522,264 @@ get_journal_filename (const char *filename, guint32 random_tag)
       random_tag >>= 4;
     }
 
-  tag[8] = 0;
+  tag[8] = 0;
+
+  return g_strconcat (filename, "-", tag, ".log", NULL);
+}
+
+static void
+meta_journal_free (MetaJournal *journal)
+{
+  g_hash_table_destroy (journal->path_index);
+  g_hash_table_destroy (journal->child_index);
+  meta_mapping_unref (journal->mapping);
+  g_free (journal);
+}
+
+static GHashTable *
+journal_index_copy (GHashTable *index)
+{
+  GHashTable *copy;
+  GHashTableIter iter;
+  GArray *offsets, *offsets_copy;
+  char *path;
+
+  copy = g_hash_table_new_full (g_str_hash, g_str_equal,
+				g_free, (GDestroyNotify)g_array_unref);
+
+  g_hash_table_iter_init (&iter, index);
+  while (g_hash_table_iter_next (&iter, (gpointer *)&path, (gpointer *)&offsets))
+    {
+      offsets_copy = g_array_sized_new (FALSE, FALSE, sizeof (guint32), offsets->len);
+      g_array_append_vals (offsets_copy, offsets->data, offsets->len);
+      g_hash_table_insert (copy, g_strdup (path), offsets_copy);
+    }
+
+  return copy;
+}
+
+/* Copies the validated state, sharing the mapping, so that the copy
+   can be validated further without affecting readers of the original */
+static MetaJournal *
+meta_journal_copy (MetaJournal *journal)
+{
+  MetaJournal *copy;
+
+  copy = g_new0 (MetaJournal, 1);
+  *copy = *journal;
+  meta_mapping_ref (copy->mapping);
+  copy->path_index = journal_index_copy (journal->path_index);
+  copy->child_index = journal_index_copy (journal->child_index);
+
+  return copy;
+}
+
+static MetaJournalEntry *
+verify_journal_entry (MetaJournal *journal,
+		      MetaJournalEntry *entry)
+{
+  guint32 offset, real_crc32;
+  guint32 entry_len, entry_len_end;
+  char *ptr;
+
+  ptr = (char *)entry;
+  if (ptr < journal->data)
+    return NULL;
+  offset =  ptr - journal->data;
+
+  /* Must be 32bit aligned */
+  if (offset % 4 != 0)
+    return NULL;
+
+  /* entry_size must be valid */
+  if (offset > journal->len - 4)
+    return NULL;
+
+  /* Verify that entry fits and has right size */
+  entry_len = GUINT32_FROM_BE (entry->entry_size);
+
+  /* Must be 32bit aligned */
+  if (entry_len % 4 != 0)
+    return NULL;
+  /* Must have space for at the very least:
+     len+crc32+mtime+type+path_terminating_zeor+end_len */
+  if (journal->len < 4 + 4 + 8 + 1 + 1 + 4)
+    return NULL;
+
+  if (entry_len > journal->len ||
+      offset > journal->len - entry_len)
+    return NULL;
+
+  entry_len_end = GUINT32_FROM_BE (*(guint32 *)(journal->data + offset + entry_len - 4));
+  if (entry_len != entry_len_end)
+    return NULL;
+
+  real_crc32 = metadata_crc32 (journal->data + offset + 8, entry_len - 8);
+  if (real_crc32 != GUINT32_FROM_BE (entry->crc32))
+    return NULL;
+
+  return (MetaJournalEntry *)(journal->data + offset + entry_len);
+}
+
+/* The index only handles absolute paths without empty or trailing
+   components, which is what clients send. Anything else falls back to
+   scanning the journal. */
+static gboolean
+journal_path_is_canonical (const char *path)
+{
+  const char *p;
+
+  if (path[0] != '/')
+    return FALSE;
+
+  if (path[1] == 0)
+    return TRUE;
+
+  for (p = path; *p != 0; p++)
+    {
+      if (p[0] == '/' && (p[1] == '/' || p[1] == 0))
+	return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Cuts the last component off a canonical path, returns FALSE for the root */
+static gboolean
+journal_path_to_parent (char *path)
+{
+  char *slash;
+
+  if (path[1] == 0)
+    return FALSE;
+
+  slash = strrchr (path, '/');
+  if (slash == path)
+    slash[1] = 0;
+  else
+    *slash = 0;
+
+  return TRUE;
+}
+
+static void
+journal_index_add (GHashTable *index,
+		   const char *path,
+		   guint32 offset)
+{
+  GArray *offsets;
+
+  offsets = g_hash_table_lookup (index, path);
+  if (offsets == NULL)
+    {
+      offsets = g_array_new (FALSE, FALSE, sizeof (guint32));
+      g_hash_table_insert (index, g_strdup (path), offsets);
+    }
+
+  g_array_append_val (offsets, offset);
+}
+
+/* Returns the offset of the last indexed entry for path before "before",
+   or 0 if there is none */
+static guint32
+journal_index_find_before (GHashTable *index,
+			   const char *path,
+			   guint32 before)
+{
+  GArray *offsets;
+  guint lo, hi, mid;
+
+  offsets = g_hash_table_lookup (index, path);
+  if (offsets == NULL)
+    return 0;
+
+  lo = 0;
+  hi = offsets->len;
+  while (lo < hi)
+    {
+      mid = (lo + hi) / 2;
+      if (g_array_index (offsets, guint32, mid) < before)
+	lo = mid + 1;
+      else
+	hi = mid;
+    }
+
+  if (lo == 0)
+    return 0;
 
-  return g_strconcat (filename, "-", tag, ".log", NULL);
+  return g_array_index (offsets, guint32, lo - 1);
 }
 
 static void
-meta_journal_free (MetaJournal *journal)
+meta_journal_index_entry (MetaJournal *journal,
+			  MetaJournalEntry *entry)
 {
-  g_free (journal->filename);
-  munmap(journal->data, journal->len);
-  close (journal->fd);
-  g_free (journal);
-}
+  char *path;
+  guint32 offset;
 
-static MetaJournalEntry *
-verify_journal_entry (MetaJournal *journal,
-		      MetaJournalEntry *entry)
-{
-  guint32 offset, real_crc32;
-  guint32 entry_len, entry_len_end;
-  char *ptr;
+  if (!journal->index_valid)
+    return;
 
-  ptr = (char *)entry;
-  if (ptr < journal->data)
-    return NULL;
-  offset =  ptr - journal->data;
+  if (!journal_path_is_canonical (entry->path))
+    {
+      journal->index_valid = FALSE;
+      return;
+    }
 
-  /* Must be 32bit aligned */
-  if (offset % 4 != 0)
-    return NULL;
+  offset = (char *)entry - journal->data;
+  journal_index_add (journal->path_index, entry->path, offset);
 
-  /* entry_size must be valid */
-  if (offset > journal->len - 4)
-    return NULL;
+  path = g_strdup (entry->path);
+  while (journal_path_to_parent (path))
+    journal_index_add (journal->child_index, path, offset);
+  g_free (path);
+}
 
-  /* Verify that entry fits and has right size */
-  entry_len = GUINT32_FROM_BE (entry->entry_size);
+/* Returns the closest entry before "entry" that may affect path, i.e.
+   one for path or any of its parents, and if include_children is set
+   also for anything below path. */
+static MetaJournalEntry *
+meta_journal_prev_entry (MetaJournal *journal,
+			 MetaJournalEntry *entry,
+			 const char *path,
+			 gboolean include_children)
+{
+  guint32 *sizep;
+  guint32 before, offset, found;
+  char *parent;
 
-  /* Must be 32bit aligned */
-  if (entry_len % 4 != 0)
-    return NULL;
-  /* Must have space for at the very least:
-     len+crc32+mtime+type+path_terminating_zeor+end_len */
-  if (journal->len < 4 + 4 + 8 + 1 + 1 + 4)
-    return NULL;
+  if (journal->index_valid &&
+      journal_path_is_canonical (path))
+    {
+      before = (char *)entry - journal->data;
 
-  if (entry_len > journal->len ||
-      offset > journal->len - entry_len)
-    return NULL;
+      found = 0;
+      if (include_children)
+	found = journal_index_find_before (journal->child_index, path, before);
 
-  entry_len_end = GUINT32_FROM_BE (*(guint32 *)(journal->data + offset + entry_len - 4));
-  if (entry_len != entry_len_end)
-    return NULL;
+      parent = g_strdup (path);
+      do
+	{
+	  offset = journal_index_find_before (journal->path_index, parent, before);
+	  found = MAX (found, offset);
+	}
+      while (journal_path_to_parent (parent));
+      g_free (parent);
 
-  real_crc32 = metadata_crc32 (journal->data + offset + 8, entry_len - 8);
-  if (real_crc32 != GUINT32_FROM_BE (entry->crc32))
+      if (found == 0)
+	return NULL;
+      return (MetaJournalEntry *)(journal->data + found);
+    }
+
+  if (entry <= journal->first_entry)
     return NULL;
 
-  return (MetaJournalEntry *)(journal->data + offset + entry_len);
+  sizep = (guint32 *)entry;
+  return (MetaJournalEntry *)((char *)entry - GUINT32_FROM_BE (*(sizep-1)));
 }
 
-/* Try to validate more entries, call with writer lock */
+/* Try to validate more entries, only call on a journal that no
+   published snapshot uses, or with the snapshot lock held */
 static void
 meta_journal_validate_more (MetaJournal *journal)
 {
@@ -943,6 +1804,8 @@ meta_journal_validate_more (MetaJournal *journal)
 	  break;
 	}
 
+      meta_journal_index_entry (journal, entry);
+
       entry = next_entry;
       i++;
     }
@@ -998,12 +1861,11 @@ append_string (GString *s, const char *str)
 }
 
 static guint64
-get_time_t (MetaTree *tree, guint32 val)
+get_time_t (MetaTreeSnapshot *snapshot, guint32 val)
 {
-  val = GUINT32_FROM_BE (val);
   if (val == 0)
     return 0;
-  return val + tree->time_t_base;
+  return val + snapshot->time_t_base;
 }
 
 static GString *
@@ -1110,7 +1972,9 @@ meta_journal_entry_new_unset (guint64 mtime,
 }
 
 
-/* Call with writer lock held */
+/* Appends after the validated entries, which no reader looks at.
+   Call with the update lock held and publish the result with
+   meta_tree_journal_updated_locked() */
 static gboolean
 meta_journal_add_entry (MetaJournal *journal,
 			GString *entry)
@@ -1130,12 +1994,59 @@ meta_journal_add_entry (MetaJournal *journal,
   memcpy (ptr, entry->str, entry->len);
 
   journal->header->num_entries = GUINT_TO_BE (journal->last_entry_num + 1);
-  meta_journal_validate_more (journal);
-  g_assert (journal->journal_valid);
 
   return TRUE;
 }
 
+/* Returns how many of the entries, starting at start, fit in the journal */
+static guint
+meta_journal_count_fitting (MetaJournal *journal,
+			    GPtrArray *entries,
+			    guint start)
+{
+  GString *entry;
+  gsize space;
+  guint i;
+
+  space = journal->len - ((char *)journal->last_entry - journal->data);
+
+  for (i = start; i < entries->len; i++)
+    {
+      entry = g_ptr_array_index (entries, i);
+      if (entry->len > space)
+	break;
+      space -= entry->len;
+    }
+
+  return i - start;
+}
+
+/* Adds entries start..end-1, which must fit, with a single update of
+   the header so readers see all of them at once.
+   Call with the update lock held, like meta_journal_add_entry() */
+static void
+meta_journal_add_entries (MetaJournal *journal,
+			  GPtrArray *entries,
+			  guint start,
+			  guint end)
+{
+  GString *entry;
+  char *ptr;
+  guint i;
+
+  g_assert (journal->journal_valid);
+
+  ptr = (char *)journal->last_entry;
+  for (i = start; i < end; i++)
+    {
+      entry = g_ptr_array_index (entries, i);
+      memcpy (ptr, entry->str, entry->len);
+      ptr += entry->len;
+    }
+
+  journal->header->num_entries = GUINT_TO_BE (journal->last_entry_num + (end - start));
+}
+
 static MetaJournal *
 meta_journal_open (MetaTree *tree, const char *filename, gboolean for_write, guint32 tag)
 {
@@ -1178,14 +2089,18 @@ meta_journal_open (MetaTree *tree, const char *filename, gboolean for_write, gui
     }
 
   journal = g_new0 (MetaJournal, 1);
-  journal->filename = g_strdup (filename);
-  journal->fd = fd;
+  journal->mapping = meta_mapping_new (fd, data, statbuf.st_size);
   journal->len = statbuf.st_size;
   journal->data = data;
   journal->header = (MetaJournalHeader *)data;
   journal->first_entry = (MetaJournalEntry *)(data + sizeof (MetaJournalHeader));
   journal->last_entry = journal->first_entry;
   journal->last_entry_num = 0;
+  journal->path_index = g_hash_table_new_full (g_str_hash, g_str_equal,
+					       g_free, (GDestroyNotify)g_array_unref);
+  journal->child_index = g_hash_table_new_full (g_str_hash, g_str_equal,
+						g_free, (GDestroyNotify)g_array_unref);
+  journal->index_valid = TRUE;
 
   if (memcmp (journal->header->magic, JOURNAL_MAGIC, JOURNAL_MAGIC_LEN) != 0)
     goto err;
@@ -1282,12 +2197,12 @@ typedef gboolean (*journal_path_callback) (MetaJournal *journal,
 static char *
 meta_journal_iterate (MetaJournal *journal,
 		      const char *path,
+		      gboolean include_children,
 		      journal_key_callback key_callback,
 		      journal_path_callback path_callback,
 		      gpointer user_data)
 {
   MetaJournalEntry *entry;
-  guint32 *sizep;
   char *journal_path, *journal_key, *source_path;
   char *path_copy, *value;
   gboolean res;
@@ -1299,11 +2214,9 @@ meta_journal_iterate (MetaJournal *journal,
     return path_copy;
 
   entry = journal->last_entry;
-  while (entry > journal->first_entry)
+  while ((entry = meta_journal_prev_entry (journal, entry, path_copy,
+					   include_children)) != NULL)
     {
-      sizep = (guint32 *)entry;
-      entry = (MetaJournalEntry *)((char *)entry - GUINT32_FROM_BE (*(sizep-1)));
-
       mtime = GUINT64_FROM_BE (entry->mtime);
       journal_path = &entry->path[0];
 
@@ -1451,6 +2364,7 @@ meta_journal_reverse_map_path_and_key (MetaJournal *journal,
   data.key = key;
   res_path = meta_journal_iterate (journal,
 				   path,
+				   FALSE,
 				   journal_iter_key,
 				   journal_iter_path,
 				   &data);
@@ -1466,37 +2380,37 @@ meta_tree_lookup_key_type  (MetaTree                         *tree,
 			    const char                       *path,
 			    const char                       *key)
 {
-  MetaFileData *data;
-  MetaFileDataEnt *ent;
+  MetaTreeDataEnt ent;
+  gboolean found;
   char *new_path;
   MetaKeyType type;
   gpointer value;
+  MetaTreeSnapshot *snapshot;
 
-  g_rw_lock_reader_lock (&metatree_lock);
+  snapshot = meta_tree_get_snapshot (tree);
 
-  new_path = meta_journal_reverse_map_path_and_key (tree->journal,
+  new_path = meta_journal_reverse_map_path_and_key (snapshot->journal,
 						    path,
 						    key,
 						    &type, NULL, &value);
   if (new_path == NULL)
     goto out; /* type is set */
 
-  data = meta_tree_lookup_data (tree, new_path);
-  ent = NULL;
-  if (data)
-    ent = meta_data_get_key (tree, data, key);
+  found = meta_data_get_key (snapshot,
+			     meta_tree_lookup_data (snapshot, new_path),
+			     key, &ent);
 
   g_free (new_path);
 
-  if (ent == NULL)
+  if (!found)
     type = META_KEY_TYPE_NONE;
-  else if (GUINT32_FROM_BE (ent->key) & KEY_IS_LIST_MASK)
+  else if (ent.is_list)
     type = META_KEY_TYPE_STRINGV;
   else
     type = META_KEY_TYPE_STRING;
 
  out:
-  g_rw_lock_reader_unlock (&metatree_lock);
+  meta_tree_snapshot_unref (snapshot);
   return type;
 }
 
@@ -1504,15 +2418,16 @@ guint64
 meta_tree_get_last_changed (MetaTree *tree,
 			    const char *path)
 {
-  MetaFileDirEnt *dirent;
+  MetaTreeDirEnt dirent;
   MetaKeyType type;
   char *new_path;
   gpointer value;
   guint64 res, mtime;
+  MetaTreeSnapshot *snapshot;
 
-  g_rw_lock_reader_lock (&metatree_lock);
+  snapshot = meta_tree_get_snapshot (tree);
 
-  new_path = meta_journal_reverse_map_path_and_key (tree->journal,
+  new_path = meta_journal_reverse_map_path_and_key (snapshot->journal,
 						    path,
 						    NULL,
 						    &type, &mtime, &value);
@@ -1523,14 +2438,13 @@ meta_tree_get_last_changed (MetaTree *tree,
     }
 
   res = 0;
-  dirent = meta_tree_lookup (tree, new_path);
-  if (dirent)
-    res = get_time_t (tree, dirent->last_changed);
+  if (meta_tree_lookup (snapshot, new_path, &dirent))
+    res = get_time_t (snapshot, dirent.last_changed);
 
   g_free (new_path);
 
  out:
-  g_rw_lock_reader_unlock (&metatree_lock);
+  meta_tree_snapshot_unref (snapshot);
 
   return res;
 }
@@ -1540,16 +2454,17 @@ meta_tree_lookup_string (MetaTree   *tree,
 			 const char *path,
 			 const char *key)
 {
-  MetaFileData *data;
-  MetaFileDataEnt *ent;
+  MetaTreeDataEnt ent;
+  gboolean found;
   MetaKeyType type;
   gpointer value;
   char *new_path;
   char *res;
+  MetaTreeSnapshot *snapshot;
 
-  g_rw_lock_reader_lock (&metatree_lock);
+  snapshot = meta_tree_get_snapshot (tree);
 
-  new_path = meta_journal_reverse_map_path_and_key (tree->journal,
+  new_path = meta_journal_reverse_map_path_and_key (snapshot->journal,
 						    path,
 						    key,
 						    &type, NULL, &value);
@@ -1561,22 +2476,21 @@ meta_tree_lookup_string (MetaTree   *tree,
       goto out;
     }
 
-  data = meta_tree_lookup_data (tree, new_path);
-  ent = NULL;
-  if (data)
-    ent = meta_data_get_key (tree, data, key);
+  found = meta_data_get_key (snapshot,
+			     meta_tree_lookup_data (snapshot, new_path),
+			     key, &ent);
 
   g_free (new_path);
 
-  if (ent == NULL)
+  if (!found)
     res = NULL;
-  else if (GUINT32_FROM_BE (ent->key) & KEY_IS_LIST_MASK)
+  else if (ent.is_list)
     res = NULL;
   else
-    res = g_strdup (verify_string (tree, ent->value));
+    res = g_strdup (data_ent_get_string (snapshot, &ent));
 
  out:
-  g_rw_lock_reader_unlock (&metatree_lock);
+  meta_tree_snapshot_unref (snapshot);
 
   return res;
 }
@@ -1616,18 +2530,18 @@ meta_tree_lookup_stringv   (MetaTree                         *tree,
 			    const char                       *path,
 			    const char                       *key)
 {
-  MetaFileData *data;
-  MetaFileDataEnt *ent;
+  MetaTreeDataEnt ent;
+  gboolean found;
   MetaKeyType type;
-  MetaFileStringv *stringv;
   gpointer value;
   char *new_path;
-  char **res;
-  guint32 num_strings, i;
+  char **res, **strv;
+  guint32 i;
+  MetaTreeSnapshot *snapshot;
 
-  g_rw_lock_reader_lock (&metatree_lock);
+  snapshot = meta_tree_get_snapshot (tree);
 
-  new_path = meta_journal_reverse_map_path_and_key (tree->journal,
+  new_path = meta_journal_reverse_map_path_and_key (snapshot->journal,
 						    path,
 						    key,
 						    &type, NULL, &value);
@@ -1639,30 +2553,28 @@ meta_tree_lookup_stringv   (MetaTree                         *tree,
       goto out;
     }
 
-  data = meta_tree_lookup_data (tree, new_path);
-  ent = NULL;
-  if (data)
-    ent = meta_data_get_key (tree, data, key);
+  found = meta_data_get_key (snapshot,
+			     meta_tree_lookup_data (snapshot, new_path),
+			     key, &ent);
 
   g_free (new_path);
 
-  if (ent == NULL)
-    res = NULL;
-  else if ((GUINT32_FROM_BE (ent->key) & KEY_IS_LIST_MASK) == 0)
-    res = NULL;
-  else
+  res = NULL;
+  if (found && ent.is_list)
     {
-      stringv = verify_array_block (tree, ent->value,
-				    sizeof (guint32));
-      num_strings = GUINT32_FROM_BE (stringv->num_strings);
-      res = g_new (char *, num_strings + 1);
-      for (i = 0; i < num_strings; i++)
-	res[i] = g_strdup (verify_string (tree, stringv->strings[i]));
-      res[i] = NULL;
+      strv = data_ent_get_stringv (snapshot, &ent);
+      if (strv != NULL)
+	{
+	  res = g_new (char *, g_strv_length (strv) + 1);
+	  for (i = 0; strv[i] != NULL; i++)
+	    res[i] = g_strdup (strv[i]);
+	  res[i] = NULL;
+	  g_free (strv);
+	}
     }
 
  out:
-  g_rw_lock_reader_unlock (&metatree_lock);
+  meta_tree_snapshot_unref (snapshot);
 
   return res;
 }
@@ -1815,31 +2727,29 @@ enum_dir_iter_path (MetaJournal *journal,
 }
 
 static gboolean
-enumerate_dir (MetaTree *tree,
-	       MetaFileDir *dir,
+enumerate_dir (MetaTreeSnapshot *snapshot,
+	       guint32 dir,
 	       GHashTable *children,
 	       meta_tree_dir_enumerate_callback callback,
 	       gpointer user_data)
 {
-  guint32 i, num_children;
-  MetaFileDirEnt *dirent;
+  MetaTreeChildIter iter;
+  MetaTreeDirEnt dirent;
   EnumDirChildInfo *info;
-  char *dirent_name;
+  const char *dirent_name;
   gboolean has_children;
   gboolean has_data;
   guint64 last_changed;
+  gboolean res;
 
-  num_children = GUINT32_FROM_BE (dir->num_children);
-  for (i = 0; i < num_children; i++)
+  res = TRUE;
+  child_iter_init (&iter, snapshot, dir);
+  while (child_iter_next (&iter, &dirent))
     {
-      dirent = &dir->children[i];
-      dirent_name = verify_string (tree, dirent->name);
-      if (dirent_name == NULL)
-	continue;
-
-      last_changed = get_time_t (tree, dirent->last_changed);
-      has_children = dirent->children != 0;
-      has_data = dirent->metadata != 0;
+      dirent_name = dirent.name;
+      last_changed = get_time_t (snapshot, dirent.last_changed);
+      has_children = dirent.children != 0;
+      has_data = dirent.metadata != 0;
 
       info = g_hash_table_lookup (children, dirent_name);
       if (info)
@@ -1861,9 +2771,13 @@ enumerate_dir (MetaTree *tree,
 		     has_children,
 		     has_data,
 		     user_data))
-	return FALSE;
+	{
+	  res = FALSE;
+	  break;
+	}
     }
-  return TRUE;
+  child_iter_clear (&iter);
+  return res;
 }
 
 void
@@ -1875,12 +2789,12 @@ meta_tree_enumerate_dir (MetaTree                         *tree,
   EnumDirData data;
   GHashTable *children;
   EnumDirChildInfo *info;
-  MetaFileDirEnt *dirent;
+  MetaTreeDirEnt dirent;
   GHashTableIter iter;
-  MetaFileDir *dir;
   char *res_path;
+  MetaTreeSnapshot *snapshot;
 
-  g_rw_lock_reader_lock (&metatree_lock);
+  snapshot = meta_tree_get_snapshot (tree);
 
   data.children = children =
     g_hash_table_new_full (g_str_hash,
@@ -1889,24 +2803,20 @@ meta_tree_enumerate_dir (MetaTree                         *tree,
 			   (GDestroyNotify)child_info_free);
 
 
-  res_path = meta_journal_iterate (tree->journal,
+  res_path = meta_journal_iterate (snapshot->journal,
 				   path,
+				   TRUE,
 				   enum_dir_iter_key,
 				   enum_dir_iter_path,
 				   &data);
 
   if (res_path != NULL)
     {
-      dirent = meta_tree_lookup (tree, res_path);
-      if (dirent != NULL &&
-	  dirent->children != 0)
+      if (meta_tree_lookup (snapshot, res_path, &dirent) &&
+	  dirent.children != 0)
 	{
-	  dir = verify_children_block (tree, dirent->children);
-	  if (dir)
-	    {
-	      if (!enumerate_dir (tree, dir, children, callback, user_data))
-		goto out;
-	    }
+	  if (!enumerate_dir (snapshot, dirent.children, children, callback, user_data))
+	    goto out;
 	}
     }
 
@@ -1926,7 +2836,7 @@ meta_tree_enumerate_dir (MetaTree                         *tree,
  out:
   g_free (res_path);
   g_hash_table_destroy (children);
-  g_rw_lock_reader_unlock (&metatree_lock);
+  meta_tree_snapshot_unref (snapshot);
 }
 
 typedef struct {
@@ -1951,22 +2861,40 @@ key_info_free (EnumKeysInfo *info)
 }
 
 static EnumKeysInfo *
-get_key_info (EnumKeysData *data,
+get_key_info (GHashTable *keys,
 	      const char *key)
 {
   EnumKeysInfo *info;
 
-  info = g_hash_table_lookup (data->keys, key);
+  info = g_hash_table_lookup (keys, key);
   if (info == NULL)
     {
       info = g_new0 (EnumKeysInfo, 1);
       info->key = g_strdup (key);
-      g_hash_table_insert (data->keys, info->key, info);
+      g_hash_table_insert (keys, info->key, info);
     }
 
   return info;
 }
 
+static void
+key_info_set_from_journal (EnumKeysInfo *info,
+			   MetaJournalEntryType entry_type,
+			   gpointer value)
+{
+  if (info->seen)
+    return;
+
+  info->seen = TRUE;
+  if (entry_type == JOURNAL_OP_UNSET_KEY)
+    info->type = META_KEY_TYPE_NONE;
+  else if (entry_type == JOURNAL_OP_SET_KEY)
+    info->type = META_KEY_TYPE_STRING;
+  else
+    info->type = META_KEY_TYPE_STRINGV;
+  info->value = value;
+}
+
 static gboolean
 enum_keys_iter_key (MetaJournal *journal,
 		    MetaJournalEntryType entry_type,
@@ -1982,19 +2910,8 @@ enum_keys_iter_key (MetaJournal *journal,
 
   if (strcmp (path, *iter_path) == 0)
     {
-      info = get_key_info (data, key);
-
-      if (!info->seen)
-	{
-	  info->seen = TRUE;
-	  if (entry_type == JOURNAL_OP_UNSET_KEY)
-	    info->type = META_KEY_TYPE_NONE;
-	  else if (entry_type == JOURNAL_OP_SET_KEY)
-	    info->type = META_KEY_TYPE_STRING;
-	  else
-	    info->type = META_KEY_TYPE_STRINGV;
-	  info->value = value;
-	}
+      info = get_key_info (data->keys, key);
+      key_info_set_from_journal (info, entry_type, value);
     }
 
   return TRUE; /* continue */
@@ -2032,39 +2949,34 @@ enum_keys_iter_path (MetaJournal *journal,
 }
 
 static gboolean
-enumerate_data (MetaTree *tree,
-		MetaFileData *data,
+enumerate_data (MetaTreeSnapshot *snapshot,
+		guint32 metadata,
 		GHashTable *keys,
 		meta_tree_keys_enumerate_callback callback,
 		gpointer user_data)
 {
-  guint32 i, j, num_keys, num_strings;
-  MetaFileDataEnt *ent;
+  MetaTreeDataIter iter;
+  MetaTreeDataEnt ent;
   EnumKeysInfo *info;
   char *key_name;
-  guint32 key_id;
   MetaKeyType type;
   gpointer value;
-  MetaFileStringv *stringv;
   gpointer free_me;
-  char **strv;
-  char *strv_static[10];
+  gboolean res;
 
-  num_keys = GUINT32_FROM_BE (data->num_keys);
-  for (i = 0; i < num_keys; i++)
+  res = TRUE;
+  data_iter_init (&iter, snapshot, metadata);
+  while (data_iter_next (&iter, &ent))
     {
-      ent = &data->keys[i];
-
-      key_id = GUINT32_FROM_BE (ent->key) & ~KEY_IS_LIST_MASK;
-      if (GUINT32_FROM_BE (ent->key) & KEY_IS_LIST_MASK)
+      if (ent.is_list)
 	type = META_KEY_TYPE_STRINGV;
       else
 	type = META_KEY_TYPE_STRING;
 
-      if (key_id >= tree->num_attributes)
+      if (ent.key >= snapshot->num_attributes)
 	continue;
 
-      key_name = tree->attributes[key_id];
+      key_name = snapshot->attributes[ent.key];
       if (key_name == NULL)
 	continue;
 
@@ -2074,37 +2986,24 @@ enumerate_data (MetaTree *tree,
 
       free_me = NULL;
       if (type == META_KEY_TYPE_STRING)
-	value = verify_string (tree, ent->value);
+	value = data_ent_get_string (snapshot, &ent);
       else
-	{
-	  stringv = verify_array_block (tree, ent->value,
-					sizeof (guint32));
-	  num_strings = GUINT32_FROM_BE (stringv->num_strings);
-
-	  if (num_strings < 10)
-	    strv = strv_static;
-	  else
-	    {
-	      strv = g_new (char *, num_strings + 1);
-	      free_me = (gpointer)strv;
-	    }
-
-	  for (j = 0; j < num_strings; j++)
-	    strv[j] = verify_string (tree, stringv->strings[j]);
-	  strv[j] = NULL;
+	value = free_me = data_ent_get_stringv (snapshot, &ent);
 
-	  value = strv;
-	}
+      if (value == NULL)
+	continue;
 
-      if (!callback (key_name,
-		     type,
-		     value,
-		     user_data))
-	return FALSE;
+      res = callback (key_name,
+		      type,
+		      value,
+		      user_data);
 
       g_free (free_me);
+
+      if (!res)
+	break;
     }
-  return TRUE;
+  return res;
 }
 
 void
@@ -2116,11 +3015,12 @@ meta_tree_enumerate_keys (MetaTree                         *tree,
   EnumKeysData keydata;
   GHashTable *keys;
   EnumKeysInfo *info;
-  MetaFileData *data;
+  guint32 data;
   GHashTableIter iter;
   char *res_path;
+  MetaTreeSnapshot *snapshot;
 
-  g_rw_lock_reader_lock (&metatree_lock);
+  snapshot = meta_tree_get_snapshot (tree);
 
   keydata.keys = keys =
     g_hash_table_new_full (g_str_hash,
@@ -2129,18 +3029,19 @@ meta_tree_enumerate_keys (MetaTree                         *tree,
 			   (GDestroyNotify)key_info_free);
 
 
-  res_path = meta_journal_iterate (tree->journal,
+  res_path = meta_journal_iterate (snapshot->journal,
 				   path,
+				   FALSE,
 				   enum_keys_iter_key,
 				   enum_keys_iter_path,
 				   &keydata);
 
   if (res_path != NULL)
     {
-      data = meta_tree_lookup_data (tree, res_path);
-      if (data != NULL)
+      data = meta_tree_lookup_data (snapshot, res_path);
+      if (data != 0)
 	{
-	  if (!enumerate_data (tree, data, keys, callback, user_data))
+	  if (!enumerate_data (snapshot, data, keys, callback, user_data))
 	    goto out;
 	}
     }
@@ -2174,103 +3075,313 @@ meta_tree_enumerate_keys (MetaTree                         *tree,
  out:
   g_free (res_path);
   g_hash_table_destroy (keys);
-  g_rw_lock_reader_unlock (&metatree_lock);
+  meta_tree_snapshot_unref (snapshot);
 }
 
 
+typedef struct {
+  char *name;
+  GHashTable *keys; /* key -> EnumKeysInfo, newest journal state */
+  gboolean deleted; /* Removed or overwritten, ignore everything before */
+  gboolean copied; /* Copy destination, needs a full per-path lookup */
+} EnumDirKeysChild;
+
+typedef struct {
+  GHashTable *children;
+} EnumDirKeysData;
+
+typedef struct {
+  const char *child;
+  meta_tree_dir_keys_enumerate_callback callback;
+  gpointer user_data;
+  gboolean stop;
+} EnumDirKeysCallbackData;
+
 static void
-copy_tree_to_builder (MetaTree *tree,
-		      MetaFileDirEnt *dirent,
-		      MetaFile *builder_file)
+dir_keys_child_free (EnumDirKeysChild *child)
 {
-  MetaFile *builder_child;
-  MetaFileData *data;
-  MetaFileDataEnt *ent;
-  MetaFileDir *dir;
-  MetaFileDirEnt *child_dirent;
-  MetaKeyType type;
-  char *child_name, *key_name, *value;
-  guint32 i, num_keys, num_children, j;
-  guint32 key_id;
+  g_free (child->name);
+  g_hash_table_destroy (child->keys);
+  g_free (child);
+}
 
-  /* Copy metadata */
-  data = verify_metadata_block (tree, dirent->metadata);
-  if (data)
+/* Returns the direct child of iter_path that path refers to, or NULL if
+   path is iter_path itself or a deeper descendant */
+static EnumDirKeysChild *
+get_dir_keys_child (EnumDirKeysData *data,
+		    const char *path,
+		    const char *iter_path)
+{
+  EnumDirKeysChild *child;
+  const char *remainder;
+
+  remainder = get_prefix_match (path, iter_path);
+  if (remainder == NULL || *remainder == 0 ||
+      strchr (remainder, '/') != NULL)
+    return NULL;
+
+  child = g_hash_table_lookup (data->children, remainder);
+  if (child == NULL)
     {
-      num_keys = GUINT32_FROM_BE (data->num_keys);
-      for (i = 0; i < num_keys; i++)
-	{
-	  ent = &data->keys[i];
+      child = g_new0 (EnumDirKeysChild, 1);
+      child->name = g_strdup (remainder);
+      child->keys = g_hash_table_new_full (g_str_hash,
+					   g_str_equal,
+					   NULL,
+					   (GDestroyNotify)key_info_free);
+      g_hash_table_insert (data->children, child->name, child);
+    }
 
-	  key_id = GUINT32_FROM_BE (ent->key) & ~KEY_IS_LIST_MASK;
-	  if (GUINT32_FROM_BE (ent->key) & KEY_IS_LIST_MASK)
-	    type = META_KEY_TYPE_STRINGV;
-	  else
-	    type = META_KEY_TYPE_STRING;
+  return child;
+}
 
-	  if (key_id >= tree->num_attributes)
-	    continue;
+static gboolean
+enum_dir_keys_iter_key (MetaJournal *journal,
+			MetaJournalEntryType entry_type,
+			const char *path,
+			guint64 mtime,
+			const char *key,
+			gpointer value,
+			char **iter_path,
+			gpointer user_data)
+{
+  EnumDirKeysData *data = user_data;
+  EnumDirKeysChild *child;
 
-	  key_name = tree->attributes[key_id];
-	  if (key_name == NULL)
-	    continue;
+  child = get_dir_keys_child (data, path, *iter_path);
+  if (child != NULL && !child->deleted)
+    key_info_set_from_journal (get_key_info (child->keys, key),
+			       entry_type, value);
+
+  return TRUE; /* continue */
+}
+
+static gboolean
+enum_dir_keys_iter_path (MetaJournal *journal,
+			 MetaJournalEntryType entry_type,
+			 const char *path,
+			 guint64 mtime,
+			 const char *source_path,
+			 char **iter_path,
+			 gpointer user_data)
+{
+  EnumDirKeysData *data = user_data;
+  EnumDirKeysChild *child;
+
+  child = get_dir_keys_child (data, path, *iter_path);
+  if (child != NULL && !child->deleted)
+    {
+      child->deleted = TRUE;
+      child->copied = entry_type == JOURNAL_OP_COPY_PATH;
+    }
+
+  /* Removes and copies of the directory itself or a parent */
+  return enum_keys_iter_path (journal, entry_type, path, mtime,
+			      source_path, iter_path, NULL);
+}
+
+static gboolean
+enum_dir_keys_callback (const char *key,
+			MetaKeyType type,
+			gpointer value,
+			gpointer user_data)
+{
+  EnumDirKeysCallbackData *cb_data = user_data;
+
+  if (!cb_data->callback (cb_data->child, key, type, value,
+			  cb_data->user_data))
+    {
+      cb_data->stop = TRUE;
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Enumerates the keys of all the direct children of path, resolving
+   the directory once and walking the journal and the children block a
+   single time, rather than once per child. */
+void
+meta_tree_enumerate_dir_with_keys (MetaTree                             *tree,
+				   const char                           *path,
+				   meta_tree_dir_keys_enumerate_callback callback,
+				   gpointer                              user_data)
+{
+  EnumDirKeysCallbackData cb_data;
+  EnumDirKeysData dirdata;
+  EnumDirKeysChild *child;
+  EnumKeysInfo *info;
+  GHashTable *children, *no_keys;
+  GHashTableIter iter, key_iter;
+  GPtrArray *copied;
+  MetaTreeChildIter child_iter;
+  MetaTreeDirEnt dirent, child_dirent;
+  char *res_path, *child_path;
+  gpointer value;
+  guint32 i;
+  MetaTreeSnapshot *snapshot;
+
+  cb_data.callback = callback;
+  cb_data.user_data = user_data;
+  cb_data.stop = FALSE;
+  copied = g_ptr_array_new_with_free_func (g_free);
+
+  snapshot = meta_tree_get_snapshot (tree);
+
+  dirdata.children = children =
+    g_hash_table_new_full (g_str_hash,
+			   g_str_equal,
+			   NULL,
+			   (GDestroyNotify)dir_keys_child_free);
+  no_keys = g_hash_table_new (g_str_hash, g_str_equal);
+
+  res_path = meta_journal_iterate (snapshot->journal,
+				   path,
+				   TRUE,
+				   enum_dir_keys_iter_key,
+				   enum_dir_keys_iter_path,
+				   &dirdata);
 
-	  if (type == META_KEY_TYPE_STRING)
+  if (res_path != NULL)
+    {
+      if (meta_tree_lookup (snapshot, res_path, &dirent) &&
+	  child_iter_init (&child_iter, snapshot, dirent.children))
+	{
+	  while (!cb_data.stop &&
+		 child_iter_next (&child_iter, &child_dirent))
 	    {
-	      value = verify_string (tree, ent->value);
-	      if (value)
-		metafile_key_set_value (builder_file,
-					key_name, value);
+	      if (child_dirent.metadata == 0)
+		continue;
+
+	      child = g_hash_table_lookup (children, child_dirent.name);
+	      if (child != NULL && child->deleted)
+		continue;
+
+	      cb_data.child = child_dirent.name;
+	      enumerate_data (snapshot, child_dirent.metadata,
+			      child ? child->keys : no_keys,
+			      enum_dir_keys_callback, &cb_data);
 	    }
+	  child_iter_clear (&child_iter);
+	}
+    }
+
+  g_hash_table_iter_init (&iter, children);
+  while (!cb_data.stop &&
+	 g_hash_table_iter_next (&iter, NULL, (gpointer *)&child))
+    {
+      if (child->copied)
+	{
+	  g_ptr_array_add (copied, g_strdup (child->name));
+	  continue;
+	}
+
+      g_hash_table_iter_init (&key_iter, child->keys);
+      while (!cb_data.stop &&
+	     g_hash_table_iter_next (&key_iter, NULL, (gpointer *)&info))
+	{
+	  if (info->type == META_KEY_TYPE_NONE)
+	    continue;
+
+	  if (info->type == META_KEY_TYPE_STRING)
+	    value = info->value;
 	  else
+	    value = get_stringv_from_journal (info->value, FALSE);
+
+	  cb_data.stop = !callback (child->name, info->key, info->type, value,
+				    user_data);
+
+	  if (info->type == META_KEY_TYPE_STRINGV)
+	    g_free (value);
+	}
+    }
+
+  g_free (res_path);
+  g_hash_table_destroy (no_keys);
+  g_hash_table_destroy (children);
+  meta_tree_snapshot_unref (snapshot);
+
+  /* Children that were copied over in the journal inherit their keys
+     from elsewhere in the tree, resolve those the slow way */
+  for (i = 0; i < copied->len && !cb_data.stop; i++)
+    {
+      cb_data.child = g_ptr_array_index (copied, i);
+      child_path = g_build_filename (path, cb_data.child, NULL);
+      meta_tree_enumerate_keys (tree, child_path,
+				enum_dir_keys_callback, &cb_data);
+      g_free (child_path);
+    }
+
+  g_ptr_array_free (copied, TRUE);
+}
+
+
+static void
+copy_tree_to_builder (MetaTreeSnapshot *snapshot,
+		      MetaTreeDirEnt *dirent,
+		      MetaFile *builder_file)
+{
+  MetaFile *builder_child;
+  MetaTreeDataIter data_iter;
+  MetaTreeDataEnt ent;
+  MetaTreeChildIter child_iter;
+  MetaTreeDirEnt child_dirent;
+  char *key_name, *value;
+  char **strv;
+  guint32 j;
+
+  /* Copy metadata */
+  data_iter_init (&data_iter, snapshot, dirent->metadata);
+  while (data_iter_next (&data_iter, &ent))
+    {
+      if (ent.key >= snapshot->num_attributes)
+	continue;
+
+      key_name = snapshot->attributes[ent.key];
+      if (key_name == NULL)
+	continue;
+
+      if (!ent.is_list)
+	{
+	  value = data_ent_get_string (snapshot, &ent);
+	  if (value)
+	    metafile_key_set_value (builder_file,
+				    key_name, value);
+	}
+      else
+	{
+	  strv = data_ent_get_stringv (snapshot, &ent);
+	  if (strv)
 	    {
-	      MetaFileStringv *stringv;
-	      guint32 num_strings;
-	      char *str;
-
-	      stringv = verify_array_block (tree, ent->value,
-					    sizeof (guint32));
-
-	      if (stringv)
-		{
-		  metafile_key_list_set (builder_file, key_name);
-
-		  num_strings = GUINT32_FROM_BE (stringv->num_strings);
-		  for (j = 0; j < num_strings; j++)
-		    {
-		      str = verify_string (tree, stringv->strings[j]);
-		      if (str)
-			metafile_key_list_add (builder_file,
-					       key_name, str);
-		    }
-		}
+	      metafile_key_list_set (builder_file, key_name);
+	      for (j = 0; strv[j] != NULL; j++)
+		metafile_key_list_add (builder_file,
+				       key_name, strv[j]);
+	      g_free (strv);
 	    }
 	}
     }
 
   /* Copy last changed time */
-  builder_file->last_changed = get_time_t (tree, dirent->last_changed);
+  builder_file->last_changed = get_time_t (snapshot, dirent->last_changed);
 
   /* Copy children */
-  if (dirent->children != 0 &&
-      (dir = verify_children_block (tree, dirent->children)) != NULL)
+  if (child_iter_init (&child_iter, snapshot, dirent->children))
     {
-      num_children = GUINT32_FROM_BE (dir->num_children);
-      for (i = 0; i < num_children; i++)
+      while (child_iter_next (&child_iter, &child_dirent))
 	{
-	  child_dirent = &dir->children[i];
-	  child_name = verify_string (tree, child_dirent->name);
-	  if (child_name != NULL)
-	    {
-	      builder_child = metafile_new (child_name, builder_file);
-	      copy_tree_to_builder (tree, child_dirent, builder_child);
-	    }
+	  builder_child = metafile_new (child_dirent.name, builder_file);
+	  copy_tree_to_builder (snapshot, &child_dirent, builder_child);
 	}
+      child_iter_clear (&child_iter);
     }
+
+  /* So that flushes can point to what the journal didn't change */
+  metafile_set_stored (builder_file, dirent->children, dirent->metadata);
 }
 
 static void
-apply_journal_to_builder (MetaTree *tree,
+apply_journal_to_builder (MetaTreeSnapshot *snapshot,
 			  MetaBuilder *builder)
 {
   MetaJournal *journal;
@@ -2283,7 +3394,7 @@ apply_journal_to_builder (MetaTree *tree,
   MetaFile *file;
   int i;
 
-  journal = tree->journal;
+  journal = snapshot->journal;
 
   entry = journal->first_entry;
   while (entry < journal->last_entry)
@@ -2346,26 +3457,151 @@ apply_journal_to_builder (MetaTree *tree,
 }
 
 
-/* Needs write lock */
+/* Doubles the journal size if the current one filled up quickly and
+   halves it if it stayed mostly empty. The new journal also has to hold
+   the entries carried over from the current one, plus needed bytes */
+static gsize
+meta_tree_next_journal_size (MetaTree *tree,
+			     MetaJournal *journal,
+			     gsize carried_over,
+			     gsize needed)
+{
+  gsize size, used;
+  gint64 elapsed;
+
+  size = MIN_JOURNAL_SIZE;
+  if (journal != NULL)
+    {
+      size = journal->len;
+      used = (char *)journal->last_entry - journal->data;
+      elapsed = g_get_monotonic_time () - tree->journal_created;
+
+      if (used > size / 2 &&
+	  tree->journal_created != 0 &&
+	  elapsed < JOURNAL_FILL_TARGET_SECS * G_USEC_PER_SEC)
+	size *= 2;
+      else if (used < size / 4)
+	size /= 2;
+    }
+
+  size = CLAMP (size, MIN_JOURNAL_SIZE, MAX_JOURNAL_SIZE);
+
+  needed += sizeof (MetaJournalHeader) + carried_over;
+  while (size < needed && size < MAX_JOURNAL_SIZE)
+    size *= 2;
+
+  /* The carried over entries must fit, even if needed doesn't */
+  return MAX (size, sizeof (MetaJournalHeader) + carried_over);
+}
+
+/* Needs the update lock. It is released while the new file is written
+   and synced, so writers can keep adding to the journal meanwhile. What
+   they add is carried over to the new journal. needed is the space a
+   waiting writer wants in the new journal. */
 static gboolean
-meta_tree_flush_locked (MetaTree *tree)
+meta_tree_flush_locked (MetaTree *tree,
+			gsize needed)
 {
+  MetaTreeSnapshot *snapshot, *current;
+  MetaJournal *journal;
   MetaBuilder *builder;
+  char *tmp_name, *carried;
+  gsize carried_len, journal_size;
+  guint32 carried_num, random_tag;
   gboolean res;
 
+  /* Another thread is flushing, which also makes room in the journal */
+  if (tree->flushing)
+    {
+      while (tree->flushing)
+	g_cond_wait (&tree->flush_cond, &tree->update_lock);
+      return tree->flush_result;
+    }
+
+  snapshot = tree->snapshot;
+
+  /* Nothing changed since the last flush */
+  if (snapshot->header != NULL &&
+      snapshot->version == MAJOR_VERSION &&
+      snapshot->journal != NULL &&
+      snapshot->journal->journal_valid &&
+      snapshot->journal->last_entry_num == 0)
+    return TRUE;
+
+  /* The snapshot doesn't change when writers add to the journal, they
+     publish a new one */
+  meta_tree_snapshot_ref (snapshot);
+  tree->flushing = TRUE;
+  g_mutex_unlock (&tree->update_lock);
+
   builder = meta_builder_new ();
+  if (snapshot->has_root)
+    copy_tree_to_builder (snapshot, &snapshot->root, builder->root);
+
+  if (snapshot->journal)
+    apply_journal_to_builder (snapshot, builder);
+
+  /* Only append what changed to a copy of the current file, unless
+     that isn't possible or it is time to compact it */
+  tmp_name = NULL;
+  if (snapshot->has_root &&
+      snapshot->version == MAJOR_VERSION)
+    tmp_name = meta_builder_write_tmp_incremental (builder,
+						   meta_tree_get_filename (tree),
+						   snapshot->mapping->fd,
+						   snapshot->data,
+						   snapshot->len,
+						   &random_tag);
+  if (tmp_name == NULL)
+    tmp_name = meta_builder_write_tmp (builder,
+				       meta_tree_get_filename (tree),
+				       &random_tag);
+
+  g_mutex_lock (&tree->update_lock);
 
-  copy_tree_to_builder (tree, tree->root, builder->root);
+  res = FALSE;
+  current = tree->snapshot;
+  if (tmp_name != NULL &&
+      current->tag != snapshot->tag)
+    {
+      /* Replaced by someone else while we were writing */
+      g_unlink (tmp_name);
+    }
+  else if (tmp_name != NULL)
+    {
+      carried = NULL;
+      carried_len = 0;
+      carried_num = 0;
+      journal = current->journal;
+      if (journal != NULL && journal->journal_valid &&
+	  snapshot->journal != NULL)
+	{
+	  carried = journal->data +
+	    ((char *)snapshot->journal->last_entry - snapshot->journal->data);
+	  carried_len = (char *)journal->last_entry - carried;
+	  carried_num = journal->last_entry_num - snapshot->journal->last_entry_num;
+	}
 
-  if (tree->journal)
-    apply_journal_to_builder (tree, builder);
+      journal_size = meta_tree_next_journal_size (tree, journal,
+						  carried_len, needed);
+      res = meta_builder_install_tmp (meta_tree_get_filename (tree),
+				      tmp_name, random_tag, journal_size,
+				      carried, carried_len, carried_num);
+    }
+  g_free (tmp_name);
 
-  res = meta_builder_write (builder,
-			    meta_tree_get_filename (tree));
   if (res)
-    meta_tree_refresh_locked (tree);
+    {
+      meta_tree_refresh_locked (tree);
+      tree->journal_created = g_get_monotonic_time ();
+    }
 
   meta_builder_free (builder);
+  meta_tree_snapshot_unref (snapshot);
+
+  tree->flushing = FALSE;
+  tree->flush_result = res;
+  g_cond_broadcast (&tree->flush_cond);
 
   return res;
 }
@@ -2375,89 +3611,82 @@ meta_tree_flush (MetaTree *tree)
 {
   gboolean res;
 
-  g_rw_lock_writer_lock (&metatree_lock);
-  res = meta_tree_flush_locked (tree);
-  g_rw_lock_writer_unlock (&metatree_lock);
+  g_mutex_lock (&tree->update_lock);
+  res = meta_tree_flush_locked (tree, 0);
+  g_mutex_unlock (&tree->update_lock);
   return res;
 }
 
+/* Whether the journal is more than half full, so a flush started now
+   is likely to finish before writers run out of space */
 gboolean
-meta_tree_unset (MetaTree                         *tree,
-		 const char                       *path,
-		 const char                       *key)
+meta_tree_needs_flush (MetaTree *tree)
 {
-  GString *entry;
-  guint64 mtime;
+  MetaTreeSnapshot *snapshot;
+  MetaJournal *journal;
   gboolean res;
 
-  g_rw_lock_writer_lock (&metatree_lock);
+  snapshot = meta_tree_get_snapshot (tree);
+  journal = snapshot->journal;
+  res = journal != NULL &&
+    journal->journal_valid &&
+    (char *)journal->last_entry - journal->data > journal->len / 2;
+  meta_tree_snapshot_unref (snapshot);
 
-  if (tree->journal == NULL ||
-      !tree->journal->journal_valid)
-    {
-      res = FALSE;
-      goto out;
-    }
+  return res;
+}
 
-  mtime = time (NULL);
+/* Adds an entry to the journal, flushing if it's full. Takes ownership
+   of entry. */
+static gboolean
+meta_tree_add_entry (MetaTree *tree,
+		     GString *entry)
+{
+  MetaJournal *journal;
+  gboolean res;
 
-  entry = meta_journal_entry_new_unset (mtime, path, key);
+  g_mutex_lock (&tree->update_lock);
 
   res = TRUE;
  retry:
-  if (!meta_journal_add_entry (tree->journal, entry))
-    {
-      if (meta_tree_flush_locked (tree))
-	goto retry;
+  journal = tree->snapshot->journal;
+  if (journal == NULL ||
+      !journal->journal_valid)
+    res = FALSE;
+  else if (meta_journal_add_entry (journal, entry))
+    meta_tree_journal_updated_locked (tree);
+  else if (journal->last_entry_num != 0 &&
+	   meta_tree_flush_locked (tree, entry->len))
+    goto retry;
+  else
+    res = FALSE;
 
-      res = FALSE;
-    }
+  g_mutex_unlock (&tree->update_lock);
 
   g_string_free (entry, TRUE);
 
- out:
-  g_rw_lock_writer_unlock (&metatree_lock);
   return res;
 }
 
+gboolean
+meta_tree_unset (MetaTree                         *tree,
+		 const char                       *path,
+		 const char                       *key)
+{
+  return meta_tree_add_entry (tree,
+			      meta_journal_entry_new_unset (time (NULL),
+							    path, key));
+}
+
 gboolean
 meta_tree_set_string (MetaTree                         *tree,
 		      const char                       *path,
 		      const char                       *key,
 		      const char                       *value)
 {
-  GString *entry;
-  guint64 mtime;
-  gboolean res;
-
-  g_rw_lock_writer_lock (&metatree_lock);
-
-  if (tree->journal == NULL ||
-      !tree->journal->journal_valid)
-    {
-      res = FALSE;
-      goto out;
-    }
-
-  mtime = time (NULL);
-
-  entry = meta_journal_entry_new_set (mtime, path, key, value);
-
-  res = TRUE;
- retry:
-  if (!meta_journal_add_entry (tree->journal, entry))
-    {
-      if (meta_tree_flush_locked (tree))
-	goto retry;
-
-      res = FALSE;
-    }
-
-  g_string_free (entry, TRUE);
-
- out:
-  g_rw_lock_writer_unlock (&metatree_lock);
-  return res;
+  return meta_tree_add_entry (tree,
+			      meta_journal_entry_new_set (time (NULL),
+							  path, key, value));
 }
 
 gboolean
@@ -2466,114 +3695,168 @@ meta_tree_set_stringv (MetaTree                         *tree,
 		       const char                       *key,
 		       char                            **value)
 {
-  GString *entry;
-  guint64 mtime;
-  gboolean res;
-
-  g_rw_lock_writer_lock (&metatree_lock);
+  return meta_tree_add_entry (tree,
+			      meta_journal_entry_new_setv (time (NULL),
+							   path, key, value));
+}
 
-  if (tree->journal == NULL ||
-      !tree->journal->journal_valid)
-    {
-      res = FALSE;
-      goto out;
-    }
+gboolean
+meta_tree_remove (MetaTree *tree,
+		  const char *path)
+{
+  return meta_tree_add_entry (tree,
+			      meta_journal_entry_new_remove (time (NULL),
+							     path));
+}
 
-  mtime = time (NULL);
+gboolean
+meta_tree_copy (MetaTree                         *tree,
+		const char                       *src,
+		const char                       *dest)
+{
+  return meta_tree_add_entry (tree,
+			      meta_journal_entry_new_copy (time (NULL),
+							   src, dest));
+}
 
-  entry = meta_journal_entry_new_setv (mtime, path, key, value);
+struct _MetaTreeBatch {
+  guint64 mtime;
+  GPtrArray *entries;
+};
 
-  res = TRUE;
- retry:
-  if (!meta_journal_add_entry (tree->journal, entry))
-    {
-      if (meta_tree_flush_locked (tree))
-	goto retry;
+static void
+free_entry (gpointer data)
+{
+  g_string_free (data, TRUE);
+}
 
-      res = FALSE;
-    }
+MetaTreeBatch *
+meta_tree_batch_new (void)
+{
+  MetaTreeBatch *batch;
 
-  g_string_free (entry, TRUE);
+  batch = g_new0 (MetaTreeBatch, 1);
+  batch->mtime = time (NULL);
+  batch->entries = g_ptr_array_new_with_free_func (free_entry);
 
- out:
-  g_rw_lock_writer_unlock (&metatree_lock);
-  return res;
+  return batch;
 }
 
-gboolean
-meta_tree_remove (MetaTree *tree,
-		  const char *path)
+void
+meta_tree_batch_free (MetaTreeBatch *batch)
 {
-  GString *entry;
-  guint64 mtime;
-  gboolean res;
+  g_ptr_array_free (batch->entries, TRUE);
+  g_free (batch);
+}
 
-  g_rw_lock_writer_lock (&metatree_lock);
+void
+meta_tree_batch_set_string (MetaTreeBatch *batch,
+			    const char    *path,
+			    const char    *key,
+			    const char    *value)
+{
+  g_ptr_array_add (batch->entries,
+		   meta_journal_entry_new_set (batch->mtime, path, key, value));
+}
 
-  if (tree->journal == NULL ||
-      !tree->journal->journal_valid)
-    {
-      res = FALSE;
-      goto out;
-    }
+void
+meta_tree_batch_set_stringv (MetaTreeBatch *batch,
+			     const char    *path,
+			     const char    *key,
+			     char         **value)
+{
+  g_ptr_array_add (batch->entries,
+		   meta_journal_entry_new_setv (batch->mtime, path, key, value));
+}
 
-  mtime = time (NULL);
+void
+meta_tree_batch_unset (MetaTreeBatch *batch,
+		       const char    *path,
+		       const char    *key)
+{
+  g_ptr_array_add (batch->entries,
+		   meta_journal_entry_new_unset (batch->mtime, path, key));
+}
 
-  entry = meta_journal_entry_new_remove (mtime, path);
+static gsize
+batch_size_from (MetaTreeBatch *batch,
+		 guint start)
+{
+  GString *entry;
+  gsize size;
+  guint i;
 
-  res = TRUE;
- retry:
-  if (!meta_journal_add_entry (tree->journal, entry))
+  size = 0;
+  for (i = start; i < batch->entries->len; i++)
     {
-      if (meta_tree_flush_locked (tree))
-	goto retry;
-
-      res = FALSE;
+      entry = g_ptr_array_index (batch->entries, i);
+      size += entry->len;
     }
 
-  g_string_free (entry, TRUE);
+  return size;
+}
 
- out:
-  g_rw_lock_writer_unlock (&metatree_lock);
-  return res;
+void
+meta_tree_batch_remove (MetaTreeBatch *batch,
+			const char    *path)
+{
+  g_ptr_array_add (batch->entries,
+		   meta_journal_entry_new_remove (batch->mtime, path));
+}
+
+void
+meta_tree_batch_copy (MetaTreeBatch *batch,
+		      const char    *src,
+		      const char    *dest)
+{
+  g_ptr_array_add (batch->entries,
+		   meta_journal_entry_new_copy (batch->mtime, src, dest));
 }
 
+/* Writes all changes in the batch under one lock, flushing the tree
+   only when the journal runs out of space */
 gboolean
-meta_tree_copy (MetaTree                         *tree,
-		const char                       *src,
-		const char                       *dest)
+meta_tree_batch_commit (MetaTree      *tree,
+			MetaTreeBatch *batch)
 {
-  GString *entry;
-  guint64 mtime;
+  MetaJournal *journal;
+  guint i, n;
   gboolean res;
 
-  g_rw_lock_writer_lock (&metatree_lock);
-
-  if (tree->journal == NULL ||
-      !tree->journal->journal_valid)
-    {
-      res = FALSE;
-      goto out;
-    }
-
-  mtime = time (NULL);
-
-  entry = meta_journal_entry_new_copy (mtime, src, dest);
+  g_mutex_lock (&tree->update_lock);
 
   res = TRUE;
- retry:
-  if (!meta_journal_add_entry (tree->journal, entry))
+  i = 0;
+  while (i < batch->entries->len)
     {
-      if (meta_tree_flush_locked (tree))
-	goto retry;
+      journal = tree->snapshot->journal;
+      if (journal == NULL ||
+	  !journal->journal_valid)
+	{
+	  res = FALSE;
+	  break;
+	}
+
+      n = meta_journal_count_fitting (journal, batch->entries, i);
+      if (n > 0)
+	{
+	  meta_journal_add_entries (journal, batch->entries, i, i + n);
+	  meta_tree_journal_updated_locked (tree);
+	  i += n;
+	  continue;
+	}
 
-      res = FALSE;
+      /* Doesn't even fit in an empty journal */
+      if (journal->last_entry_num == 0 ||
+	  !meta_tree_flush_locked (tree, batch_size_from (batch, i)))
+	{
+	  res = FALSE;
+	  break;
+	}
     }
 
-  g_string_free (entry, TRUE);
+  g_mutex_unlock (&tree->update_lock);
 
- out:
-  g_rw_lock_writer_unlock (&metatree_lock);
   return res;
 }
 
@@ -2757,7 +4040,6 @@ struct _MetaLookupCache {
   char *last_parent_mountpoint;
   char *last_parent_mountpoint_extra_prefix;
 
-  dev_t last_device;
   char *last_device_tree;
 };
 
@@ -2803,24 +4085,6 @@ get_tree_from_udev (MetaLookupCache *cache,
 }
 #endif
 
-static const char *
-get_tree_for_device (MetaLookupCache *cache,
-		     dev_t device)
-{
-#ifdef HAVE_LIBUDEV
-  if (device != cache->last_device)
-    {
-      cache->last_device = device;
-      g_free (cache->last_device_tree);
-      cache->last_device_tree = get_tree_from_udev (cache, device);
-    }
-
-  return cache->last_device_tree;
-#endif
-  return NULL;
-}
-
-
 #ifdef __linux__
 
 typedef struct {
@@ -2831,6 +4095,7 @@ typedef struct {
 static gboolean mountinfo_initialized = FALSE;
 static int mountinfo_fd = -1;
 static MountinfoEntry *mountinfo_roots = NULL;
+static guint mountinfo_generation = 0;
 G_LOCK_DEFINE_STATIC (mountinfo);
 
 /* We want to avoid mmap and stat as these are not ideal
@@ -3013,6 +4278,7 @@ update_mountinfo (void)
 	return;
     }
 
+  mountinfo_generation++;
   free_mountinfo ();
   contents = read_contents (mountinfo_fd);
   lseek (mountinfo_fd, SEEK_SET, 0);
@@ -3064,6 +4330,154 @@ get_extra_prefix_for_mount (const char *mountpoint)
   return NULL;
 }
 
+/* Process-wide caches shared by all MetaLookupCaches, so that looking up
+ * many files doesn't ask udev and walk up to the mountpoint every time.
+ * They only depend on what is mounted where, so they are dropped when
+ * poll() says /proc/self/mountinfo changed. Without that notification
+ * they are never reused.
+ */
+typedef struct {
+  char *mountpoint;
+  char *extra_prefix;
+} SharedMountpoint;
+
+#define MAX_SHARED_MOUNTPOINTS 1024
+
+G_LOCK_DEFINE_STATIC (shared_lookup);
+static GHashTable *shared_device_trees = NULL; /* devnum -> tree name or NULL */
+static GHashTable *shared_mountpoints = NULL; /* "devnum:dir" -> SharedMountpoint */
+static guint shared_lookup_generation = 0;
+
+static void
+shared_mountpoint_free (SharedMountpoint *mp)
+{
+  g_free (mp->mountpoint);
+  g_free (mp->extra_prefix);
+  g_free (mp);
+}
+
+/* Call with the shared_lookup lock held, returns the generation the
+   caches are valid for, or 0 if they can't be used */
+static guint
+shared_lookup_validate (void)
+{
+  guint generation;
+
+  generation = 0;
+#ifdef __linux__
+  G_LOCK (mountinfo);
+  update_mountinfo ();
+  if (mountinfo_fd != -1)
+    generation = mountinfo_generation;
+  G_UNLOCK (mountinfo);
+#endif
+
+  if (shared_device_trees == NULL)
+    {
+      shared_device_trees = g_hash_table_new_full (g_int64_hash, g_int64_equal,
+						   g_free, g_free);
+      shared_mountpoints = g_hash_table_new_full (g_str_hash, g_str_equal,
+						  g_free, (GDestroyNotify)shared_mountpoint_free);
+    }
+
+  if (generation == 0 ||
+      generation != shared_lookup_generation)
+    {
+      g_hash_table_remove_all (shared_device_trees);
+      g_hash_table_remove_all (shared_mountpoints);
+      shared_lookup_generation = generation;
+    }
+
+  return generation;
+}
+
+static char *
+get_tree_for_device (MetaLookupCache *cache,
+		     dev_t device)
+{
+#ifdef HAVE_LIBUDEV
+  gint64 devnum;
+  gpointer value;
+  guint generation;
+  char *res;
+
+  devnum = device;
+
+  G_LOCK (shared_lookup);
+  generation = shared_lookup_validate ();
+  if (g_hash_table_lookup_extended (shared_device_trees, &devnum, NULL, &value))
+    {
+      res = g_strdup (value);
+      G_UNLOCK (shared_lookup);
+      return res;
+    }
+  G_UNLOCK (shared_lookup);
+
+  res = get_tree_from_udev (cache, device);
+
+  G_LOCK (shared_lookup);
+  if (generation != 0 &&
+      generation == shared_lookup_generation)
+    g_hash_table_insert (shared_device_trees,
+			 g_memdup (&devnum, sizeof (devnum)),
+			 g_strdup (res));
+  G_UNLOCK (shared_lookup);
+
+  return res;
+#endif
+  return NULL;
+}
+
+static gboolean
+lookup_shared_mountpoint (dev_t dev,
+			  const char *dir,
+			  char **mountpoint_out,
+			  char **extra_prefix_out)
+{
+  SharedMountpoint *mp;
+  char *key;
+
+  key = g_strdup_printf ("%" G_GUINT64_FORMAT ":%s", (guint64)dev, dir);
+
+  G_LOCK (shared_lookup);
+  shared_lookup_validate ();
+  mp = g_hash_table_lookup (shared_mountpoints, key);
+  if (mp)
+    {
+      *mountpoint_out = g_strdup (mp->mountpoint);
+      *extra_prefix_out = g_strdup (mp->extra_prefix);
+    }
+  G_UNLOCK (shared_lookup);
+
+  g_free (key);
+
+  return mp != NULL;
+}
+
+static void
+add_shared_mountpoint (dev_t dev,
+		       const char *dir,
+		       const char *mountpoint,
+		       const char *extra_prefix)
+{
+  SharedMountpoint *mp;
+
+  G_LOCK (shared_lookup);
+  if (shared_lookup_validate () != 0)
+    {
+      if (g_hash_table_size (shared_mountpoints) >= MAX_SHARED_MOUNTPOINTS)
+	g_hash_table_remove_all (shared_mountpoints);
+
+      mp = g_new (SharedMountpoint, 1);
+      mp->mountpoint = g_strdup (mountpoint);
+      mp->extra_prefix = g_strdup (extra_prefix);
+      g_hash_table_insert (shared_mountpoints,
+			   g_strdup_printf ("%" G_GUINT64_FORMAT ":%s", (guint64)dev, dir),
+			   mp);
+    }
+  G_UNLOCK (shared_lookup);
+}
+
 static dev_t
 get_devnum (const char *path)
 {
@@ -3101,6 +4515,11 @@ find_mountpoint_for (MetaLookupCache *cache,
   if (cache->last_parent_mountpoint != NULL)
     goto out; /* Cache hit! */
 
+  if (lookup_shared_mountpoint (dev, first_dir,
+				&cache->last_parent_mountpoint,
+				&cache->last_parent_mountpoint_extra_prefix))
+    goto out;
+
   dir = g_strdup (first_dir);
   last = g_strdup (file);
   while (1)
@@ -3112,6 +4531,12 @@ find_mountpoint_for (MetaLookupCache *cache,
 	  g_free (dir);
 	  cache->last_parent_mountpoint = last;
 	  cache->last_parent_mountpoint_extra_prefix = get_extra_prefix_for_mount (last);
+	  /* Unless file itself is the mountpoint this holds for anything
+	     in first_dir */
+	  if (strcmp (last, file) != 0)
+	    add_shared_mountpoint (dev, first_dir,
+				   cache->last_parent_mountpoint,
+				   cache->last_parent_mountpoint_extra_prefix);
 	  break;
 	}
 
@@ -3308,7 +4733,9 @@ meta_lookup_cache_lookup_path (MetaLookupCache *cache,
       goto found;
     }
 
-  treename = get_tree_for_device (cache, device);
+  g_free (cache->last_device_tree);
+  cache->last_device_tree = get_tree_for_device (cache, device);
+  treename = cache->last_device_tree;
 
   if (treename)
     {
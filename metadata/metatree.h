@@ -27,6 +27,7 @@
 
 typedef struct _MetaTree MetaTree;
 typedef struct _MetaLookupCache MetaLookupCache;
+typedef struct _MetaTreeBatch MetaTreeBatch;
 
 typedef enum {
   META_KEY_TYPE_NONE,
@@ -34,8 +35,8 @@ typedef enum {
   META_KEY_TYPE_STRINGV
 } MetaKeyType;
 
-/* Note: These are called with the read-lock held, so
-   don't call any MetaTree operations */
+/* Note: These are called on a snapshot of the tree, so they
+   won't see changes made from the callback */
 typedef gboolean (*meta_tree_dir_enumerate_callback) (const char *entry,
 						      guint64 last_changed,
 						      gboolean has_children,
@@ -47,7 +48,15 @@ typedef gboolean (*meta_tree_keys_enumerate_callback) (const char *key,
 						       gpointer value,
 						       gpointer user_data);
 
-/* MetaLookupCache is not threadsafe */
+typedef gboolean (*meta_tree_dir_keys_enumerate_callback) (const char *child,
+							   const char *key,
+							   MetaKeyType type,
+							   gpointer value,
+							   gpointer user_data);
+
+/* MetaLookupCache is not threadsafe. What it finds out about devices and
+   mountpoints is shared by all of them until the mounts change, so they
+   are cheap to create */
 MetaLookupCache *meta_lookup_cache_new         (void);
 void             meta_lookup_cache_free        (MetaLookupCache *cache);
 MetaTree        *meta_lookup_cache_lookup_path (MetaLookupCache *cache,
@@ -86,7 +95,12 @@ void        meta_tree_enumerate_keys   (MetaTree                         *tree,
 					const char                       *path,
 					meta_tree_keys_enumerate_callback callback,
 					gpointer                          user_data);
+void        meta_tree_enumerate_dir_with_keys (MetaTree                             *tree,
+					       const char                           *path,
+					       meta_tree_dir_keys_enumerate_callback callback,
+					       gpointer                              user_data);
 gboolean    meta_tree_flush            (MetaTree                         *tree);
+gboolean    meta_tree_needs_flush      (MetaTree                         *tree);
 gboolean    meta_tree_unset            (MetaTree                         *tree,
 					const char                       *path,
 					const char                       *key);
@@ -103,4 +117,26 @@ gboolean    meta_tree_remove           (MetaTree                         *tree,
 gboolean    meta_tree_copy             (MetaTree                         *tree,
 					const char                       *src,
 					const char                       *dest);
+
+/* Batches are committed to the journal as a whole */
+MetaTreeBatch *meta_tree_batch_new         (void);
+void           meta_tree_batch_free        (MetaTreeBatch *batch);
+void           meta_tree_batch_set_string  (MetaTreeBatch *batch,
+					    const char    *path,
+					    const char    *key,
+					    const char    *value);
+void           meta_tree_batch_set_stringv (MetaTreeBatch *batch,
+					    const char    *path,
+					    const char    *key,
+					    char         **value);
+void           meta_tree_batch_unset       (MetaTreeBatch *batch,
+					    const char    *path,
+					    const char    *key);
+void           meta_tree_batch_remove      (MetaTreeBatch *batch,
+					    const char    *path);
+void           meta_tree_batch_copy        (MetaTreeBatch *batch,
+					    const char    *src,
+					    const char    *dest);
+gboolean       meta_tree_batch_commit      (MetaTree      *tree,
+					    MetaTreeBatch *batch);
 #endif /* __META_TREE_H__ */
@@ -0,0 +1,263 @@
+/* GIO - GLib Input, Output and Streaming Library
+ *
+ * Copyright (C) 2006-2007 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+
+#include <config.h>
+
+#include <stdio.h>
+#include <unistd.h>
+#include <locale.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#define BENCHMARK_UNIT_NAME "fuse-parallel-read"
+
+#include "benchmark-common.c"
+
+/* Meant to be run against a directory in the fuse mount, e.g. a
+ * localtest:// mount under $XDG_RUNTIME_DIR/gvfs, to stress the
+ * daemon's handle maps and caches from many threads at once */
+
+#define FILES_NUM      64
+#define FILE_SIZE      (1024 * 256)
+#define BUFFER_SIZE    4096
+#define OPS_PER_THREAD 2000
+
+static gchar *scratch_dir;
+
+/* Failed reads would otherwise count as throughput */
+static gint read_errors;
+static gint short_reads;
+
+static gboolean
+is_dir (const gchar *dir)
+{
+  struct stat sbuf;
+
+  if (stat (dir, &sbuf) < 0)
+    return FALSE;
+
+  if (S_ISDIR (sbuf.st_mode))
+    return TRUE;
+
+  return FALSE;
+}
+
+static gchar *
+file_path (gint n)
+{
+  return g_strdup_printf ("%s/file-%d", scratch_dir, n);
+}
+
+static gboolean
+create_files (void)
+{
+  gchar  buffer [BUFFER_SIZE];
+  gchar *path;
+  gint   fd;
+  gint   i, j;
+
+  memset (buffer, 0xaa, BUFFER_SIZE);
+
+  for (i = 0; i < FILES_NUM; i++)
+    {
+      path = file_path (i);
+      fd = open (path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+      g_free (path);
+
+      if (fd < 0)
+        {
+          g_printerr ("Failed to create scratch file: %s\n", g_strerror (errno));
+          return FALSE;
+        }
+
+      for (j = 0; j < FILE_SIZE; j += BUFFER_SIZE)
+        {
+          if (write (fd, buffer, BUFFER_SIZE) != BUFFER_SIZE)
+            {
+              g_printerr ("Failed to populate scratch file: %s\n", g_strerror (errno));
+              close (fd);
+              return FALSE;
+            }
+        }
+
+      close (fd);
+    }
+
+  return TRUE;
+}
+
+static void
+delete_files (void)
+{
+  gchar *path;
+  gint   i;
+
+  for (i = 0; i < FILES_NUM; i++)
+    {
+      path = file_path (i);
+      g_unlink (path);
+      g_free (path);
+    }
+
+  if (g_rmdir (scratch_dir) < 0)
+    g_printerr ("Failed to delete scratch dir: %s\n", g_strerror (errno));
+}
+
+/* A mix of what parallel builds or file indexers do: mostly stats and
+ * short reads at random places, with opens and closes in between */
+static gpointer
+reader_thread (gpointer data)
+{
+  GRand *rand;
+  gchar  buffer [BUFFER_SIZE];
+  gchar *path;
+  struct stat sbuf;
+  gssize bytes_read;
+  gint   fd = -1;
+  gint   i;
+
+  rand = g_rand_new_with_seed (GPOINTER_TO_UINT (data));
+
+  for (i = 0; i < OPS_PER_THREAD; i++)
+    {
+      path = file_path (g_rand_int_range (rand, 0, FILES_NUM));
+
+      switch (g_rand_int_range (rand, 0, 4))
+        {
+        case 0:
+          stat (path, &sbuf);
+          break;
+
+        case 1:
+          if (fd >= 0)
+            close (fd);
+          fd = open (path, O_RDONLY);
+          break;
+
+        default:
+          if (fd < 0)
+            fd = open (path, O_RDONLY);
+          if (fd >= 0)
+            {
+              bytes_read = pread (fd, buffer, BUFFER_SIZE,
+                                  g_rand_int_range (rand, 0, FILE_SIZE / BUFFER_SIZE) * BUFFER_SIZE);
+              if (bytes_read < 0)
+                g_atomic_int_inc (&read_errors);
+              else if (bytes_read != BUFFER_SIZE)
+                g_atomic_int_inc (&short_reads);
+            }
+          break;
+        }
+
+      g_free (path);
+    }
+
+  if (fd >= 0)
+    close (fd);
+
+  g_rand_free (rand);
+  return NULL;
+}
+
+static gdouble
+run_readers (gint threads_num)
+{
+  GThread **threads;
+  GTimer   *timer;
+  gdouble   elapsed;
+  gint      i;
+
+  threads = g_new (GThread *, threads_num);
+
+  timer = g_timer_new ();
+  for (i = 0; i < threads_num; i++)
+    threads [i] = g_thread_new ("reader", reader_thread, GINT_TO_POINTER (i + 1));
+  for (i = 0; i < threads_num; i++)
+    g_thread_join (threads [i]);
+  elapsed = g_timer_elapsed (timer, NULL);
+
+  g_timer_destroy (timer);
+  g_free (threads);
+
+  return elapsed;
+}
+
+static gint
+benchmark_run (gint argc, gchar *argv [])
+{
+  gint threads_nums[] = { 1, 2, 4, 8, 16, 32 };
+  gdouble elapsed;
+  guint i;
+
+  setlocale (LC_ALL, "");
+
+  if (argc < 2)
+    {
+      g_printerr ("Usage: %s <scratch path>\n", argv [0]);
+      return 1;
+    }
+
+  if (!is_dir (argv [1]))
+    {
+      g_printerr ("Scratch path %s is not a directory\n", argv [1]);
+      return 1;
+    }
+
+  scratch_dir = g_strdup_printf ("%s/fuse-benchmark-scratch-%d", argv [1], getpid ());
+  if (g_mkdir (scratch_dir, 0700) < 0)
+    {
+      g_printerr ("Failed to create scratch dir: %s\n", g_strerror (errno));
+      g_free (scratch_dir);
+      return 1;
+    }
+
+  if (!create_files ())
+    {
+      delete_files ();
+      g_free (scratch_dir);
+      return 1;
+    }
+
+  for (i = 0; i < G_N_ELEMENTS (threads_nums); i++)
+    {
+      elapsed = run_readers (threads_nums[i]);
+      g_print ("%2d threads: %.0f ops/s\n",
+               threads_nums[i],
+               threads_nums[i] * OPS_PER_THREAD / elapsed);
+    }
+
+  delete_files ();
+  g_free (scratch_dir);
+
+  if (read_errors > 0 || short_reads > 0)
+    {
+      g_printerr ("%d reads failed, %d reads were short\n", read_errors, short_reads);
+      return 1;
+    }
+
+  return 0;
+}
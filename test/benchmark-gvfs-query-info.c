@@ -0,0 +1,135 @@
+/* GIO - GLib Input, Output and Streaming Library
+ *
+ * Copyright (C) 2006-2007 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+
+#include <config.h>
+
+#include <stdio.h>
+#include <unistd.h>
+#include <locale.h>
+#include <errno.h>
+#include <string.h>
+
+#include <glib.h>
+#include <gio/gio.h>
+
+#define BENCHMARK_UNIT_NAME "gvfs-query-info"
+
+#include "benchmark-common.c"
+
+/* Meant to be run against a daemon mount, e.g. localtest:///tmp, where
+ * every call is a round trip to the backend */
+
+#define ITERATIONS_NUM 20000
+
+static GFile *base_dir;
+
+static gboolean
+is_dir (GFile *file)
+{
+  GFileInfo *info;
+  gboolean res;
+
+  info = g_file_query_info (file, G_FILE_ATTRIBUTE_STANDARD_TYPE, 0, NULL, NULL);
+  res = info && g_file_info_get_file_type (info) == G_FILE_TYPE_DIRECTORY;
+  if (info)
+    g_object_unref (info);
+  return res;
+}
+
+static gpointer
+query_thread (gpointer data)
+{
+  gint iterations = GPOINTER_TO_INT (data);
+  GFileInfo *info;
+  GError *error = NULL;
+  gint i;
+
+  for (i = 0; i < iterations; i++)
+    {
+      info = g_file_query_info (base_dir, "standard::*,time::modified", 0, NULL, &error);
+      if (info == NULL)
+        {
+          g_printerr ("Failed to query info: %s\n", error->message);
+          g_error_free (error);
+          return NULL;
+        }
+
+      g_object_unref (info);
+    }
+
+  return NULL;
+}
+
+static void
+benchmark_query_info (gint threads_num)
+{
+  GThread **threads;
+  GTimer   *timer;
+  gint      iterations;
+  gint      i;
+
+  threads = g_new (GThread *, threads_num);
+  iterations = ITERATIONS_NUM / threads_num;
+
+  timer = g_timer_new ();
+  for (i = 0; i < threads_num; i++)
+    threads [i] = g_thread_new ("query", query_thread, GINT_TO_POINTER (iterations));
+  for (i = 0; i < threads_num; i++)
+    g_thread_join (threads [i]);
+  g_timer_stop (timer);
+
+  g_print ("%2d threads: %.0f g_file_query_info/s\n",
+           threads_num,
+           iterations * threads_num / g_timer_elapsed (timer, NULL));
+
+  g_timer_destroy (timer);
+  g_free (threads);
+}
+
+static gint
+benchmark_run (gint argc, gchar *argv [])
+{
+  gint threads_nums[] = { 1, 2, 4, 8 };
+  guint i;
+
+  setlocale (LC_ALL, "");
+
+  if (argc < 2)
+    {
+      g_printerr ("Usage: %s <scratch URI>\n", argv [0]);
+      return 1;
+    }
+
+  base_dir = g_file_new_for_commandline_arg (argv [1]);
+
+  if (!is_dir (base_dir))
+    {
+      g_printerr ("Scratch URI %s is not a directory\n", argv [1]);
+      g_object_unref (base_dir);
+      return 1;
+    }
+
+  for (i = 0; i < G_N_ELEMENTS (threads_nums); i++)
+    benchmark_query_info (threads_nums[i]);
+
+  g_object_unref (base_dir);
+  return 0;
+}
@@ -0,0 +1,145 @@
+/* GIO - GLib Input, Output and Streaming Library
+ *
+ * Copyright (C) 2006-2007 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+
+#include <config.h>
+
+#include <stdio.h>
+#include <unistd.h>
+#include <locale.h>
+#include <errno.h>
+#include <string.h>
+
+#include <glib.h>
+#include <gio/gio.h>
+
+#define BENCHMARK_UNIT_NAME "gvfs-uri-parse"
+
+#include "benchmark-common.c"
+
+/* Converts a corpus of uris like the ones in recent files lists to
+ * GFiles. Nothing is mounted or queried, this only measures parsing */
+
+#define PASSES_NUM 20
+
+static const gchar *uri_formats[] = {
+  "sftp://user@host%d.example.com/home/user/Documents/report-%d.odt",
+  "smb://server%d/share/Photos/2012/IMG_%04d.JPG",
+  "ftp://ftp%d.example.org/pub/releases/package-%d.tar.gz",
+  "dav://host%d.example.com:8080/remote.php/webdav/notes-%d.txt",
+  "http://www%d.example.com/blog/post-%d.html",
+  "afp://user@mac%d.local/Volume/Projects/file%%20name-%d.txt",
+  "smb://WORKGROUP;user@[fe80::%x]/share/dir/file-%d",
+  "trash:///file-%d-%d"
+};
+
+static gchar **
+create_corpus (gint uris_num)
+{
+  gchar **uris;
+  gint i;
+
+  uris = g_new0 (gchar *, uris_num + 1);
+  for (i = 0; i < uris_num; i++)
+    uris [i] = g_strdup_printf (uri_formats [i % G_N_ELEMENTS (uri_formats)],
+                                i % 16, i);
+
+  return uris;
+}
+
+static gboolean
+benchmark_parse (gint uris_num)
+{
+  gchar **uris;
+  gchar **first_uris;
+  GFile  *file;
+  GTimer *timer;
+  gdouble first, rest;
+  gint    pass, i;
+
+  uris = create_corpus (uris_num);
+  first_uris = g_new0 (gchar *, uris_num + 1);
+
+  timer = g_timer_new ();
+  for (i = 0; i < uris_num; i++)
+    {
+      file = g_file_new_for_uri (uris [i]);
+      first_uris [i] = g_file_get_uri (file);
+      g_object_unref (file);
+    }
+  first = g_timer_elapsed (timer, NULL);
+
+  g_timer_start (timer);
+  for (pass = 1; pass < PASSES_NUM; pass++)
+    for (i = 0; i < uris_num; i++)
+      {
+        file = g_file_new_for_uri (uris [i]);
+        g_object_unref (file);
+      }
+  rest = g_timer_elapsed (timer, NULL);
+
+  /* Repeated conversions must give the same files as the first one */
+  for (i = 0; i < uris_num; i++)
+    {
+      gchar *uri;
+
+      file = g_file_new_for_uri (uris [i]);
+      uri = g_file_get_uri (file);
+      g_object_unref (file);
+
+      if (strcmp (uri, first_uris [i]) != 0)
+        {
+          g_printerr ("%s converted to %s, then to %s\n", uris [i], first_uris [i], uri);
+          g_free (uri);
+          g_strfreev (first_uris);
+          g_strfreev (uris);
+          g_timer_destroy (timer);
+          return FALSE;
+        }
+      g_free (uri);
+    }
+
+  g_print ("%6d uris: first pass %.2f us/uri, repeated %.2f us/uri\n",
+           uris_num,
+           first * 1000000 / uris_num,
+           rest * 1000000 / (uris_num * (PASSES_NUM - 1)));
+
+  g_timer_destroy (timer);
+  g_strfreev (first_uris);
+  g_strfreev (uris);
+  return TRUE;
+}
+
+static gint
+benchmark_run (gint argc, gchar *argv [])
+{
+  gint uris_nums[] = { 100, 500, 5000, 50000 };
+  guint i;
+
+  setlocale (LC_ALL, "");
+
+  for (i = 0; i < G_N_ELEMENTS (uris_nums); i++)
+    {
+      if (!benchmark_parse (uris_nums[i]))
+        return 1;
+    }
+
+  return 0;
+}
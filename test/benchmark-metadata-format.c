@@ -0,0 +1,219 @@
+/* GIO - GLib Input, Output and Streaming Library
+ *
+ * Copyright (C) 2006-2007 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+
+#include <config.h>
+
+#include <stdio.h>
+#include <unistd.h>
+#include <locale.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "metatree.h"
+#include "metabuilder.h"
+
+#define BENCHMARK_UNIT_NAME "metadata-format"
+
+#include "benchmark-common.c"
+
+/* Something like a home directory where a file manager has been used
+   for a while: icon positions everywhere, a few emblems */
+#define DIRS_NUM        200
+#define FILES_PER_DIR   100
+#define LOOKUPS_NUM     200000
+
+static gboolean
+is_dir (const gchar *dir)
+{
+  struct stat sbuf;
+
+  if (stat (dir, &sbuf) < 0)
+    return FALSE;
+
+  if (S_ISDIR (sbuf.st_mode))
+    return TRUE;
+
+  return FALSE;
+}
+
+static gchar *
+get_file_path (gint dir, gint file)
+{
+  return g_strdup_printf ("/home/user/Documents/project-%03d/document-%04d.odt",
+                          dir, file);
+}
+
+static MetaBuilder *
+create_builder (void)
+{
+  MetaBuilder *builder;
+  MetaFile *file;
+  gchar *path, *value;
+  gint i, j;
+
+  builder = meta_builder_new ();
+  for (i = 0; i < DIRS_NUM; i++)
+    {
+      for (j = 0; j < FILES_PER_DIR; j++)
+        {
+          path = get_file_path (i, j);
+          file = meta_builder_lookup (builder, path, TRUE);
+          g_free (path);
+
+          value = g_strdup_printf ("%d,%d", 64 + (j % 8) * 96, 64 + (j / 8) * 96);
+          metafile_key_set_value (file, "nautilus-icon-position", value);
+          g_free (value);
+
+          if (j % 10 == 0)
+            {
+              metafile_key_list_set (file, "emblems");
+              metafile_key_list_add (file, "emblems", "important");
+            }
+
+          metafile_set_mtime (file, 1300000000 + i * FILES_PER_DIR + j);
+        }
+    }
+
+  return builder;
+}
+
+static void
+benchmark_lookup (const gchar *tree_file,
+                  gint version)
+{
+  MetaTree *tree;
+  GTimer *timer;
+  gchar *path, *value;
+  struct stat sbuf;
+  gint i, found;
+
+  if (stat (tree_file, &sbuf) < 0)
+    return;
+
+  tree = meta_tree_open (tree_file, FALSE);
+
+  found = 0;
+  timer = g_timer_new ();
+  for (i = 0; i < LOOKUPS_NUM; i++)
+    {
+      path = get_file_path (g_random_int_range (0, DIRS_NUM),
+                            g_random_int_range (0, FILES_PER_DIR));
+      value = meta_tree_lookup_string (tree, path, "nautilus-icon-position");
+      if (value)
+        found++;
+      g_free (value);
+      g_free (path);
+    }
+  g_timer_stop (timer);
+
+  g_print ("version %d: %" G_GINT64_FORMAT " bytes, lookup: %.2f us",
+           version, (gint64)sbuf.st_size,
+           g_timer_elapsed (timer, NULL) * 1000000 / LOOKUPS_NUM);
+  if (found != LOOKUPS_NUM)
+    g_print (" (only %d found)", found);
+  g_print ("\n");
+
+  g_timer_destroy (timer);
+  meta_tree_unref (tree);
+}
+
+static void
+delete_dir (const gchar *scratch_dir)
+{
+  const gchar *name;
+  gchar *path;
+  GDir *dir;
+
+  dir = g_dir_open (scratch_dir, 0, NULL);
+  if (dir)
+    {
+      while ((name = g_dir_read_name (dir)) != NULL)
+        {
+          path = g_build_filename (scratch_dir, name, NULL);
+          g_unlink (path);
+          g_free (path);
+        }
+      g_dir_close (dir);
+    }
+
+  if (g_rmdir (scratch_dir) < 0)
+    g_printerr ("Failed to delete scratch dir: %s\n", g_strerror (errno));
+}
+
+static gint
+benchmark_run (gint argc, gchar *argv [])
+{
+  MetaBuilder *builder;
+  gchar *scratch_dir, *tree_file;
+  gint version, res;
+
+  setlocale (LC_ALL, "");
+
+  if (argc < 2)
+    {
+      g_printerr ("Usage: %s <scratch path>\n", argv [0]);
+      return 1;
+    }
+
+  if (!is_dir (argv [1]))
+    {
+      g_printerr ("Scratch path %s is not a directory\n", argv [1]);
+      return 1;
+    }
+
+  builder = create_builder ();
+  res = 0;
+
+  for (version = 1; version <= 2; version++)
+    {
+      scratch_dir = g_strdup_printf ("%s/metadata-benchmark-scratch-%d-%d",
+                                     argv [1], getpid (), version);
+      if (g_mkdir (scratch_dir, 0700) < 0)
+        {
+          g_printerr ("Failed to create scratch dir: %s\n", g_strerror (errno));
+          g_free (scratch_dir);
+          res = 1;
+          break;
+        }
+      tree_file = g_build_filename (scratch_dir, "tree", NULL);
+
+      if (meta_builder_write_version (builder, tree_file, version))
+        benchmark_lookup (tree_file, version);
+      else
+        {
+          g_printerr ("Failed to write version %d tree\n", version);
+          res = 1;
+        }
+
+      delete_dir (scratch_dir);
+      g_free (tree_file);
+      g_free (scratch_dir);
+    }
+
+  meta_builder_free (builder);
+
+  return res;
+}
@@ -0,0 +1,235 @@
+/* GIO - GLib Input, Output and Streaming Library
+ *
+ * Copyright (C) 2006-2007 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+
+#include <config.h>
+
+#include <stdio.h>
+#include <unistd.h>
+#include <locale.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "metatree.h"
+#include "crc32.h"
+
+#define BENCHMARK_UNIT_NAME "metadata-journal"
+
+#include "benchmark-common.c"
+
+/* About three quarters of a freshly created 32k journal */
+#define JOURNAL_ENTRIES 400
+#define ITERATIONS_NUM  10000
+#define CRC_BUFFER_SIZE (1024 * 1024)
+
+static gboolean
+is_dir (const gchar *dir)
+{
+  struct stat sbuf;
+
+  if (stat (dir, &sbuf) < 0)
+    return FALSE;
+
+  if (S_ISDIR (sbuf.st_mode))
+    return TRUE;
+
+  return FALSE;
+}
+
+static gboolean
+fill_journal (const gchar *tree_file)
+{
+  MetaTree *tree;
+  gchar *path, *value;
+  gboolean res;
+  gint i;
+
+  tree = meta_tree_open (tree_file, TRUE);
+  if (!meta_tree_exists (tree))
+    {
+      g_printerr ("Failed to create metadata tree %s\n", tree_file);
+      meta_tree_unref (tree);
+      return FALSE;
+    }
+
+  res = TRUE;
+  for (i = 0; i < JOURNAL_ENTRIES && res; i++)
+    {
+      path = g_strdup_printf ("/home/user/Documents/file-%d", i);
+      value = g_strdup_printf ("%d,%d", i * 7, i * 13);
+      res = meta_tree_set_string (tree, path, "nautilus-icon-position", value);
+      g_free (path);
+      g_free (value);
+    }
+
+  if (!res)
+    g_printerr ("Failed to write journal entry\n");
+
+  meta_tree_unref (tree);
+  return res;
+}
+
+static void
+benchmark_open (const gchar *tree_file)
+{
+  MetaTree *tree;
+  GTimer *timer;
+  gint i;
+
+  timer = g_timer_new ();
+  for (i = 0; i < ITERATIONS_NUM; i++)
+    {
+      /* Opening validates every entry in the journal */
+      tree = meta_tree_open (tree_file, FALSE);
+      meta_tree_unref (tree);
+    }
+  g_timer_stop (timer);
+
+  g_print ("open + validate %d journal entries: %.2f us\n",
+           JOURNAL_ENTRIES,
+           g_timer_elapsed (timer, NULL) * 1000000 / ITERATIONS_NUM);
+  g_timer_destroy (timer);
+}
+
+static gboolean
+benchmark_crc (gsize chunk_size)
+{
+  guchar *buffer;
+  GTimer *timer;
+  gdouble reference, dispatched;
+  guint32 a, b;
+  gsize i;
+
+  buffer = g_malloc (CRC_BUFFER_SIZE);
+  for (i = 0; i < CRC_BUFFER_SIZE; i++)
+    buffer[i] = g_random_int ();
+
+  for (i = 0; i + chunk_size <= CRC_BUFFER_SIZE; i += chunk_size)
+    {
+      a = metadata_crc32 (buffer + i, chunk_size);
+      b = metadata_crc32_reference (buffer + i, chunk_size);
+      if (a != b)
+        {
+          g_printerr ("crc32 mismatch at offset %" G_GSIZE_FORMAT ": %08x != %08x\n",
+                      i, a, b);
+          g_free (buffer);
+          return FALSE;
+        }
+    }
+
+  timer = g_timer_new ();
+  for (i = 0; i + chunk_size <= CRC_BUFFER_SIZE; i += chunk_size)
+    metadata_crc32_reference (buffer + i, chunk_size);
+  reference = g_timer_elapsed (timer, NULL);
+
+  g_timer_start (timer);
+  for (i = 0; i + chunk_size <= CRC_BUFFER_SIZE; i += chunk_size)
+    metadata_crc32 (buffer + i, chunk_size);
+  dispatched = g_timer_elapsed (timer, NULL);
+
+  g_print ("crc32 %6" G_GSIZE_FORMAT " byte chunks: %.1f MB/s (bytewise %.1f MB/s)\n",
+           chunk_size,
+           CRC_BUFFER_SIZE / dispatched / (1024 * 1024),
+           CRC_BUFFER_SIZE / reference / (1024 * 1024));
+
+  g_timer_destroy (timer);
+  g_free (buffer);
+  return TRUE;
+}
+
+static void
+delete_dir (const gchar *scratch_dir)
+{
+  const gchar *name;
+  gchar *path;
+  GDir *dir;
+
+  /* The tree and its journal, whose name depends on the random tag */
+  dir = g_dir_open (scratch_dir, 0, NULL);
+  if (dir)
+    {
+      while ((name = g_dir_read_name (dir)) != NULL)
+        {
+          path = g_build_filename (scratch_dir, name, NULL);
+          g_unlink (path);
+          g_free (path);
+        }
+      g_dir_close (dir);
+    }
+
+  if (g_rmdir (scratch_dir) < 0)
+    g_printerr ("Failed to delete scratch dir: %s\n", g_strerror (errno));
+}
+
+static gint
+benchmark_run (gint argc, gchar *argv [])
+{
+  gchar *scratch_dir, *tree_file;
+  gsize chunk_sizes[] = { 48, 64, 256, 4096, CRC_BUFFER_SIZE };
+  guint i;
+  gint res;
+
+  setlocale (LC_ALL, "");
+
+  if (argc < 2)
+    {
+      g_printerr ("Usage: %s <scratch path>\n", argv [0]);
+      return 1;
+    }
+
+  if (!is_dir (argv [1]))
+    {
+      g_printerr ("Scratch path %s is not a directory\n", argv [1]);
+      return 1;
+    }
+
+  for (i = 0; i < G_N_ELEMENTS (chunk_sizes); i++)
+    {
+      if (!benchmark_crc (chunk_sizes[i]))
+        return 1;
+    }
+
+  scratch_dir = g_strdup_printf ("%s/metadata-benchmark-scratch-%d", argv [1], getpid ());
+  if (g_mkdir (scratch_dir, 0700) < 0)
+    {
+      g_printerr ("Failed to create scratch dir: %s\n", g_strerror (errno));
+      g_free (scratch_dir);
+      return 1;
+    }
+  tree_file = g_build_filename (scratch_dir, "tree", NULL);
+
+  res = 1;
+  if (fill_journal (tree_file))
+    {
+      benchmark_open (tree_file);
+      res = 0;
+    }
+
+  delete_dir (scratch_dir);
+  g_free (tree_file);
+  g_free (scratch_dir);
+
+  return res;
+}